@@ -39,6 +39,7 @@
 #include "options.h"
 #include "progress.h"
 #include "sequence.h"
+#include "thread.h"
 #include "tools.h"
 #include "vmath.h"
 
@@ -87,14 +88,16 @@ static void bcd_actpos(mdl_t *mdl, bcd_t *bcd, const seq_t *seq, uint64_t o) {
 	uint32_t  actcnt = 0;
 	for (uint32_t t = 0; t < T; t++) {
 		const pos_t *pos = &(seq->pos[t]);
+		const obs_t *uobs = seq_uobs(seq, pos);
+		const obs_t *bobs = seq_bobs(seq, pos);
 		bool ok = false;
 		if (mdl->kind[o] & 1)
 			for (uint32_t n = 0; !ok && n < pos->ucnt; n++)
-				if (pos->uobs[n] == o)
+				if (uobs[n] == o)
 					ok = true;
 		if (mdl->kind[o] & 2)
 			for (uint32_t n = 0; !ok && n < pos->bcnt; n++)
-				if (pos->bobs[n] == o)
+				if (bobs[n] == o)
 					ok = true;
 		if (!ok)
 			continue;
@@ -280,65 +283,77 @@ static void bcd_update(mdl_t *mdl, bcd_t *bcd, uint64_t o) {
 	}
 }
 
-/* trn_bcd
- *   Train the model using the blockwise coordinates descend method.
+/* bcd_idx_t:
+ *   Inverted index from observations to the sequences where they are active,
+ *   stored in compressed form: the sequences of observation <o> are found in
+ *   <seq> between <off>[o] and <off>[o + 1] in increasing order.
  */
-void trn_bcd(mdl_t *mdl) {
-	const uint32_t Y = mdl->nlbl;
+typedef struct bcd_idx_s bcd_idx_t;
+struct bcd_idx_s {
+	uint64_t *off;     //  [O+1]
+	uint32_t *seq;     //  [N]
+};
+
+/* bcd_index:
+ *   Build the inverted index in two passes over the dataset, the first one
+ *   count the active sequences of each observation and the second one fill the
+ *   lists. The last sequence seen for each observation is tracked in order to
+ *   count it only once per sequence.
+ */
+static bcd_idx_t *bcd_index(mdl_t *mdl) {
 	const uint64_t O = mdl->nobs;
 	const uint32_t S = mdl->train->nseq;
-	const uint32_t T = mdl->train->mlen;
-	const uint32_t K = mdl->opt->maxiter;
-	// Build the index:
+	bcd_idx_t *idx = xmalloc(sizeof(bcd_idx_t));
+	uint64_t *off = xmalloc(sizeof(uint64_t) * (O + 1));
+	uint32_t *lcl = xmalloc(sizeof(uint32_t) * O);
 	//   Count active sequences per blocks
-	info("    - Build the index\n");
 	info("        1/2 -- scan the sequences\n");
-	uint64_t tot = 0;
-	uint32_t cnt[O], lcl[O];
 	for (uint64_t o = 0; o < O; o++)
-		cnt[o] = 0, lcl[o] = (uint32_t)-1;
+		off[o] = 0, lcl[o] = (uint32_t)-1;
 	for (uint32_t s = 0; s < S; s++) {
-		// List actives blocks
 		const seq_t *seq = mdl->train->seq[s];
-		for (uint32_t t = 0; t < seq->len; t++) {
-			for (uint32_t b = 0; b < seq->pos[t].ucnt; b++)
-				lcl[seq->pos[t].uobs[b]] = s;
-			for (uint32_t b = 0; b < seq->pos[t].bcnt; b++)
-				lcl[seq->pos[t].bobs[b]] = s;
-		}
-		// Updates blocks count
-		for (uint64_t o = 0; o < O; o++)
-			cnt[o] += (lcl[o] == s);
+		const pos_t *lst = &seq->pos[seq->len - 1];
+		const obs_t *raw = seq->raw;
+		const uint64_t N = lst->off + lst->ucnt + lst->bcnt;
+		for (uint64_t n = 0; n < N; n++)
+			if (lcl[raw[n]] != s)
+				lcl[raw[n]] = s, off[raw[n]]++;
 	}
-	for (uint64_t o = 0; o < O; o++)
-		tot += cnt[o];
-	// Allocate memory
-	uint32_t  *idx_cnt = xmalloc(sizeof(uint32_t  ) * O);
-	uint32_t **idx_lst = xmalloc(sizeof(uint32_t *) * O);
+	uint64_t tot = 0;
 	for (uint64_t o = 0; o < O; o++) {
-		idx_cnt[o] = cnt[o];
-		idx_lst[o] = xmalloc(sizeof(uint32_t) * cnt[o]);
+		const uint64_t cnt = off[o];
+		off[o] = tot;
+		tot += cnt;
 	}
-	// Populate the index
+	off[O] = tot;
+	// Populate the index, using <lcl> to track the current end of each
+	// list.
 	info("        2/2 -- Populate the index\n");
+	uint32_t *lst = xmalloc(sizeof(uint32_t) * max(tot, 1));
+	uint64_t *end = xmalloc(sizeof(uint64_t) * max(O, 1));
 	for (uint64_t o = 0; o < O; o++)
-		cnt[o] = 0, lcl[o] = (uint32_t)-1;
+		end[o] = off[o], lcl[o] = (uint32_t)-1;
 	for (uint32_t s = 0; s < S; s++) {
-		// List actives blocks
 		const seq_t *seq = mdl->train->seq[s];
-		for (uint32_t t = 0; t < seq->len; t++) {
-			for (uint32_t b = 0; b < seq->pos[t].ucnt; b++)
-				lcl[seq->pos[t].uobs[b]] = s;
-			for (uint32_t b = 0; b < seq->pos[t].bcnt; b++)
-				lcl[seq->pos[t].bobs[b]] = s;
-		}
-		// Build index
-		for (uint64_t o = 0; o < O; o++)
-			if (lcl[o] == s)
-				idx_lst[o][cnt[o]++] = s;
+		const pos_t *pos = &seq->pos[seq->len - 1];
+		const obs_t *raw = seq->raw;
+		const uint64_t N = pos->off + pos->ucnt + pos->bcnt;
+		for (uint64_t n = 0; n < N; n++)
+			if (lcl[raw[n]] != s)
+				lcl[raw[n]] = s, lst[end[raw[n]]++] = s;
 	}
-	info("      Done\n");
-	// Allocate the specific trainer of BCD
+	xfree(end);
+	xfree(lcl);
+	idx->off = off;
+	idx->seq = lst;
+	return idx;
+}
+
+/* bcd_stnew:
+ *   Allocate the state of a BCD worker for sequences of length up to <T>.
+ */
+static bcd_t *bcd_stnew(mdl_t *mdl, uint32_t T) {
+	const uint32_t Y = mdl->nlbl;
 	bcd_t *bcd = xmalloc(sizeof(bcd_t));
 	bcd->ugrd   = xvm_new(Y);
 	bcd->uhes   = xvm_new(Y);
@@ -346,49 +361,135 @@ void trn_bcd(mdl_t *mdl) {
 	bcd->bhes   = xvm_new(Y * Y);
 	bcd->actpos = xmalloc(sizeof(int) * T);
 	bcd->grd_st = grd_stnew(mdl, NULL);
+	return bcd;
+}
+
+/* bcd_stfree:
+ *   Free all memory used by a BCD worker state.
+ */
+static void bcd_stfree(bcd_t *bcd) {
+	grd_stfree(bcd->grd_st);
+	xvm_free(bcd->ugrd); xvm_free(bcd->uhes);
+	xvm_free(bcd->bgrd); xvm_free(bcd->bhes);
+	xfree(bcd->actpos);
+	xfree(bcd);
+}
+
+/* bcd_block:
+ *   Optimize the block of observation <o>: compute its gradient and hessian
+ *   over all the sequences where it is active and update its weights.
+ */
+static void bcd_block(mdl_t *mdl, bcd_t *bcd, const bcd_idx_t *idx,
+                      uint64_t o) {
+	const uint32_t Y = mdl->nlbl;
+	// Clear the gradient and the hessian
+	for (uint32_t y = 0, d = 0; y < Y; y++) {
+		bcd->ugrd[y] = 0.0;
+		bcd->uhes[y] = 0.0;
+		for (uint32_t yp = 0; yp < Y; yp++, d++) {
+			bcd->bgrd[d] = 0.0;
+			bcd->bhes[d] = 0.0;
+		}
+	}
+	// Process active sequences
+	for (uint64_t n = idx->off[o]; n < idx->off[o + 1]; n++) {
+		const seq_t *seq = mdl->train->seq[idx->seq[n]];
+		bcd_actpos(mdl, bcd, seq, o);
+		grd_stcheck(bcd->grd_st, seq->len);
+		grd_st_t *grd_st = bcd->grd_st;
+		grd_st->prf.nseq++;
+		grd_st->prf.ntok += seq->len;
+		uint64_t tic = grd_tic(grd_st);
+		if (mdl->opt->sparse) {
+			grd_spdopsi(grd_st, seq);
+			tic = grd_toc(grd_st, UIT_PSI, tic);
+			grd_spfwdbwd(grd_st, seq);
+			tic = grd_toc(grd_st, UIT_FWDBWD, tic);
+			bcd_spgradhes(mdl, bcd, seq, o);
+		} else {
+			grd_fldopsi(grd_st, seq);
+			tic = grd_toc(grd_st, UIT_PSI, tic);
+			grd_flfwdbwd(grd_st, seq);
+			tic = grd_toc(grd_st, UIT_FWDBWD, tic);
+			bcd_flgradhes(mdl, bcd, seq, o);
+		}
+		grd_toc(grd_st, UIT_UPDATE, tic);
+	}
+	// And update the model
+	bcd_update(mdl, bcd, o);
+}
+
+/* bcd_worker:
+ *   Optimize the blocks given by the jobs. Observations are given in chunks
+ *   starting at <base> as jobs are limited to 32bit.
+ */
+typedef struct bcd_wrk_s bcd_wrk_t;
+struct bcd_wrk_s {
+	mdl_t           *mdl;
+	bcd_t           *bcd;
+	const bcd_idx_t *idx;
+	uint64_t         base;
+};
+
+static void bcd_worker(job_t *job, uint32_t id, uint32_t cnt, bcd_wrk_t *wrk) {
+	unused(id); unused(cnt);
+	uint32_t count, pos;
+	while (!uit_stop && mth_getjob(job, &count, &pos))
+		for (uint32_t n = pos; n < pos + count; n++)
+			bcd_block(wrk->mdl, wrk->bcd, wrk->idx, wrk->base + n);
+}
+
+/* trn_bcd
+ *   Train the model using the blockwise coordinates descend method.
+ *
+ *   With more than one thread, the blocks are spread over the workers who
+ *   optimize them concurrently like in the Shotgun algorithm [1]. Each block
+ *   own its weights so the updates never conflict, but a block can be
+ *   optimized with a slightly outdated value of the others. With a single
+ *   thread, the blocks are optimized one after the other in order.
+ *
+ *   [1] Parallel coordinate descent for L1-regularized loss minimization,
+ *       Joseph K. Bradley, Aapo Kyrola, Danny Bickson and Carlos Guestrin, in
+ *       Proceedings of the 28th ICML, pages 321-328, 2011
+ */
+void trn_bcd(mdl_t *mdl) {
+	const uint64_t O = mdl->nobs;
+	const uint32_t T = mdl->train->mlen;
+	const uint32_t K = mdl->opt->maxiter;
+	const uint32_t W = mdl->opt->nthread;
+	// Build the index
+	info("    - Build the index\n");
+	bcd_idx_t *idx = bcd_index(mdl);
+	info("      Done\n");
+	// Allocate the specific trainer of BCD, one for each worker
+	bcd_wrk_t *wrk[W];
+	for (uint32_t w = 0; w < W; w++) {
+		wrk[w] = xmalloc(sizeof(bcd_wrk_t));
+		wrk[w]->mdl = mdl;
+		wrk[w]->bcd = bcd_stnew(mdl, T);
+		wrk[w]->idx = idx;
+	}
 	// And train the model
+	const uint64_t chunk = (uint64_t)1 << 31;
 	for (uint32_t i = 1; i <= K; i++) {
-		for (uint64_t o = 0; o < O; o++) {
-			// Clear the gradient and the hessian
-			for (uint32_t y = 0, d = 0; y < Y; y++) {
-				bcd->ugrd[y] = 0.0;
-				bcd->uhes[y] = 0.0;
-				for (uint32_t yp = 0; yp < Y; yp++, d++) {
-					bcd->bgrd[d] = 0.0;
-					bcd->bhes[d] = 0.0;
-				}
-			}
-			// Process active sequences
-			for (uint32_t s = 0; s < idx_cnt[o]; s++) {
-				const uint32_t id = idx_lst[o][s];
-				const seq_t *seq = mdl->train->seq[id];
-				bcd_actpos(mdl, bcd, seq, o);
-				grd_stcheck(bcd->grd_st, seq->len);
-				if (mdl->opt->sparse) {
-					grd_spdopsi(bcd->grd_st, seq);
-					grd_spfwdbwd(bcd->grd_st, seq);
-					bcd_spgradhes(mdl, bcd, seq, o);
-				} else {
-					grd_fldopsi(bcd->grd_st, seq);
-					grd_flfwdbwd(bcd->grd_st, seq);
-					bcd_flgradhes(mdl, bcd, seq, o);
-				}
-			}
-			// And update the model
-			bcd_update(mdl, bcd, o);
+		for (uint64_t base = 0; base < O && !uit_stop; base += chunk) {
+			for (uint32_t w = 0; w < W; w++)
+				wrk[w]->base = base;
+			mth_spawn((func_t *)bcd_worker, W, (void **)wrk,
+				min(O - base, chunk), W == 1 ? 1 : 64);
 		}
+		for (uint32_t w = 0; w < W && mdl->opt->profile; w++)
+			uit_prfadd(&wrk[w]->bcd->grd_st->prf);
 		if (!uit_progress(mdl, i, -1.0))
 			break;
+		uit_checkpoint(mdl, i, NULL, NULL);
 	}
 	// Cleanup memory
-	grd_stfree(bcd->grd_st);
-	xvm_free(bcd->ugrd); xvm_free(bcd->uhes);
-	xvm_free(bcd->bgrd); xvm_free(bcd->bhes);
-	xfree(bcd->actpos);
-	xfree(bcd);
-	for (uint64_t o = 0; o < O; o++)
-		xfree(idx_lst[o]);
-	xfree(idx_lst);
-	xfree(idx_cnt);
+	for (uint32_t w = 0; w < W; w++) {
+		bcd_stfree(wrk[w]->bcd);
+		xfree(wrk[w]);
+	}
+	xfree(idx->off);
+	xfree(idx->seq);
+	xfree(idx);
 }
-
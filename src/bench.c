@@ -0,0 +1,564 @@
+/*
+ *      Wapiti - A linear-chain CRF tool
+ *
+ * Copyright (c) 2009-2013  CNRS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__llvm__) && defined(WIN32)
+#include "winsock.h"
+#else
+#include <sys/time.h>
+#endif
+#if !defined(WIN32) && !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+
+#include "wapiti.h"
+#include "bench.h"
+#include "decoder.h"
+#include "gradient.h"
+#include "model.h"
+#include "options.h"
+#include "progress.h"
+#include "quark.h"
+#include "reader.h"
+#include "sequence.h"
+#include "tools.h"
+#include "trainers.h"
+#include "vmath.h"
+
+/******************************************************************************
+ * Benchmarks
+ *
+ *   This module time the main steps of the training and labelling pipelines so
+ *   the effect of a change can be measured in a reproducible way. Each step is
+ *   reported as a CSV line on the output with the following columns:
+ *     bench,data,Y,T,count,unit,seconds,rate,allocs,bytes,rss
+ *   where <count> items of kind <unit> were processed at <rate> items per
+ *   second, <allocs> and <bytes> are the number and total size of the memory
+ *   allocations done by the step, and <rss> is the peak resident size of the
+ *   process in kilobytes. This last one is a maximum since the start of the
+ *   program so it only grow along the report.
+ *
+ *   Two kinds of runs are available. With a pattern file, the input data are
+ *   read and featurized, the observations quark is searched in its two forms,
+ *   one iteration of the selected trainers is done, and the resulting model is
+ *   used to time the gradient and all the decoders. With lists of labels counts
+ *   and sequences lengths, a random dataset and model are built for each pair
+ *   so the scaling of the gradient and decoders with Y and T can be followed.
+ *   Random values come from a fixed seed so all runs do the same work.
+ ******************************************************************************/
+
+#define BCH_TOKENS  20000   // tokens in synthetic datasets
+#define BCH_WORDS   1000    // vocabulary of synthetic datasets
+#define BCH_LOOKUP  1000000 // minimum number of quark lookups
+#define BCH_NBEST   10      // size of the timed n-best lists
+#define BCH_BEAM    8       // beam of the timed pruned decoding
+#define BCH_MAXLST  32      // maximum length of the sizes lists
+
+/* bch_t:
+ *   State of a benchmark run: where the report goes, the description of the
+ *   current dataset, the counters at the start of the current step, and the
+ *   state of the random generator.
+ */
+typedef struct bch_s bch_t;
+struct bch_s {
+	iol_t      *iol;    //  output of the report
+	const char *data;   //  name of the dataset
+	uint32_t    Y, T;   //  labels count and max length of the dataset
+	double      start;  //  start time of the current step
+	uint64_t    acnt;   //  allocations count at its start
+	uint64_t    asize;  //  allocations size at its start
+	uint64_t    rnd;    //  random generator state
+};
+
+/* bch_now:
+ *   Return the wall clock time in seconds. This must be the same clock than
+ *   the progress report as the steps are multi-threaded.
+ */
+static double bch_now(void) {
+	tms_t tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + (double)tv.tv_usec * 1.0e-6;
+}
+
+/* bch_rss:
+ *   Return the peak resident size of the process in kilobytes, or 0 if it is
+ *   not available on this system.
+ */
+static uint64_t bch_rss(void) {
+#if !defined(WIN32) && !defined(_WIN32)
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) == 0) {
+#if defined(__APPLE__)
+		return (uint64_t)ru.ru_maxrss / 1024;
+#else
+		return (uint64_t)ru.ru_maxrss;
+#endif
+	}
+#endif
+	return 0;
+}
+
+/* bch_rand:
+ *   Return the next value of a xorshift64* pseudo-random generator.
+ */
+static uint64_t bch_rand(bch_t *bch) {
+	uint64_t x = bch->rnd;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	bch->rnd = x;
+	return x * UINT64_C(2685821657736338717);
+}
+
+/* bch_start:
+ *   Start timing a new step.
+ */
+static void bch_start(bch_t *bch) {
+	xmem_stats(&bch->acnt, &bch->asize);
+	bch->start = bch_now();
+}
+
+/* bch_stop:
+ *   End the current step who processed <cnt> items of kind <unit> and report
+ *   it both on the output and to the user.
+ */
+static void bch_stop(bch_t *bch, const char *name, uint64_t cnt,
+		const char *unit) {
+	const double tm = bch_now() - bch->start;
+	uint64_t acnt, asize;
+	xmem_stats(&acnt, &asize);
+	const double rate = tm > 0.0 ? cnt / tm : 0.0;
+	bch->iol->print_cb(bch->iol->out,
+		"%s,%s,%"PRIu32",%"PRIu32",%"PRIu64",%s,%.6f,%.1f,"
+		"%"PRIu64",%"PRIu64",%"PRIu64"\n",
+		name, bch->data, bch->Y, bch->T, cnt, unit, tm, rate,
+		acnt - bch->acnt, asize - bch->asize, bch_rss());
+	info("    %-18s %9.3fs %12.0f %s/s\n", name, tm, rate, unit);
+}
+
+/* bch_featurize:
+ *   Time the conversion of the <S> raw sequences to a new dataset with the
+ *   given reader.
+ */
+static dat_t *bch_featurize(bch_t *bch, rdr_t *rdr, raw_t *raw[],
+		uint32_t S, uint64_t ntok) {
+	dat_t *dat = xmalloc(sizeof(dat_t));
+	dat->lbl  = true;
+	dat->mlen = 0;
+	dat->nseq = S;
+	dat->seq  = xmalloc(sizeof(seq_t *) * S);
+	dat->blk  = NULL;
+	bch_start(bch);
+	for (uint32_t s = 0; s < S; s++) {
+		dat->seq[s] = rdr_raw2seq(rdr, raw[s], true);
+		dat->mlen = max(dat->mlen, dat->seq[s]->len);
+	}
+	bch->Y = qrk_count(rdr->lbl);
+	bch_stop(bch, "featurize", ntok, "token");
+	return dat;
+}
+
+/* bch_lookup:
+ *   Time the search of the <L> keys selected by <ids> in the quark.
+ */
+static void bch_lookup(bch_t *bch, const char *name, qrk_t *qrk,
+		char *keys[], const uint64_t ids[], uint64_t L) {
+	uint64_t bad = 0;
+	bch_start(bch);
+	for (uint64_t i = 0; i < L; i++)
+		if (qrk_str2id(qrk, keys[ids[i]]) != ids[i])
+			bad++;
+	bch_stop(bch, name, L, "lookup");
+	if (bad != 0)
+		fatal("%"PRIu64" quark lookups failed", bad);
+}
+
+/* bch_quark:
+ *   Time the search of the observations in random order, first in the trie
+ *   and next in the frozen form. The keys are copied first as freezing the
+ *   quark release the strings of the trie.
+ */
+static void bch_quark(bch_t *bch, qrk_t *qrk) {
+	const uint64_t N = qrk_count(qrk);
+	if (N == 0)
+		return;
+	const uint64_t L = max(N, (uint64_t)BCH_LOOKUP);
+	char    **keys = xmalloc(sizeof(char *) * N);
+	uint64_t *ids  = xmalloc(sizeof(uint64_t) * L);
+	for (uint64_t n = 0; n < N; n++)
+		keys[n] = xstrdup(qrk_id2str(qrk, n));
+	for (uint64_t i = 0; i < L; i++)
+		ids[i] = bch_rand(bch) % N;
+	bch_lookup(bch, "quark-trie", qrk, keys, ids, L);
+	qrk_freeze(qrk);
+	bch_lookup(bch, "quark-frozen", qrk, keys, ids, L);
+	for (uint64_t n = 0; n < N; n++)
+		xfree(keys[n]);
+	xfree(keys);
+	xfree(ids);
+}
+
+/* bch_train:
+ *   Time one iteration of each selected trainer starting from a null model.
+ *   The user give them as a comma separated list in <algo>, or "all". Each
+ *   one include the evaluation of the model done by the progress report. The
+ *   weights of the last one are kept for the next steps so the l-bfgs, who
+ *   give the most typical model, come last.
+ */
+static void bch_train(bch_t *bch, mdl_t *mdl, opt_t *opt, uint64_t ntok) {
+	static const struct {
+		char *name;
+		void (* train)(mdl_t *mdl);
+	} lst[] = {
+		{"sgd-l1", trn_sgdl1},
+		{"bcd",    trn_bcd  },
+		{"rprop",  trn_rprop},
+		{"l-bfgs", trn_lbfgs},
+	};
+	const uint32_t cnt = sizeof(lst) / sizeof(lst[0]);
+	const char *sel = opt->algo;
+	const bool all = !strcmp(sel, "all");
+	bool use[cnt];
+	for (uint32_t i = 0; i < cnt; i++)
+		use[i] = all;
+	while (!all) {
+		const size_t len = strcspn(sel, ",");
+		uint32_t i = 0;
+		while (i < cnt && (strlen(lst[i].name) != len
+				|| strncmp(lst[i].name, sel, len)))
+			i++;
+		if (i == cnt)
+			fatal("unknown algorithm '%.*s'", (int)len, sel);
+		use[i] = true;
+		if (sel[len] == '\0')
+			break;
+		sel += len + 1;
+	}
+	opt->maxiter = 1;
+	for (uint32_t i = 0; i < cnt; i++) {
+		if (!use[i])
+			continue;
+		char name[32];
+		snprintf(name, sizeof(name), "train-%s", lst[i].name);
+		opt->algo = lst[i].name;
+		for (uint64_t f = 0; f < mdl->nftr; f++)
+			mdl->theta[f] = 0.0;
+		uit_setup(mdl);
+		bch_start(bch);
+		lst[i].train(mdl);
+		bch_stop(bch, name, ntok, "token");
+		uit_cleanup(mdl);
+	}
+}
+
+/* bch_gradient:
+ *   Time a full gradient computation with the current weights, using either
+ *   the dense or the sparse forward-backward.
+ */
+static void bch_gradient(bch_t *bch, mdl_t *mdl, opt_t *opt, bool sparse,
+		uint64_t ntok) {
+	opt->sparse = sparse;
+	double *g = xvm_new(mdl->nftr);
+	grd_t *grd = grd_new(mdl, g);
+	bch_start(bch);
+	grd_gradient(grd);
+	bch_stop(bch, sparse ? "gradient-sparse" : "gradient", ntok, "token");
+	grd_free(grd);
+	xvm_free(g);
+	opt->sparse = false;
+}
+
+/* bch_label:
+ *   Time the decoding of all the training sequences with the given tracker
+ *   and the current options.
+ */
+static void bch_label(bch_t *bch, const char *name, tag_st_t *st,
+		uint32_t N, uint64_t ntok) {
+	const dat_t *dat = st->mdl->train;
+	bch_start(bch);
+	for (uint32_t s = 0; s < dat->nseq; s++) {
+		const seq_t *seq = dat->seq[s];
+		if (N == 1)
+			tag_viterbi(st, seq, st->out, st->scs, st->psc);
+		else
+			tag_nbviterbi(st, seq, N, st->out, st->scs, st->psc);
+	}
+	bch_stop(bch, name, ntok, "token");
+}
+
+/* bch_batch:
+ *   Time the Viterbi decoding of all the training sequences by groups of the
+ *   job size, as done by the labeller, so they are batched if possible.
+ */
+static void bch_batch(bch_t *bch, const char *name, tag_st_t *st,
+		uint64_t ntok) {
+	const dat_t *dat = st->mdl->train;
+	const uint32_t J = st->mdl->opt->jobsize;
+	uint32_t *buf = xmalloc(sizeof(uint32_t) * dat->mlen * J);
+	uint32_t *out[J];
+	for (uint32_t j = 0; j < J; j++)
+		out[j] = buf + (uint64_t)j * dat->mlen;
+	double sc[J];
+	bch_start(bch);
+	for (uint32_t s = 0; s < dat->nseq; s += J) {
+		const uint32_t n = min(J, dat->nseq - s);
+		const seq_t **seq = (const seq_t **)dat->seq + s;
+		tag_viterbis(st, n, seq, out, sc, NULL);
+	}
+	bch_stop(bch, name, ntok, "token");
+	xfree(buf);
+}
+
+/* bch_decode:
+ *   Time all the decoders with the current weights. The sparse one is done
+ *   last as it need its own cache.
+ */
+static void bch_decode(bch_t *bch, mdl_t *mdl, opt_t *opt, uint64_t ntok) {
+	tag_cache_t *cache = tag_cachenew(mdl);
+	tag_st_t *st = tag_stnew(mdl, BCH_NBEST);
+	st->cache = cache;
+	tag_stcheck(st, mdl->train->mlen);
+	bch_label(bch, "label-viterbi", st, 1, ntok);
+	bch_batch(bch, "label-batched", st, ntok);
+	opt->beam = BCH_BEAM;
+	bch_label(bch, "label-beam", st, 1, ntok);
+	opt->beam = 0;
+	bch_label(bch, "label-nbest", st, BCH_NBEST, ntok);
+	opt->lblpost = true;
+	bch_label(bch, "label-posterior", st, 1, ntok);
+	opt->lblpost = false;
+	tag_cachefree(cache);
+	opt->sparse = true;
+	cache = tag_cachenew(mdl);
+	st->cache = cache;
+	bch_label(bch, "label-sparse", st, 1, ntok);
+	opt->sparse = false;
+	tag_stfree(st);
+	tag_cachefree(cache);
+}
+
+/* bch_dataset:
+ *   Run all the benchmarks on the data read from <iol> with the patterns from
+ *   the user. The raw sequences are all kept in memory so the reading and the
+ *   featurization are timed separately, their lines may be views in the input
+ *   buffer so this one must stay alive until they are freed.
+ */
+static void bch_dataset(bch_t *bch, mdl_t *mdl, opt_t *opt, iol_t *iol) {
+	rdr_t *rdr = mdl->reader;
+	FILE *file = fopen(opt->pattern, "r");
+	if (file == NULL)
+		pfatal("cannot open pattern file");
+	iol_t *pat = iol_new(file, NULL);
+	rdr_loadpat(rdr, pat);
+	iol_free(pat);
+	fclose(file);
+	qrk_lock(rdr->obs, false);
+	// Read all the raw sequences
+	raw_t  **raw = NULL;
+	uint32_t S = 0, size = 0;
+	uint64_t ntok = 0;
+	bch_start(bch);
+	while (true) {
+		raw_t *seq = rdr_readraw(iol, rdr->autouni);
+		if (seq == NULL)
+			break;
+		if (S == size) {
+			size = size == 0 ? 1024 : size * 2;
+			raw = xrealloc(raw, sizeof(raw_t *) * size);
+		}
+		raw[S++] = seq;
+		ntok += seq->len;
+		bch->T = max(bch->T, seq->len);
+	}
+	bch_stop(bch, "read", ntok, "token");
+	if (S == 0)
+		fatal("no data to benchmark");
+	// Featurize them while building the quarks, and next again with the
+	// quarks locked as it is done for labelling.
+	dat_t *dat = bch_featurize(bch, rdr, raw, S, ntok);
+	qrk_lock(rdr->lbl, true);
+	qrk_lock(rdr->obs, true);
+	bch_start(bch);
+	for (uint32_t s = 0; s < S; s++)
+		rdr_freeseq(rdr_raw2seq(rdr, raw[s], true));
+	bch_stop(bch, "featurize-locked", ntok, "token");
+	for (uint32_t s = 0; s < S; s++)
+		rdr_freeraw(raw[s]);
+	xfree(raw);
+	bch_quark(bch, rdr->obs);
+	// Build a CRF model on this data
+	mdl->type  = 2;
+	mdl->train = dat;
+	mdl_sync(mdl);
+	if (opt->nthread > 1)
+		rdr_sortdat(dat);
+	info("    %"PRIu32" labels, %"PRIu64" blocks, %"PRIu64" features\n",
+		mdl->nlbl, mdl->nobs, mdl->nftr);
+	bch_train(bch, mdl, opt, ntok);
+	bch_gradient(bch, mdl, opt, false, ntok);
+	bch_gradient(bch, mdl, opt, true, ntok);
+	bch_decode(bch, mdl, opt, ntok);
+}
+
+/* bch_gets:
+ *   Line callback returning the strings of a NULL terminated list, used to
+ *   feed the patterns of the synthetic datasets to the reader.
+ */
+static char *bch_gets(void *ud) {
+	const char ***lst = ud;
+	if (**lst == NULL)
+		return NULL;
+	return xstrdup(*(*lst)++);
+}
+
+/* bch_synth:
+ *   Run the benchmarks on a random dataset with <Y> labels and sequences of
+ *   length <T>. The words are uniformly drawn and the labels too, except that
+ *   the first tokens take all of them so the model has exactly <Y> labels.
+ *   The weights are also random as the trainers would learn nothing here.
+ */
+static void bch_synth(bch_t *bch, opt_t *opt, uint32_t Y, uint32_t T) {
+	static const char *pats[] = {
+		"u:w-1=%x[-1,0]", "u:w=%x[0,0]", "u:w+1=%x[1,0]", "b", NULL
+	};
+	const char **lst = pats;
+	rdr_t *rdr = rdr_new(NULL, false);
+	iol_t *iol = iol_new2(bch_gets, &lst, NULL, NULL);
+	rdr_loadpat(rdr, iol);
+	iol_free(iol);
+	bch->data = "synthetic";
+	bch->Y = Y;
+	bch->T = T;
+	const uint32_t S = max(BCH_TOKENS / T, 1u);
+	const uint64_t ntok = (uint64_t)S * T;
+	raw_t **raw = xmalloc(sizeof(raw_t *) * S);
+	uint64_t n = 0;
+	for (uint32_t s = 0; s < S; s++) {
+		raw[s] = xmalloc(sizeof(raw_t) + sizeof(char *) * T);
+		raw[s]->len  = T;
+		raw[s]->view = false;
+		for (uint32_t t = 0; t < T; t++, n++) {
+			const uint64_t w = bch_rand(bch) % BCH_WORDS;
+			const uint64_t y = n < Y ? n : bch_rand(bch) % Y;
+			char line[64];
+			snprintf(line, sizeof(line), "w%"PRIu64" l%"PRIu64,
+				w, y);
+			raw[s]->lines[t] = xstrdup(line);
+		}
+	}
+	dat_t *dat = bch_featurize(bch, rdr, raw, S, ntok);
+	for (uint32_t s = 0; s < S; s++)
+		rdr_freeraw(raw[s]);
+	xfree(raw);
+	qrk_lock(rdr->lbl, true);
+	qrk_lock(rdr->obs, true);
+	mdl_t *mdl = mdl_new(rdr);
+	mdl->opt   = opt;
+	mdl->type  = 2;
+	mdl->train = dat;
+	mdl_sync(mdl);
+	for (uint64_t f = 0; f < mdl->nftr; f++) {
+		const double r = (double)(bch_rand(bch) >> 11) * 0x1p-53;
+		mdl->theta[f] = (r - 0.5) * 0.2;
+	}
+	bch_gradient(bch, mdl, opt, false, ntok);
+	bch_decode(bch, mdl, opt, ntok);
+	mdl_free(mdl);
+}
+
+/* bch_sizes:
+ *   Parse a comma separated list of positive sizes in <lst> and return its
+ *   length.
+ */
+static uint32_t bch_sizes(const char *str, uint32_t lst[BCH_MAXLST]) {
+	uint32_t cnt = 0;
+	const char *pos = str;
+	while (*pos != '\0') {
+		char *end;
+		const unsigned long val = strtoul(pos, &end, 10);
+		if (end == pos || val == 0 || val > UINT32_MAX)
+			fatal("invalid list of sizes '%s'", str);
+		if (*end != ',' && *end != '\0')
+			fatal("invalid list of sizes '%s'", str);
+		if (cnt == BCH_MAXLST)
+			fatal("too many sizes in '%s'", str);
+		lst[cnt++] = val;
+		pos = *end == ',' ? end + 1 : end;
+	}
+	if (cnt == 0)
+		fatal("invalid list of sizes '%s'", str);
+	return cnt;
+}
+
+/* bch_run:
+ *   Run the benchmarks requested by the user and write the report to <iol>.
+ *   The options are copied as the steps change them.
+ */
+void bch_run(mdl_t *mdl, iol_t *iol) {
+	const opt_t *old = mdl->opt;
+	opt_t opt = *old;
+	mdl->opt = &opt;
+	const bool synth = opt.scaley != NULL || opt.scalet != NULL;
+	if (opt.pattern == NULL && !synth)
+		fatal("nothing to benchmark, give patterns or synthetic sizes");
+	uint32_t lsty[BCH_MAXLST], lstt[BCH_MAXLST];
+	uint32_t ny = 0, nt = 0;
+	if (synth) {
+		ny = bch_sizes(opt.scaley != NULL ? opt.scaley : "16", lsty);
+		nt = bch_sizes(opt.scalet != NULL ? opt.scalet : "32", lstt);
+	}
+	bch_t bch = {
+		.iol  = iol,
+		.data = opt.input != NULL ? opt.input : "stdin",
+		.Y    = 0, .T = 0,
+		.rnd  = UINT64_C(0x9e3779b97f4a7c15),
+	};
+	xvm_parallel(opt.nthread);
+	xmem_track = true;
+	iol->print_cb(iol->out, "bench,data,Y,T,count,unit,seconds,rate,"
+		"allocs,bytes,rss\n");
+	if (opt.pattern != NULL) {
+		info("* Benchmark %s\n", bch.data);
+		bch_dataset(&bch, mdl, &opt, iol);
+	}
+	for (uint32_t i = 0; i < ny; i++) {
+		for (uint32_t j = 0; j < nt; j++) {
+			info("* Benchmark synthetic Y=%"PRIu32" T=%"PRIu32"\n",
+				lsty[i], lstt[j]);
+			bch_synth(&bch, &opt, lsty[i], lstt[j]);
+		}
+	}
+	xmem_track = false;
+	mdl->opt = old;
+	info("* Done\n");
+}
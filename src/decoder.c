@@ -25,6 +25,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <ctype.h>
 #include <inttypes.h>
 #include <float.h>
 #include <stdint.h>
@@ -37,6 +38,7 @@
 #include "wapiti.h"
 #include "gradient.h"
 #include "model.h"
+#include "pattern.h"
 #include "quark.h"
 #include "reader.h"
 #include "sequence.h"
@@ -51,21 +53,124 @@
  *   This module implement sequence tagging using a trained model and model
  *   evaluation on devlopment set.
  *
- *   The viterbi can be quite intensive on the stack if you push in it long
- *   sequence and use large labels set. It's less a problem than in gradient
- *   computations but it can show up in particular cases. The fix is to call it
- *   through the mth_spawn function and request enough stack space, this will be
- *   fixed in next version.
+ *   All the temporary memory used by the decoders is kept in a tag_st_t state
+ *   who only grow, so decoding a lot of sequences with the same state doesn't
+ *   allocate anything once the state is big enough.
  ******************************************************************************/
 
+/* tag_cachenew:
+ *   Build the decoding cache for the current weights of the model. First the
+ *   constant bigram observations are searched by applying the patterns without
+ *   token references and their weights are summed in the default transition
+ *   matrix. Next, in sparse mode, the lists of non-zero weights are built.
+ *   In hashed mode, other observations can fall in the bucket of a constant
+ *   one and must still be added at each of their occurrences as during the
+ *   training, so the default matrix is left empty.
+ */
+tag_cache_t *tag_cachenew(mdl_t *mdl) {
+	const rdr_t   *rdr = mdl->reader;
+	const uint32_t Y   = mdl->nlbl;
+	const uint64_t O   = mdl->nobs;
+	tag_cache_t *cache = xmalloc(sizeof(tag_cache_t));
+	cache->mdl   = mdl;
+	cache->ncst  = 0;
+	cache->cst   = xmalloc(sizeof(uint64_t) * (rdr->nbi + 1));
+	cache->dflt  = xvm_new(Y * Y);
+	cache->dnnz  = 0;
+	cache->dcol  = NULL;
+	cache->drow  = NULL;
+	cache->spoff = NULL;
+	cache->spidx = NULL;
+	for (uint32_t d = 0; d < Y * Y; d++)
+		cache->dflt[d] = 0.0;
+	const uint32_t off = rdr->autouni ? 1 : 0;
+	tok_t tok = {.len = 1};
+	char    *buf  = NULL;
+	uint32_t size = 0;
+	for (uint32_t p = 0; p < rdr->npats && rdr->hbits == 0; p++) {
+		const pat_t *pat = rdr->pats[p];
+		bool cst = true;
+		for (uint32_t it = 0; it < pat->nitems; it++)
+			if (pat->items[it].type != 's')
+				cst = false;
+		if (!cst)
+			continue;
+		pat_execbuf(pat, &tok, 0, &buf, &size, off);
+		if (off != 0)
+			buf[0] = 'u';
+		if (buf[off] != 'b' && buf[off] != '*')
+			continue;
+		const uint64_t o = qrk_str2id(rdr->obs, buf);
+		if (o == none || !(mdl->kind[o] & 2))
+			continue;
+		cache->cst[cache->ncst++] = o;
+		mdl_wadd(mdl, cache->dflt, o, mdl->boff[o], Y * Y);
+	}
+	xfree(buf);
+	if (!mdl->opt->sparse)
+		return cache;
+	cache->dcol = xmalloc(sizeof(uint32_t) * (Y + 1));
+	cache->drow = xmalloc(sizeof(uint32_t) * Y * Y);
+	for (uint32_t y = 0; y < Y; y++) {
+		cache->dcol[y] = cache->dnnz;
+		for (uint32_t yp = 0; yp < Y; yp++)
+			if (cache->dflt[yp * Y + y] != 0.0)
+				cache->drow[cache->dnnz++] = yp;
+	}
+	cache->dcol[Y] = cache->dnnz;
+	uint64_t nnz = 0;
+	cache->spoff = xmalloc(sizeof(uint64_t) * (O + 1));
+	for (uint64_t o = 0; o < O; o++) {
+		cache->spoff[o] = nnz;
+		if (mdl->kind[o] & 2)
+			for (uint32_t d = 0; d < Y * Y; d++) {
+				const uint64_t f = mdl->boff[o] + d;
+				nnz += mdl_wget(mdl, o, f) != 0.0;
+			}
+	}
+	cache->spoff[O] = nnz;
+	cache->spidx = xmalloc(sizeof(uint32_t) * (nnz + 1));
+	for (uint64_t o = 0, n = 0; o < O; o++)
+		if (mdl->kind[o] & 2)
+			for (uint32_t d = 0; d < Y * Y; d++)
+				if (mdl_wget(mdl, o, mdl->boff[o] + d) != 0.0)
+					cache->spidx[n++] = d;
+	return cache;
+}
+
+/* tag_cachefree:
+ *   Free all memory used by a decoding cache.
+ */
+void tag_cachefree(tag_cache_t *cache) {
+	xfree(cache->cst);
+	xvm_free(cache->dflt);
+	xfree(cache->dcol);
+	xfree(cache->drow);
+	xfree(cache->spoff);
+	xfree(cache->spidx);
+	xfree(cache);
+}
+
+/* tag_iscst:
+ *   Return true if the observation is one of the constant bigram observations
+ *   summed in the default matrix of the cache.
+ */
+static inline bool tag_iscst(const tag_cache_t *cache, uint64_t o) {
+	for (uint32_t i = 0; i < cache->ncst; i++)
+		if (cache->cst[i] == o)
+			return true;
+	return false;
+}
+
 /* tag_expsc:
  *   Compute the score lattice for classical Viterbi decoding. This is the same
  *   as for the first step of the gradient computation with the exception that
  *   we don't need to take the exponential of the scores as the Viterbi decoding
  *   works in log-space.
  */
-static int tag_expsc(mdl_t *mdl, const seq_t *seq, double *vpsi) {
-	const double  *x = mdl->theta;
+static int tag_expsc(tag_st_t *st, const seq_t *seq, double *vpsi) {
+	const mdl_t *mdl = st->mdl;
+	const tag_cache_t *cache = st->cache;
 	const uint32_t Y = mdl->nlbl;
 	const uint32_t T = seq->len;
 	double (*psi)[T][Y][Y] = (void *)vpsi;
@@ -93,30 +198,46 @@ static int tag_expsc(mdl_t *mdl, const seq_t *seq, double *vpsi) {
 	//   2/ we add the bigrams features weights by looping over actives
 	//        bigrams observations (we don't have to do this for t=0 since
 	//        there is no bigrams here)
+	//
+	// If a cache is available, the bigrams weights of the constant
+	// observations are already summed in the default matrix so each
+	// position just have to add it and the weights of the others.
+	//
+	// The weights are read through mdl_wadd so models with reduced
+	// weights are decoded the same way, the sums are done in the first
+	// row of each position and copied to the others.
 	for (uint32_t t = 0; t < T; t++) {
 		const pos_t *pos = &(seq->pos[t]);
-		for (uint32_t y = 0; y < Y; y++) {
-			double sum = 0.0;
-			for (uint32_t n = 0; n < pos->ucnt; n++) {
-				const uint64_t o = pos->uobs[n];
-				sum += x[mdl->uoff[o] + y];
-			}
-			for (uint32_t yp = 0; yp < Y; yp++)
-				(*psi)[t][yp][y] = sum;
+		const obs_t *uobs = seq_uobs(seq, pos);
+		double *row = (*psi)[t][0];
+		for (uint32_t y = 0; y < Y; y++)
+			row[y] = 0.0;
+		for (uint32_t n = 0; n < pos->ucnt; n++) {
+			const uint64_t o = uobs[n];
+			mdl_wadd(mdl, row, o, mdl->uoff[o], Y);
 		}
+		for (uint32_t yp = 1; yp < Y; yp++)
+			memcpy((*psi)[t][yp], row, sizeof(double) * Y);
 	}
+	if (cache != NULL) {
+		for (uint32_t t = 1; t < T; t++)
+			grd_addbi(mdl, (*psi)[t][0], st->btmp, seq, t,
+				cache->dflt, cache->cst, cache->ncst);
+		return 0;
+	}
+	double *sum = st->btmp;
 	for (uint32_t t = 1; t < T; t++) {
 		const pos_t *pos = &(seq->pos[t]);
-		for (uint32_t yp = 0, d = 0; yp < Y; yp++) {
-			for (uint32_t y = 0; y < Y; y++, d++) {
-				double sum = 0.0;
-				for (uint32_t n = 0; n < pos->bcnt; n++) {
-					const uint64_t o = pos->bobs[n];
-					sum += x[mdl->boff[o] + d];
-				}
-				(*psi)[t][yp][y] += sum;
-			}
+		const obs_t *bobs = seq_bobs(seq, pos);
+		for (uint32_t d = 0; d < Y * Y; d++)
+			sum[d] = 0.0;
+		for (uint32_t n = 0; n < pos->bcnt; n++) {
+			const uint64_t o = bobs[n];
+			mdl_wadd(mdl, sum, o, mdl->boff[o], Y * Y);
 		}
+		for (uint32_t yp = 0, d = 0; yp < Y; yp++)
+			for (uint32_t y = 0; y < Y; y++, d++)
+				(*psi)[t][yp][y] += sum[d];
 	}
 	return 0;
 }
@@ -127,10 +248,10 @@ static int tag_expsc(mdl_t *mdl, const seq_t *seq, double *vpsi) {
  *   relative to the previous label. This normalization must be done in linear
  *   space, not in logarithm one.
  */
-static int tag_memmsc(mdl_t *mdl, const seq_t *seq, double *vpsi) {
-	const uint32_t Y = mdl->nlbl;
+static int tag_memmsc(tag_st_t *st, const seq_t *seq, double *vpsi) {
+	const uint32_t Y = st->mdl->nlbl;
 	const uint32_t T = seq->len;
-	tag_expsc(mdl, seq, vpsi);
+	tag_expsc(st, seq, vpsi);
 	xvm_expma(vpsi, vpsi, 0.0, T * Y * Y);
 	double (*psi)[T][Y][Y] = (void *)vpsi;
 	for (uint32_t t = 0; t < T; t++) {
@@ -145,17 +266,25 @@ static int tag_memmsc(mdl_t *mdl, const seq_t *seq, double *vpsi) {
 	return 1;
 }
 
-/* tag_postsc:
- *   This function compute score lattice with posteriors. This generally result
- *   in a slightly best labelling and allow to output normalized score for the
- *   sequence and for each labels but this is more costly as we have to perform
- *   a full forward backward instead of just the forward pass.
+/* tag_posterior:
+ *   Compute the posterior probability of each label at each position of the
+ *   sequence and store them in <post> as a [T][Y] array. The forward-backward
+ *   is done with a gradient state kept in the tracker, so nothing is allocated
+ *   once it is big enough, and only these unigram marginals are computed from
+ *   the forward and backward scores, the bigram ones are never built.
  */
-static int tag_postsc(mdl_t *mdl, const seq_t *seq, double *vpsi) {
+void tag_posterior(tag_st_t *st, const seq_t *seq, double post[]) {
+	mdl_t *mdl = st->mdl;
 	const uint32_t Y = mdl->nlbl;
 	const uint32_t T = seq->len;
-	double (*psi)[T][Y][Y] = (void *)vpsi;
-	grd_st_t *grd_st = grd_stnew(mdl, NULL);
+	if (st->grd_st == NULL)
+		st->grd_st = grd_stnew(mdl, NULL);
+	grd_st_t *grd_st = st->grd_st;
+	if (st->cache != NULL) {
+		grd_st->bcst = st->cache->dflt;
+		grd_st->cst  = st->cache->cst;
+		grd_st->ncst = st->cache->ncst;
+	}
 	grd_st->first = 0;
 	grd_st->last  = T - 1;
 	grd_stcheck(grd_st, seq->len);
@@ -166,20 +295,69 @@ static int tag_postsc(mdl_t *mdl, const seq_t *seq, double *vpsi) {
 		grd_fldopsi(grd_st, seq);
 		grd_flfwdbwd(grd_st, seq);
 	}
-	double (*alpha)[T][Y] = (void *)grd_st->alpha;
-	double (*beta )[T][Y] = (void *)grd_st->beta;
-	double  *unorm        =         grd_st->unorm;
+	const double (*alpha)[T][Y] = (void *)grd_st->alpha;
+	const double (*beta )[T][Y] = (void *)grd_st->beta;
+	const double  *unorm        =         grd_st->unorm;
+	double (*pst)[T][Y] = (void *)post;
+	for (uint32_t t = 0; t < T; t++) {
+		const double *a = (*alpha)[t], *b = (*beta)[t];
+		for (uint32_t y = 0; y < Y; y++)
+			(*pst)[t][y] = a[y] * b[y] * unorm[t];
+	}
+}
+
+/* tag_postsc:
+ *   This function compute score lattice with posteriors. This generally result
+ *   in a slightly best labelling and allow to output normalized score for the
+ *   sequence and for each labels but this is more costly as we have to perform
+ *   a full forward backward instead of just the forward pass. The lattice is
+ *   only needed for n-best and forced decoding, see tag_pstviterbi.
+ */
+static int tag_postsc(tag_st_t *st, const seq_t *seq, double *vpsi) {
+	mdl_t *mdl = st->mdl;
+	const uint32_t Y = mdl->nlbl;
+	const uint32_t T = seq->len;
+	double (*psi)[T][Y][Y] = (void *)vpsi;
+	double (*pst)[T][Y]    = (void *)st->post;
+	tag_posterior(st, seq, st->post);
 	for (uint32_t t = 0; t < T; t++) {
 		for (uint32_t y = 0; y < Y; y++) {
-			double e = (*alpha)[t][y] * (*beta)[t][y] * unorm[t];
+			const double e = (*pst)[t][y];
 			for (uint32_t yp = 0; yp < Y; yp++)
 				(*psi)[t][yp][y] = e;
 		}
 	}
-	grd_stfree(grd_st);
 	return 1;
 }
 
+/* tag_pstviterbi:
+ *   Posterior decoding of the best sequence. As the scores of the arcs in the
+ *   posterior lattice only depend on the label they lead to, the best path is
+ *   made of the best label at each position and its score is the product of
+ *   their posteriors. So there is no need to build the lattice or to do the
+ *   Viterbi, the labels are selected directly from the marginals.
+ */
+static void tag_pstviterbi(tag_st_t *st, const seq_t *seq,
+                           uint32_t out[], double *sc, double psc[]) {
+	const uint32_t Y = st->mdl->nlbl;
+	const uint32_t T = seq->len;
+	double (*pst)[T][Y] = (void *)st->post;
+	tag_posterior(st, seq, st->post);
+	double sum = 1.0;
+	for (uint32_t t = 0; t < T; t++) {
+		uint32_t bst = 0;
+		for (uint32_t y = 1; y < Y; y++)
+			if ((*pst)[t][y] > (*pst)[t][bst])
+				bst = y;
+		out[t] = bst;
+		sum = (t != 0) ? sum * (*pst)[t][bst] : (*pst)[t][bst];
+		if (psc != NULL)
+			psc[t] = (*pst)[t][bst];
+	}
+	if (sc != NULL)
+		*sc = sum;
+}
+
 /* tag_forced:
  *   This function apply correction to the psi table to take account of already
  *   known labels. If a label is known, all arcs leading or comming from other
@@ -217,33 +395,481 @@ static void tag_forced(mdl_t *mdl, const seq_t *seq, double *vpsi, int op) {
 	}
 }
 
+/* tag_stcheck:
+ *   Check that enough memory is allocated in the decoding state for sequences
+ *   of the given length. If not, the memory is grown, so after a few calls the
+ *   state is big enough for all sequences and no more allocations are done.
+ */
+void tag_stcheck(tag_st_t *st, uint32_t len) {
+	if (len <= st->len)
+		return;
+	const uint32_t Y = st->mdl->nlbl;
+	const uint32_t N = st->nbest;
+	const uint32_t T = len;
+	xvm_free(st->psi);
+	st->psi  = xvm_new(T * Y * Y);
+	st->back = xrealloc(st->back, sizeof(uint32_t) * T * Y);
+	st->out  = xrealloc(st->out,  sizeof(uint32_t) * T * N);
+	st->psc  = xrealloc(st->psc,  sizeof(double  ) * T * N);
+	st->post = xrealloc(st->post, sizeof(double  ) * T * Y);
+	st->len  = len;
+}
+
+/* tag_stnew:
+ *   Allocate a new decoding state for n-best lists of at most <nbest>
+ *   sequences. The memory depending on the sequence length will be allocated
+ *   by tag_stcheck when needed.
+ */
+tag_st_t *tag_stnew(mdl_t *mdl, uint32_t nbest) {
+	const uint32_t Y = mdl->nlbl;
+	const uint32_t N = nbest;
+	tag_st_t *st = xmalloc(sizeof(tag_st_t));
+	st->mdl    = mdl;
+	st->len    = 0;
+	st->nbest  = N;
+	st->psi    = NULL;
+	st->back   = NULL;
+	st->out    = NULL;
+	st->psc    = NULL;
+	st->post   = NULL;
+	st->cur    = xmalloc(sizeof(double) * Y);
+	st->old    = xmalloc(sizeof(double) * Y);
+	st->scs    = xmalloc(sizeof(double) * N);
+	st->grd_st = NULL;
+	st->cache  = NULL;
+	st->btmp   = xmalloc(sizeof(double) * Y * Y);
+	st->spsz   = 0;
+	st->sptop  = NULL;
+	st->spval  = NULL;
+	st->spmrk  = NULL;
+	st->splst  = NULL;
+	st->spcol  = NULL;
+	st->spgrp  = NULL;
+	st->spexc  = NULL;
+	st->spstp  = 0;
+	st->spexs  = 0;
+	st->bmlst  = xmalloc(sizeof(uint32_t) * Y);
+	st->bmarc  = st->bmall = 0;
+	st->nbalp  = NULL;
+	st->nblen  = 0;
+	st->nbhyp  = NULL;
+	st->nbhp   = NULL;
+	st->nbsz   = 0;
+	st->btpsc  = NULL;
+	st->btback = NULL;
+	st->btmat  = NULL;
+	st->btuni  = NULL;
+	st->btcur  = NULL;
+	st->btold  = NULL;
+	st->btsz   = 0;
+	st->btlan  = 0;
+	return st;
+}
+
+/* tag_stfree:
+ *   Free all memory used by a decoding state.
+ */
+void tag_stfree(tag_st_t *st) {
+	if (st->grd_st != NULL)
+		grd_stfree(st->grd_st);
+	xvm_free(st->psi);
+	xfree(st->back);
+	xfree(st->out);
+	xfree(st->psc);
+	xfree(st->post);
+	xfree(st->cur);
+	xfree(st->old);
+	xfree(st->scs);
+	xfree(st->btmp);
+	xfree(st->sptop);
+	xfree(st->spval);
+	xfree(st->spmrk);
+	xfree(st->splst);
+	xfree(st->spcol);
+	xfree(st->spgrp);
+	xfree(st->spexc);
+	xfree(st->bmlst);
+	xfree(st->nbalp);
+	xfree(st->nbhyp);
+	xfree(st->nbhp);
+	xfree(st->btpsc);
+	xfree(st->btback);
+	xfree(st->btmat);
+	xfree(st->btuni);
+	xfree(st->btcur);
+	xfree(st->btold);
+	xfree(st);
+}
+
+/* tag_ctxnew:
+ *   Build a new decoding context for the given shared model and the optional
+ *   cache, this cache is not owned by the context and must outlive it.
+ */
+tag_ctx_t *tag_ctxnew(mdl_t *mdl, const tag_cache_t *cache, uint32_t nbest) {
+	tag_ctx_t *ctx = xmalloc(sizeof(tag_ctx_t));
+	ctx->mdl = mdl;
+	ctx->st  = tag_stnew(mdl, nbest);
+	ctx->st->cache = cache;
+	ctx->scr = rdr_scrnew();
+	return ctx;
+}
+
+/* tag_ctxfree:
+ *   Free all the memory used by a decoding context.
+ */
+void tag_ctxfree(tag_ctx_t *ctx) {
+	rdr_scrfree(ctx->scr);
+	tag_stfree(ctx->st);
+	xfree(ctx);
+}
+
+/* tag_spviterbi:
+ *   Sparse version of the Viterbi for models where most of the bigrams weights
+ *   are null. At each position, the score of the arc (y',y) is the unigram
+ *   score of y plus the sum of the bigram weights of (y',y), and for most of
+ *   the arcs this sum is null. The non-zero entries come from the default
+ *   transition matrix, grouped by column once in the cache, and from the few
+ *   other active observations which are merged at each position. For each
+ *   label y, the best arc is either one with a non-zero weight or, for all the
+ *   others, the one coming from the best previous label without non-zero
+ *   weight, which is searched in the list of the K best previous labels.
+ *   This cost O(Y K + N) at each position, with N the number of non-zero
+ *   weights, instead of O(Y^2) and give the same result than the dense version
+ *   except for ties between paths who only differs in their last rounding.
+ */
+#define TAG_SPTOP 8
+static void tag_spviterbi(tag_st_t *st, const seq_t *seq,
+                          uint32_t out[], double *sc, double psc[]) {
+	mdl_t *mdl = st->mdl;
+	const tag_cache_t *cache = st->cache;
+	const uint32_t Y = mdl->nlbl;
+	const uint32_t T = seq->len;
+	const uint32_t K = min(Y, TAG_SPTOP);
+	if (st->spsz != Y) {
+		st->spsz  = Y;
+		st->sptop = xmalloc(sizeof(uint32_t) * TAG_SPTOP);
+		st->spval = xmalloc(sizeof(double  ) * Y * Y);
+		st->spmrk = xmalloc(sizeof(uint32_t) * Y * Y);
+		st->splst = xmalloc(sizeof(uint32_t) * Y * Y);
+		st->spcol = xmalloc(sizeof(uint32_t) * (Y + 1));
+		st->spgrp = xmalloc(sizeof(uint32_t) * Y * Y);
+		st->spexc = xmalloc(sizeof(uint32_t) * Y);
+		memset(st->spmrk, 0, sizeof(uint32_t) * Y * Y);
+		memset(st->spexc, 0, sizeof(uint32_t) * Y);
+	}
+	double   (*uni) [T][Y] = (void *)st->psi;
+	uint32_t (*back)[T][Y] = (void *)st->back;
+	double   *cur = st->cur, *old = st->old;
+	uint32_t *top = st->sptop;
+	double   *val = st->spval;
+	uint32_t *mrk = st->spmrk, *lst = st->splst;
+	uint32_t *col = st->spcol, *grp = st->spgrp;
+	uint32_t *exc = st->spexc;
+	const double   *dflt = cache->dflt;
+	const uint32_t *dcol = cache->dcol, *drow = cache->drow;
+	// First, the unigrams scores are computed like in tag_expsc, they are
+	// stored in the psi buffer of the state as it is big enough.
+	for (uint32_t t = 0; t < T; t++) {
+		const pos_t *pos = &(seq->pos[t]);
+		const obs_t *uobs = seq_uobs(seq, pos);
+		for (uint32_t y = 0; y < Y; y++)
+			(*uni)[t][y] = 0.0;
+		for (uint32_t n = 0; n < pos->ucnt; n++) {
+			const uint64_t o = uobs[n];
+			mdl_wadd(mdl, (*uni)[t], o, mdl->uoff[o], Y);
+		}
+	}
+	for (uint32_t y = 0; y < Y; y++)
+		cur[y] = (*uni)[0][y];
+	for (uint32_t t = 1; t < T; t++) {
+		const pos_t *pos = &(seq->pos[t]);
+		const obs_t *bobs = seq_bobs(seq, pos);
+		// Keep the previous scores and select the K best ones, in
+		// decreasing order and with the lowest label first for ties.
+		uint32_t ntop = 0;
+		for (uint32_t y = 0; y < Y; y++) {
+			old[y] = cur[y];
+			if (ntop == K && !(old[y] > old[top[K - 1]]))
+				continue;
+			uint32_t i = (ntop == K) ? K - 1 : ntop++;
+			for ( ; i > 0 && old[y] > old[top[i - 1]]; i--)
+				top[i] = top[i - 1];
+			top[i] = y;
+		}
+		// Merge the non-zero weights of the non-constant observations
+		// active at this position, the stamps avoid to clear the full
+		// matrix each time.
+		if (++st->spstp == 0) {
+			memset(mrk, 0, sizeof(uint32_t) * Y * Y);
+			st->spstp = 1;
+		}
+		const uint32_t stp = st->spstp;
+		uint32_t nl = 0;
+		for (uint32_t n = 0; n < pos->bcnt; n++) {
+			const uint64_t o = bobs[n];
+			if (tag_iscst(cache, o))
+				continue;
+			const uint64_t f = mdl->boff[o];
+			for (uint64_t k = cache->spoff[o]; k < cache->spoff[o + 1]; k++) {
+				const uint32_t d = cache->spidx[k];
+				if (mrk[d] != stp) {
+					mrk[d] = stp, lst[nl++] = d;
+					val[d] = 0.0;
+				}
+				val[d] += mdl_wget(mdl, o, f + d);
+			}
+		}
+		// Group the merged entries by column with a counting sort, the
+		// ones also in the default matrix are handled with it.
+		for (uint32_t y = 0; y <= Y; y++)
+			col[y] = 0;
+		for (uint32_t n = 0; n < nl; n++)
+			if (dflt[lst[n]] == 0.0)
+				col[lst[n] % Y + 1]++;
+		for (uint32_t y = 0; y < Y; y++)
+			col[y + 1] += col[y];
+		for (uint32_t n = 0; n < nl; n++)
+			if (dflt[lst[n]] == 0.0)
+				grp[col[lst[n] % Y]++] = lst[n];
+		for (uint32_t y = Y; y > 0; y--)
+			col[y] = col[y - 1];
+		col[0] = 0;
+		// And finally do the max for each label
+		for (uint32_t y = 0; y < Y; y++) {
+			const double u = (*uni)[t][y];
+			double   bst = -HUGE_VAL;
+			uint32_t idx = 0;
+			#define tag_spupd(yp, v) do {                                \
+				const double sv = (v);                           \
+				if (sv > bst || (sv == bst && (yp) < idx))       \
+					bst = sv, idx = (yp);                    \
+			} while (0)
+			if (++st->spexs == 0) {
+				memset(exc, 0, sizeof(uint32_t) * Y);
+				st->spexs = 1;
+			}
+			const uint32_t exs = st->spexs;
+			for (uint32_t n = dcol[y]; n < dcol[y + 1]; n++) {
+				const uint32_t yp = drow[n];
+				const uint32_t d  = yp * Y + y;
+				double w = dflt[d];
+				if (mrk[d] == stp)
+					w += val[d];
+				exc[yp] = exs;
+				tag_spupd(yp, old[yp] + (u + w));
+			}
+			for (uint32_t n = col[y]; n < col[y + 1]; n++) {
+				const uint32_t yp = grp[n] / Y;
+				exc[yp] = exs;
+				tag_spupd(yp, old[yp] + (u + val[grp[n]]));
+			}
+			// The best arc without bigram weight come from the best
+			// previous label not excluded, if all the K best ones
+			// are excluded we have to look at all the labels.
+			uint32_t i = 0;
+			while (i < ntop && exc[top[i]] == exs)
+				i++;
+			if (i < ntop) {
+				tag_spupd(top[i], old[top[i]] + u);
+			} else {
+				for (uint32_t yp = 0; yp < Y; yp++)
+					if (exc[yp] != exs)
+						tag_spupd(yp, old[yp] + u);
+			}
+			#undef tag_spupd
+			(*back)[t][y] = idx;
+			cur[y] = bst;
+		}
+	}
+	// The backtracking is the same as in the dense version except that the
+	// scores of the selected arcs have to be recomputed.
+	uint32_t bst = 0;
+	for (uint32_t y = 1; y < Y; y++)
+		if (cur[y] > cur[bst])
+			bst = y;
+	if (sc != NULL)
+		*sc = cur[bst];
+	for (uint32_t t = T; t > 0; t--) {
+		const uint32_t yp = (t != 1) ? (*back)[t - 1][bst] : 0;
+		const uint32_t y  = bst;
+		out[t - 1] = y;
+		if (psc != NULL) {
+			const pos_t *pos = &(seq->pos[t - 1]);
+			const obs_t *bobs = seq_bobs(seq, pos);
+			double sum = 0.0;
+			if (t != 1)
+				for (uint32_t n = 0; n < pos->bcnt; n++) {
+					const uint64_t o = bobs[n];
+					const uint64_t d = yp * Y + y;
+					const uint64_t f = mdl->boff[o] + d;
+					sum += mdl_wget(mdl, o, f);
+				}
+			psc[t - 1] = (*uni)[t - 1][y] + sum;
+		}
+		bst = yp;
+	}
+}
+
+/* tag_bmviterbi:
+ *   Beam-pruned version of the Viterbi. At each position, only the previous
+ *   labels among the <beam> best ones and whose score is within <margin> of
+ *   the best one are extended, a null value disabling the corresponding limit.
+ *   The arcs scores are computed on the fly only for these labels so, with K
+ *   labels kept, a position cost O(K Y) instead of O(Y^2). This is an
+ *   approximation as the best path is lost if it goes through a pruned label.
+ *   The numbers of arcs extended and of arcs in the full lattice are counted
+ *   in the state so the pruning rate can be reported.
+ */
+static void tag_bmviterbi(tag_st_t *st, const seq_t *seq,
+                          uint32_t out[], double *sc, double psc[]) {
+	mdl_t *mdl = st->mdl;
+	const opt_t *opt = mdl->opt;
+	const tag_cache_t *cache = st->cache;
+	const uint32_t Y = mdl->nlbl;
+	const uint32_t T = seq->len;
+	const uint32_t K = (opt->beam == 0) ? Y : min(Y, opt->beam);
+	double   (*uni) [T][Y] = (void *)st->psi;
+	uint32_t (*back)[T][Y] = (void *)st->back;
+	double   *cur = st->cur, *old = st->old;
+	double   *row = st->btmp;
+	uint32_t *lst = st->bmlst;
+	// First, the unigrams scores are computed like in tag_expsc, they are
+	// stored in the psi buffer of the state as it is big enough.
+	for (uint32_t t = 0; t < T; t++) {
+		const pos_t *pos = &(seq->pos[t]);
+		const obs_t *uobs = seq_uobs(seq, pos);
+		for (uint32_t y = 0; y < Y; y++)
+			(*uni)[t][y] = 0.0;
+		for (uint32_t n = 0; n < pos->ucnt; n++) {
+			const uint64_t o = uobs[n];
+			mdl_wadd(mdl, (*uni)[t], o, mdl->uoff[o], Y);
+		}
+	}
+	for (uint32_t y = 0; y < Y; y++)
+		cur[y] = (*uni)[0][y];
+	for (uint32_t t = 1; t < T; t++) {
+		const pos_t *pos = &(seq->pos[t]);
+		const obs_t *bobs = seq_bobs(seq, pos);
+		// Select the previous labels to extend: the K best ones, in
+		// decreasing order and with the lowest label first for ties,
+		// among those within the margin of the best one.
+		double top = cur[0];
+		for (uint32_t y = 1; y < Y; y++)
+			top = max(top, cur[y]);
+		const double lim = opt->margin > 0.0 ? top - opt->margin
+		                                     : -HUGE_VAL;
+		uint32_t nk = 0;
+		for (uint32_t y = 0; y < Y; y++) {
+			old[y] = cur[y];
+			if (old[y] < lim)
+				continue;
+			if (nk == K && !(old[y] > old[lst[K - 1]]))
+				continue;
+			uint32_t i = (nk == K) ? K - 1 : nk++;
+			for ( ; i > 0 && old[y] > old[lst[i - 1]]; i--)
+				lst[i] = lst[i - 1];
+			lst[i] = y;
+		}
+		// Next extend each kept label with all its outgoing arcs, the
+		// row of bigram weights is built from the default matrix of
+		// the cache if available and the other observations.
+		for (uint32_t y = 0; y < Y; y++)
+			cur[y] = -HUGE_VAL, (*back)[t][y] = lst[0];
+		for (uint32_t i = 0; i < nk; i++) {
+			const uint32_t yp = lst[i];
+			for (uint32_t y = 0; y < Y; y++)
+				row[y] = cache ? cache->dflt[yp * Y + y] : 0.0;
+			for (uint32_t n = 0; n < pos->bcnt; n++) {
+				const uint64_t o = bobs[n];
+				if (cache != NULL && tag_iscst(cache, o))
+					continue;
+				const uint64_t f = mdl->boff[o] + yp * Y;
+				mdl_wadd(mdl, row, o, f, Y);
+			}
+			const double *u = (*uni)[t];
+			for (uint32_t y = 0; y < Y; y++) {
+				const double v = old[yp] + (u[y] + row[y]);
+				if (v > cur[y])
+					cur[y] = v, (*back)[t][y] = yp;
+			}
+		}
+		st->bmarc += (uint64_t)nk * Y;
+		st->bmall += (uint64_t)Y * Y;
+	}
+	// The backtracking is the same as in the dense version except that the
+	// scores of the selected arcs have to be recomputed.
+	uint32_t bst = 0;
+	for (uint32_t y = 1; y < Y; y++)
+		if (cur[y] > cur[bst])
+			bst = y;
+	if (sc != NULL)
+		*sc = cur[bst];
+	for (uint32_t t = T; t > 0; t--) {
+		const uint32_t yp = (t != 1) ? (*back)[t - 1][bst] : 0;
+		const uint32_t y  = bst;
+		out[t - 1] = y;
+		if (psc != NULL) {
+			const pos_t *pos = &(seq->pos[t - 1]);
+			const obs_t *bobs = seq_bobs(seq, pos);
+			double sum = 0.0;
+			if (t != 1)
+				for (uint32_t n = 0; n < pos->bcnt; n++) {
+					const uint64_t o = bobs[n];
+					const uint64_t d = yp * Y + y;
+					const uint64_t f = mdl->boff[o] + d;
+					sum += mdl_wget(mdl, o, f);
+				}
+			psc[t - 1] = (*uni)[t - 1][y] + sum;
+		}
+		bst = yp;
+	}
+}
+
 /* tag_viterbi:
  *   This function implement the Viterbi algorithm in order to decode the most
  *   probable sequence of labels according to the model. Some part of this code
  *   is very similar to the computation of the gradient as expected.
- *
- *   And like for the gradient, the caller is responsible to ensure there is
- *   enough stack space.
  */
-void tag_viterbi(mdl_t *mdl, const seq_t *seq,
+void tag_viterbi(tag_st_t *st, const seq_t *seq,
 	         uint32_t out[], double *sc, double psc[]) {
+	mdl_t *mdl = st->mdl;
 	const uint32_t Y = mdl->nlbl;
 	const uint32_t T = seq->len;
-	double   *vpsi  = xvm_new(T * Y * Y);
-	uint32_t *vback = xmalloc(sizeof(uint32_t) * T * Y);
+	tag_stcheck(st, T);
+	// Beam and sparse decoding are available only for the simple case of
+	// CRF models decoded with the raw scores. The beam take precedence as
+	// the sparse decoder is exact. Without forced decoding, the posterior
+	// decoding does not need the lattice.
+	const opt_t *opt = mdl->opt;
+	if (mdl->type != 1 && opt->lblpost && !opt->force) {
+		tag_pstviterbi(st, seq, out, sc, psc);
+		return;
+	}
+	if (mdl->type != 1 && !opt->lblpost && !opt->force) {
+		if (opt->beam != 0 || opt->margin > 0.0) {
+			tag_bmviterbi(st, seq, out, sc, psc);
+			return;
+		}
+		if (st->cache != NULL && st->cache->spoff != NULL) {
+			tag_spviterbi(st, seq, out, sc, psc);
+			return;
+		}
+	}
+	double   *vpsi  = st->psi;
+	uint32_t *vback = st->back;
 	double   (*psi) [T][Y][Y] = (void *)vpsi;
 	uint32_t (*back)[T][Y]    = (void *)vback;
-	double *cur = xmalloc(sizeof(double) * Y);
-	double *old = xmalloc(sizeof(double) * Y);
+	double *cur = st->cur;
+	double *old = st->old;
 	// We first compute the scores for each transitions in the lattice of
 	// labels.
 	int op;
 	if (mdl->type == 1)
-		op = tag_memmsc(mdl, seq, vpsi);
+		op = tag_memmsc(st, seq, vpsi);
 	else if (mdl->opt->lblpost)
-		op = tag_postsc(mdl, seq, vpsi);
+		op = tag_postsc(st, seq, vpsi);
 	else
-		op = tag_expsc(mdl, seq, vpsi);
+		op = tag_expsc(st, seq, vpsi);
 	if (mdl->opt->force)
 		tag_forced(mdl, seq, vpsi, op);
 	// Now we can do the Viterbi algorithm. This is very similar to the
@@ -261,26 +887,16 @@ void tag_viterbi(mdl_t *mdl, const seq_t *seq,
 	// the full matrix.
 	for (uint32_t y = 0; y < Y; y++)
 		cur[y] = (*psi)[0][0][y];
+	//
+	// The max over y' for all y are computed at once by the vmath lattice
+	// kernels which use the fastest SIMD instructions available.
 	for (uint32_t t = 1; t < T; t++) {
 		for (uint32_t y = 0; y < Y; y++)
 			old[y] = cur[y];
-		for (uint32_t y = 0; y < Y; y++) {
-			double   bst = -HUGE_VAL;
-			uint32_t idx = 0;
-			for (uint32_t yp = 0; yp < Y; yp++) {
-				double val = old[yp];
-				if (op)
-					val *= (*psi)[t][yp][y];
-				else
-					val += (*psi)[t][yp][y];
-				if (val > bst) {
-					bst = val;
-					idx = yp;
-				}
-			}
-			(*back)[t][y] = idx;
-			cur[y]        = bst;
-		}
+		if (op)
+			xvm_maxmul(cur, (*back)[t], old, &(*psi)[t][0][0], Y);
+		else
+			xvm_maxadd(cur, (*back)[t], old, &(*psi)[t][0][0], Y);
 	}
 	// We can now build the sequence of labels predicted by the model. For
 	// this we search in the last α vector the best value. Using this index
@@ -300,10 +916,297 @@ void tag_viterbi(mdl_t *mdl, const seq_t *seq,
 			psc[t - 1] = (*psi)[t - 1][yp][y];
 		bst = yp;
 	}
-	xfree(old);
-	xfree(cur);
-	xfree(vback);
-	xvm_free(vpsi);
+}
+
+/* tag_btbigram:
+ *   Sum the bigram scores of position <t> of <seq> in <tmp> as done in
+ *   tag_expsc. If only constant observations are active, this is just the
+ *   default matrix of the cache so nothing is done and false is returned.
+ */
+static bool tag_btbigram(tag_st_t *st, const seq_t *seq, uint32_t t,
+                         double *tmp) {
+	const mdl_t *mdl = st->mdl;
+	const tag_cache_t *cache = st->cache;
+	const uint32_t Y = mdl->nlbl;
+	const pos_t *pos = &(seq->pos[t]);
+	const obs_t *bobs = seq_bobs(seq, pos);
+	bool cst = pos->bcnt != 0 || cache->ncst == 0;
+	for (uint32_t n = 0; n < pos->bcnt && cst; n++)
+		cst = tag_iscst(cache, bobs[n]);
+	if (cst)
+		return false;
+	for (uint32_t d = 0; d < Y * Y; d++)
+		tmp[d] = 0.0;
+	grd_addbi(mdl, tmp, st->btmp, seq, t, cache->dflt, cache->cst,
+		cache->ncst);
+	return true;
+}
+
+/* tag_btviterbi:
+ *   Viterbi decoding of a batch of <B> sequences at once. This is the plain
+ *   algorithm of tag_viterbi but the scores of the sequences are interleaved
+ *   so each step of the max-plus recursion is done for all of them together,
+ *   filling the vector registers even for small label sets. The lattice is
+ *   never built: at each position the unigram scores are interleaved and, as
+ *   most of the time only constant bigram observations are active, the default
+ *   matrix of the cache is shared by all the sequences. The sequences are
+ *   expected to have close lengths as the shorter ones are padded up to the
+ *   longest one, their result being taken at their own last position. The
+ *   results are exactly the same than with tag_viterbi.
+ */
+static void tag_btviterbi(tag_st_t *st, uint32_t B, const seq_t *seq[B],
+                          uint32_t *out[B], double sc[B], double *psc[B]) {
+	const mdl_t *mdl = st->mdl;
+	const uint32_t Y = mdl->nlbl;
+	uint32_t T = 0;
+	for (uint32_t b = 0; b < B; b++)
+		T = max(T, seq[b]->len);
+	if ((uint64_t)T * B > st->btsz) {
+		st->btsz   = (uint64_t)T * B;
+		st->btpsc  = xrealloc(st->btpsc,
+			sizeof(double) * st->btsz * Y);
+		st->btback = xrealloc(st->btback,
+			sizeof(uint32_t) * st->btsz * Y);
+	}
+	if (B > st->btlan) {
+		st->btlan = B;
+		st->btmat = xrealloc(st->btmat,
+			sizeof(double) * Y * Y * (B + 1));
+		st->btuni = xrealloc(st->btuni, sizeof(double) * Y * B);
+		st->btcur = xrealloc(st->btcur, sizeof(double) * Y * B);
+		st->btold = xrealloc(st->btold, sizeof(double) * Y * B);
+	}
+	double   (*pbst)[T][Y][B] = (void *)st->btpsc;
+	uint32_t (*back)[T][Y][B] = (void *)st->btback;
+	double   (*mat)[Y][B] = (void *)st->btmat;
+	double   (*uni)[B]    = (void *)st->btuni;
+	double   (*cur)[B]    = (void *)st->btcur;
+	double   (*old)[B]    = (void *)st->btold;
+	double   *tmp = st->btmat + Y * Y * B;
+	double   *row = st->cur;
+	for (uint32_t t = 0; t < T; t++) {
+		// First the unigram scores of each sequence at this position
+		// are summed as in tag_expsc and interleaved, the padding
+		// getting null scores. At the first position, this is all.
+		for (uint32_t b = 0; b < B; b++) {
+			for (uint32_t y = 0; y < Y; y++)
+				row[y] = 0.0;
+			if (t < seq[b]->len) {
+				const pos_t *pos = &(seq[b]->pos[t]);
+				const obs_t *uobs = seq_uobs(seq[b], pos);
+				for (uint32_t n = 0; n < pos->ucnt; n++) {
+					const uint64_t o = uobs[n];
+					mdl_wadd(mdl, row, o, mdl->uoff[o], Y);
+				}
+			}
+			for (uint32_t y = 0; y < Y; y++)
+				uni[y][b] = row[y];
+		}
+		if (t == 0) {
+			memcpy(cur, uni, sizeof(double) * Y * B);
+			memcpy((*pbst)[0], uni, sizeof(double) * Y * B);
+		} else {
+			// Next the bigram scores: if all the sequences use the
+			// default matrix it is shared, else they are
+			// interleaved too.
+			const double *dflt = st->cache->dflt;
+			bool own[B], sh = true;
+			for (uint32_t b = 0; b < B; b++) {
+				own[b] = t < seq[b]->len
+				      && tag_btbigram(st, seq[b], t, tmp);
+				if (!own[b])
+					continue;
+				for (uint32_t d = 0; d < Y * Y; d++)
+					mat[d / Y][d % Y][b] = tmp[d];
+				sh = false;
+			}
+			for (uint32_t b = 0; b < B && !sh; b++)
+				if (!own[b])
+					for (uint32_t d = 0; d < Y * Y; d++)
+						mat[d / Y][d % Y][b] = dflt[d];
+			memcpy(old, cur, sizeof(double) * Y * B);
+			xvm_maxaddb(&cur[0][0], &(*back)[t][0][0],
+				&(*pbst)[t][0][0], &old[0][0], &uni[0][0],
+				sh ? dflt : &mat[0][0][0], Y, B, sh);
+		}
+		// At the last position of each sequence, its best final label
+		// is searched and kept in its last output slot for the
+		// backtracking.
+		for (uint32_t b = 0; b < B; b++) {
+			if (seq[b]->len != t + 1)
+				continue;
+			uint32_t bst = 0;
+			for (uint32_t y = 1; y < Y; y++)
+				if (cur[y][b] > cur[bst][b])
+					bst = y;
+			if (sc != NULL)
+				sc[b] = cur[bst][b];
+			out[b][t] = bst;
+		}
+	}
+	// And finally the backtracking done independently for each sequence.
+	for (uint32_t b = 0; b < B; b++) {
+		uint32_t bst = out[b][seq[b]->len - 1];
+		for (uint32_t t = seq[b]->len; t > 0; t--) {
+			out[b][t - 1] = bst;
+			if (psc != NULL && psc[b] != NULL)
+				psc[b][t - 1] = (*pbst)[t - 1][bst][b];
+			if (t != 1)
+				bst = (*back)[t - 1][bst][b];
+		}
+	}
+}
+
+/* tag_btcmp:
+ *   Order the sequences of a batch by decreasing length.
+ */
+static int tag_btcmp(const void *a, const void *b) {
+	const seq_t *x = *(const seq_t *const *)a;
+	const seq_t *y = *(const seq_t *const *)b;
+	if (x->len != y->len)
+		return x->len > y->len ? -1 : 1;
+	return 0;
+}
+
+/* tag_viterbis:
+ *   Decode a list of <S> sequences with Viterbi, storing the result of each one
+ *   in its own output buffers. If batched decoding is requested and usable,
+ *   that is for plain Viterbi on CRF with a small label set and a dense
+ *   decoding cache, the sequences are sorted by length and decoded by groups
+ *   of <vbatch> sequences of close lengths with tag_btviterbi. Else they are
+ *   just decoded one by one. <sc> and <psc> can be NULL if these scores are
+ *   not needed.
+ */
+#define TAG_BTMAXY 64
+
+void tag_viterbis(tag_st_t *st, uint32_t S, const seq_t *seq[],
+                  uint32_t *out[], double sc[], double *psc[]) {
+	const mdl_t *mdl = st->mdl;
+	const opt_t *opt = mdl->opt;
+	const uint32_t B = opt->vbatch;
+	bool batch = B > 1 && S > 1 && mdl->type != 1;
+	if (mdl->nlbl > TAG_BTMAXY)
+		batch = false;
+	if (opt->lblpost || opt->force || opt->beam != 0 || opt->margin > 0.0)
+		batch = false;
+	if (st->cache == NULL || st->cache->spoff != NULL)
+		batch = false;
+	if (!batch) {
+		for (uint32_t s = 0; s < S; s++)
+			tag_viterbi(st, seq[s], out[s],
+				sc != NULL ? &sc[s] : NULL,
+				psc != NULL ? psc[s] : NULL);
+		return;
+	}
+	// The sequences are sorted through a list of their indices, kept just
+	// after each pointer, so the results go back to the right buffers.
+	struct {const seq_t *seq; uint32_t idx;} lst[S];
+	for (uint32_t s = 0; s < S; s++)
+		lst[s].seq = seq[s], lst[s].idx = s;
+	qsort(lst, S, sizeof(lst[0]), tag_btcmp);
+	for (uint32_t s = 0; s < S; s += B) {
+		const uint32_t n = min(B, S - s);
+		const seq_t *bseq[n];
+		uint32_t *bout[n];
+		double    bsc[n], *bpsc[n];
+		for (uint32_t i = 0; i < n; i++) {
+			const uint32_t idx = lst[s + i].idx;
+			bseq[i] = lst[s + i].seq;
+			bout[i] = out[idx];
+			bpsc[i] = psc != NULL ? psc[idx] : NULL;
+		}
+		tag_btviterbi(st, n, bseq, bout, bsc, bpsc);
+		if (sc != NULL)
+			for (uint32_t i = 0; i < n; i++)
+				sc[lst[s + i].idx] = bsc[i];
+	}
+}
+
+/* tag_nbop:
+ *   Combine two scores, by a product if the lattice hold probabilities and by
+ *   a sum if it hold log-scores.
+ */
+static inline double tag_nbop(int op, double a, double b) {
+	return op ? a * b : a + b;
+}
+
+/* tag_nbless:
+ *   Order of the hypotheses in the heap: higher score first and, for ties,
+ *   the oldest one first so the search is deterministic.
+ */
+static inline bool tag_nbless(const tag_st_t *st, uint32_t a, uint32_t b) {
+	const double fa = st->nbhyp[a].f, fb = st->nbhyp[b].f;
+	return fa < fb || (fa == fb && a > b);
+}
+
+/* tag_nbpush:
+ *   Add a new hypothesis and insert it in the heap, there is <*nh> hypotheses
+ *   and <*nq> of them are in the heap.
+ */
+static void tag_nbpush(tag_st_t *st, uint32_t *nh, uint32_t *nq,
+                       tag_hyp_t hyp) {
+	if (*nh == st->nbsz) {
+		st->nbsz  = st->nbsz * 2 + 64;
+		st->nbhyp = xrealloc(st->nbhyp, sizeof(tag_hyp_t) * st->nbsz);
+		st->nbhp  = xrealloc(st->nbhp,  sizeof(uint32_t ) * st->nbsz);
+	}
+	const uint32_t id = (*nh)++;
+	st->nbhyp[id] = hyp;
+	uint32_t *hp = st->nbhp, i = (*nq)++;
+	while (i > 0 && tag_nbless(st, hp[(i - 1) / 2], id)) {
+		hp[i] = hp[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	hp[i] = id;
+}
+
+/* tag_nbpop:
+ *   Remove the best hypothesis from the heap and return it.
+ */
+static uint32_t tag_nbpop(tag_st_t *st, uint32_t *nq) {
+	uint32_t *hp = st->nbhp;
+	const uint32_t id = hp[0], lst = hp[--(*nq)];
+	uint32_t i = 0;
+	while (2 * i + 1 < *nq) {
+		uint32_t c = 2 * i + 1;
+		if (c + 1 < *nq && tag_nbless(st, hp[c], hp[c + 1]))
+			c++;
+		if (!tag_nbless(st, lst, hp[c]))
+			break;
+		hp[i] = hp[c];
+		i = c;
+	}
+	hp[i] = lst;
+	return id;
+}
+
+/* tag_nbnext:
+ *   Search the label at position <t> coming after <y> in the arcs entering the
+ *   label <yn> at position <t> + 1 ordered by decreasing score of the best path
+ *   using them, with the lowest label first for ties. With <t> the last
+ *   position, the labels are ordered by their forward score. If <y> is equal
+ *   to Y, the first label is returned and if there is no more label, Y is
+ *   returned.
+ */
+static uint32_t tag_nbnext(const tag_st_t *st, const double *vpsi, int op,
+                           uint32_t T, uint32_t t, uint32_t yn, uint32_t y) {
+	const uint32_t Y = st->mdl->nlbl;
+	const double (*alp)[T][Y]    = (void *)st->nbalp;
+	const double (*psi)[T][Y][Y] = (void *)vpsi;
+	#define tag_nbkey(z) ((t == T - 1) ? (*alp)[t][z]                    \
+		: tag_nbop(op, (*alp)[t][z], (*psi)[t + 1][z][yn]))
+	const double ky = (y == Y) ? HUGE_VAL : tag_nbkey(y);
+	uint32_t bst = Y;
+	double   bky = -HUGE_VAL;
+	for (uint32_t z = 0; z < Y; z++) {
+		const double kz = tag_nbkey(z);
+		if (kz > ky || (kz == ky && z <= y))
+			continue;
+		if (bst == Y || kz > bky)
+			bst = z, bky = kz;
+	}
+	#undef tag_nbkey
+	return bst;
 }
 
 /* tag_nbviterbi:
@@ -311,161 +1214,224 @@ void tag_viterbi(mdl_t *mdl, const seq_t *seq,
  *   probable sequences of labels according to the model. It can be used to
  *   compute only the best one and will return the same sequence than the
  *   previous function but will be slower to do it.
+ *   The labels and their scores are stored in <out> and <psc> as [T][N]
+ *   arrays. If the lattice contains less than N paths, the last ones are
+ *   copies of the worst one with a score of -DBL_MAX.
+ *
+ *   A single Viterbi pass is done, keeping the forward scores, and the paths
+ *   are next extracted lazily in order by a best-first search going backward
+ *   in the lattice. The forward scores give the exact score of the best
+ *   completion of each partial path so these are discovered in decreasing
+ *   order. When a hypothesis is expanded, only its best extension and its next
+ *   sibling are added to the queue so the N paths cost O(T Y^2 + N T Y)
+ *   instead of O(T Y^2 N).
  */
-void tag_nbviterbi(mdl_t *mdl, const seq_t *seq, uint32_t N,
-                   uint32_t **out, double sc[], double **psc) {
+void tag_nbviterbi(tag_st_t *st, const seq_t *seq, uint32_t N,
+                   uint32_t out[], double sc[], double psc[]) {
+	mdl_t *mdl = st->mdl;
 	const uint32_t Y = mdl->nlbl;
 	const uint32_t T = seq->len;
-	double   *vpsi  = xvm_new(T * Y * Y);
-	uint32_t *vback = xmalloc(sizeof(uint32_t) * T * Y * N);
-	double   (*psi) [T][Y    ][Y] = (void *)vpsi;
-	uint32_t (*back)[T][Y * N]    = (void *)vback;
-	double *cur = xmalloc(sizeof(double) * Y * N);
-	double *old = xmalloc(sizeof(double) * Y * N);
+	if (N > st->nbest)
+		fatal("n-best list too long for the decoding state");
+	tag_stcheck(st, T);
+	if (T > st->nblen) {
+		st->nblen = T;
+		st->nbalp = xrealloc(st->nbalp, sizeof(double) * T * Y);
+	}
+	double   *vpsi  = st->psi;
+	uint32_t *vback = st->back;
+	double   (*psi) [T][Y][Y] = (void *)vpsi;
+	uint32_t (*back)[T][Y]    = (void *)vback;
+	double   (*alp) [T][Y]    = (void *)st->nbalp;
 	// We first compute the scores for each transitions in the lattice of
 	// labels.
 	int op;
 	if (mdl->type == 1)
-		op = tag_memmsc(mdl, seq, vpsi);
+		op = tag_memmsc(st, seq, (double *)psi);
 	else if (mdl->opt->lblpost)
-		op = tag_postsc(mdl, seq, (double *)psi);
+		op = tag_postsc(st, seq, (double *)psi);
 	else
-		op = tag_expsc(mdl, seq, (double *)psi);
+		op = tag_expsc(st, seq, (double *)psi);
 	if (mdl->opt->force)
 		tag_forced(mdl, seq, vpsi, op);
-	// Here also, it's classical but we have to keep the N best paths
-	// leading to each nodes of the lattice instead of only the best one.
-	// This mean that code is less trivial and the current implementation is
-	// not the most efficient way to do this but it works well and is good
-	// enough for the moment.
-	// We first build the list of all incoming arcs from all paths from all
-	// N-best nodes and next select the N-best one. There is a lot of room
-	// here for later optimisations if needed.
-	for (uint32_t y = 0, d = 0; y < Y; y++) {
-		cur[d++] = (*psi)[0][0][y];
-		for (uint32_t n = 1; n < N; n++)
-			cur[d++] = -DBL_MAX;
-	}
+	// Next, the forward pass of the Viterbi where the scores at each
+	// position are kept. The back-pointers are not needed after.
+	for (uint32_t y = 0; y < Y; y++)
+		(*alp)[0][y] = (*psi)[0][0][y];
 	for (uint32_t t = 1; t < T; t++) {
-		for (uint32_t d = 0; d < Y * N; d++)
-			old[d] = cur[d];
-		for (uint32_t y = 0; y < Y; y++) {
-			// 1st, build the list of all incoming
-			double lst[Y * N];
-			for (uint32_t yp = 0, d = 0; yp < Y; yp++) {
-				for (uint32_t n = 0; n < N; n++, d++) {
-					lst[d] = old[d];
-					if (op)
-						lst[d] *= (*psi)[t][yp][y];
-					else
-						lst[d] += (*psi)[t][yp][y];
-				}
-			}
-			// 2nd, init the back with the N first
-			uint32_t *bk = &(*back)[t][y * N];
-			for (uint32_t n = 0; n < N; n++)
-				bk[n] = n;
-			// 3rd, search the N highest values
-			for (uint32_t i = N; i < N * Y; i++) {
-				// Search the smallest current value
-				uint32_t idx = 0;
-				for (uint32_t n = 1; n < N; n++)
-					if (lst[bk[n]] < lst[bk[idx]])
-						idx = n;
-				// And replace it if needed
-				if (lst[i] > lst[bk[idx]])
-					bk[idx] = i;
-			}
-			// 4th, get the new scores
-			for (uint32_t n = 0; n < N; n++)
-				cur[y * N + n] = lst[bk[n]];
-		}
+		if (op)
+			xvm_maxmul((*alp)[t], (*back)[t], (*alp)[t - 1],
+				&(*psi)[t][0][0], Y);
+		else
+			xvm_maxadd((*alp)[t], (*back)[t], (*alp)[t - 1],
+				&(*psi)[t][0][0], Y);
 	}
-	// Retrieving the best paths is similar to classical Viterbi except that
-	// we have to search for the N bet ones and there is N time more
-	// possibles starts.
-	for (uint32_t n = 0; n < N; n++) {
-		uint32_t bst = 0;
-		for (uint32_t d = 1; d < Y * N; d++)
-			if (cur[d] > cur[bst])
-				bst = d;
+	// And the search itself, starting with the best label at the last
+	// position. Each time a hypothesis is popped, its next sibling is
+	// pushed and, if it is not complete, its best extension. When a
+	// complete one is popped, it is the next best path.
+	const double one = op ? 1.0 : 0.0;
+	const uint32_t none32 = (uint32_t)-1;
+	uint32_t nh = 0, nq = 0, n = 0;
+	const uint32_t yl = tag_nbnext(st, vpsi, op, T, T - 1, 0, Y);
+	tag_nbpush(st, &nh, &nq, (tag_hyp_t){
+		(*alp)[T - 1][yl], one, T - 1, yl, none32});
+	while (n < N && nq != 0) {
+		const uint32_t id = tag_nbpop(st, &nq);
+		const tag_hyp_t hyp = st->nbhyp[id];
+		const uint32_t yu = hyp.up == none32 ? 0 : st->nbhyp[hyp.up].y;
+		const uint32_t ys = tag_nbnext(st, vpsi, op, T, hyp.t, yu,
+			hyp.y);
+		if (ys != Y) {
+			const double g = hyp.up == none32 ? one
+			               : st->nbhyp[hyp.up].g;
+			const double a = (*alp)[hyp.t][ys];
+			const double w = hyp.t == T - 1 ? one
+			               : (*psi)[hyp.t + 1][ys][yu];
+			tag_nbpush(st, &nh, &nq, (tag_hyp_t){
+				tag_nbop(op, a, tag_nbop(op, w, g)),
+				tag_nbop(op, w, g), hyp.t, ys, hyp.up});
+		}
+		if (hyp.t != 0) {
+			const uint32_t t  = hyp.t - 1;
+			const uint32_t yp = tag_nbnext(st, vpsi, op, T, t,
+				hyp.y, Y);
+			const double g = tag_nbop(op, (*psi)[t + 1][yp][hyp.y],
+				hyp.g);
+			tag_nbpush(st, &nh, &nq, (tag_hyp_t){
+				tag_nbop(op, (*alp)[t][yp], g), g, t, yp, id});
+			continue;
+		}
+		// A complete path was found, its labels are retrieved by
+		// walking up the suffixes and its score is recomputed in the
+		// same order as the forward pass.
+		double sum = 0.0;
+		for (uint32_t h = id, t = 0; t < T; h = st->nbhyp[h].up, t++) {
+			const uint32_t y  = st->nbhyp[h].y;
+			const uint32_t yp = t != 0 ? out[(t - 1) * N + n] : 0;
+			const double   w  = (*psi)[t][yp][y];
+			sum = t != 0 ? tag_nbop(op, sum, w) : w;
+			out[t * N + n] = y;
+			if (psc != NULL)
+				psc[t * N + n] = w;
+		}
 		if (sc != NULL)
-			sc[n] = cur[bst];
-		cur[bst] = -DBL_MAX;
-		for (uint32_t t = T; t > 0; t--) {
-			const uint32_t yp = (t != 1) ? (*back)[t - 1][bst] / N: 0;
-			const uint32_t y  = bst / N;
-			out[t - 1][n] = y;
+			sc[n] = sum;
+		n++;
+	}
+	for ( ; n < N; n++) {
+		for (uint32_t t = 0; t < T; t++) {
+			out[t * N + n] = out[t * N + n - 1];
 			if (psc != NULL)
-				psc[t - 1][n] = (*psi)[t - 1][yp][y];
-			bst = (*back)[t - 1][bst];
+				psc[t * N + n] = psc[t * N + n - 1];
 		}
+		if (sc != NULL)
+			sc[n] = -DBL_MAX;
 	}
-	xfree(old);
-	xfree(cur);
-	xfree(vback);
-	xvm_free(vpsi);
 }
 
-/* tag_label:
- *   Label a data file using the current model. This output an almost exact copy
- *   of the input file with an additional column with the predicted label. If
- *   the check option is specified, the input file must be labelled and the
- *   predicted labels will be checked against the provided ones. This will
- *   output error rates during the labelling and detailed statistics per label
- *   at the end.
+/* tag_item_t:
+ *   A sequence in a labelling batch with the raw input kept for the output and
+ *   the decoding results. The results buffers are kept with the item and only
+ *   grown when a longer sequence come in this slot.
  */
-void tag_label(mdl_t *mdl, iol_t *iol) {
+typedef struct tag_item_s tag_item_t;
+struct tag_item_s {
+	raw_t    *raw;
+	seq_t    *seq;
+	uint32_t  size;
+	uint32_t *out;
+	double   *psc;
+	double   *scs;
+};
+
+/* tag_lbl_t:
+ *   The state of the labelling pipeline. There is three batches of sequences
+ *   in flight: <cur> is decoded by the workers while <prv>, decoded in the
+ *   previous round, is written and <nxt> is read. As only these three batches
+ *   are alive, the memory used is bounded whatever the size of the input and
+ *   as they are written one after the other the order of the input is kept.
+ *   The other fields are the statistics collected when checking the output.
+ */
+typedef struct tag_lbl_s tag_lbl_t;
+struct tag_lbl_s {
+	mdl_t      *mdl;
+	iol_t      *iol;
+	uint32_t    size;
+	tag_item_t *cur, *prv, *nxt;
+	uint32_t    ncur, nprv, nnxt;
+	uint64_t    tcnt, terr;
+	uint64_t    scnt, serr;
+	uint64_t   *stat;
+};
+
+/* tag_wrk_t:
+ *   The per-worker state, each worker need its own scratch memory to convert
+ *   the raw sequences and its own decoding state.
+ */
+typedef struct tag_wrk_s tag_wrk_t;
+struct tag_wrk_s {
+	tag_lbl_t *lbl;
+	rdr_scr_t *scr;
+	tag_st_t  *st;
+};
+
+/* tag_read:
+ *   Read the next batch of raw sequences from the input.
+ */
+static void tag_read(tag_lbl_t *lbl) {
+	mdl_t *mdl = lbl->mdl;
+	lbl->nnxt = 0;
+	while (lbl->nnxt < lbl->size) {
+		raw_t *raw = rdr_readraw(lbl->iol, mdl->reader->autouni);
+		if (raw == NULL)
+			break;
+		lbl->nxt[lbl->nnxt++].raw = raw;
+	}
+}
+
+/* tag_write:
+ *   Output a decoded batch and release it. This output an almost exact copy of
+ *   the input sequences with an additional column with the predicted labels
+ *   and, if reference labels are available, collect statistics about how well
+ *   we have performed.
+ */
+static void tag_write(tag_lbl_t *lbl) {
+	mdl_t *mdl = lbl->mdl;
+	iol_t *iol = lbl->iol;
 	qrk_t *lbls = mdl->reader->lbl;
 	const uint32_t Y = mdl->nlbl;
 	const uint32_t N = mdl->opt->nbest;
-	// We start by preparing the statistic collection to be ready if check
-	// option is used. The stat array hold the following for each label
-	//   [0] # of reference with this label
-	//   [1] # of token we have taged with this label
-	//   [2] # of match of the two preceding
-	uint64_t tcnt = 0, terr = 0;
-	uint64_t scnt = 0, serr = 0;
-	uint64_t stat[3][Y];
-	for (uint32_t y = 0; y < Y; y++)
-		stat[0][y] = stat[1][y] = stat[2][y] = 0;
-	// Next read the input file sequence by sequence and label them, we have
-	// to take care of not discarding the raw input as we want to send it
-	// back to the output with the additional predicted labels.
-        while (true) {
-		// So, first read an input sequence keeping the raw_t object
-		// available, and label it with Viterbi.
-                raw_t *raw = rdr_readraw(iol, mdl->reader->autouni);
-		if (raw == NULL)
-			break;
-		seq_t *seq = rdr_raw2seq(mdl->reader, raw,
-			mdl->opt->check | mdl->opt->force);
+	uint64_t (*stat)[Y] = (void *)lbl->stat;
+	for (uint32_t i = 0; i < lbl->nprv; i++) {
+		tag_item_t *itm = &lbl->prv[i];
+		const raw_t *raw = itm->raw;
+		const seq_t *seq = itm->seq;
 		const uint32_t T = seq->len;
-		uint32_t *out = xmalloc(sizeof(uint32_t) * T * N);
-		double   *psc = xmalloc(sizeof(double  ) * T * N);
-		double   *scs = xmalloc(sizeof(double  ) * N);
-		if (N == 1)
-			tag_viterbi(mdl, seq, (uint32_t*)out, scs, (double*)psc);
-		else
-			tag_nbviterbi(mdl, seq, N, (void*)out, scs, (void*)psc);
+		const uint32_t *out = itm->out;
 		// Next we output the raw sequence with an aditional column for
 		// the predicted labels
 		for (uint32_t n = 0; n < N; n++) {
 			if (mdl->opt->outsc)
-                            iol->print_cb(iol->out, "# %d %f\n", (int)n, scs[n]);
+				iol->print_cb(iol->out, "# %d %f\n", (int)n,
+					itm->scs[n]);
 			for (uint32_t t = 0; t < T; t++) {
-				if (!mdl->opt->label)
-                                    iol->print_cb(iol->out, "%s\t", raw->lines[t]);
-				uint32_t lbl = out[t * N + n];
-				const char *lblstr = qrk_id2str(lbls, lbl);
-                                iol->print_cb(iol->out, "%s", lblstr);
+				if (!mdl->opt->label) {
+					const char *ln = raw->lines[t];
+					const int len = strcspn(ln, "\n");
+					iol->print_cb(iol->out, "%.*s\t", len, ln);
+				}
+				uint32_t lb = out[t * N + n];
+				const char *lblstr = qrk_id2str(lbls, lb);
+				iol->print_cb(iol->out, "%s", lblstr);
 				if (mdl->opt->outsc) {
-                                    iol->print_cb(iol->out, "\t%s", lblstr);
-                                    iol->print_cb(iol->out, "/%f", psc[t * N + n]);
+					iol->print_cb(iol->out, "\t%s", lblstr);
+					iol->print_cb(iol->out, "/%f",
+						itm->psc[t * N + n]);
 				}
-                                iol->print_cb(iol->out, "\n");
+				iol->print_cb(iol->out, "\n");
 			}
-                        iol->print_cb(iol->out, "\n");
+			iol->print_cb(iol->out, "\n");
 		}
 		// If user provided reference labels, use them to collect
 		// statistics about how well we have performed here. Labels
@@ -478,53 +1444,192 @@ void tag_label(mdl_t *mdl, iol_t *iol) {
 				stat[0][seq->pos[t].lbl]++;
 				stat[1][out[t * N]]++;
 				if (seq->pos[t].lbl != out[t * N])
-					terr++, err = true;
+					lbl->terr++, err = true;
 				else
 					stat[2][out[t * N]]++;
 			}
-			tcnt += T;
-			serr += err;
+			lbl->tcnt += T;
+			lbl->serr += err;
 		}
 		// Cleanup memory used for this sequence
-		xfree(scs);
-		xfree(psc);
-		xfree(out);
-		rdr_freeseq(seq);
-		rdr_freeraw(raw);
+		rdr_freeseq(itm->seq);
+		rdr_freeraw(itm->raw);
 		// And report our progress, at regular interval we display how
 		// much sequence are labelled and if possible the current tokens
 		// and sequence error rates.
-		if (++scnt % 1000 == 0) {
-			info("%10"PRIu64" sequences labeled", scnt);
+		if (++lbl->scnt % 1000 == 0) {
+			info("%10"PRIu64" sequences labeled", lbl->scnt);
 			if (mdl->opt->check) {
-				const double te = (double)terr  / tcnt * 100.0;
-				const double se = (double)serr  / scnt * 100.0;
-				info("\t%5.2f%%/%5.2f%%", te, se);
+				const double te = (double)lbl->terr / lbl->tcnt;
+				const double se = (double)lbl->serr / lbl->scnt;
+				info("\t%5.2f%%/%5.2f%%", te * 100.0, se * 100.0);
 			}
 			info("\n");
 		}
 	}
+	lbl->nprv = 0;
+}
+
+/* tag_labelsub:
+ *   A pipeline round. The first worker handle the input/output by writing the
+ *   previous batch and reading the next one while the others convert and label
+ *   the sequences of the current batch with Viterbi. If there is a single
+ *   worker, it do all this job itself.
+ */
+static void tag_labelsub(job_t *job, uint32_t id, uint32_t cnt, tag_wrk_t *wrk) {
+	tag_lbl_t *lbl = wrk->lbl;
+	mdl_t *mdl = lbl->mdl;
+	const uint32_t N = mdl->opt->nbest;
+	if (id == 0) {
+		tag_write(lbl);
+		tag_read(lbl);
+		if (cnt != 1)
+			return;
+	}
+	uint32_t count, pos;
+	while (mth_getjob(job, &count, &pos)) {
+		// The sequences of the job are first converted and, for
+		// simple Viterbi, decoded together at the end so they can be
+		// batched.
+		const seq_t *seqs[count];
+		uint32_t    *outs[count];
+		double      *pscs[count], scs[count];
+		for (uint32_t s = pos; s < pos + count; s++) {
+			tag_item_t *itm = &lbl->cur[s];
+			seq_t *seq = rdr_raw2seqscr(mdl->reader, wrk->scr,
+				itm->raw, mdl->opt->check | mdl->opt->force);
+			const uint32_t T = seq->len;
+			itm->seq = seq;
+			if (itm->scs == NULL)
+				itm->scs = xmalloc(sizeof(double) * N);
+			if (T * N > itm->size) {
+				itm->size = T * N;
+				itm->out = xrealloc(itm->out,
+					sizeof(uint32_t) * T * N);
+				itm->psc = xrealloc(itm->psc,
+					sizeof(double  ) * T * N);
+			}
+			seqs[s - pos] = seq;
+			outs[s - pos] = itm->out;
+			pscs[s - pos] = itm->psc;
+			if (N != 1)
+				tag_nbviterbi(wrk->st, seq, N, itm->out,
+					itm->scs, itm->psc);
+		}
+		if (N != 1)
+			continue;
+		tag_viterbis(wrk->st, count, seqs, outs, scs, pscs);
+		for (uint32_t s = pos; s < pos + count; s++)
+			lbl->cur[s].scs[0] = scs[s - pos];
+	}
+}
+
+/* tag_label:
+ *   Label a data file using the current model. This output an almost exact copy
+ *   of the input file with an additional column with the predicted label. If
+ *   the check option is specified, the input file must be labelled and the
+ *   predicted labels will be checked against the provided ones. This will
+ *   output error rates during the labelling and detailed statistics per label
+ *   at the end.
+ *
+ *   The input is processed by batches of sequences through a pipeline so the
+ *   reading, labelling and writing are overlapped and the labelling is spread
+ *   over the workers threads. Note that, if more than one thread is requested,
+ *   the iol callbacks are called from a worker thread.
+ */
+void tag_label(mdl_t *mdl, iol_t *iol) {
+	qrk_t *lbls = mdl->reader->lbl;
+	const uint32_t Y = mdl->nlbl;
+	const uint32_t W = mdl->opt->nthread;
+	// We start by preparing the pipeline state. The batches are large
+	// enough to give some jobs to each worker. We also prepare the
+	// statistic collection to be ready if check option is used. The stat
+	// array hold the following for each label
+	//   [0] # of reference with this label
+	//   [1] # of token we have taged with this label
+	//   [2] # of match of the two preceding
+	tag_lbl_t lbl = {.mdl = mdl, .iol = iol};
+	lbl.size = W * mdl->opt->jobsize * 4;
+	tag_item_t *itms = xmalloc(sizeof(tag_item_t) * lbl.size * 3);
+	memset(itms, 0, sizeof(tag_item_t) * lbl.size * 3);
+	lbl.cur  = itms;
+	lbl.prv  = itms + lbl.size;
+	lbl.nxt  = itms + lbl.size * 2;
+	lbl.stat = xmalloc(sizeof(uint64_t) * 3 * Y);
+	uint64_t (*stat)[Y] = (void *)lbl.stat;
+	for (uint32_t y = 0; y < Y; y++)
+		stat[0][y] = stat[1][y] = stat[2][y] = 0;
+	// With more than one thread, the first one is dedicated to the input
+	// and output so there is one more worker than requested.
+	const uint32_t P = (W == 1) ? 1 : W + 1;
+	tag_cache_t *cache = tag_cachenew(mdl);
+	tag_wrk_t *wrk[P];
+	for (uint32_t w = 0; w < P; w++) {
+		wrk[w] = xmalloc(sizeof(tag_wrk_t));
+		wrk[w]->lbl = &lbl;
+		wrk[w]->scr = rdr_scrnew();
+		wrk[w]->st  = tag_stnew(mdl, mdl->opt->nbest);
+		wrk[w]->st->cache = cache;
+	}
+	// Next read the input file batch by batch and label them, we have to
+	// take care of not discarding the raw input as we want to send it back
+	// to the output with the additional predicted labels. Each round, the
+	// batches move one step forward in the pipeline.
+	tag_read(&lbl);
+	while (lbl.nnxt != 0) {
+		tag_item_t *tmp = lbl.cur;
+		lbl.cur = lbl.nxt, lbl.ncur = lbl.nnxt;
+		lbl.nxt = tmp;
+		mth_spawn((func_t *)tag_labelsub, P, (void *)wrk, lbl.ncur,
+			mdl->opt->jobsize);
+		tmp = lbl.prv;
+		lbl.prv = lbl.cur, lbl.nprv = lbl.ncur;
+		lbl.cur = tmp;
+	}
+	tag_write(&lbl);
+	uint64_t bmarc = 0, bmall = 0;
+	for (uint32_t w = 0; w < P; w++) {
+		bmarc += wrk[w]->st->bmarc;
+		bmall += wrk[w]->st->bmall;
+		rdr_scrfree(wrk[w]->scr);
+		tag_stfree(wrk[w]->st);
+		xfree(wrk[w]);
+	}
+	tag_cachefree(cache);
+	for (uint32_t i = 0; i < lbl.size * 3; i++) {
+		xfree(itms[i].out);
+		xfree(itms[i].psc);
+		xfree(itms[i].scs);
+	}
+	xfree(itms);
+	// With beam decoding, report the fraction of the lattice arcs which
+	// were not extended.
+	if (bmall != 0) {
+		const double pr = (double)(bmall - bmarc) / bmall * 100.0;
+		info("    Pruned arcs   : %5.2f%%\n", pr);
+	}
 	// If user have provided reference labels, we have collected a lot of
 	// statistics and we can repport global token and sequence error rate as
 	// well as precision recall and f-measure for each labels.
 	if (mdl->opt->check) {
-		const double te = (double)terr  / tcnt * 100.0;
-		const double se = (double)serr  / scnt * 100.0;
-		info("    Nb sequences  : %"PRIu64"\n", scnt);
+		const double te = (double)lbl.terr  / lbl.tcnt * 100.0;
+		const double se = (double)lbl.serr  / lbl.scnt * 100.0;
+		info("    Nb sequences  : %"PRIu64"\n", lbl.scnt);
 		info("    Token error   : %5.2f%%\n", te);
 		info("    Sequence error: %5.2f%%\n", se);
 		info("* Per label statistics\n");
 		for (uint32_t y = 0; y < Y; y++) {
-			const char   *lbl = qrk_id2str(lbls, y);
-			const double  Rc  = (double)stat[2][y] / stat[0][y];
-			const double  Pr  = (double)stat[2][y] / stat[1][y];
-			const double  F1  = 2.0 * (Pr * Rc) / (Pr + Rc);
-			info("    %-6s", lbl);
+			const char   *lb = qrk_id2str(lbls, y);
+			const double  Rc = (double)stat[2][y] / stat[0][y];
+			const double  Pr = (double)stat[2][y] / stat[1][y];
+			const double  F1 = 2.0 * (Pr * Rc) / (Pr + Rc);
+			info("    %-6s", lb);
 			info("  Pr=%.2f", Pr);
 			info("  Rc=%.2f", Rc);
 			info("  F1=%.2f\n", F1);
 		}
 	}
+	xfree(lbl.stat);
 }
 
 /* eval_t:
@@ -537,10 +1642,13 @@ typedef struct eval_s eval_t;
 struct eval_s {
 	mdl_t    *mdl;
 	dat_t    *dat;
+	tag_st_t *st;
 	uint64_t  tcnt;  // Processed tokens count
 	uint64_t  terr;  // Tokens error found
 	uint64_t  scnt;  // Processes sequences count
 	uint64_t  serr;  // Sequence error found
+	uint32_t *out;   // Decoded labels of the current job
+	uint64_t  osz;   // Size of <out>
 };
 
 /* tag_evalsub:
@@ -550,21 +1658,35 @@ struct eval_s {
  */
 static void tag_evalsub(job_t *job, uint32_t id, uint32_t cnt, eval_t *eval) {
 	unused(id && cnt);
-	mdl_t *mdl = eval->mdl;
 	dat_t *dat = eval->dat;
 	eval->tcnt = 0;
 	eval->terr = 0;
 	eval->scnt = 0;
 	eval->serr = 0;
-	// We just get a job a process all the squence in it.
+	// We just get a job and tag all the sequences in it with the Viterbi
+	// at once, so they can be batched, before scanning them.
 	uint32_t count, pos;
 	while (mth_getjob(job, &count, &pos)) {
+		const seq_t **seq = (const seq_t **)dat->seq + pos;
+		uint32_t *outs[count];
+		uint64_t size = 0;
+		for (uint32_t s = 0; s < count; s++)
+			size += seq[s]->len;
+		if (size > eval->osz) {
+			eval->osz = size;
+			eval->out = xrealloc(eval->out,
+				sizeof(uint32_t) * size);
+		}
+		uint64_t off = 0;
+		for (uint32_t s = 0; s < count; s++) {
+			outs[s] = eval->out + off;
+			off += seq[s]->len;
+		}
+		tag_viterbis(eval->st, count, seq, outs, NULL, NULL);
 		for (uint32_t s = pos; s < pos + count; s++) {
-			// Tag the sequence with the viterbi
 			const seq_t *seq = dat->seq[s];
 			const uint32_t T = seq->len;
-			uint32_t *out = xmalloc(sizeof(uint32_t) * T);
-			tag_viterbi(mdl, seq, out, NULL, NULL);
+			const uint32_t *out = outs[s - pos];
 			// And check for eventual (probable ?) errors
 			bool err = false;
 			for (uint32_t t = 0; t < T; t++)
@@ -573,41 +1695,168 @@ static void tag_evalsub(job_t *job, uint32_t id, uint32_t cnt, eval_t *eval) {
 			eval->tcnt += T;
 			eval->scnt += 1;
 			eval->serr += err;
-			xfree(out);
 		}
 	}
 }
 
-/* tag_eval:
- *   Compute the token error rate and sequence error rate over the devel set (or
- *   taining set if not available).
+/* tag_evrun_t:
+ *   An evaluation in progress, started by tag_evalstart and collected by
+ *   tag_evalend. It own the cache and the workers states until then.
  */
-void tag_eval(mdl_t *mdl, double *te, double *se) {
-	const uint32_t W = mdl->opt->nthread;
-	dat_t *dat = (mdl->devel == NULL) ? mdl->train : mdl->devel;
+struct tag_evrun_s {
+	uint32_t      W;
+	tag_cache_t  *cache;
+	eval_t      **eval;
+	mth_task_t   *task;
+};
+
+/* tag_evalstart:
+ *   Start the evaluation of the model on the sequences of <dat> using <W>
+ *   threads. If <async> is true, the workers run in background threads and
+ *   this function return immediately, else the evaluation is complete when it
+ *   return. In both case, the result is retrieved with tag_evalend. In the
+ *   background case, the model weights must not change until then so the
+ *   caller will usually give here a model with a snapshot of them.
+ */
+tag_evrun_t *tag_evalstart(mdl_t *mdl, dat_t *dat, uint32_t W, bool async) {
 	// First we prepare the eval state for all the workers threads, we just
 	// have to give them the model and dataset to use. This state will be
 	// used to retrieve partial result they computed.
-	eval_t *eval[W];
+	tag_evrun_t *run = xmalloc(sizeof(tag_evrun_t));
+	run->W     = W;
+	run->cache = tag_cachenew(mdl);
+	run->eval  = xmalloc(sizeof(eval_t *) * W);
+	run->task  = NULL;
 	for (uint32_t w = 0; w < W; w++) {
-		eval[w] = xmalloc(sizeof(eval_t));
-		eval[w]->mdl = mdl;
-		eval[w]->dat = dat;
-	}
-	// And next, we call the workers to do the job and reduce the partial
-	// result by summing them and computing the final error rates.
-	mth_spawn((func_t *)tag_evalsub, W, (void *)eval, dat->nseq,
-		mdl->opt->jobsize);
+		eval_t *eval = xmalloc(sizeof(eval_t));
+		eval->mdl = mdl;
+		eval->dat = dat;
+		eval->st  = tag_stnew(mdl, 1);
+		eval->st->cache = run->cache;
+		eval->out = NULL;
+		eval->osz = 0;
+		run->eval[w] = eval;
+	}
+	// And next, we call the workers to do the job either in background or
+	// directly.
+	func_t *f = (func_t *)tag_evalsub;
+	if (async)
+		run->task = mth_async(f, W, (void *)run->eval, dat->nseq,
+			mdl->opt->jobsize);
+	else
+		mth_spawn(f, W, (void *)run->eval, dat->nseq,
+			mdl->opt->jobsize);
+	return run;
+}
+
+/* tag_evalend:
+ *   Wait for the end of an evaluation started by tag_evalstart, reduce the
+ *   partial results by summing them and computing the final error rates, and
+ *   release it.
+ */
+void tag_evalend(tag_evrun_t *run, double *te, double *se) {
+	if (run->task != NULL)
+		mth_wait(run->task);
 	uint64_t tcnt = 0, terr = 0;
 	uint64_t scnt = 0, serr = 0;
-	for (uint32_t w = 0; w < W; w++) {
-		tcnt += eval[w]->tcnt;
-		terr += eval[w]->terr;
-		scnt += eval[w]->scnt;
-		serr += eval[w]->serr;
-		xfree(eval[w]);
+	for (uint32_t w = 0; w < run->W; w++) {
+		eval_t *eval = run->eval[w];
+		tcnt += eval->tcnt;
+		terr += eval->terr;
+		scnt += eval->scnt;
+		serr += eval->serr;
+		tag_stfree(eval->st);
+		xfree(eval->out);
+		xfree(eval);
 	}
+	tag_cachefree(run->cache);
+	xfree(run->eval);
+	xfree(run);
 	*te = (double)terr / tcnt * 100.0;
 	*se = (double)serr / scnt * 100.0;
 }
 
+/* tag_eval:
+ *   Compute the token error rate and sequence error rate over the devel set (or
+ *   taining set if not available).
+ */
+void tag_eval(mdl_t *mdl, double *te, double *se) {
+	const uint32_t W = mdl->opt->nthread;
+	dat_t *dat = (mdl->devel == NULL) ? mdl->train : mdl->devel;
+	tag_evalend(tag_evalstart(mdl, dat, W, false), te, se);
+}
+
+
+/* tag_bufseq:
+ *   Decode the raw sequence and store its labels in <out> from position <pos>
+ *   as long as there is room for them. Return the position after the sequence.
+ */
+static uint64_t tag_bufseq(tag_ctx_t *ctx, const raw_t *raw, uint32_t out[],
+                           uint64_t pos, uint64_t size) {
+	tag_st_t *st = ctx->st;
+	seq_t *seq = rdr_raw2seqscr(ctx->mdl->reader, ctx->scr, raw, false);
+	const uint32_t T = seq->len;
+	tag_stcheck(st, T);
+	tag_viterbi(st, seq, st->out, NULL, NULL);
+	for (uint32_t t = 0; t < T && pos + t < size; t++)
+		out[pos + t] = st->out[t];
+	rdr_freeseq(seq);
+	return pos + T;
+}
+
+/* tag_labelbuf:
+ *   Label all the sequences of the buffer <buf> of <len> bytes, given in the
+ *   data file format with blank lines between sequences, and store the best
+ *   label of each token in <out> in input order. At most <size> labels are
+ *   stored but the total number of tokens is returned so the caller can retry
+ *   with a larger array.
+ *
+ *   The lines are used as views in the buffer, only a last line without end of
+ *   line is copied. Concurrent calls on a shared model are safe as long as
+ *   each one use its own context.
+ */
+uint64_t tag_labelbuf(tag_ctx_t *ctx, const char *buf, size_t len,
+                      uint32_t out[], uint64_t size) {
+	const bool autouni = ctx->mdl->reader->autouni;
+	uint32_t rsz = 32;
+	raw_t *raw = xmalloc(sizeof(raw_t) + sizeof(char *) * rsz);
+	raw->view = true;
+	raw->len  = 0;
+	char *last = NULL;
+	uint64_t pos = 0;
+	const char *lin = buf, *end = buf + len;
+	while (lin < end) {
+		const char *eol = memchr(lin, '\n', end - lin);
+		char *line = (char *)lin;
+		if (eol == NULL) {
+			const size_t n = end - lin;
+			last = xmalloc(n + 2);
+			memcpy(last, lin, n);
+			memcpy(last + n, "\n", 2);
+			line = last;
+			eol  = end;
+		}
+		bool blank = true;
+		for (const char *c = lin; c < eol && blank; c++)
+			blank = isspace(*c & 0xff);
+		lin = eol + 1;
+		if (!blank) {
+			if (raw->len == rsz) {
+				rsz *= 2;
+				raw = xrealloc(raw, sizeof(raw_t)
+				                + sizeof(char *) * rsz);
+			}
+			raw->lines[raw->len++] = line;
+			if (!autouni)
+				continue;
+		}
+		if (raw->len != 0)
+			pos = tag_bufseq(ctx, raw, out, pos, size);
+		raw->len = 0;
+	}
+	if (raw->len != 0)
+		pos = tag_bufseq(ctx, raw, out, pos, size);
+	xfree(raw);
+	xfree(last);
+	return pos;
+}
@@ -33,16 +33,144 @@
 #include <stdio.h>
 
 #include "wapiti.h"
+#include "gradient.h"
 #include "model.h"
+#include "reader.h"
 #include "sequence.h"
 
-void tag_viterbi(mdl_t *mdl, const seq_t *seq,
+/* tag_cache_t:
+ *   Per-model data precomputed for decoding and shared by all the decoding
+ *   states. The constant bigram observations, coming from patterns without
+ *   any reference to the tokens, are present at every position so the sum of
+ *   their weights is precomputed in the <dflt> default transition matrix.
+ *   For sparse decoding, we also keep the list of non-zero entries of <dflt>
+ *   and of the bigram blocks of each observations.
+ *   The cache must be rebuilt each time the model weights change.
+ */
+typedef struct tag_cache_s tag_cache_t;
+struct tag_cache_s {
+	mdl_t    *mdl;
+	uint32_t  ncst;    //            number of constant bigram observations
+	uint64_t *cst;     // [ncst]     their identifiers
+	double   *dflt;    // [Y][Y]     sum of their bigram weights
+	uint64_t  dnnz;    //            number of non-zero entries of <dflt>
+	uint32_t *dcol;    // [Y+1]      start of each column in <drow>
+	uint32_t *drow;    // [dnnz]     rows of the non-zero entries
+	uint64_t *spoff;   // [O+1]      start of each observation list
+	uint32_t *spidx;   //            indexes of non-zero bigram weights
+};
+
+tag_cache_t *tag_cachenew(mdl_t *mdl);
+void tag_cachefree(tag_cache_t *cache);
+
+/* tag_hyp_t:
+ *   A partial path of the lazy n-best search: the label <y> at position <t>
+ *   followed by the path of the hypothesis <up>, or by nothing for the last
+ *   position. <g> is the score of the arcs after <t> and <f> the score of the
+ *   best complete path ending with this suffix.
+ */
+typedef struct tag_hyp_s tag_hyp_t;
+struct tag_hyp_s {
+	double    f, g;
+	uint32_t  t, y;
+	uint32_t  up;
+};
+
+/* tag_st_t:
+ *   State tracker for decoding. This hold all the temporary memory needed by
+ *   the decoders so no allocation is done when decoding a sequence. Like for
+ *   the gradient state, it can decode sequences of length <len> at most and
+ *   grow monotonically when tag_stcheck is called with longer ones. It is
+ *   allocated for n-best lists of at most <nbest> sequences.
+ *   A tracker must not be shared between threads.
+ */
+typedef struct tag_st_s tag_st_t;
+struct tag_st_s {
+	mdl_t    *mdl;
+	uint32_t  len;     // =T          max length of sequence
+	uint32_t  nbest;   // =N          max size of n-best lists
+	double   *psi;     // [T][Y][Y]   the transitions scores
+	uint32_t *back;    // [T][Y]      back-pointers
+	double   *cur;     // [Y]         current scores
+	double   *old;     // [Y]         previous scores
+	uint32_t *out;     // [T][N]      decoded labels
+	double   *psc;     // [T][N]      decoded labels scores
+	double   *post;    // [T][Y]      posterior marginals
+	double   *scs;     // [N]         decoded sequences scores
+	grd_st_t *grd_st;  //             gradient state for posteriors
+	const tag_cache_t *cache; //      model cache or NULL
+	double   *btmp;    // [Y][Y]      temporary for bigrams sums
+	// Temporary memory for sparse decoding, only allocated if needed
+	uint32_t  spsz;    //             =Y if allocated
+	uint32_t *sptop;   // [K]         best previous labels
+	double   *spval;   // [Y][Y]      merged bigram weights
+	uint32_t *spmrk;   // [Y][Y]      stamps of the touched entries
+	uint32_t *splst;   // [Y][Y]      list of touched entries
+	uint32_t *spcol;   // [Y+1]       start of each column in <spgrp>
+	uint32_t *spgrp;   // [Y][Y]      touched entries grouped by column
+	uint32_t *spexc;   // [Y]         stamps of the excluded previous labels
+	uint32_t  spstp;   //             current stamp for <spmrk>
+	uint32_t  spexs;   //             current stamp for <spexc>
+	// Beam decoding, the kept labels and the count of arcs extended
+	uint32_t *bmlst;   // [Y]         labels kept at current position
+	uint64_t  bmarc;   //             number of arcs extended
+	uint64_t  bmall;   //             number of arcs in the full lattice
+	// Lazy n-best search, grown when needed
+	double    *nbalp;  // [T][Y]      forward scores
+	uint32_t   nblen;  //             length allocated for <nbalp>
+	tag_hyp_t *nbhyp;  // [H]         hypotheses
+	uint32_t  *nbhp;   // [H]         heap of the pending hypotheses
+	uint32_t   nbsz;   //   H         size allocated for the two last
+	// Batched Viterbi over B sequences, grown when needed
+	double    *btpsc;  // [T][Y][B]   interleaved best transitions scores
+	uint32_t  *btback; // [T][Y][B]   interleaved back-pointers
+	double    *btmat;  // [Y][Y][B+1] interleaved bigrams scores
+	double    *btuni;  // [Y][B]      interleaved unigrams scores
+	double    *btcur;  // [Y][B]      current scores
+	double    *btold;  // [Y][B]      previous scores
+	uint64_t   btsz;   //   T*B       size allocated for the two first
+	uint32_t   btlan;  //   B         lanes allocated for the others
+};
+
+tag_st_t *tag_stnew(mdl_t *mdl, uint32_t nbest);
+void tag_stfree(tag_st_t *st);
+void tag_stcheck(tag_st_t *st, uint32_t len);
+
+/* tag_ctx_t:
+ *   Per-thread context for decoding with a shared model. The model and the
+ *   cache are only read by the decoders so they can be used by any number of
+ *   contexts concurrently once mdl_share was called on the model. A context
+ *   hold all the memory needed to convert and decode sequences: the tracker
+ *   <st> and the reader scratch <scr>. It is cheap to build but must only be
+ *   used by one thread at a time.
+ */
+typedef struct tag_ctx_s tag_ctx_t;
+struct tag_ctx_s {
+	mdl_t     *mdl;
+	tag_st_t  *st;
+	rdr_scr_t *scr;
+};
+
+tag_ctx_t *tag_ctxnew(mdl_t *mdl, const tag_cache_t *cache, uint32_t nbest);
+void tag_ctxfree(tag_ctx_t *ctx);
+
+void tag_posterior(tag_st_t *st, const seq_t *seq, double post[]);
+void tag_viterbi(tag_st_t *st, const seq_t *seq,
                  uint32_t out[], double *sc, double psc[]);
-void tag_nbviterbi(mdl_t *mdl, const seq_t *seq, uint32_t N,
-                   uint32_t **out, double sc[], double **psc);
+void tag_viterbis(tag_st_t *st, uint32_t S, const seq_t *seq[],
+                  uint32_t *out[], double sc[], double *psc[]);
+void tag_nbviterbi(tag_st_t *st, const seq_t *seq, uint32_t N,
+                   uint32_t out[], double sc[], double psc[]);
 
 void tag_label(mdl_t *mdl, iol_t *iol);
 void tag_eval(mdl_t *mdl, double *te, double *se);
 
+typedef struct tag_evrun_s tag_evrun_t;
+tag_evrun_t *tag_evalstart(mdl_t *mdl, dat_t *dat, uint32_t W, bool async);
+void tag_evalend(tag_evrun_t *run, double *te, double *se);
+
+uint64_t tag_labelbuf(tag_ctx_t *ctx, const char *buf, size_t len,
+                      uint32_t out[], uint64_t size);
+
 #endif
 
@@ -0,0 +1,407 @@
+/*
+ *      Wapiti - A linear-chain CRF tool
+ *
+ * Copyright (c) 2009-2013  CNRS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if !defined(WIN32) && !defined(_WIN32)
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#endif
+
+#include "wapiti.h"
+#include "dist.h"
+#include "tools.h"
+
+/******************************************************************************
+ * Distributed computations
+ *
+ *   This module connect several instances of Wapiti running on different nodes
+ *   so they can sum their partial gradients. The nodes are listed in a file
+ *   with one "host:port" address per line in rank order, every node listen on
+ *   the port of its own line and connect to the next node, forming a ring.
+ *
+ *   Vectors are summed with the bandwidth optimal ring algorithm [1]: the
+ *   vector is split in as many chunks as nodes, the chunks are first reduced
+ *   while going around the ring and the fully reduced ones are next sent
+ *   around to all nodes. Each chunk is reduced by a single node in a fixed
+ *   order so all nodes get exactly the same result. Chunks with enough null
+ *   values are sent as sparse lists of indexes and values.
+ *
+ *   All nodes must run on the same kind of platform as data are exchanged in
+ *   their native binary format.
+ *
+ *   [1] Bandwidth optimal all-reduce algorithms for clusters of workstations,
+ *       Pitch Patarasuk and Xin Yuan, in Journal of Parallel and Distributed
+ *       Computing, volume 69, pages 117-124, 2009
+ ******************************************************************************/
+#if !defined(WIN32) && !defined(_WIN32)
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* dst_addr:
+ *   Split the address given on <line> in its host and port parts and resolve
+ *   it. If <lst> is true, the address is resolved for listening on its port.
+ */
+static struct addrinfo *dst_addr(char *line, bool lst) {
+	char *sep = strrchr(line, ':');
+	if (sep == NULL)
+		fatal("invalid node address '%s'", line);
+	*sep = '\0';
+	struct addrinfo hint, *res;
+	memset(&hint, 0, sizeof(hint));
+	hint.ai_family   = AF_UNSPEC;
+	hint.ai_socktype = SOCK_STREAM;
+	hint.ai_flags    = lst ? AI_PASSIVE : 0;
+	const int err = getaddrinfo(lst ? NULL : line, sep + 1, &hint, &res);
+	if (err != 0)
+		fatal("cannot resolve '%s': %s", line, gai_strerror(err));
+	return res;
+}
+
+/* dst_setup:
+ *   Tune a connected socket: disable the Nagle algorithm as messages are
+ *   exchanged in lockstep, and switch it to non-blocking mode for dst_xchg.
+ */
+static void dst_setup(int sck) {
+	const int one = 1;
+	setsockopt(sck, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (fcntl(sck, F_SETFL, fcntl(sck, F_GETFL) | O_NONBLOCK) == -1)
+		pfatal("cannot setup socket");
+}
+
+/* dst_listen:
+ *   Open a socket listening on the port of the given address.
+ */
+static int dst_listen(char *line) {
+	struct addrinfo *res = dst_addr(line, true);
+	int sck = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (sck == -1)
+		pfatal("cannot create socket");
+	const int one = 1;
+	setsockopt(sck, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(sck, res->ai_addr, res->ai_addrlen) == -1)
+		pfatal("cannot bind listening socket");
+	if (listen(sck, 1) == -1)
+		pfatal("cannot listen on socket");
+	freeaddrinfo(res);
+	return sck;
+}
+
+/* dst_connect:
+ *   Connect to the given address. The node may not be started yet, so we
+ *   retry for about a minute before giving up.
+ */
+static int dst_connect(char *line) {
+	struct addrinfo *res = dst_addr(line, false);
+	const struct timespec dly = {0, 100000000};
+	for (uint32_t i = 0; i < 600; i++) {
+		int sck = socket(res->ai_family, res->ai_socktype,
+			res->ai_protocol);
+		if (sck == -1)
+			pfatal("cannot create socket");
+		if (connect(sck, res->ai_addr, res->ai_addrlen) == 0) {
+			freeaddrinfo(res);
+			return sck;
+		}
+		close(sck);
+		nanosleep(&dly, NULL);
+	}
+	pfatal("cannot connect to node '%s'", line);
+	return -1;
+}
+
+/* dst_xchg:
+ *   Send <slen> bytes from <sbuf> to the next node while receiving <rlen> bytes
+ *   in <rbuf> from the previous one. Both are done at the same time else the
+ *   nodes could block each other when the messages are bigger than the socket
+ *   buffers.
+ */
+static void dst_xchg(dst_t *dst, const void *sbuf, size_t slen,
+                     void *rbuf, size_t rlen) {
+	size_t spos = 0, rpos = 0;
+	while (spos < slen || rpos < rlen) {
+		struct pollfd fds[2] = {
+			{.fd = spos < slen ? dst->next : -1, .events = POLLOUT},
+			{.fd = rpos < rlen ? dst->prev : -1, .events = POLLIN },
+		};
+		if (poll(fds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			pfatal("cannot poll sockets");
+		}
+		if (fds[0].revents != 0) {
+			const ssize_t n = send(dst->next, (char *)sbuf + spos,
+				slen - spos, MSG_NOSIGNAL);
+			if (n >= 0)
+				spos += n;
+			else if (errno != EAGAIN && errno != EWOULDBLOCK
+			      && errno != EINTR)
+				pfatal("cannot send to next node");
+		}
+		if (fds[1].revents != 0) {
+			const ssize_t n = recv(dst->prev, (char *)rbuf + rpos,
+				rlen - rpos, 0);
+			if (n > 0)
+				rpos += n;
+			else if (n == 0)
+				fatal("connection closed by previous node");
+			else if (errno != EAGAIN && errno != EWOULDBLOCK
+			      && errno != EINTR)
+				pfatal("cannot receive from previous node");
+		}
+	}
+}
+
+/* dst_new:
+ *   Connect this node of rank <rank> with the others listed in the file at
+ *   <path>. This block until the full ring is established.
+ */
+dst_t *dst_new(const char *path, uint32_t rank) {
+	FILE *file = fopen(path, "r");
+	if (file == NULL)
+		pfatal("cannot open nodes file");
+	uint32_t N = 0, size = 16;
+	char **lst = xmalloc(sizeof(char *) * size);
+	char line[1024];
+	while (fgets(line, sizeof(line), file) != NULL) {
+		char *beg = line + strspn(line, " \t");
+		beg[strcspn(beg, " \t\r\n")] = '\0';
+		if (beg[0] == '\0' || beg[0] == '#')
+			continue;
+		if (N == size) {
+			size *= 2;
+			lst = xrealloc(lst, sizeof(char *) * size);
+		}
+		lst[N++] = xstrdup(beg);
+	}
+	fclose(file);
+	if (rank >= N)
+		fatal("rank %"PRIu32" not in nodes file", rank);
+	dst_t *dst = xmalloc(sizeof(dst_t));
+	dst->rank = rank;
+	dst->size = N;
+	dst->next = dst->prev = -1;
+	dst->sbuf = dst->rbuf = NULL;
+	dst->blen = 0;
+	if (N != 1) {
+		// As connections are queued by the listening socket, all nodes
+		// can first connect to their next one and only after accept
+		// the previous one without deadlock.
+		info("    connect node %"PRIu32"/%"PRIu32"\n", rank, N);
+		int sck = dst_listen(lst[rank]);
+		dst->next = dst_connect(lst[(rank + 1) % N]);
+		dst->prev = accept(sck, NULL, NULL);
+		if (dst->prev == -1)
+			pfatal("cannot accept previous node");
+		close(sck);
+		dst_setup(dst->next);
+		dst_setup(dst->prev);
+		// Check that the ring is consistent, each node send its rank
+		// and the number of nodes it found to the next one.
+		const uint32_t snd[2] = {rank, N};
+		uint32_t rcv[2];
+		dst_xchg(dst, snd, sizeof(snd), rcv, sizeof(rcv));
+		if (rcv[0] != (rank + N - 1) % N || rcv[1] != N)
+			fatal("inconsistent nodes file");
+	}
+	for (uint32_t n = 0; n < N; n++)
+		xfree(lst[n]);
+	xfree(lst);
+	return dst;
+}
+
+/* dst_free:
+ *   Close the connections to the other nodes and free the object.
+ */
+void dst_free(dst_t *dst) {
+	if (dst->size != 1) {
+		close(dst->next);
+		close(dst->prev);
+	}
+	xfree(dst->sbuf);
+	xfree(dst->rbuf);
+	xfree(dst);
+}
+
+/* dst_encode:
+ *   Encode the <m> values of <x> in the send buffer after a header of two
+ *   values: the chunk size and the number of values sent, or <none> if the
+ *   chunk is sent as is. If less than two third of the values are not null,
+ *   only them are sent, followed by their indexes in the chunk. Return the
+ *   size of the encoded chunk.
+ */
+static size_t dst_encode(dst_t *dst, const double *x, uint64_t m) {
+	uint64_t *hdr = (uint64_t *)dst->sbuf;
+	double   *val = (double *)(hdr + 2);
+	uint64_t nnz = 0;
+	for (uint64_t i = 0; i < m; i++)
+		if (x[i] != 0.0)
+			nnz++;
+	hdr[0] = m;
+	if (m > UINT32_MAX || nnz * 12 >= m * 8) {
+		hdr[1] = none;
+		memcpy(val, x, sizeof(double) * m);
+		return sizeof(uint64_t) * 2 + sizeof(double) * m;
+	}
+	uint32_t *idx = (uint32_t *)(val + nnz);
+	hdr[1] = nnz;
+	for (uint64_t i = 0, n = 0; i < m; i++) {
+		if (x[i] != 0.0) {
+			val[n] = x[i];
+			idx[n] = i;
+			n++;
+		}
+	}
+	return sizeof(uint64_t) * 2 + sizeof(double) * nnz
+	     + sizeof(uint32_t) * nnz;
+}
+
+/* dst_step:
+ *   Perform a step of the ring algorithm: send chunk <sc> of <x> to the next
+ *   node and receive chunk <rc> from the previous one. The received values are
+ *   either added to the local ones if <add> is true, or replace them.
+ */
+static void dst_step(dst_t *dst, double *x, uint64_t n,
+                     uint32_t sc, uint32_t rc, bool add) {
+	const uint32_t N = dst->size;
+	const uint64_t q = n / N, r = n % N;
+	const uint64_t soff = q * sc + min(sc, r), sm = q + (sc < r);
+	const uint64_t roff = q * rc + min(rc, r), rm = q + (rc < r);
+	// First exchange the headers so we know how many bytes to expect from
+	// the previous node, and next the data themselves.
+	const size_t slen = dst_encode(dst, x + soff, sm);
+	const size_t hlen = sizeof(uint64_t) * 2;
+	uint64_t *hdr = (uint64_t *)dst->rbuf;
+	dst_xchg(dst, dst->sbuf, hlen, dst->rbuf, hlen);
+	if (hdr[0] != rm)
+		fatal("inconsistent vector size between nodes");
+	const uint64_t nnz = hdr[1];
+	size_t rlen = sizeof(double) * rm;
+	if (nnz != none)
+		rlen = (sizeof(double) + sizeof(uint32_t)) * nnz;
+	dst_xchg(dst, dst->sbuf + hlen, slen - hlen, dst->rbuf + hlen, rlen);
+	// Decode the received chunk
+	double *y = x + roff;
+	const double *val = (const double *)(hdr + 2);
+	if (nnz == none) {
+		if (add)
+			for (uint64_t i = 0; i < rm; i++)
+				y[i] += val[i];
+		else
+			memcpy(y, val, sizeof(double) * rm);
+		return;
+	}
+	const uint32_t *idx = (const uint32_t *)(val + nnz);
+	if (!add)
+		for (uint64_t i = 0; i < rm; i++)
+			y[i] = 0.0;
+	for (uint64_t i = 0; i < nnz; i++)
+		y[idx[i]] += val[i];
+}
+
+/* dst_allreduce:
+ *   Replace the vector <x> of size <n> on all nodes by the sum of their own
+ *   vectors. At step <k> of the first pass, each node add the chunk received
+ *   from the previous node to its own and forward it, so after the pass the
+ *   node <r> hold the full sum of the chunk <r + 1>. The second pass just
+ *   forward the full chunks around the ring.
+ */
+void dst_allreduce(dst_t *dst, double *x, uint64_t n) {
+	const uint32_t N = dst->size, r = dst->rank;
+	if (N == 1)
+		return;
+	const size_t len = sizeof(uint64_t) * 2
+	                 + sizeof(double) * (n / N + 1);
+	if (dst->blen < len) {
+		xfree(dst->sbuf);
+		xfree(dst->rbuf);
+		dst->sbuf = xmalloc(len);
+		dst->rbuf = xmalloc(len);
+		dst->blen = len;
+	}
+	for (uint32_t k = 0; k < N - 1; k++) {
+		const uint32_t c = (r + N - k) % N;
+		dst_step(dst, x, n, c, (c + N - 1) % N, true);
+	}
+	for (uint32_t k = 0; k < N - 1; k++) {
+		const uint32_t c = (r + 1 + N - k) % N;
+		dst_step(dst, x, n, c, (c + N - 1) % N, false);
+	}
+}
+
+/* dst_bcast:
+ *   Send the <len> bytes of <buf> from the node of rank 0 to all the others,
+ *   the data are just forwarded along the ring.
+ */
+void dst_bcast(dst_t *dst, void *buf, size_t len) {
+	if (dst->size == 1)
+		return;
+	if (dst->rank != 0)
+		dst_xchg(dst, NULL, 0, buf, len);
+	if (dst->rank != dst->size - 1)
+		dst_xchg(dst, buf, len, NULL, 0);
+}
+
+#else
+
+dst_t *dst_new(const char *path, uint32_t rank) {
+	unused(path); unused(rank);
+	fatal("distributed training is not supported on this platform");
+	return NULL;
+}
+
+void dst_free(dst_t *dst) {
+	xfree(dst);
+}
+
+void dst_allreduce(dst_t *dst, double *x, uint64_t n) {
+	unused(dst); unused(x); unused(n);
+}
+
+void dst_bcast(dst_t *dst, void *buf, size_t len) {
+	unused(dst); unused(buf); unused(len);
+}
+
+#endif
+
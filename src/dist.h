@@ -0,0 +1,57 @@
+/*
+ *      Wapiti - A linear-chain CRF tool
+ *
+ * Copyright (c) 2009-2013  CNRS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef dist_h
+#define dist_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* dst_t:
+ *   Connection of the current node with the other ones of a distributed
+ *   training. Nodes are connected in a ring, each one send data to the next
+ *   and receive from the previous.
+ */
+typedef struct dst_s dst_t;
+struct dst_s {
+	uint32_t  rank;    //  Index of this node in the ring
+	uint32_t  size;    //  Number of nodes in the ring
+	int       next;    //  Socket to the next node
+	int       prev;    //  Socket from the previous node
+	char     *sbuf;    //  Buffer of the encoded chunk to send
+	char     *rbuf;    //  Buffer of the encoded chunk received
+	size_t    blen;    //  Size of the two buffers
+};
+
+dst_t *dst_new(const char *path, uint32_t rank);
+void dst_free(dst_t *dst);
+void dst_allreduce(dst_t *dst, double *x, uint64_t n);
+void dst_bcast(dst_t *dst, void *buf, size_t len);
+
+#endif
+
@@ -32,6 +32,7 @@
 #include <string.h>
 
 #include "wapiti.h"
+#include "dist.h"
 #include "gradient.h"
 #include "model.h"
 #include "options.h"
@@ -42,17 +43,20 @@
 #include "vmath.h"
 
 /* atm_inc:
- *   Atomically increment the value pointed by [ptr] by [inc]. If ATM_ANSI is
- *   defined this NOT atomic at all so caller must have to deal with this.
+ *   Atomically increment the value pointed by [ptr] by [inc] and return the
+ *   number of times the update had to be retried. If ATM_ANSI is defined this
+ *   NOT atomic at all so caller must have to deal with this.
  */
 #ifdef ATM_ANSI
 static inline
-void atm_inc(double *value, double inc) {
+uint32_t atm_inc(double *value, double inc) {
 	*value += inc;
+	return 0;
 }
 #else
 static inline
-void atm_inc(volatile double *value, double inc) {
+uint32_t atm_inc(volatile double *value, double inc) {
+	uint32_t retry = 0;
 	while (1) {
 		volatile union {
 			double   d;
@@ -63,10 +67,42 @@ void atm_inc(volatile double *value, double inc) {
 		uint64_t *ptr = (uint64_t *)value;
 		if (__sync_bool_compare_and_swap(ptr, old.u, new.u))
 			break;
+		retry++;
 	}
+	return retry;
 }
 #endif
 
+/* grd_blknew:
+ *   Allocate the private gradient block <b> of the given state. Blocks are
+ *   allocated when first touched and kept from one gradient computation to the
+ *   next, they are cleared by the reduction.
+ */
+static double *grd_blknew(grd_st_t *grd_st, uint64_t b) {
+	double *blk = xvm_new(GRD_BLKSZ);
+	for (uint32_t i = 0; i < GRD_BLKSZ; i++)
+		blk[i] = 0.0;
+	grd_st->blk[b] = blk;
+	return blk;
+}
+
+/* grd_inc:
+ *   Add <v> to the gradient of feature <f>. If the state have private blocks
+ *   the update go there without any synchronization, else it is atomically
+ *   added to the shared gradient vector.
+ */
+static inline
+void grd_inc(grd_st_t *grd_st, uint64_t f, double v) {
+	if (grd_st->blk == NULL) {
+		grd_st->prf.retry += atm_inc(grd_st->g + f, v);
+		return;
+	}
+	double *blk = grd_st->blk[f >> GRD_BLKBITS];
+	if (blk == NULL)
+		blk = grd_blknew(grd_st, f >> GRD_BLKBITS);
+	blk[f & (GRD_BLKSZ - 1)] += v;
+}
+
 /******************************************************************************
  * Maxent gradient computation
  *
@@ -89,9 +125,9 @@ void grd_domaxent(grd_st_t *grd_st, const seq_t *seq) {
 	const uint32_t T = seq->len;
 	const uint32_t Y = mdl->nlbl;
 	double *psi = grd_st->psi;
-	double *g   = grd_st->g;
 	for (uint32_t t = 0; t < T; t++) {
 		const pos_t *pos = &(seq->pos[t]);
+		const obs_t *uobs = seq_uobs(seq, pos);
 		// We first compute for each Y the sum of weights of all
 		// features actives in the sample:
 		//     Ψ(y,x^i) = \exp( ∑_k θ_k f_k(y,x^i) )
@@ -100,7 +136,7 @@ void grd_domaxent(grd_st_t *grd_st, const seq_t *seq) {
 		for (uint32_t y = 0; y < Y; y++)
 			psi[y] = 0.0;
 		for (uint32_t n = 0; n < pos->ucnt; n++) {
-			const double *wgh = x + mdl->uoff[pos->uobs[n]];
+			const double *wgh = x + mdl->uoff[uobs[n]];
 			for (uint32_t y = 0; y < Y; y++)
 				psi[y] += wgh[y];
 		}
@@ -119,10 +155,10 @@ void grd_domaxent(grd_st_t *grd_st, const seq_t *seq) {
 		for (uint32_t y = 0; y < Y; y++)
 			psi[y] /= Z;
 		for (uint32_t n = 0; n < pos->ucnt; n++) {
-			double *grd = g + mdl->uoff[pos->uobs[n]];
+			const uint64_t f = mdl->uoff[uobs[n]];
 			for (uint32_t y = 0; y < Y; y++)
-				atm_inc(grd + y, psi[y]);
-			atm_inc(grd + pos->lbl, -1.0);
+				grd_inc(grd_st, f + y, psi[y]);
+			grd_inc(grd_st, f + pos->lbl, -1.0);
 		}
 		// And finally the log-likelihood with:
 		//     L_θ(x^i,y^i) = log(Z_θ(x^i)) - log(ψ(y^i,x^i))
@@ -154,9 +190,10 @@ void grd_domemm(grd_st_t *grd_st, const seq_t *seq) {
 	const uint32_t T = seq->len;
 	const uint32_t Y = mdl->nlbl;
 	double *psi = grd_st->psi;
-	double *g   = grd_st->g;
 	for (uint32_t t = 0; t < T; t++) {
 		const pos_t *pos = &(seq->pos[t]);
+		const obs_t *uobs = seq_uobs(seq, pos);
+		const obs_t *bobs = seq_bobs(seq, pos);
 		// We first compute for each Y the sum of weights of all
 		// features actives in the sample:
 		//     Ψ(y,x^i) = \exp( ∑_k θ_k f_k(y_t-1, y,x^i) )
@@ -167,7 +204,7 @@ void grd_domemm(grd_st_t *grd_st, const seq_t *seq) {
 		for (uint32_t y = 0; y < Y; y++)
 			psi[y] = 0.0;
 		for (uint32_t n = 0; n < pos->ucnt; n++) {
-			const double *wgh = x + mdl->uoff[pos->uobs[n]];
+			const double *wgh = x + mdl->uoff[uobs[n]];
 			for (uint32_t y = 0; y < Y; y++)
 				psi[y] += wgh[y];
 		}
@@ -177,7 +214,7 @@ void grd_domemm(grd_st_t *grd_st, const seq_t *seq) {
 			for (uint32_t y = 0; y < Y; y++) {
 				double sum = 0.0;
 				for (uint32_t n = 0; n < pos->bcnt; n++) {
-					const uint64_t o = pos->bobs[n];
+					const uint64_t o = bobs[n];
 					sum += x[mdl->boff[o] + d + y];
 				}
 				psi[y] += sum;
@@ -198,19 +235,19 @@ void grd_domemm(grd_st_t *grd_st, const seq_t *seq) {
 		for (uint32_t y = 0; y < Y; y++)
 			psi[y] /= Z;
 		for (uint32_t n = 0; n < pos->ucnt; n++) {
-			double *grd = g + mdl->uoff[pos->uobs[n]];
+			const uint64_t f = mdl->uoff[uobs[n]];
 			for (uint32_t y = 0; y < Y; y++)
-				atm_inc(grd + y, psi[y]);
-			atm_inc(grd + pos->lbl, -1.0);
+				grd_inc(grd_st, f + y, psi[y]);
+			grd_inc(grd_st, f + pos->lbl, -1.0);
 		}
 		if (t != 0) {
 			const uint32_t yp = seq->pos[t - 1].lbl;
 			const uint32_t d  = yp * Y;
 			for (uint32_t n = 0; n < pos->bcnt; n++) {
-				double *grd = g + mdl->boff[pos->bobs[n]] + d;
+				const uint64_t f = mdl->boff[bobs[n]] + d;
 				for (uint32_t y = 0; y < Y; y++)
-					atm_inc(grd + y, psi[y]);
-				atm_inc(grd + pos->lbl, -1.0);
+					grd_inc(grd_st, f + y, psi[y]);
+				grd_inc(grd_st, f + pos->lbl, -1.0);
 			}
 		}
 		// And finally the log-likelihood with:
@@ -260,6 +297,50 @@ void grd_domemm(grd_st_t *grd_st, const seq_t *seq) {
  *   the worst case use as less as possible memory.
  ******************************************************************************/
 
+/* grd_addbi:
+ *   Add to the Y×Y matrix <psi> the sum of the bigram weights of observations
+ *   active at position <t> of <seq>. The sum is built in <tmp> by adding the
+ *   blocks one after the other so the loops are over contiguous memory, and
+ *   the constant observations, if any, are replaced by the precomputed sum of
+ *   their weights in <bcst>. The additions are done in the same order than in
+ *   the direct computation so, with a single constant observation, the result
+ *   is exactly the same.
+ */
+void grd_addbi(const mdl_t *mdl, double *psi, double *tmp, const seq_t *seq,
+               uint32_t t, const double *bcst, const uint64_t *cst,
+               uint32_t ncst) {
+	const uint32_t Y = mdl->nlbl;
+	const pos_t *pos = &(seq->pos[t]);
+	const obs_t *bobs = seq_bobs(seq, pos);
+	bool first = true, done = false;
+	for (uint32_t n = 0; n < pos->bcnt; n++) {
+		const uint64_t o = bobs[n];
+		bool iscst = false;
+		for (uint32_t i = 0; i < ncst; i++)
+			if (cst[i] == o)
+				iscst = true;
+		if (iscst && done)
+			continue;
+		done |= iscst;
+		double *dst = tmp;
+		if (pos->bcnt == 1) {
+			dst = psi;
+		} else if (first) {
+			for (uint32_t d = 0; d < Y * Y; d++)
+				tmp[d] = 0.0;
+			first = false;
+		}
+		if (iscst)
+			for (uint32_t d = 0; d < Y * Y; d++)
+				dst[d] += bcst[d];
+		else
+			mdl_wadd(mdl, dst, o, mdl->boff[o], Y * Y);
+	}
+	if (!first)
+		for (uint32_t d = 0; d < Y * Y; d++)
+			psi[d] += tmp[d];
+}
+
 /* grd_fldopsi:
  *   We first have to compute the Ψ_t(y',y,x) weights defined as
  *       Ψ_t(y',y,x) = \exp( ∑_k θ_k f_k(y',y,x_t) )
@@ -280,39 +361,63 @@ void grd_domemm(grd_st_t *grd_st, const seq_t *seq) {
  *          there is no bigrams here)
  *     3/ we take the component-wise exponential of the resulting matrix
  *          (this can be done efficiently with vector maths)
+ *   If the summed weights of the constant bigram observations are provided in
+ *   the state, they are added in a single pass in step 2 instead of being
+ *   summed again at each position.
+ *
+ *   The Ψ are computed for the positions from <t0> to <t1> excluded and stored
+ *   in <buf> starting from its begining, so the checkpointed forward-backward
+ *   can compute them block by block.
  */
-void grd_fldopsi(grd_st_t *grd_st, const seq_t *seq) {
+static void grd_flpsiblk(grd_st_t *grd_st, const seq_t *seq, double *buf,
+                         uint32_t t0, uint32_t t1) {
 	const mdl_t *mdl = grd_st->mdl;
 	const double  *x = mdl->theta;
 	const uint32_t Y = mdl->nlbl;
-	const uint32_t T = seq->len;
-	double (*psi)[T][Y][Y] = (void *)grd_st->psi;
-	for (uint32_t t = 0; t < T; t++) {
+	const uint32_t T = t1 - t0;
+	double (*psi)[T][Y][Y] = (void *)buf;
+	for (uint32_t t = t0; t < t1; t++) {
 		const pos_t *pos = &(seq->pos[t]);
+		const obs_t *uobs = seq_uobs(seq, pos);
 		for (uint32_t y = 0; y < Y; y++) {
 			double sum = 0.0;
 			for (uint32_t n = 0; n < pos->ucnt; n++) {
-				const uint64_t o = pos->uobs[n];
+				const uint64_t o = uobs[n];
 				sum += x[mdl->uoff[o] + y];
 			}
 			for (uint32_t yp = 0; yp < Y; yp++)
-				(*psi)[t][yp][y] = sum;
+				(*psi)[t - t0][yp][y] = sum;
 		}
 	}
-	for (uint32_t t = 1; t < T; t++) {
+	if (grd_st->bcst != NULL) {
+		if (grd_st->btmp == NULL)
+			grd_st->btmp = xvm_new(Y * Y);
+		for (uint32_t t = max(t0, 1); t < t1; t++)
+			grd_addbi(mdl, (*psi)[t - t0][0], grd_st->btmp, seq, t,
+				grd_st->bcst, grd_st->cst, grd_st->ncst);
+	}
+	for (uint32_t t = max(t0, 1); t < t1 && grd_st->bcst == NULL; t++) {
 		const pos_t *pos = &(seq->pos[t]);
+		const obs_t *bobs = seq_bobs(seq, pos);
 		for (uint32_t yp = 0, d = 0; yp < Y; yp++) {
 			for (uint32_t y = 0; y < Y; y++, d++) {
 				double sum = 0.0;
 				for (uint32_t n = 0; n < pos->bcnt; n++) {
-					const uint64_t o = pos->bobs[n];
+					const uint64_t o = bobs[n];
 					sum += x[mdl->boff[o] + d];
 				}
-				(*psi)[t][yp][y] += sum;
+				(*psi)[t - t0][yp][y] += sum;
 			}
 		}
 	}
-	xvm_expma((double *)psi, (double *)psi, 0.0, (uint64_t)T * Y * Y);
+	xvm_expma(buf, buf, 0.0, (uint64_t)T * Y * Y);
+}
+
+/* grd_fldopsi:
+ *   Compute the Ψ of the full sequence in the state.
+ */
+void grd_fldopsi(grd_st_t *grd_st, const seq_t *seq) {
+	grd_flpsiblk(grd_st, seq, grd_st->psi, 0, seq->len);
 }
 
 /* grd_spdopsi:
@@ -348,10 +453,11 @@ void grd_spdopsi(grd_st_t *grd_st, const seq_t *seq) {
 	uint32_t  *psioff        =         grd_st->psioff;
 	for (uint32_t t = 0; t < T; t++) {
 		const pos_t *pos = &(seq->pos[t]);
+		const obs_t *uobs = seq_uobs(seq, pos);
 		for (uint32_t y = 0; y < Y; y++) {
 			double sum = 0.0;
 			for (uint32_t n = 0; n < pos->ucnt; n++) {
-				const uint64_t o = pos->uobs[n];
+				const uint64_t o = uobs[n];
 				sum += x[mdl->uoff[o] + y];
 			}
 			(*psiuni)[t][y] = sum;
@@ -360,12 +466,13 @@ void grd_spdopsi(grd_st_t *grd_st, const seq_t *seq) {
 	uint32_t off = 0;
 	for (uint32_t t = 1; t < T; t++) {
 		const pos_t *pos = &(seq->pos[t]);
+		const obs_t *bobs = seq_bobs(seq, pos);
 		psioff[t] = off;
 		for (uint32_t y = 0, nnz = 0; y < Y; y++) {
 			for (uint32_t yp = 0; yp < Y; yp++) {
 				double sum = 0.0;
 				for (uint32_t n = 0; n < pos->bcnt; n++) {
-					const uint64_t o = pos->bobs[n];
+					const uint64_t o = bobs[n];
 					sum += x[mdl->boff[o] + yp * Y + y];
 				}
 				if (sum == 0.0)
@@ -401,6 +508,8 @@ void grd_spdopsi(grd_st_t *grd_st, const seq_t *seq) {
  *       for bigrams:  Z_θ(t) = ∑_y α_t(y) β_t(y) / α-scale_t
  *   with α-scale_t the scaling factor used for the α vector at position t
  *   in the forward recursion.
+ *   The vector-matrix products of the recursions are done by the vmath lattice
+ *   kernels who select the best SIMD code for the running CPU.
  */
 void grd_flfwdbwd(grd_st_t *grd_st, const seq_t *seq) {
 	const mdl_t *mdl = grd_st->mdl;
@@ -416,23 +525,13 @@ void grd_flfwdbwd(grd_st_t *grd_st, const seq_t *seq) {
 		(*alpha)[0][y] = (*psi)[0][0][y];
 	scale[0] = xvm_unit((*alpha)[0], (*alpha)[0], Y);
 	for (uint32_t t = 1; t < grd_st->last + 1; t++) {
-		for (uint32_t y = 0; y < Y; y++) {
-			double sum = 0.0;
-			for (uint32_t yp = 0; yp < Y; yp++)
-				sum += (*alpha)[t - 1][yp] * (*psi)[t][yp][y];
-			(*alpha)[t][y] = sum;
-		}
+		xvm_vecmat((*alpha)[t], (*alpha)[t - 1], &(*psi)[t][0][0], Y);
 		scale[t] = xvm_unit((*alpha)[t], (*alpha)[t], Y);
 	}
 	for (uint32_t yp = 0; yp < Y; yp++)
 		(*beta)[T - 1][yp] = 1.0 / Y;
 	for (uint32_t t = T - 1; t > grd_st->first; t--) {
-		for (uint32_t yp = 0; yp < Y; yp++) {
-			double sum = 0.0;
-			for (uint32_t y = 0; y < Y; y++)
-				sum += (*beta)[t][y] * (*psi)[t][yp][y];
-			(*beta)[t - 1][yp] = sum;
-		}
+		xvm_matvec((*beta)[t - 1], &(*psi)[t][0][0], (*beta)[t], Y);
 		xvm_unit((*beta)[t - 1], (*beta)[t - 1], Y);
 	}
 	for (uint32_t t = 0; t < T; t++) {
@@ -554,42 +653,56 @@ void grd_spfwdbwd(grd_st_t *grd_st, const seq_t *seq) {
  *   We must also take care of not clearing previous value of the gradient
  *   vector but just adding the contribution of this sequence. This allow to
  *   compute it easily the gradient over more than one sequence.
+ *
+ *   The update is done for the positions from <t0> to <t1> excluded whose
+ *   values are stored in the state starting from its begining. If <t0> is not
+ *   the first position, <prev> must hold the α vector of the position before.
  */
-void grd_flupgrad(grd_st_t *grd_st, const seq_t *seq) {
+static void grd_flupgblk(grd_st_t *grd_st, const seq_t *seq,
+                         uint32_t t0, uint32_t t1, const double *prev) {
 	const mdl_t *mdl = grd_st->mdl;
 	const uint32_t Y = mdl->nlbl;
-	const uint32_t T = seq->len;
+	const uint32_t T = t1 - t0;
 	const double (*psi  )[T][Y][Y] = (void *)grd_st->psi;
 	const double (*alpha)[T][Y]    = (void *)grd_st->alpha;
 	const double (*beta )[T][Y]    = (void *)grd_st->beta;
 	const double  *unorm           =         grd_st->unorm;
 	const double  *bnorm           =         grd_st->bnorm;
-	double *g = grd_st->g;
 	for (uint32_t t = 0; t < T; t++) {
-		const pos_t *pos = &(seq->pos[t]);
+		const pos_t *pos = &(seq->pos[t0 + t]);
+		const obs_t *uobs = seq_uobs(seq, pos);
 		for (uint32_t y = 0; y < Y; y++) {
 			double e = (*alpha)[t][y] * (*beta)[t][y] * unorm[t];
 			for (uint32_t n = 0; n < pos->ucnt; n++) {
-				const uint64_t o = pos->uobs[n];
-				atm_inc(g + mdl->uoff[o] + y, e);
+				const uint64_t o = uobs[n];
+				grd_inc(grd_st, mdl->uoff[o] + y, e);
 			}
 		}
 	}
-	for (uint32_t t = 1; t < T; t++) {
-		const pos_t *pos = &(seq->pos[t]);
+	for (uint32_t t = (t0 == 0); t < T; t++) {
+		const pos_t *pos = &(seq->pos[t0 + t]);
+		const obs_t *bobs = seq_bobs(seq, pos);
+		const double *a = t == 0 ? prev : (*alpha)[t - 1];
 		for (uint32_t yp = 0, d = 0; yp < Y; yp++) {
 			for (uint32_t y = 0; y < Y; y++, d++) {
-				double e = (*alpha)[t - 1][yp] * (*beta)[t][y]
+				double e = a[yp] * (*beta)[t][y]
 				         * (*psi)[t][yp][y] * bnorm[t];
 				for (uint32_t n = 0; n < pos->bcnt; n++) {
-					const uint64_t o = pos->bobs[n];
-					atm_inc(g + mdl->boff[o] + d, e);
+					const uint64_t o = bobs[n];
+					grd_inc(grd_st, mdl->boff[o] + d, e);
 				}
 			}
 		}
 	}
 }
 
+/* grd_flupgrad:
+ *   Update the gradient for the full sequence.
+ */
+void grd_flupgrad(grd_st_t *grd_st, const seq_t *seq) {
+	grd_flupgblk(grd_st, seq, 0, seq->len, NULL);
+}
+
 /* grd_spupgrad:
  *   The sparse matrix make things a bit more complicated here as we cannot
  *   directly multiply with the original Ψ_t(y',y,x) because we have split it
@@ -611,19 +724,20 @@ void grd_spupgrad(grd_st_t *grd_st, const seq_t *seq) {
 	const double   (*beta )[T][Y]  = (void *)grd_st->beta;
 	const double    *unorm         =         grd_st->unorm;
 	const double    *bnorm         =         grd_st->bnorm;
-	double *g = grd_st->g;
 	for (uint32_t t = 0; t < T; t++) {
 		const pos_t *pos = &(seq->pos[t]);
+		const obs_t *uobs = seq_uobs(seq, pos);
 		for (uint32_t y = 0; y < Y; y++) {
 			double e = (*alpha)[t][y] * (*beta)[t][y] * unorm[t];
 			for (uint32_t n = 0; n < pos->ucnt; n++) {
-				const uint64_t o = pos->uobs[n];
-				atm_inc(g + mdl->uoff[o] + y, e);
+				const uint64_t o = uobs[n];
+				grd_inc(grd_st, mdl->uoff[o] + y, e);
 			}
 		}
 	}
 	for (uint32_t t = 1; t < T; t++) {
 		const pos_t *pos = &(seq->pos[t]);
+		const obs_t *bobs = seq_bobs(seq, pos);
 		// We build the expectation matrix
 		double e[Y][Y];
 		for (uint32_t yp = 0; yp < Y; yp++)
@@ -645,8 +759,8 @@ void grd_spupgrad(grd_st_t *grd_st, const seq_t *seq) {
 		for (uint32_t yp = 0, d = 0; yp < Y; yp++) {
 			for (uint32_t y = 0; y < Y; y++, d++) {
 				for (uint32_t n = 0; n < pos->bcnt; n++) {
-					const uint64_t o = pos->bobs[n];
-					atm_inc(g + mdl->boff[o] + d, e[yp][y]);
+					const uint64_t o = bobs[n];
+					grd_inc(grd_st, mdl->boff[o] + d, e[yp][y]);
 				}
 			}
 		}
@@ -662,24 +776,25 @@ void grd_subemp(grd_st_t *grd_st, const seq_t *seq) {
 	const mdl_t *mdl = grd_st->mdl;
 	const uint32_t Y = mdl->nlbl;
 	const uint32_t T = seq->len;
-	double *g = grd_st->g;
 	for (uint32_t t = 0; t < T; t++) {
 		const pos_t *pos = &(seq->pos[t]);
+		const obs_t *uobs = seq_uobs(seq, pos);
 		const uint32_t y = seq->pos[t].lbl;
 		for (uint32_t n = 0; n < pos->ucnt; n++)
-			atm_inc(g + mdl->uoff[pos->uobs[n]] + y, -1.0);
+			grd_inc(grd_st, mdl->uoff[uobs[n]] + y, -1.0);
 	}
 	for (uint32_t t = 1; t < T; t++) {
 		const pos_t *pos = &(seq->pos[t]);
+		const obs_t *bobs = seq_bobs(seq, pos);
 		const uint32_t yp = seq->pos[t - 1].lbl;
 		const uint32_t y  = seq->pos[t    ].lbl;
 		const uint32_t d  = yp * Y + y;
 		for (uint32_t n = 0; n < pos->bcnt; n++)
-			atm_inc(g + mdl->boff[pos->bobs[n]] + d, -1.0);
+			grd_inc(grd_st, mdl->boff[bobs[n]] + d, -1.0);
 	}
 }
 
-/* grd_logloss:
+/* grd_lossval:
  *   And the final touch, the computation of the negative log-likelihood
  *       -L(θ) = log(Z_θ) - ∑_t ∑_k θ_k f_k(y_{t-1}, y_t, x_t)
  *
@@ -700,36 +815,50 @@ void grd_subemp(grd_st_t *grd_st, const seq_t *seq) {
  *   in two sums, one for unigrams and one for bigrams. And, as here also the
  *   weights will be non-nul only for observations present in the sequence, we
  *   sum only over these ones.
+ *
+ *   The first term is computed from the last α vector <last> and the scaling
+ *   factors <scale> of the full sequence.
  */
-void grd_logloss(grd_st_t *grd_st, const seq_t *seq) {
-	const mdl_t *mdl = grd_st->mdl;
+static double grd_lossval(const mdl_t *mdl, const seq_t *seq,
+                          const double *last, const double *scale) {
 	const double  *x = mdl->theta;
 	const uint32_t Y = mdl->nlbl;
 	const uint32_t T = seq->len;
-	const double (*alpha)[T][Y] = (void *)grd_st->alpha;
-	const double  *scale        =         grd_st->scale;
 	double logz = 0.0;
 	for (uint32_t y = 0; y < Y; y++)
-		logz += (*alpha)[T - 1][y];
+		logz += last[y];
 	logz = log(logz);
 	for (uint32_t t = 0; t < T; t++)
 		logz -= log(scale[t]);
 	double lloss = logz;
 	for (uint32_t t = 0; t < T; t++) {
 		const pos_t *pos = &(seq->pos[t]);
+		const obs_t *uobs = seq_uobs(seq, pos);
 		const uint32_t y = seq->pos[t].lbl;
 		for (uint32_t n = 0; n < pos->ucnt; n++)
-			lloss -= x[mdl->uoff[pos->uobs[n]] + y];
+			lloss -= x[mdl->uoff[uobs[n]] + y];
 	}
 	for (uint32_t t = 1; t < T; t++) {
 		const pos_t *pos = &(seq->pos[t]);
+		const obs_t *bobs = seq_bobs(seq, pos);
 		const uint32_t yp = seq->pos[t - 1].lbl;
 		const uint32_t y  = seq->pos[t    ].lbl;
 		const uint32_t d  = yp * Y + y;
 		for (uint32_t n = 0; n < pos->bcnt; n++)
-			lloss -= x[mdl->boff[pos->bobs[n]] + d];
+			lloss -= x[mdl->boff[bobs[n]] + d];
 	}
-	grd_st->lloss += lloss;
+	return lloss;
+}
+
+/* grd_logloss:
+ *   Add the negative log-likelihood of the sequence to the state.
+ */
+void grd_logloss(grd_st_t *grd_st, const seq_t *seq) {
+	const uint32_t Y = grd_st->mdl->nlbl;
+	const uint32_t T = seq->len;
+	const double (*alpha)[T][Y] = (void *)grd_st->alpha;
+	grd_st->lloss += grd_lossval(grd_st->mdl, seq, (*alpha)[T - 1],
+		grd_st->scale);
 }
 
 /* grd_docrf:
@@ -744,19 +873,131 @@ void grd_docrf(grd_st_t *grd_st, const seq_t *seq) {
 	const mdl_t *mdl = grd_st->mdl;
 	grd_st->first = 0;
 	grd_st->last  = seq->len - 1;
+	uint64_t tic = grd_tic(grd_st);
 	if (!mdl->opt->sparse) {
 		grd_fldopsi(grd_st, seq);
+		tic = grd_toc(grd_st, UIT_PSI, tic);
 		grd_flfwdbwd(grd_st, seq);
+		tic = grd_toc(grd_st, UIT_FWDBWD, tic);
 		grd_flupgrad(grd_st, seq);
 	} else {
 		grd_spdopsi(grd_st, seq);
+		tic = grd_toc(grd_st, UIT_PSI, tic);
 		grd_spfwdbwd(grd_st, seq);
+		tic = grd_toc(grd_st, UIT_FWDBWD, tic);
 		grd_spupgrad(grd_st, seq);
 	}
 	grd_subemp(grd_st, seq);
+	grd_toc(grd_st, UIT_UPDATE, tic);
 	grd_logloss(grd_st, seq);
 }
 
+/* grd_ckfwd:
+ *   Compute the Ψ and the α of the positions from <t0> to <t1> excluded in the
+ *   state, starting from the α vector <prev> of the position before if <t0> is
+ *   not the first one. The scaling factors are stored in <scale> at their
+ *   position in the sequence.
+ */
+static void grd_ckfwd(grd_st_t *grd_st, const seq_t *seq, uint32_t t0,
+                      uint32_t t1, const double *prev, double *scale) {
+	const uint64_t Y = grd_st->mdl->nlbl;
+	const uint32_t T = t1 - t0;
+	const double (*psi)[T][Y][Y] = (void *)grd_st->psi;
+	double (*alpha)[T][Y] = (void *)grd_st->alpha;
+	uint64_t tic = grd_tic(grd_st);
+	grd_flpsiblk(grd_st, seq, grd_st->psi, t0, t1);
+	tic = grd_toc(grd_st, UIT_PSI, tic);
+	for (uint32_t t = 0; t < T; t++) {
+		if (t0 + t == 0) {
+			for (uint32_t y = 0; y < Y; y++)
+				(*alpha)[0][y] = (*psi)[0][0][y];
+		} else {
+			const double *a = t == 0 ? prev : (*alpha)[t - 1];
+			xvm_vecmat((*alpha)[t], a, &(*psi)[t][0][0], Y);
+		}
+		scale[t0 + t] = xvm_unit((*alpha)[t], (*alpha)[t], Y);
+	}
+	grd_toc(grd_st, UIT_FWDBWD, tic);
+}
+
+/* grd_docrfck:
+ *   Checkpointed version of grd_docrf for long sequences who need memory only
+ *   for about √T positions instead of the full sequence. The sequence is split
+ *   in blocks of K = ⌈√T⌉ positions and a first forward pass compute the Ψ and
+ *   α block by block, keeping only the scaling factors and the last α vector
+ *   of each block as checkpoints.
+ *   The blocks are next processed from the last one: their Ψ and α are
+ *   computed again from the checkpoint of the previous block, the β are
+ *   computed backward from the one carried from the next block, and the
+ *   gradient is updated for all positions of the block.
+ *   This cost a second computation of the Ψ and the forward recursion, but
+ *   the state only have to hold a single block. The values are the same than
+ *   with the full computation, only the order of the updates of the gradient
+ *   change.
+ */
+static void grd_docrfck(grd_st_t *grd_st, const seq_t *seq) {
+	const mdl_t *mdl = grd_st->mdl;
+	const uint64_t Y = mdl->nlbl;
+	const uint32_t T = seq->len;
+	uint32_t K = sqrt(T);
+	while ((uint64_t)K * K < T)
+		K++;
+	const uint32_t B = (T + K - 1) / K;
+	grd_stcheck(grd_st, K);
+	const double (*psi  )[K][Y][Y] = (void *)grd_st->psi;
+	const double (*alpha)[K][Y]    = (void *)grd_st->alpha;
+	double (*beta)[K][Y] = (void *)grd_st->beta;
+	double  *unorm       =         grd_st->unorm;
+	double  *bnorm       =         grd_st->bnorm;
+	double  *scale       = xvm_new(T);
+	double  *carry       = xvm_new(Y);
+	double (*ckpt)[B + 1][Y] = (void *)xvm_new((B + 1) * Y);
+	// First the forward pass keeping the checkpoints
+	for (uint32_t b = 0; b < B; b++) {
+		const uint32_t t0 = b * K, t1 = min(T, t0 + K);
+		grd_ckfwd(grd_st, seq, t0, t1, (*ckpt)[b], scale);
+		for (uint32_t y = 0; y < Y; y++)
+			(*ckpt)[b + 1][y] = (*alpha)[t1 - t0 - 1][y];
+	}
+	// Next the backward pass over the blocks, the last one is still in the
+	// state so we don't have to compute it again.
+	for (uint32_t b = B; b-- > 0; ) {
+		const uint32_t t0 = b * K, t1 = min(T, t0 + K);
+		const uint32_t N = t1 - t0;
+		if (b != B - 1)
+			grd_ckfwd(grd_st, seq, t0, t1, (*ckpt)[b], scale);
+		uint64_t tic = grd_tic(grd_st);
+		for (uint32_t yp = 0; yp < Y; yp++)
+			(*beta)[N - 1][yp] = b == B - 1 ? 1.0 / Y : carry[yp];
+		for (uint32_t t = N - 1; t > 0; t--) {
+			xvm_matvec((*beta)[t - 1], &(*psi)[t][0][0],
+				(*beta)[t], Y);
+			xvm_unit((*beta)[t - 1], (*beta)[t - 1], Y);
+		}
+		if (b != 0) {
+			xvm_matvec(carry, &(*psi)[0][0][0], (*beta)[0], Y);
+			xvm_unit(carry, carry, Y);
+		}
+		for (uint32_t t = 0; t < N; t++) {
+			double z = 0.0;
+			for (uint32_t y = 0; y < Y; y++)
+				z += (*alpha)[t][y] * (*beta)[t][y];
+			unorm[t] = 1.0 / z;
+			bnorm[t] = scale[t0 + t] / z;
+		}
+		tic = grd_toc(grd_st, UIT_FWDBWD, tic);
+		grd_flupgblk(grd_st, seq, t0, t1, (*ckpt)[b]);
+		grd_toc(grd_st, UIT_UPDATE, tic);
+	}
+	const uint64_t tic = grd_tic(grd_st);
+	grd_subemp(grd_st, seq);
+	grd_toc(grd_st, UIT_UPDATE, tic);
+	grd_st->lloss += grd_lossval(mdl, seq, (*ckpt)[B], scale);
+	xvm_free(scale);
+	xvm_free(carry);
+	xvm_free((double *)ckpt);
+}
+
 /******************************************************************************
  * Dataset gradient computation
  *
@@ -840,6 +1081,12 @@ grd_st_t *grd_stnew(mdl_t *mdl, double *g) {
 	grd_st->unorm  = NULL;
 	grd_st->bnorm  = NULL;
 	grd_st->scale  = NULL;
+	grd_st->bcst   = NULL;
+	grd_st->cst    = NULL;
+	grd_st->ncst   = 0;
+	grd_st->btmp   = NULL;
+	grd_st->blk    = NULL;
+	uit_prfclear(&grd_st->prf);
 	return grd_st;
 }
 
@@ -848,24 +1095,36 @@ grd_st_t *grd_stnew(mdl_t *mdl, double *g) {
  */
 void grd_stfree(grd_st_t *grd_st) {
 	grd_stcheck(grd_st, 0);
+	xvm_free(grd_st->btmp);
 	xfree(grd_st);
 }
 
 /* grd_dospl:
  *   Compute the gradient of a single sample choosing between the maxent
- *   optimised codepath and classical one depending of the sample.
+ *   optimised codepath and classical one depending of the sample. For CRF,
+ *   sequences longer than the <ckptlen> option use the checkpointed codepath
+ *   so the state never grow above this length.
  */
 void grd_dospl(grd_st_t *grd_st, const seq_t *seq) {
-	grd_stcheck(grd_st, seq->len);
+	const uint32_t L = grd_st->mdl->opt->ckptlen;
 	rdr_t *rdr = grd_st->mdl->reader;
-	if (seq->len == 1 || (rdr->npats != 0 && rdr->nbi == 0))
+	grd_st->prf.nseq++;
+	grd_st->prf.ntok += seq->len;
+	if (seq->len == 1 || (rdr->npats != 0 && rdr->nbi == 0)) {
+		grd_stcheck(grd_st, seq->len);
 		grd_domaxent(grd_st, seq);
-	else if (grd_st->mdl->type == 0)
+	} else if (grd_st->mdl->type == 0) {
+		grd_stcheck(grd_st, seq->len);
 		grd_domaxent(grd_st, seq);
-	else if (grd_st->mdl->type == 1)
+	} else if (grd_st->mdl->type == 1) {
+		grd_stcheck(grd_st, seq->len);
 		grd_domemm(grd_st, seq);
-	else
+	} else if (L != 0 && seq->len > L) {
+		grd_docrfck(grd_st, seq);
+	} else {
+		grd_stcheck(grd_st, seq->len);
 		grd_docrf(grd_st, seq);
+	}
 }
 
 /* grd_new:
@@ -877,6 +1136,19 @@ grd_t *grd_new(mdl_t *mdl, double *g) {
 	grd_t *grd = xmalloc(sizeof(grd_t));
 	grd->mdl = mdl;
 	grd->grd_st = xmalloc(sizeof(grd_st_t *) * W);
+	grd->nblk = 0;
+	if (mdl->opt->reduce && W > 1) {
+		const uint64_t B = (mdl->nftr + GRD_BLKSZ - 1) >> GRD_BLKBITS;
+		grd->nblk = B;
+		for (uint32_t w = 0; w < W; w++) {
+			grd_st_t *grd_st = grd_stnew(mdl, g);
+			grd_st->blk = xmalloc(sizeof(double *) * B);
+			for (uint64_t b = 0; b < B; b++)
+				grd_st->blk[b] = NULL;
+			grd->grd_st[w] = grd_st;
+		}
+		return grd;
+	}
 #ifdef ATM_ANSI
 	grd->grd_st[0] = grd_stnew(mdl, g);
 	for (uint32_t w = 1; w < W; w++)
@@ -893,9 +1165,21 @@ grd_t *grd_new(mdl_t *mdl, double *g) {
  */
 void grd_free(grd_t *grd) {
 	const uint32_t W = grd->mdl->opt->nthread;
+	if (grd->nblk != 0) {
+		for (uint32_t w = 0; w < W; w++) {
+			grd_st_t *grd_st = grd->grd_st[w];
+			for (uint64_t b = 0; b < grd->nblk; b++)
+				if (grd_st->blk[b] != NULL)
+					xvm_free(grd_st->blk[b]);
+			xfree(grd_st->blk);
+			grd_st->blk = NULL;
+		}
+	}
 #ifdef ATM_ANSI
-	for (uint32_t w = 1; w < W; w++)
-		xvm_free(grd->grd_st[w]->g);
+	else {
+		for (uint32_t w = 1; w < W; w++)
+			xvm_free(grd->grd_st[w]->g);
+	}
 #endif
 	for (uint32_t w = 0; w < W; w++)
 		grd_stfree(grd->grd_st[w]);
@@ -918,8 +1202,9 @@ void grd_worker(job_t *job, uint32_t id, uint32_t cnt, grd_st_t *grd_st) {
 	grd_st->lloss = 0.0;
 #ifdef ATM_ANSI
 	const uint64_t F = mdl->nftr;
-	for (uint64_t f = 0; f < F; f++)
-		grd_st->g[f] = 0.0;
+	if (grd_st->blk == NULL)
+		for (uint64_t f = 0; f < F; f++)
+			grd_st->g[f] = 0.0;
 #endif
 	// Now all is ready, we can process our sequences and accumulate the
 	// gradient and inverse log-likelihood
@@ -930,6 +1215,77 @@ void grd_worker(job_t *job, uint32_t id, uint32_t cnt, grd_st_t *grd_st) {
 		if (uit_stop)
 			break;
 	}
+	if (mdl->opt->profile)
+		uit_prfadd(&grd_st->prf);
+}
+
+/* grd_reduce:
+ *   Sum the private gradient blocks of all the workers in the final gradient
+ *   vector. Each job is a range of blocks, so the reduction is done in
+ *   parallel without any synchronization, and the blocks are cleared for the
+ *   next computation while they are still in cache. Blocks are summed in the
+ *   order of the workers so the result don't depend on the scheduling of the
+ *   reduction.
+ */
+static
+void grd_reduce(job_t *job, uint32_t id, uint32_t cnt, grd_t *grd) {
+	unused(id && cnt);
+	const mdl_t   *mdl = grd->mdl;
+	const uint64_t F   = mdl->nftr;
+	const uint32_t W   = mdl->opt->nthread;
+	double *g = grd->grd_st[0]->g;
+	uint32_t count, pos;
+	while (mth_getjob(job, &count, &pos)) {
+		for (uint64_t b = pos; b < (uint64_t)pos + count; b++) {
+			double  *dst = g + (b << GRD_BLKBITS);
+			const uint64_t n = min(GRD_BLKSZ, F - (b << GRD_BLKBITS));
+			bool first = true;
+			for (uint32_t w = 0; w < W; w++) {
+				double *src = grd->grd_st[w]->blk[b];
+				if (src == NULL)
+					continue;
+				if (first) {
+					for (uint64_t i = 0; i < n; i++)
+						dst[i] = src[i];
+					first = false;
+				} else {
+					for (uint64_t i = 0; i < n; i++)
+						dst[i] += src[i];
+				}
+				for (uint64_t i = 0; i < n; i++)
+					src[i] = 0.0;
+			}
+			if (first)
+				for (uint64_t i = 0; i < n; i++)
+					dst[i] = 0.0;
+		}
+	}
+}
+
+/* grd_penalty:
+ *   Finish the gradient over the given range of features. If needed we first
+ *   clip the gradient: setting to 0.0 all coordinates where the function is
+ *   0.0. Next we apply the elastic-net penalty, depending of the values of
+ *   rho1 and rho2, this can in fact be a classical L1 or L2 penalty. The l1
+ *   and squared l2 norms of the range are returned in <nrm>.
+ */
+static void grd_penalty(grd_t *grd, uint64_t off, uint64_t n, double nrm[2]) {
+	const mdl_t  *mdl = grd->mdl;
+	const double *x   = mdl->theta;
+	double *g = grd->grd_st[0]->g;
+	const double rho2 = mdl->opt->rho2;
+	const bool   clip = mdl->opt->lbfgs.clip;
+	double nl1 = 0.0, nl2 = 0.0;
+	for (uint64_t f = off; f < off + n; f++) {
+		const double v = x[f];
+		if (clip && v == 0.0)
+			g[f] = 0.0;
+		g[f] += rho2 * v;
+		nl1  += fabs(v);
+		nl2  += v * v;
+	}
+	nrm[0] = nl1;
+	nrm[1] = nl2;
 }
 
 /* grd_gradient:
@@ -937,16 +1293,23 @@ void grd_worker(job_t *job, uint32_t id, uint32_t cnt, grd_st_t *grd_st) {
  *   at current point. The computation is done in parallel taking profit of
  *   the fact that the gradient over the full training set is just the sum of
  *   the gradient of each sequence.
+ *
+ *   For distributed training, each node compute the gradient over its own
+ *   part of the training set and the results are summed over all the nodes
+ *   before the penalty is applied, so every node get exactly the same values
+ *   and take the same optimization steps.
  */
 double grd_gradient(grd_t *grd) {
 	mdl_t *mdl = grd->mdl;
-	const double  *x = mdl->theta;
 	const uint64_t F = mdl->nftr;
 	const uint32_t W = mdl->opt->nthread;
 	double *g = grd->grd_st[0]->g;
+	const bool prof = mdl->opt->profile;
+	const uint64_t tic = prof ? uit_clock() : 0;
 #ifndef ATM_ANSI
-	for (uint64_t f = 0; f < F; f++)
-		g[f] = 0.0;
+	if (grd->nblk == 0)
+		for (uint64_t f = 0; f < F; f++)
+			g[f] = 0.0;
 #endif
 	// All is ready to compute the gradient, we spawn the threads of
 	// workers, each one working on a part of the data. As the gradient and
@@ -954,36 +1317,53 @@ double grd_gradient(grd_t *grd) {
 	// trivial.
 	mth_spawn((func_t *)grd_worker, W, (void **)grd->grd_st,
 		mdl->train->nseq, mdl->opt->jobsize);
-	if (uit_stop)
+	if (uit_stop && mdl->dist == NULL)
 		return -1.0;
 	// All computations are done, it just remain to add all the gradients
 	// and negative log-likelihood from all the workers.
+	const uint64_t mid = prof ? uit_clock() : 0;
 	double fx = grd->grd_st[0]->lloss;
 	for (uint32_t w = 1; w < W; w++)
 		fx += grd->grd_st[w]->lloss;
+	if (grd->nblk != 0) {
+		void *ud[W];
+		for (uint32_t w = 0; w < W; w++)
+			ud[w] = grd;
+		mth_spawn((func_t *)grd_reduce, W, ud, grd->nblk, 16);
+	}
 #ifdef ATM_ANSI
-	for (uint32_t w = 1; w < W; w++)
-		for (uint64_t f = 0; f < F; f++)
-			g[f] += grd->grd_st[w]->g[f];
+	else {
+		for (uint32_t w = 1; w < W; w++)
+			for (uint64_t f = 0; f < F; f++)
+				g[f] += grd->grd_st[w]->g[f];
+	}
 #endif
-	// If needed we clip the gradient: setting to 0.0 all coordinates where
-	// the function is 0.0.
-	if (mdl->opt->lbfgs.clip == true)
-		for (uint64_t f = 0; f < F; f++)
-			if (x[f] == 0.0)
-				g[f] = 0.0;
-	// Now we can apply the elastic-net penalty. Depending of the values of
-	// rho1 and rho2, this can in fact be a classical L1 or L2 penalty.
-	const double rho1 = mdl->opt->rho1;
-	const double rho2 = mdl->opt->rho2;
-	double nl1 = 0.0, nl2 = 0.0;
-	for (uint64_t f = 0; f < F; f++) {
-		const double v = x[f];
-		g[f] += rho2 * v;
-		nl1  += fabs(v);
-		nl2  += v * v;
+	// Sum the values and gradients of all the nodes. An interruption of
+	// any node is also forwarded to the others so they all stop at the
+	// same point.
+	if (mdl->dist != NULL) {
+		double val[2] = {fx, uit_intr ? 1.0 : 0.0};
+		dst_allreduce(mdl->dist, val, 2);
+		if (val[1] != 0.0) {
+			uit_stop = true;
+			return -1.0;
+		}
+		dst_allreduce(mdl->dist, g, F);
+		fx = val[0];
+	}
+	// If needed we clip the gradient and apply the elastic-net penalty,
+	// this is done in chunks so it can be run in parallel.
+	double nrm[2];
+	xvm_parfor((xvm_fn_t *)grd_penalty, grd, F, nrm, 2);
+	fx += nrm[0] * mdl->opt->rho1 + nrm[1] * mdl->opt->rho2 / 2.0;
+	if (prof) {
+		uit_prf_t prf;
+		uit_prfclear(&prf);
+		const uint64_t toc = uit_clock();
+		prf.tm[UIT_GRADIENT] = toc - tic;
+		prf.tm[UIT_REDUCE]   = toc - mid;
+		uit_prfadd(&prf);
 	}
-	fx += nl1 * rho1 + nl2 * rho2 / 2.0;
 	return fx;
 }
 
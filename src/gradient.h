@@ -30,8 +30,17 @@
 
 #include "wapiti.h"
 #include "model.h"
+#include "progress.h"
 #include "sequence.h"
 
+/* GRD_BLKBITS:
+ *   Private gradient buffers used by the blocked reduction are split in blocks
+ *   of 2^GRD_BLKBITS features, so only the blocks touched by a worker have to
+ *   be allocated and summed.
+ */
+#define GRD_BLKBITS 10
+#define GRD_BLKSZ   ((uint32_t)1 << GRD_BLKBITS)
+
 /* grd_st_t:
  *   State tracker for the gradient computation. To compute the gradient we need
  *   to perform several steps and communicate between them a lot of intermediate
@@ -61,12 +70,42 @@ struct grd_st_s {
 	double   *bnorm;   // [T]       normalization factors for bigrams
 	uint32_t  first;   //           first position where gradient is needed
 	uint32_t  last;    //           last position where gradient is needed
+	const double   *bcst;  // [Y][Y] summed weights of constant bigrams
+	const uint64_t *cst;   // [C]    constant bigram observations
+	uint32_t        ncst;  //  C     or NULL and 0 if not available
+	double   *btmp;    // [Y][Y]    temporary for bigrams sums
+	double  **blk;     // [F/B][B]  private gradient blocks or NULL
+	uit_prf_t prf;     //           profile counters of this state
 };
 
+/* grd_tic:
+ *   Start timing a phase of the gradient computation if the training is
+ *   profiled, see grd_toc.
+ */
+static inline uint64_t grd_tic(const grd_st_t *grd_st) {
+	return grd_st->mdl->opt->profile ? uit_clock() : 0;
+}
+
+/* grd_toc:
+ *   Account the time since <tic> to the phase <ph> in the profile counters of
+ *   the state and return the current time so the next phase can be chained.
+ */
+static inline uint64_t grd_toc(grd_st_t *grd_st, int ph, uint64_t tic) {
+	if (!grd_st->mdl->opt->profile)
+		return 0;
+	const uint64_t toc = uit_clock();
+	grd_st->prf.tm[ph] += toc - tic;
+	return toc;
+}
+
 grd_st_t *grd_stnew(mdl_t *mdl, double *g);
 void grd_stfree(grd_st_t *grd_st);
 void grd_stcheck(grd_st_t *grd_st, uint32_t len);
 
+void grd_addbi(const mdl_t *mdl, double *psi, double *tmp, const seq_t *seq,
+               uint32_t t, const double *bcst, const uint64_t *cst,
+               uint32_t ncst);
+
 void grd_fldopsi(grd_st_t *grd_st, const seq_t *seq);
 void grd_flfwdbwd(grd_st_t *grd_st, const seq_t *seq);
 void grd_flupgrad(grd_st_t *grd_st, const seq_t *seq);
@@ -89,6 +128,7 @@ typedef struct grd_s grd_t;
 struct grd_s {
 	mdl_t     *mdl;
 	grd_st_t **grd_st;
+	uint64_t   nblk;   // number of private blocks or 0 if not used
 };
 
 grd_t *grd_new(mdl_t *mdl, double *g);
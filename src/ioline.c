@@ -22,22 +22,57 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+// Needed for fileno and posix_madvise in strict C99 mode
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if !defined(WIN32) && !defined(_WIN32)
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 #include "ioline.h"
 #include "tools.h"
 
+/* iol_buf_t:
+ *   State of the line reader over a FILE. When the input is a regular file
+ *   ending with a new line, it is mapped in memory and lines can be returned
+ *   as views directly in the mapping. Else, it is read by large blocks in
+ *   <base> and lines are searched in the block, so a line cost a single
+ *   allocation for its copy.
+ */
+#define IOL_BLKSZ ((size_t)1 << 20)
+
+typedef struct iol_buf_s iol_buf_t;
+struct iol_buf_s {
+	FILE   *file;   //  Input file
+	char   *base;   //  Mapping or block buffer
+	size_t  size;   //  Size of <base>
+	size_t  pos;    //  Start of the next line
+	size_t  end;    //  End of the valid data
+	bool    map;    //  Is <base> a mapping
+	bool    eof;    //  Is the file exhausted
+};
+
+static iol_buf_t *iol_bufnew(FILE *file);
+static void iol_buffree(iol_buf_t *buf);
 static char *iol_gets(void *in);
+static const char *iol_getv(void *in);
 static int   iol_print(void *out, char *msg, ...);
 static int   iol_sprint(void *out, char *msg, ...);
 static char *iol_gets_cb_interop(void *in);
 
 iol_t *iol_new(FILE *in, FILE *out) {
     iol_t *iol = xmalloc(sizeof(iol_t));
+    iol_buf_t *buf = in != NULL ? iol_bufnew(in) : NULL;
     iol->gets_cb  = iol_gets,
-    iol->in       = in;
+    iol->getv_cb  = buf != NULL && buf->map ? iol_getv : NULL;
+    iol->in       = buf;
     iol->print_cb = iol_print;
     iol->write_cb = NULL;
     iol->out      = out;
@@ -51,6 +86,7 @@ iol_t *iol_new2(gets_cb_t gets_cb, void *in, print_cb_t print_cb, void *out) {
     iol->print_cb = print_cb;
     iol->write_cb = NULL;
     iol->out      = out;
+    iol->getv_cb  = NULL;
     return iol;
 }
 
@@ -62,6 +98,7 @@ iol_t *iol_new_interop(gets_cb_t gets_cb, write_cb_t write_cb) {
 	iol_interop->in = (void *)iol;
 
 	iol->gets_cb = iol_gets_cb_interop;
+	iol->getv_cb = NULL;
 	iol->in = (void *)iol_interop;
     iol->print_cb = iol_sprint;
     iol->write_cb = write_cb;
@@ -69,8 +106,24 @@ iol_t *iol_new_interop(gets_cb_t gets_cb, write_cb_t write_cb) {
     return iol;
 }
 
+/* iol_free:
+ *   Release the object and its input buffer, the files are left open.
+ */
 void iol_free(iol_t *iol) {
-    xfree(iol);
+	if (iol->gets_cb == iol_gets && iol->in != NULL)
+		iol_buffree(iol->in);
+	xfree(iol);
+}
+
+/* iol_close:
+ *   Close the input and output files of an object created by iol_new, the
+ *   object itself remain to be freed.
+ */
+void iol_close(iol_t *iol) {
+	if (iol->in != NULL)
+		fclose(((iol_buf_t *)iol->in)->file);
+	if (iol->out != NULL)
+		fclose(iol->out);
 }
 
 void iol_free_interop(iol_t *iol) {
@@ -102,47 +155,114 @@ static char *write_cb_interop(void *s) {
 	return NULL;
 }
 
+/* iol_bufnew:
+ *   Prepare the reader for the given file, mapping it if possible.
+ */
+static iol_buf_t *iol_bufnew(FILE *file) {
+	iol_buf_t *buf = xmalloc(sizeof(iol_buf_t));
+	buf->file = file;
+	buf->pos  = buf->end = 0;
+	buf->eof  = false;
+	buf->map  = false;
+#if !defined(WIN32) && !defined(_WIN32)
+	// The file is mapped from its current offset which must be aligned on
+	// a page. Requiring a final new line ensure all views are terminated
+	// inside the mapping.
+	struct stat st;
+	const int  fd  = fileno(file);
+	const long off = ftell(file);
+	const long pg  = sysconf(_SC_PAGESIZE);
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && off >= 0 && pg > 0
+	 && off % pg == 0 && st.st_size > off) {
+		const size_t size = st.st_size - off;
+		char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, off);
+		if (base != MAP_FAILED && base[size - 1] == '\n') {
+			posix_madvise(base, size, POSIX_MADV_SEQUENTIAL);
+			buf->base = base, buf->size = buf->end = size;
+			buf->map  = buf->eof = true;
+			return buf;
+		}
+		if (base != MAP_FAILED)
+			munmap(base, size);
+	}
+#endif
+	buf->size = IOL_BLKSZ;
+	buf->base = xmalloc(buf->size);
+	return buf;
+}
+
+/* iol_buffree:
+ *   Release the buffer or the mapping of the reader, but not the file.
+ */
+static void iol_buffree(iol_buf_t *buf) {
+#if !defined(WIN32) && !defined(_WIN32)
+	if (buf->map)
+		munmap(buf->base, buf->size);
+	else
+#endif
+		xfree(buf->base);
+	xfree(buf);
+}
+
+/* iol_bufline:
+ *   Find the next line in the buffer, reading more data from the file if
+ *   needed, and return its start and length without the end of line. The
+ *   position is moved after it. Return NULL if the input is exhausted.
+ */
+static const char *iol_bufline(iol_buf_t *buf, size_t *len) {
+	while (true) {
+		const size_t  rem = buf->end - buf->pos;
+		const char   *str = buf->base + buf->pos;
+		const char   *eol = memchr(str, '\n', rem);
+		if (eol != NULL || (buf->eof && rem != 0)) {
+			*len = eol != NULL ? (size_t)(eol - str) : rem;
+			buf->pos += *len + (eol != NULL);
+			return str;
+		}
+		if (buf->eof)
+			return NULL;
+		// No full line remain in the buffer so move the partial one at
+		// its start, growing it if it is full, and read the next block.
+		memmove(buf->base, str, rem);
+		buf->pos = 0, buf->end = rem;
+		if (rem == buf->size) {
+			buf->size *= 2;
+			buf->base = xrealloc(buf->base, buf->size);
+		}
+		const size_t cnt = fread(buf->base + rem, 1, buf->size - rem,
+		                         buf->file);
+		buf->end += cnt;
+		if (cnt == 0) {
+			if (ferror(buf->file))
+				pfatal("cannot read from file");
+			buf->eof = true;
+		}
+	}
+}
+
 /* iol_gets:
  *   Read an input line from <in>. The line can be of any size limited only by
  *   available memory, a buffer large enough is allocated and returned. The
  *   caller is responsible to free it. If the input is exhausted, NULL is returned.
  */
 static char *iol_gets(void *in) {
-	FILE *file = (FILE*)in;
-	// Initialize the buffer
-	uint32_t len = 0, size = 16;
-	char *buffer = xmalloc(size);
-	// We read the line chunk by chunk until end of line, file or error
-	for(;;) {
-		if (fgets(buffer + len, size - len, file) == NULL) {
-			// On NULL return there is two possible cases, either an
-			// error or the end of file
-			if (ferror(file))
-				pfatal("cannot read from file");
-			// On end of file, we must check if we have already read
-			// some data or not
-			if (len == 0) {
-				xfree(buffer);
-				return NULL;
-			}
-			break;
-		}
-		// Check for end of line, if this is not the case enlarge the
-		// buffer and go read more data
-		len += strlen(buffer + len);
-		if (len == size - 1 && buffer[len - 1] != '\n') {
-			size = size * 1.4;
-			buffer = xrealloc(buffer, size);
-			continue;
-		}
-		break;
-	}
-	// At this point empty line should have already catched so we just
-	// remove the end of line if present and resize the buffer to fit the
-	// data
-	if (buffer[len - 1] == '\n')
-		buffer[--len] = '\0';
-	return xrealloc(buffer, len + 1);
+	size_t len;
+	const char *str = iol_bufline(in, &len);
+	if (str == NULL)
+		return NULL;
+	char *line = xmalloc(len + 1);
+	memcpy(line, str, len);
+	line[len] = '\0';
+	return line;
+}
+
+/* iol_getv:
+ *   Return a view of the next input line inside the mapping of <in>, the line
+ *   is terminated by its end of line and must not be freed.
+ */
+static const char *iol_getv(void *in) {
+	size_t len;
+	return iol_bufline(in, &len);
 }
 
 /* iol_print:
@@ -28,11 +28,17 @@
 #include <stdio.h>
 
 typedef char *(*gets_cb_t)(void *);
+typedef const char *(*getv_cb_t)(void *);
 typedef int   (*print_cb_t)(void *, char *, ...);
 typedef void  (*write_cb_t)(char *, int);
 
 /* iol_t:
  *   Represents a class to do IO in a line by line basis.
+ *
+ *   The lines returned by <gets_cb> are owned by the caller. If <getv_cb> is
+ *   not NULL, it give instead a view of the next line directly in the input
+ *   buffer, terminated by a '\n', who stay valid until the object is freed.
+ *   Both can be mixed, they share the same position.
  */
 typedef struct iol_s iol_t;
 struct iol_s {
@@ -42,6 +48,8 @@ struct iol_s {
 
     void *in;          // state passed to the gets callback
     void *out;         // state passed to the puts callback
+
+    getv_cb_t getv_cb; // callback to get a line view from in or NULL
 };    
 
 typedef struct iol_interop_s iol_interop_t;
@@ -54,5 +62,6 @@ iol_t *iol_new(FILE *in, FILE *out);
 iol_t *iol_new2(gets_cb_t gets_cb, void *in, print_cb_t print_cb, void *out);
 iol_t *iol_new_interop(gets_cb_t gets_cb, write_cb_t write_cb);
 void iol_free(iol_t *iol);
+void iol_close(iol_t *iol);
 
 #endif
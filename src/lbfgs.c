@@ -42,6 +42,165 @@
 #include "thread.h"
 #include "vmath.h"
 
+/******************************************************************************
+ * History storage
+ *
+ *   The s_k and y_k history vectors are the biggest part of the optimizer
+ *   memory, so they can be stored with a reduced precision: either as single
+ *   precision floats or as bfloat16 who keep only the upper half of a float,
+ *   that is 8 bits of precision. All computations are still done in double
+ *   precision, the values are only rounded when stored, and dot products are
+ *   accumulated in double. With the default double precision, the usual
+ *   vector operations are used directly.
+ ******************************************************************************/
+enum {HST_DBL, HST_FLT, HST_B16};
+
+#define HST_BLOCK 256
+
+static inline uint16_t hst_tob16(double v) {
+	union {float f; uint32_t u;} c = {.f = (float)v};
+	c.u += 0x7FFF + ((c.u >> 16) & 1);
+	return c.u >> 16;
+}
+
+static inline double hst_fromb16(uint16_t v) {
+	union {float f; uint32_t u;} c = {.u = (uint32_t)v << 16};
+	return c.f;
+}
+
+static void *hst_new(int fmt, uint64_t F) {
+	switch (fmt) {
+		case HST_FLT: return xmalloc(sizeof(float) * F);
+		case HST_B16: return xmalloc(sizeof(uint16_t) * F);
+	}
+	return xvm_new(F);
+}
+
+static void hst_free(int fmt, void *v) {
+	if (fmt == HST_DBL)
+		xvm_free(v);
+	else
+		xfree(v);
+}
+
+static inline double hst_get(int fmt, const void *v, uint64_t f) {
+	switch (fmt) {
+		case HST_FLT: return ((const float *)v)[f];
+		case HST_B16: return hst_fromb16(((const uint16_t *)v)[f]);
+	}
+	return ((const double *)v)[f];
+}
+
+static inline void hst_set(int fmt, void *v, uint64_t f, double x) {
+	switch (fmt) {
+		case HST_FLT: ((float    *)v)[f] = x;            break;
+		case HST_B16: ((uint16_t *)v)[f] = hst_tob16(x); break;
+		default:      ((double   *)v)[f] = x;            break;
+	}
+}
+
+/* hst_load:
+ *   Get the <n> values starting at <off> of a vector as doubles. For double
+ *   vectors this is just a pointer in it, else values are converted in <tmp>.
+ */
+static const double *hst_load(int fmt, const void *v, uint64_t off,
+		uint32_t n, double tmp[]) {
+	if (fmt == HST_DBL)
+		return (const double *)v + off;
+	if (fmt == HST_FLT) {
+		const float *src = (const float *)v + off;
+		for (uint32_t i = 0; i < n; i++)
+			tmp[i] = src[i];
+	} else {
+		const uint16_t *src = (const uint16_t *)v + off;
+		for (uint32_t i = 0; i < n; i++)
+			tmp[i] = hst_fromb16(src[i]);
+	}
+	return tmp;
+}
+
+typedef struct hst_op_s hst_op_t;
+struct hst_op_s {
+	int           fx, fy;
+	const void   *x, *y;
+	double       *r;
+	void         *h;
+	double        a;
+};
+
+static void hst_dotsub(hst_op_t *op, uint64_t off, uint64_t n, double res[]) {
+	double tx[HST_BLOCK], ty[HST_BLOCK], sum = 0.0;
+	for (uint64_t b = off; b < off + n; b += HST_BLOCK) {
+		const uint32_t cnt = min(HST_BLOCK, off + n - b);
+		const double *x = hst_load(op->fx, op->x, b, cnt, tx);
+		const double *y = hst_load(op->fy, op->y, b, cnt, ty);
+		for (uint32_t i = 0; i < cnt; i++)
+			sum += x[i] * y[i];
+	}
+	res[0] = sum;
+}
+
+static void hst_axpysub(hst_op_t *op, uint64_t off, uint64_t n, double res[]) {
+	unused(res);
+	double tx[HST_BLOCK];
+	for (uint64_t b = off; b < off + n; b += HST_BLOCK) {
+		const uint32_t cnt = min(HST_BLOCK, off + n - b);
+		const double *x = hst_load(op->fx, op->x, b, cnt, tx);
+		double *r = op->r + b;
+		for (uint32_t i = 0; i < cnt; i++)
+			r[i] += op->a * x[i];
+	}
+}
+
+static void hst_diffsub(hst_op_t *op, uint64_t off, uint64_t n, double res[]) {
+	unused(res);
+	const double *x = op->x, *y = op->y;
+	for (uint64_t f = off; f < off + n; f++)
+		hst_set(op->fx, op->h, f, x[f] - y[f]);
+}
+
+/* hst_dot:
+ *   Return the dot product of vector <x> stored in format <fx> and vector <y>
+ *   stored in format <fy>.
+ */
+static double hst_dot(int fx, const void *x, int fy, const void *y,
+		uint64_t F) {
+	if (fx == HST_DBL && fy == HST_DBL)
+		return xvm_dot(x, y, F);
+	hst_op_t op = {.fx = fx, .fy = fy, .x = x, .y = y};
+	double res;
+	xvm_parfor((xvm_fn_t *)hst_dotsub, &op, F, &res, 1);
+	return res;
+}
+
+/* hst_axpy:
+ *   Add to <r> the history vector <x> scaled by <a>:
+ *       r = a * x + r
+ */
+static void hst_axpy(int fmt, double r[], double a, const void *x,
+		uint64_t F) {
+	if (fmt == HST_DBL) {
+		xvm_axpy(r, a, x, r, F);
+		return;
+	}
+	hst_op_t op = {.fx = fmt, .x = x, .r = r, .a = a};
+	xvm_parfor((xvm_fn_t *)hst_axpysub, &op, F, NULL, 0);
+}
+
+/* hst_sub:
+ *   Store in the history vector <h> the difference of the two given vectors:
+ *       h = x .- y
+ */
+static void hst_sub(int fmt, void *h, const double x[], const double y[],
+		uint64_t F) {
+	if (fmt == HST_DBL) {
+		xvm_sub(h, x, y, F);
+		return;
+	}
+	hst_op_t op = {.fx = fmt, .x = x, .y = y, .h = h};
+	xvm_parfor((xvm_fn_t *)hst_diffsub, &op, F, NULL, 0);
+}
+
 /******************************************************************************
  * Quasi-Newton optimizer
  *
@@ -60,6 +219,113 @@
  *       Machine Learning (ICML), Corvallis, OR, 2007.
  ******************************************************************************/
 
+/* trn_lbfgsvec_t:
+ *   The vectors used by the OWL-QN specific passes below. These are written as
+ *   functions over a range of features so they can be split in chunks and run
+ *   in parallel by xvm_parfor.
+ */
+typedef struct trn_lbfgsvec_s trn_lbfgsvec_t;
+struct trn_lbfgsvec_s {
+	double *x, *xp;
+	double *g, *pg;
+	double *d;
+	double  rho1;
+};
+
+/* trn_lbfgspg:
+ *   Compute the pseudo-gradient over the given range of features.
+ */
+static void trn_lbfgspg(trn_lbfgsvec_t *v, uint64_t off, uint64_t n,
+		double res[]) {
+	unused(res);
+	const double *x = v->x, *g = v->g;
+	const double rho1 = v->rho1;
+	double *pg = v->pg;
+	for (uint64_t f = off; f < off + n; f++) {
+		if (x[f] < 0.0)
+			pg[f] = g[f] - rho1;
+		else if (x[f] > 0.0)
+			pg[f] = g[f] + rho1;
+		else if (g[f] < -rho1)
+			pg[f] = g[f] + rho1;
+		else if (g[f] > rho1)
+			pg[f] = g[f] - rho1;
+		else
+			pg[f] = 0.0;
+	}
+}
+
+/* trn_lbfgsdir:
+ *   Constrain the search direction to the orthant of the pseudo-gradient over
+ *   the given range of features.
+ */
+static void trn_lbfgsdir(trn_lbfgsvec_t *v, uint64_t off, uint64_t n,
+		double res[]) {
+	unused(res);
+	for (uint64_t f = off; f < off + n; f++)
+		if (v->d[f] * v->pg[f] >= 0.0)
+			v->d[f] = 0.0;
+}
+
+/* trn_lbfgsprj:
+ *   Project back the point in the current orthant over the given range of
+ *   features.
+ */
+static void trn_lbfgsprj(trn_lbfgsvec_t *v, uint64_t off, uint64_t n,
+		double res[]) {
+	unused(res);
+	for (uint64_t f = off; f < off + n; f++) {
+		double or = v->xp[f];
+		if (or == 0.0)
+			or = -v->pg[f];
+		if (v->x[f] * or <= 0.0)
+			v->x[f] = 0.0;
+	}
+}
+
+/* trn_lbfgsvp:
+ *   Compute the dot product of the step with the search direction over the
+ *   given range of features.
+ */
+static void trn_lbfgsvp(trn_lbfgsvec_t *v, uint64_t off, uint64_t n,
+		double res[]) {
+	double vp = 0.0;
+	for (uint64_t f = off; f < off + n; f++)
+		vp += (v->x[f] - v->xp[f]) * v->d[f];
+	res[0] = vp;
+}
+
+/* trn_lbfgsst_t:
+ *   The optimizer state saved to restart the training: the previous point and
+ *   gradient, and the <M> history vectors stored in format <hf>.
+ */
+typedef struct trn_lbfgsst_s trn_lbfgsst_t;
+struct trn_lbfgsst_s {
+	uint32_t   M;
+	int        hf;
+	double    *xp, *gp;
+	void     **s, **y;
+};
+
+/* trn_lbfgssave:
+ *   Write the optimizer state in the format read back with --rstate. This is
+ *   used both for --sstate and for the checkpoints.
+ */
+static void trn_lbfgssave(mdl_t *mdl, FILE *file, void *ud) {
+	const trn_lbfgsst_t *st = ud;
+	const uint64_t F = mdl->nftr;
+	const uint32_t M = st->M;
+	fprintf(file, "#state#0#%"PRIu32"#%"PRIu64"\n", M, F);
+	for (uint64_t f = 0; f < F; f++) {
+		fprintf(file, "%"PRIu64, f);
+		fprintf(file, " %la %la", st->xp[f], st->gp[f]);
+		for (uint32_t m = 0; m < M; m++)
+			fprintf(file, " %la %la", hst_get(st->hf, st->s[m], f),
+				hst_get(st->hf, st->y[m], f));
+		fprintf(file, "\n");
+	}
+}
+
 void trn_lbfgs(mdl_t *mdl) {
 	const uint64_t F  = mdl->nftr;
 	const uint32_t K  = mdl->opt->maxiter;
@@ -70,10 +336,18 @@ void trn_lbfgs(mdl_t *mdl) {
 	double *g, *gp; // Current and previous value of the gradient
 	double *pg;     // The pseudo-gradient (only for owl-qn)
 	double *d;      // The search direction
-	double *s[M];   // History value s_k = Δ(x,px)
-	double *y[M];   // History value y_k = Δ(g,pg)
+	void   *s[M];   // History value s_k = Δ(x,px)
+	void   *y[M];   // History value y_k = Δ(g,pg)
 	double  p[M];   // ρ_k
 	double  fh[C];  // f(x) history
+	// Select the storage format of the history vectors
+	int hf = HST_DBL;
+	if (!strcmp(mdl->opt->histfmt, "float"))
+		hf = HST_FLT;
+	else if (!strcmp(mdl->opt->histfmt, "bf16"))
+		hf = HST_B16;
+	else if (strcmp(mdl->opt->histfmt, "double"))
+		fatal("unknown history format '%s'", mdl->opt->histfmt);
 	// Initialization: Here, we have to allocate memory on the heap as we
 	// cannot request so much memory on the stack as this will have a too
 	// big impact on performance and will be refused by the system on non-
@@ -82,11 +356,13 @@ void trn_lbfgs(mdl_t *mdl) {
 	xp = xvm_new(F); g = xvm_new(F);
 	gp = xvm_new(F); d = xvm_new(F);
 	for (uint32_t m = 0; m < M; m++) {
-		s[m] = xvm_new(F);
-		y[m] = xvm_new(F);
+		s[m] = hst_new(hf, F);
+		y[m] = hst_new(hf, F);
 	}
 	pg = l1 ? xvm_new(F) : NULL;
 	grd_t *grd = grd_new(mdl, g);
+	trn_lbfgsvec_t vec = {x, xp, g, pg, d, mdl->opt->rho1};
+	trn_lbfgsst_t  sst = {M, hf, xp, gp, s, y};
 	// Restore a saved state if user specified one.
 	if (mdl->opt->rstate != NULL) {
 		const char *err = "invalid state file";
@@ -107,14 +383,17 @@ void trn_lbfgs(mdl_t *mdl) {
 			if (fscanf(file, "%la %la", &xp[f], &gp[f]) != 2)
 				fatal("2 %s", err);
 			for (uint32_t m = 0; m < M; m++) {
-				if (fscanf(file, "%la", &s[m][f]) != 1)
+				double vs, vy;
+				if (fscanf(file, "%la", &vs) != 1)
 					fatal("3 %s", err);
-				if (fscanf(file, "%la", &y[m][f]) != 1)
+				if (fscanf(file, "%la", &vy) != 1)
 					fatal("4 %s", err);
+				hst_set(hf, s[m], f, vs);
+				hst_set(hf, y[m], f, vy);
 			}
 		}
 		for (uint32_t m = 0; m < M; m++)
-			p[m] = 1.0 / xvm_dot(y[m], s[m], F);
+			p[m] = 1.0 / hst_dot(hf, y[m], hf, s[m], F);
 		fclose(file);
 	}
 	// Minimization: This is the heart of the function. (a big heart...) We
@@ -133,21 +412,8 @@ void trn_lbfgs(mdl_t *mdl) {
 		// with
 		//   ∂_i^± f(x) = ∂/∂x_i l(x) + | Cσ(x_i) if x_i ≠ 0
 		//                              | ±C      if x_i = 0
-		if (l1) {
-			const double rho1 = mdl->opt->rho1;
-			for (uint64_t f = 0; f < F; f++) {
-				if (x[f] < 0.0)
-					pg[f] = g[f] - rho1;
-				else if (x[f] > 0.0)
-					pg[f] = g[f] + rho1;
-				else if (g[f] < -rho1)
-					pg[f] = g[f] + rho1;
-				else if (g[f] > rho1)
-					pg[f] = g[f] - rho1;
-				else
-					pg[f] = 0.0;
-			}
-		}
+		if (l1)
+			xvm_parfor((xvm_fn_t *)trn_lbfgspg, &vec, F, NULL, 0);
 		// 1st step: We compute the search direction. We search in the
 		// direction who minimize the second order approximation given
 		// by the Taylor series which give
@@ -166,24 +432,23 @@ void trn_lbfgs(mdl_t *mdl) {
 			// q_i = q_{i+1} - α_i y_i
 			for (uint32_t i = bnd; i > 0; i--) {
 				const uint32_t j = (M + 1 + k - i) % M;
-				alpha[i - 1] = p[j] * xvm_dot(s[j], d, F);
-				xvm_axpy(d, -alpha[i - 1], y[j], d, F);
+				alpha[i - 1] = p[j] * hst_dot(hf, s[j], HST_DBL, d, F);
+				hst_axpy(hf, d, -alpha[i - 1], y[j], F);
 			}
 			// r_0 = H_0 q_0
 			//     Scaling is described in [2, pp 515]
 			//     for k = 0: H_0 = I
 			//     for k > 0: H_0 = I * y_k^T s_k / ||y_k||²
 			//                    = I * 1 / ρ_k ||y_k||²
-			const double y2 = xvm_dot(y[km], y[km], F);
+			const double y2 = hst_dot(hf, y[km], hf, y[km], F);
 			const double v = 1.0 / (p[km] * y2);
-			for (uint64_t f = 0; f < F; f++)
-				d[f] *= v;
+			xvm_scale(d, d, v, F);
 			// β_j     = ρ_j y_j^T r_i
 			// r_{i+1} = r_i + s_j (α_i - β_i)
 			for (uint32_t i = 0; i < bnd; i++) {
 				const uint32_t j = (M + k - i) % M;
-				beta = p[j] * xvm_dot(y[j], d, F);
-				xvm_axpy(d, alpha[i] - beta, s[j], d, F);
+				beta = p[j] * hst_dot(hf, y[j], HST_DBL, d, F);
+				hst_axpy(hf, d, alpha[i] - beta, s[j], F);
 			}
 		}
 		// For owl-qn, we must remain in the same orthant than the
@@ -192,9 +457,7 @@ void trn_lbfgs(mdl_t *mdl) {
 		//   d^k = π(d^k ; v^k)
 		//       = π(d^k ; -◇f(x^k))
 		if (l1)
-			for (uint64_t f = 0; f < F; f++)
-				if (d[f] * pg[f] >= 0.0)
-					d[f] = 0.0;
+			xvm_parfor((xvm_fn_t *)trn_lbfgsdir, &vec, F, NULL, 0);
 		// 2nd step: we perform a linesearch in the computed direction,
 		// we search a step value that satisfy the constrains using a
 		// backtracking algorithm. Much elaborated algorithm can perform
@@ -206,8 +469,8 @@ void trn_lbfgs(mdl_t *mdl) {
 		// We have to keep track of the current point and gradient as we
 		// will need to compute the delta between those and the found
 		// point, and perhaps need to restore them if linesearch fail.
-		memcpy(xp, x, sizeof(double) * F);
-		memcpy(gp, g, sizeof(double) * F);
+		xvm_copy(xp, x, F);
+		xvm_copy(gp, g, F);
 		double sc  = (k == 0) ? 0.1 : 0.5;
 		double stp = (k == 0) ? 1.0 / xvm_norm(d, F) : 1.0;
 		double gd  = l1 ? 0.0 : xvm_dot(g, d, F); // gd = g_k^T d_k
@@ -220,15 +483,9 @@ void trn_lbfgs(mdl_t *mdl) {
 			// For owl-qn, we have to project back the point in the
 			// current orthant [3, pp 35]
 			//   x^{k+1} = π(x^k + αp^k ; ξ)
-			if (l1) {
-				for (uint64_t f = 0; f < F; f++) {
-					double or = xp[f];
-					if (or == 0.0)
-						or = -pg[f];
-					if (x[f] * or <= 0.0)
-						x[f] = 0.0;
-				}
-			}
+			if (l1)
+				xvm_parfor((xvm_fn_t *)trn_lbfgsprj, &vec, F,
+					NULL, 0);
 			// And we ask for the value of the objective function
 			// and its gradient.
 			fx = grd_gradient(grd);
@@ -249,9 +506,9 @@ void trn_lbfgs(mdl_t *mdl) {
 				else
 					break;
 			} else {
-				double vp = 0.0;
-				for (uint64_t f = 0; f < F; f++)
-					vp += (x[f] - xp[f]) * d[f];
+				double vp;
+				xvm_parfor((xvm_fn_t *)trn_lbfgsvp, &vec, F,
+					&vp, 1);
 				if (fx < fi + vp * 1e-4)
 					break;
 			}
@@ -268,7 +525,7 @@ void trn_lbfgs(mdl_t *mdl) {
 		// probably not fully optimized but we let the user decide what
 		// to do with it.
 		if (err || uit_stop) {
-			memcpy(x, xp, sizeof(double) * F);
+			xvm_copy(x, xp, F);
 			break;
 		}
 		if (uit_progress(mdl, k + 1, fx) == false)
@@ -279,9 +536,10 @@ void trn_lbfgs(mdl_t *mdl) {
 		//   y_k = g_{k+1} - g_k
 		//   ρ_k = 1 / y_k^T s_k
 		const uint32_t kn = (k + 1) % M;
-		xvm_sub(s[kn], x, xp, F);
-		xvm_sub(y[kn], g, gp, F);
-		p[kn] = 1.0 / xvm_dot(y[kn], s[kn], F);
+		hst_sub(hf, s[kn], x, xp, F);
+		hst_sub(hf, y[kn], g, gp, F);
+		p[kn] = 1.0 / hst_dot(hf, y[kn], hf, s[kn], F);
+		uit_checkpoint(mdl, k + 1, trn_lbfgssave, &sst);
 		// And last, we check for convergence. The convergence check is
 		// quite simple [2, pp 508]
 		//   ||g|| / max(1, ||x||) ≤ ε
@@ -311,22 +569,15 @@ void trn_lbfgs(mdl_t *mdl) {
 		FILE *file = fopen(mdl->opt->sstate, "w");
 		if (file == NULL)
 			fatal("failed to open output state file");
-		fprintf(file, "#state#0#%"PRIu32"#%"PRIu64"\n", M, F);
-		for (uint64_t f = 0; f < F; f++) {
-			fprintf(file, "%"PRIu64, f);
-			fprintf(file, " %la %la", xp[f], gp[f]);
-			for (uint32_t m = 0; m < M; m++)
-				fprintf(file, " %la %la", s[m][f], y[m][f]);
-			fprintf(file, "\n");
-		}
+		trn_lbfgssave(mdl, file, &sst);
 		fclose(file);
 	}
 	// Cleanup: We free all the vectors we have allocated.
 	xvm_free(xp); xvm_free(g);
 	xvm_free(gp); xvm_free(d);
 	for (uint32_t m = 0; m < M; m++) {
-		xvm_free(s[m]);
-		xvm_free(y[m]);
+		hst_free(hf, s[m]);
+		hst_free(hf, y[m]);
 	}
 	if (l1)
 		xvm_free(pg);
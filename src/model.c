@@ -25,6 +25,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 #include <inttypes.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -72,7 +73,13 @@ mdl_t *mdl_new(rdr_t *rdr) {
 	mdl->kind = NULL;
 	mdl->uoff = mdl->boff = NULL;
 	mdl->theta = NULL;
+	mdl->map = NULL;
 	mdl->train = mdl->devel = NULL;
+	mdl->dmap = NULL;
+	mdl->dist = NULL;
+	mdl->wfmt = MDL_WDBL;
+	mdl->wval = NULL;
+	mdl->wscl = NULL;
 	mdl->reader = rdr;
 	mdl->werr = NULL;
 	mdl->total = 0.0;
@@ -85,11 +92,17 @@ mdl_t *mdl_new(rdr_t *rdr) {
  *   loaded in the model.
  */
 void mdl_free(mdl_t *mdl) {
-	xfree(mdl->kind);
-	xfree(mdl->uoff);
-	xfree(mdl->boff);
-	if (mdl->theta != NULL)
+	if (!bin_has(mdl->map, mdl->kind)) {
+		xfree(mdl->kind);
+		xfree(mdl->uoff);
+		xfree(mdl->boff);
+	}
+	if (mdl->theta != NULL && !bin_has(mdl->map, mdl->theta))
 		xvm_free(mdl->theta);
+	if (mdl->wval != NULL && !bin_has(mdl->map, mdl->wval))
+		xfree((void *)mdl->wval);
+	if (mdl->wscl != NULL && !bin_has(mdl->map, mdl->wscl))
+		xfree((void *)mdl->wscl);
 	if (mdl->train != NULL)
 		rdr_freedat(mdl->train);
 	if (mdl->devel != NULL)
@@ -98,9 +111,38 @@ void mdl_free(mdl_t *mdl) {
 		rdr_free(mdl->reader);
 	if (mdl->werr != NULL)
 		xfree(mdl->werr);
+	if (mdl->map != NULL)
+		bin_close(mdl->map);
+	if (mdl->dmap != NULL)
+		bin_close(mdl->dmap);
 	xfree(mdl);
 }
 
+/* mdl_unmap:
+ *   Move to memory the parts of the model which point inside the mapped binary
+ *   file, this is needed before the model can be modified or resized. This does
+ *   nothing if the model was not loaded from a binary file.
+ */
+static void mdl_unmap(mdl_t *mdl) {
+	const uint64_t O = mdl->nobs, F = mdl->nftr;
+	if (bin_has(mdl->map, mdl->kind)) {
+		char     *kind = xmalloc(sizeof(char    ) * O);
+		uint64_t *uoff = xmalloc(sizeof(uint64_t) * O);
+		uint64_t *boff = xmalloc(sizeof(uint64_t) * O);
+		memcpy(kind, mdl->kind, sizeof(char    ) * O);
+		memcpy(uoff, mdl->uoff, sizeof(uint64_t) * O);
+		memcpy(boff, mdl->boff, sizeof(uint64_t) * O);
+		mdl->kind = kind;
+		mdl->uoff = uoff;
+		mdl->boff = boff;
+	}
+	if (bin_has(mdl->map, mdl->theta)) {
+		double *theta = xvm_new(F);
+		memcpy(theta, mdl->theta, sizeof(double) * F);
+		mdl->theta = theta;
+	}
+}
+
 /* mdl_sync:
  *   Synchronize the model with its reader. As the model is just a placeholder
  *   for features weights and interned sequences, it know very few about the
@@ -125,12 +167,13 @@ void mdl_free(mdl_t *mdl) {
  */
 void mdl_sync(mdl_t *mdl) {
 	const uint32_t Y = qrk_count(mdl->reader->lbl);
-	const uint64_t O = qrk_count(mdl->reader->obs);
+	const uint64_t O = rdr_nobs(mdl->reader);
 	// If model is already synchronized, do nothing and just return
 	if (mdl->nlbl == Y && mdl->nobs == O)
 		return;
 	if (Y == 0 || O == 0)
 		fatal("cannot synchronize an empty model");
+	mdl_unmap(mdl);
 	// If new labels was added, we have to discard all the model. In this
 	// case we also display a warning as this is probably not expected by
 	// the user. If only new observations was added, we will try to expand
@@ -160,13 +203,19 @@ void mdl_sync(mdl_t *mdl) {
 	mdl->boff = boff;
 	// Now, we can setup the features. For each new observations we fill the
 	// kind and offsets arrays and count total number of features as well.
+	// In hashed mode, the kind is given by the range of the bucket.
+	const uint32_t hbits = mdl->reader->hbits;
 	uint64_t F = oldF;
 	for (uint64_t o = oldO; o < O; o++) {
-		const char *obs = qrk_id2str(mdl->reader->obs, o);
-		switch (obs[0]) {
-			case 'u': kind[o] = 1; break;
-			case 'b': kind[o] = 2; break;
-			case '*': kind[o] = 3; break;
+		if (hbits != 0) {
+			kind[o] = (o >> hbits) == 0 ? 1 : 2;
+		} else {
+			const char *obs = qrk_id2str(mdl->reader->obs, o);
+			switch (obs[0]) {
+				case 'u': kind[o] = 1; break;
+				case 'b': kind[o] = 2; break;
+				case '*': kind[o] = 3; break;
+			}
 		}
 		if (kind[o] & 1)
 			uoff[o] = F, F += Y;
@@ -202,6 +251,11 @@ void mdl_sync(mdl_t *mdl) {
  */
 void mdl_compact(mdl_t *mdl) {
 	const uint32_t Y = mdl->nlbl;
+	if (mdl->reader->hbits != 0) {
+		warning("hashed models cannot be compacted");
+		return;
+	}
+	mdl_unmap(mdl);
 	// We first build the new observation list with only observations which
 	// lead to at least one active feature. At the same time we build the
 	// translation table which map the new observations index to the old
@@ -262,6 +316,144 @@ void mdl_compact(mdl_t *mdl) {
 	xvm_free(old_theta);
 }
 
+/* mdl_share:
+ *   Prepare a loaded model to be shared between threads for decoding. The
+ *   quarks are frozen so the lookups done when reading sequences never modify
+ *   them. After this call, nothing in the model, its reader, or its quarks is
+ *   written by the decoders so any number of threads can use it concurrently
+ *   as long as each one has its own context, see tag_ctxnew. The model must
+ *   not be modified anymore until all of them are done.
+ */
+void mdl_share(mdl_t *mdl) {
+	qrk_freeze(mdl->reader->lbl);
+	qrk_freeze(mdl->reader->obs);
+}
+
+/*******************************************************************************
+ * Reduced precision weights
+ *
+ *   For labelling, the weights can be stored as single precision floats or
+ *   quantized to 16 or 8 bits integers, reducing the model size and the memory
+ *   bandwidth needed by the decoder. Quantized weights use a symmetric scale
+ *   per observation, shared by its unigram and bigram features, so the largest
+ *   weight of each observation is exactly representable and small weights of
+ *   one observation are not crushed by the large ones of another.
+ ******************************************************************************/
+static const char    *mdl_wname[] = {"double", "float", "int16", "int8"};
+static const size_t   mdl_wsize[] = {sizeof(double), sizeof(float),
+                                     sizeof(int16_t), sizeof(int8_t)};
+static const uint32_t mdl_wnfmt   = sizeof(mdl_wname) / sizeof(mdl_wname[0]);
+
+/* mdl_wfmt:
+ *   Return the weights format corresponding to the given name.
+ */
+uint32_t mdl_wfmt(const char *name) {
+	for (uint32_t i = 0; i < mdl_wnfmt; i++)
+		if (!strcmp(name, mdl_wname[i]))
+			return i;
+	fatal("unknown weights format '%s'", name);
+	return 0;
+}
+
+/* mdl_wdrop:
+ *   Release the reduced weights of the model if they are not in the mapped
+ *   file, the model is left with only its <theta> vector.
+ */
+static void mdl_wdrop(mdl_t *mdl) {
+	if (mdl->wval != NULL && !bin_has(mdl->map, mdl->wval))
+		xfree((void *)mdl->wval);
+	if (mdl->wscl != NULL && !bin_has(mdl->map, mdl->wscl))
+		xfree((void *)mdl->wscl);
+	mdl->wval = NULL;
+	mdl->wscl = NULL;
+	mdl->wfmt = MDL_WDBL;
+}
+
+/* mdl_reduce:
+ *   Build the reduced version of the weights in the given format and switch
+ *   the model to it. The <theta> vector is kept so the model can still be
+ *   evaluated or saved at full precision. Return the largest absolute error
+ *   made on a weight.
+ */
+double mdl_reduce(mdl_t *mdl, uint32_t fmt) {
+	const uint32_t Y = mdl->nlbl;
+	const uint64_t O = mdl->nobs, F = mdl->nftr;
+	mdl_wdrop(mdl);
+	if (fmt == MDL_WDBL)
+		return 0.0;
+	void  *val = xmalloc(mdl_wsize[fmt] * F);
+	float *scl = NULL;
+	memset(val, 0, mdl_wsize[fmt] * F);
+	double err = 0.0;
+	if (fmt == MDL_WFLT) {
+		float *v = val;
+		for (uint64_t f = 0; f < F; f++) {
+			v[f] = mdl->theta[f];
+			err = max(err, fabs(mdl->theta[f] - v[f]));
+		}
+	} else {
+		const double Q = fmt == MDL_WI16 ? INT16_MAX : INT8_MAX;
+		scl = xmalloc(sizeof(float) * O);
+		for (uint64_t o = 0; o < O; o++) {
+			const uint64_t rng[2][2] = {
+				{mdl->uoff[o], (mdl->kind[o] & 1) ? Y     : 0},
+				{mdl->boff[o], (mdl->kind[o] & 2) ? Y * Y : 0},
+			};
+			double mx = 0.0;
+			for (int r = 0; r < 2; r++)
+				for (uint64_t i = 0; i < rng[r][1]; i++) {
+					const uint64_t f = rng[r][0] + i;
+					mx = max(mx, fabs(mdl->theta[f]));
+				}
+			scl[o] = mx / Q;
+			if (scl[o] == 0.0)
+				continue;
+			for (int r = 0; r < 2; r++)
+				for (uint64_t i = 0; i < rng[r][1]; i++) {
+					const uint64_t f = rng[r][0] + i;
+					const double   w = mdl->theta[f];
+					double q = lrint(w / scl[o]);
+					q = min(max(q, -Q), Q);
+					if (fmt == MDL_WI16)
+						((int16_t *)val)[f] = q;
+					else
+						((int8_t  *)val)[f] = q;
+					err = max(err, fabs(w - q * scl[o]));
+				}
+		}
+	}
+	mdl->wfmt = fmt;
+	mdl->wval = val;
+	mdl->wscl = scl;
+	return err;
+}
+
+/* mdl_expand:
+ *   Switch back a model with reduced weights to double precision, rebuilding
+ *   the <theta> vector if needed. This is required before any use of the
+ *   model other than labelling.
+ */
+void mdl_expand(mdl_t *mdl) {
+	if (mdl->wfmt == MDL_WDBL)
+		return;
+	if (mdl->theta == NULL) {
+		const uint32_t Y = mdl->nlbl;
+		const uint64_t O = mdl->nobs, F = mdl->nftr;
+		mdl->theta = xvm_new(F);
+		for (uint64_t f = 0; f < F; f++)
+			mdl->theta[f] = 0.0;
+		for (uint64_t o = 0; o < O; o++) {
+			if (mdl->kind[o] & 1)
+				mdl_wadd(mdl, mdl->theta + mdl->uoff[o], o,
+				         mdl->uoff[o], Y);
+			if (mdl->kind[o] & 2)
+				mdl_wadd(mdl, mdl->theta + mdl->boff[o], o,
+				         mdl->boff[o], Y * Y);
+		}
+	}
+	mdl_wdrop(mdl);
+}
+
 /* mdl_save:
  *   Save a model to be restored later in a platform independant way.
  */
@@ -292,13 +484,17 @@ void mdl_load(mdl_t *mdl) {
 	setlocale(LC_ALL, "C");
 
 	line = mdl->reader->iol->gets_cb(mdl->reader->iol->in);
+	if (line == NULL)
+		fatal(err);
 	if (sscanf(line, "#mdl#%"SCNu32"#%"SCNu64"\n", &type, &nact) == 2) {
 		mdl->type = type;
 	} else if (sscanf(line, "#mdl#%"SCNu64"\n", &nact) == 1) {
         mdl->type = 0;
     } else {
+        xfree(line);
         fatal(err);
 	}
+	xfree(line);
     rdr_load(mdl->reader);
 	mdl_sync(mdl);
 	for (uint64_t i = 0; i < nact; i++) {
@@ -306,8 +502,289 @@ void mdl_load(mdl_t *mdl) {
 		double v;
                 
         line = mdl->reader->iol->gets_cb(mdl->reader->iol->in);
-		if (sscanf(line, "%"SCNu64"=%la\n", &f, &v) != 2)
+		if (line == NULL)
+			fatal(err);
+		const int n = sscanf(line, "%"SCNu64"=%la\n", &f, &v);
+		xfree(line);
+		if (n != 2 || f >= mdl->nftr)
 			fatal(err);
 		mdl->theta[f] = v;
 	}
 }
+
+/*******************************************************************************
+ * Binary model format
+ *
+ *   Loading big models from the text format is slow as all the weights have to
+ *   be parsed and the quarks rebuilt. The binary format store everything in the
+ *   layout used in memory so the file can be mapped and the model used almost
+ *   without any work. It is made of the following blocks, each one aligned as
+ *   described in tools.c:
+ *     - a header with the magic string, the format version and a byte order
+ *       mark, the model type, and the model sizes ;
+ *     - the reader as saved by rdr_savebin, with the quarks in their frozen
+ *       form so they are also used in place ;
+ *     - the <kind>, <uoff>, and <boff> arrays ;
+ *     - the features weights, either as a dense vector of F values padded for
+ *       the SSE code or, if the <packed> option is set, as the list of indices
+ *       followed by the list of values of the non-zero weights ;
+ *     - or, for models with reduced weights, the F weights in this format
+ *       followed, for the quantized ones, by the O observations scales.
+ *   Except in the packed case, the weights are used in place. The text format
+ *   remains the portable one, the binary format is not intended to be exchanged
+ *   between different platforms.
+ ******************************************************************************/
+#define MDL_MAGIC   "WPTMODEL"
+#define MDL_VERSION 3
+#define MDL_ORDER   0x01020304
+#define MDL_PACKED  1
+
+typedef struct mdl_hdr_s mdl_hdr_t;
+struct mdl_hdr_s {
+	char     magic[8];
+	uint32_t version, order;
+	uint32_t type,    flags;
+	uint32_t nlbl,    wfmt;
+	uint64_t nobs,    nftr;
+	uint64_t nact;
+};
+
+/* mdl_savebin:
+ *   Save the model in binary form to the given file.
+ */
+void mdl_savebin(mdl_t *mdl, FILE *file) {
+	const uint64_t O = mdl->nobs, F = mdl->nftr;
+	mdl_hdr_t hdr = {
+		.version = MDL_VERSION, .order = MDL_ORDER,
+		.type    = mdl->type,   .flags = 0,
+		.nlbl    = mdl->nlbl,   .wfmt  = mdl->wfmt,
+		.nobs    = O,           .nftr  = F,
+		.nact    = 0,
+	};
+	memcpy(hdr.magic, MDL_MAGIC, sizeof(hdr.magic));
+	if (mdl->wfmt == MDL_WDBL) {
+		for (uint64_t f = 0; f < F; f++)
+			if (mdl->theta[f] != 0.0)
+				hdr.nact++;
+		if (mdl->opt->packed)
+			hdr.flags |= MDL_PACKED;
+	}
+	bin_put(file, &hdr, sizeof(hdr));
+	rdr_savebin(mdl->reader, file);
+	bin_put(file, mdl->kind, sizeof(char    ) * O);
+	bin_put(file, mdl->uoff, sizeof(uint64_t) * O);
+	bin_put(file, mdl->boff, sizeof(uint64_t) * O);
+	if (mdl->wfmt != MDL_WDBL) {
+		bin_put(file, mdl->wval, mdl_wsize[mdl->wfmt] * F);
+		if (mdl->wscl != NULL)
+			bin_put(file, mdl->wscl, sizeof(float) * O);
+	} else if (hdr.flags & MDL_PACKED) {
+		for (uint64_t f = 0; f < F; f++)
+			if (mdl->theta[f] != 0.0)
+				if (fwrite(&f, sizeof(f), 1, file) != 1)
+					pfatal("cannot write to file");
+		bin_put(file, NULL, sizeof(uint64_t) * hdr.nact);
+		for (uint64_t f = 0; f < F; f++)
+			if (mdl->theta[f] != 0.0)
+				if (fwrite(mdl->theta + f, sizeof(double), 1, file) != 1)
+					pfatal("cannot write to file");
+		bin_put(file, NULL, sizeof(double) * hdr.nact);
+	} else {
+		const double   pad[4] = {0.0, 0.0, 0.0, 0.0};
+		const uint64_t npad   = (4 - F % 4) % 4;
+		if (F != 0 && fwrite(mdl->theta, sizeof(double) * F, 1, file) != 1)
+			pfatal("cannot write to file");
+		if (npad != 0 && fwrite(pad, sizeof(double) * npad, 1, file) != 1)
+			pfatal("cannot write to file");
+		bin_put(file, NULL, sizeof(double) * (F + npad));
+	}
+	if (fflush(file) != 0)
+		pfatal("cannot write to file");
+}
+
+/* mdl_isbin:
+ *   Check if the given file is a binary model, so the caller can choose the
+ *   function to use for loading it.
+ */
+bool mdl_isbin(const char *path) {
+	char magic[sizeof(((mdl_hdr_t *)NULL)->magic)];
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return false;
+	const bool bin = fread(magic, sizeof(magic), 1, file) == 1
+	              && !memcmp(magic, MDL_MAGIC, sizeof(magic));
+	fclose(file);
+	return bin;
+}
+
+/* mdl_loadbin:
+ *   Load a model saved with mdl_savebin from the given file. The file is mapped
+ *   and kept open for the life of the model. As for mdl_load, the model must be
+ *   fresh from mdl_new and is returned synced with its quarks locked.
+ */
+void mdl_loadbin(mdl_t *mdl, const char *path) {
+	const char *err = "invalid binary model format";
+	bin_t *bin = bin_open(path);
+	mdl->map = bin;
+	const mdl_hdr_t *hdr = bin_get(bin, sizeof(mdl_hdr_t));
+	if (memcmp(hdr->magic, MDL_MAGIC, sizeof(hdr->magic)))
+		fatal(err);
+	if (hdr->order != MDL_ORDER)
+		fatal("binary model saved with a different byte order");
+	if (hdr->version != MDL_VERSION && hdr->version != 2)
+		fatal("unsupported binary model version %"PRIu32, hdr->version);
+	if (hdr->version == MDL_VERSION && hdr->wfmt >= mdl_wnfmt)
+		fatal(err);
+	mdl->type = hdr->type;
+	rdr_loadbin(mdl->reader, bin);
+	const uint32_t Y = hdr->nlbl;
+	const uint64_t O = hdr->nobs, F = hdr->nftr;
+	if (qrk_count(mdl->reader->lbl) != Y)
+		fatal(err);
+	if (rdr_nobs(mdl->reader) != O)
+		fatal(err);
+	if (F > UINT64_MAX / sizeof(double) - 4)
+		fatal(err);
+	mdl->nlbl = Y;
+	mdl->nobs = O;
+	mdl->nftr = F;
+	mdl->kind = (char     *)bin_get(bin, sizeof(char    ) * O);
+	mdl->uoff = (uint64_t *)bin_get(bin, sizeof(uint64_t) * O);
+	mdl->boff = (uint64_t *)bin_get(bin, sizeof(uint64_t) * O);
+	// The decoders trust the kinds and offsets, so a corrupt file must be
+	// rejected here rather than lead to reads outside of the weights. The
+	// kinds are set as in mdl_sync as the decoders select the offsets to use
+	// from the patterns and not from them.
+	const uint32_t hbits = mdl->reader->hbits;
+	for (uint64_t o = 0; o < O; o++) {
+		const char k = mdl->kind[o];
+		if (hbits != 0) {
+			if (k != ((o >> hbits) == 0 ? 1 : 2))
+				fatal(err);
+		} else {
+			const char *obs = qrk_id2str(mdl->reader->obs, o);
+			const char  chr = obs[0] == 'u' ? 1 : obs[0] == 'b' ? 2
+			                : obs[0] == '*' ? 3 : 0;
+			if (k != chr)
+				fatal(err);
+		}
+		if ((k & 1) && (mdl->uoff[o] > F || F - mdl->uoff[o] < Y))
+			fatal(err);
+		if ((k & 2) && (mdl->boff[o] > F
+		             || F - mdl->boff[o] < (uint64_t)Y * Y))
+			fatal(err);
+	}
+	if (hdr->version == MDL_VERSION && hdr->wfmt != MDL_WDBL) {
+		mdl->wfmt = hdr->wfmt;
+		mdl->wval = bin_get(bin, mdl_wsize[mdl->wfmt] * F);
+		if (mdl->wfmt != MDL_WFLT)
+			mdl->wscl = bin_get(bin, sizeof(float) * O);
+	} else if (hdr->flags & MDL_PACKED) {
+		const uint64_t  A   = hdr->nact;
+		if (A > F)
+			fatal(err);
+		const uint64_t *idx = bin_get(bin, sizeof(uint64_t) * A);
+		const double   *val = bin_get(bin, sizeof(double  ) * A);
+		mdl->theta = xvm_new(F);
+		for (uint64_t f = 0; f < F; f++)
+			mdl->theta[f] = 0.0;
+		for (uint64_t a = 0; a < A; a++) {
+			if (idx[a] >= F)
+				fatal(err);
+			mdl->theta[idx[a]] = val[a];
+		}
+	} else {
+		const uint64_t F4 = F + (4 - F % 4) % 4;
+		mdl->theta = (double *)bin_get(bin, sizeof(double) * F4);
+	}
+	qrk_lock(mdl->reader->lbl, true);
+	qrk_lock(mdl->reader->obs, true);
+}
+
+/******************************************************************************
+ * Dataset cache
+ *
+ *   Reading the datasets and applying the patterns on them is often the most
+ *   time consuming part of the training setup and give the same result each
+ *   time the same data and patterns are used. The cache file keep the result
+ *   of this in binary form so it can be loaded back directly: a small header,
+ *   the reader with its patterns and quarks as saved by rdr_savebin, and the
+ *   train and, optionally, the development datasets saved by rdr_savedat.
+ *   The file is mapped and the observations lists are used in place. Like the
+ *   binary models, cache files are not portable across platforms.
+ ******************************************************************************/
+#define DAT_MAGIC   "WPTCACHE"
+#define DAT_VERSION 1
+#define DAT_DEVEL   1
+
+typedef struct dat_hdr_s dat_hdr_t;
+struct dat_hdr_s {
+	char     magic[8];
+	uint32_t version, order;
+	uint32_t flags,   mincnt;
+};
+
+/* mdl_savecache:
+ *   Save the reader and datasets of the model in a cache file.
+ */
+void mdl_savecache(mdl_t *mdl, FILE *file) {
+	dat_hdr_t hdr = {
+		.version = DAT_VERSION, .order = MDL_ORDER,
+		.flags   = mdl->devel != NULL ? DAT_DEVEL : 0,
+		.mincnt  = mdl->opt->mincount > 1 ? mdl->opt->mincount : 0,
+	};
+	memcpy(hdr.magic, DAT_MAGIC, sizeof(hdr.magic));
+	bin_put(file, &hdr, sizeof(hdr));
+	rdr_savebin(mdl->reader, file);
+	rdr_savedat(mdl->train, file);
+	if (mdl->devel != NULL)
+		rdr_savedat(mdl->devel, file);
+	if (fflush(file) != 0)
+		pfatal("cannot write to file");
+}
+
+/* mdl_iscache:
+ *   Return true if the file at <path> exist and is a dataset cache.
+ */
+bool mdl_iscache(const char *path) {
+	char magic[sizeof(((dat_hdr_t *)NULL)->magic)];
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return false;
+	const bool bin = fread(magic, sizeof(magic), 1, file) == 1
+	              && !memcmp(magic, DAT_MAGIC, sizeof(magic));
+	fclose(file);
+	return bin;
+}
+
+/* mdl_loadcache:
+ *   Load the reader and the datasets from a cache file, the file stay mapped
+ *   in <dmap> until the model is released.
+ */
+void mdl_loadcache(mdl_t *mdl, const char *path) {
+	bin_t *bin = bin_open(path);
+	const dat_hdr_t *hdr = bin_get(bin, sizeof(dat_hdr_t));
+	if (memcmp(hdr->magic, DAT_MAGIC, sizeof(hdr->magic)))
+		fatal("invalid dataset cache format");
+	if (hdr->order != MDL_ORDER)
+		fatal("dataset cache saved with a different byte order");
+	if (hdr->version != DAT_VERSION)
+		fatal("unsupported dataset cache version %"PRIu32, hdr->version);
+	// The rare observations are pruned before the cache is saved, so the
+	// threshold cannot be changed without building it again.
+	const uint32_t cnt = mdl->opt->mincount > 1 ? mdl->opt->mincount : 0;
+	if (hdr->mincnt != cnt)
+		fatal("cache was built with a different --mincount");
+	// Likewise, the development set is part of the cache or not.
+	const bool devel = mdl->opt->devel != NULL;
+	if (devel != !!(hdr->flags & DAT_DEVEL))
+		fatal(devel ? "cache was built without a development set"
+		            : "cache was built with a development set");
+	mdl->dmap = bin;
+	rdr_loadbin(mdl->reader, bin);
+	mdl->train = rdr_loaddat(mdl->reader, bin);
+	if (hdr->flags & DAT_DEVEL)
+		mdl->devel = rdr_loaddat(mdl->reader, bin);
+	qrk_lock(mdl->reader->lbl, true);
+	qrk_lock(mdl->reader->obs, true);
+}
@@ -28,8 +28,10 @@
 #ifndef model_h
 #define model_h
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #if defined(__llvm__) && defined(WIN32)
 #include "winsock.h"
 #else
@@ -40,6 +42,7 @@
 #include "options.h"
 #include "sequence.h"
 #include "reader.h"
+#include "dist.h"
 #include "tools.h"
 
 typedef struct timeval tms_t;
@@ -57,12 +60,24 @@ typedef struct timeval tms_t;
  *   observations the offset in the <theta> array where the features of the
  *   observation are stored.
  *
+ *   If the model was loaded from a binary file, the <map> object keep the file
+ *   mapped in memory as the quarks and the <kind>, <*off>, and <theta> arrays
+ *   can point inside it. The arrays are copied to memory as soon as the model
+ *   is modified. In the same way, if the datasets were loaded from a cache
+ *   file, <dmap> keep it mapped as long as the datasets use it.
+ *
  *   The <*off> and <theta> array are initialized only when the model is
  *   synchronized. As you can add new labels and observations after a sync, we
  *   keep track of the old counts in <olbl> and <oblk> to detect inconsistency
  *   and resynchronize the model if needed. In this case, if the number of
  *   labels have not changed, the previously trained weights are kept, else they
  *   are now meaningless so discarded.
+ *
+ *   For inference only, the weights can be stored with a reduced precision
+ *   given by <wfmt>, see mdl_reduce. In this case <theta> is NULL and the
+ *   weights are in <wval>, scaled for the quantized formats by the value of
+ *   their observation in <wscl>. They must be read using mdl_wadd or mdl_wget
+ *   who work with all formats.
  */
 typedef struct mdl_s mdl_t;
 struct mdl_s {
@@ -81,6 +96,7 @@ struct mdl_s {
 
 	// The model itself
 	double   *theta;   //  [F]  features weights
+	bin_t    *map;     //       binary file the model is mapped from
 
 	// Datasets
 	dat_t    *train;   //       training dataset
@@ -95,13 +111,87 @@ struct mdl_s {
 	// Timing
 	tms_t     timer;   //       start time of last iter
 	double    total;   //       total training time
+
+	// Datasets cache
+	bin_t    *dmap;    //       cache file the datasets are mapped from
+
+	// Distributed training
+	dst_t    *dist;    //       ring of nodes or NULL if not distributed
+
+	// Reduced precision weights
+	uint32_t     wfmt; //       storage format of the weights
+	const void  *wval; //  [F]  weights if not stored in <theta>
+	const float *wscl; //  [O]  scale of the quantized weights
 };
 
+/* MDL_W*:
+ *   Storage formats of the features weights: double precision in <theta>, or
+ *   single precision floats and 16 or 8 bits integers in <wval>.
+ */
+#define MDL_WDBL 0
+#define MDL_WFLT 1
+#define MDL_WI16 2
+#define MDL_WI8  3
+
+/* mdl_wadd:
+ *   Add to <r> the <n> weights of observation <o> starting at feature <f>.
+ */
+static inline void mdl_wadd(const mdl_t *mdl, double *r, uint64_t o,
+                            uint64_t f, uint32_t n) {
+	switch (mdl->wfmt) {
+		case MDL_WDBL: {
+			const double *x = mdl->theta + f;
+			for (uint32_t i = 0; i < n; i++)
+				r[i] += x[i];
+			break; }
+		case MDL_WFLT: {
+			const float *x = (const float *)mdl->wval + f;
+			for (uint32_t i = 0; i < n; i++)
+				r[i] += x[i];
+			break; }
+		case MDL_WI16: {
+			const int16_t *x = (const int16_t *)mdl->wval + f;
+			const double   s = mdl->wscl[o];
+			for (uint32_t i = 0; i < n; i++)
+				r[i] += x[i] * s;
+			break; }
+		case MDL_WI8: {
+			const int8_t *x = (const int8_t *)mdl->wval + f;
+			const double  s = mdl->wscl[o];
+			for (uint32_t i = 0; i < n; i++)
+				r[i] += x[i] * s;
+			break; }
+	}
+}
+
+/* mdl_wget:
+ *   Return the weight of feature <f> of observation <o>.
+ */
+static inline double mdl_wget(const mdl_t *mdl, uint64_t o, uint64_t f) {
+	const void *x = mdl->wval;
+	switch (mdl->wfmt) {
+		case MDL_WFLT: return ((const float   *)x)[f];
+		case MDL_WI16: return ((const int16_t *)x)[f] * mdl->wscl[o];
+		case MDL_WI8:  return ((const int8_t  *)x)[f] * mdl->wscl[o];
+	}
+	return mdl->theta[f];
+}
+
 mdl_t *mdl_new(rdr_t *rdr);
 void mdl_free(mdl_t *mdl);
 void mdl_sync(mdl_t *mdl);
 void mdl_compact(mdl_t *mdl);
+void mdl_share(mdl_t *mdl);
+uint32_t mdl_wfmt(const char *name);
+double mdl_reduce(mdl_t *mdl, uint32_t fmt);
+void mdl_expand(mdl_t *mdl);
 void mdl_save(mdl_t *mdl, iol_t *iol);
 void mdl_load(mdl_t *mdl);
+void mdl_savebin(mdl_t *mdl, FILE *file);
+bool mdl_isbin(const char *path);
+void mdl_loadbin(mdl_t *mdl, const char *path);
+void mdl_savecache(mdl_t *mdl, FILE *file);
+bool mdl_iscache(const char *path);
+void mdl_loadcache(mdl_t *mdl, const char *path);
 
 #endif
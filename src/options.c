@@ -36,7 +36,9 @@
 
 #include "wapiti.h"
 #include "tools.h"
+#include "model.h"
 #include "options.h"
+#include "sequence.h"
 #include "vmath.h"
 
 /******************************************************************************
@@ -64,12 +66,20 @@ static void opt_help(const char *pname) {
 		"\t-p | --pattern  FILE    patterns for extracting features\n"
 		"\t-m | --model    FILE    model file to preload\n"
 		"\t-d | --devel    FILE    development dataset\n"
+		"\t   | --cache    FILE    featurized data cache\n"
 		"\t   | --rstate   FILE    optimizer state to restore\n"
 		"\t   | --sstate   FILE    optimizer state to save\n"
 		"\t-c | --compact          compact model after training\n"
+		"\t-b | --binary           save model in binary format\n"
+		"\t   | --packed           (binary) store only active weights\n"
 		"\t-t | --nthread  INT     number of worker threads\n"
 		"\t-j | --jobsize  INT     job size for worker threads\n"
+		"\t   | --pin              pin worker threads to CPUs\n"
+		"\t   | --reduce           private blocked gradients\n"
+		"\t   | --dist     FILE    nodes of distributed training\n"
+		"\t   | --rank     INT     rank of this node\n"
 		"\t-s | --sparse           enable sparse forward/backward\n"
+		"\t   | --ckptlen  INT     checkpointed forward/backward\n"
 		"\t-i | --maxiter  INT     maximum number of iterations\n"
 		"\t-1 | --rho1     FLOAT   l1 penalty parameter\n"
 		"\t-2 | --rho2     FLOAT   l2 penalty parameter\n"
@@ -79,14 +89,27 @@ static void opt_help(const char *pname) {
 		"\t   | --clip             (l-bfgs) clip gradient\n"
 		"\t   | --histsz   INT     (l-bfgs) history size\n"
 		"\t   | --maxls    INT     (l-bfgs) max linesearch iters\n"
+		"\t   | --histfmt  STRING  (l-bfgs) history storage format\n"
 		"\t   | --eta0     FLOAT   (sgd-l1) learning rate\n"
 		"\t   | --alpha    FLOAT   (sgd-l1) exp decay parameter\n"
+		"\t   | --batch    INT     (sgd-l1) mini-batch size\n"
 		"\t   | --kappa    FLOAT   (bcd)    stability parameter\n"
 		"\t   | --stpmin   FLOAT   (rprop)  minimum step size\n"
 		"\t   | --stpmax   FLOAT   (rprop)  maximum step size\n"
 		"\t   | --stpinc   FLOAT   (rprop)  step increment factor\n"
 		"\t   | --stpdec   FLOAT   (rprop)  step decrement factor\n"
 		"\t   | --cutoff           (rprop)  alternate projection\n"
+		"\t   | --active   INT     (rprop)  iterations before skip\n"
+		"\t   | --profile          report time of training phases\n"
+		"\t   | --profout  FILE    dump the profile in JSON\n"
+		"\t   | --evthread INT     threads for background eval\n"
+		"\t   | --evfrac   FLOAT   fraction of devel to evaluate\n"
+		"\t   | --hash     INT     bits of hashed unigram features\n"
+		"\t   | --hashbi   INT     bits of hashed bigram features\n"
+		"\t   | --mincount INT     prune rarer observations\n"
+		"\t   | --vbatch   INT     sequences per batched Viterbi\n"
+		"\t   | --snapshot FILE    periodic checkpoint of the model\n"
+		"\t   | --snapint  INT     iterations between checkpoints\n"
 		"\n"
 		"Label mode:\n"
 		"    %1$s label [options] [input data] [output data]\n"
@@ -98,6 +121,12 @@ static void opt_help(const char *pname) {
 		"\t-p | --post             label using posteriors\n"
 		"\t-n | --nbest    INT     output n-best list\n"
 		"\t   | --force            use forced decoding\n"
+		"\t   | --sparse           use sparse Viterbi decoding\n"
+		"\t   | --beam     INT     max labels kept by position\n"
+		"\t   | --margin   FLOAT   score margin of kept labels\n"
+		"\t   | --vbatch   INT     sequences per batched Viterbi\n"
+		"\t-t | --nthread  INT     number of worker threads\n"
+		"\t-j | --jobsize  INT     job size for worker threads\n"
 		"\n"
 		"Dump mode\n"
 		"    %1$s dump [options] [input model] [output text]\n"
@@ -108,6 +137,41 @@ static void opt_help(const char *pname) {
 		"    %1$s update [options] [patch file] [output model]\n"
 		"\t-m | --model    FILE    model file to load\n"
 		"\t-c | --compact          compact model after training\n"
+		"\t-b | --binary           save model in binary format\n"
+		"\t   | --packed           (binary) store only active weights\n"
+		"\n"
+		"Convert mode\n"
+		"    %1$s convert [options] [input model] [output model]\n"
+		"\t-b | --binary           save model in binary format\n"
+		"\t   | --packed           (binary) store only active weights\n"
+		"\t   | --wfmt     STRING  (binary) weights storage format\n"
+		"\t-d | --devel    FILE    data set to check reduced weights\n"
+		"\n"
+		"Server mode\n"
+		"    %1$s serve [options]\n"
+		"\t   | --me               force maxent mode\n"
+		"\t-m | --model    FILE    model file to load\n"
+		"\t   | --listen   ADDR    unix:PATH or HOST:PORT address\n"
+		"\t-l | --label            output only labels\n"
+		"\t-s | --score            add scores to output\n"
+		"\t-p | --post             label using posteriors\n"
+		"\t-n | --nbest    INT     output n-best list\n"
+		"\t   | --sparse           use sparse Viterbi decoding\n"
+		"\t   | --beam     INT     max labels kept by position\n"
+		"\t   | --margin   FLOAT   score margin of kept labels\n"
+		"\t-t | --nthread  INT     number of worker threads\n"
+		"\t   | --reload   INT     model file check interval\n"
+		"\t   | --stats    INT     latency report interval\n"
+		"\n"
+		"Bench mode\n"
+		"    %1$s bench [options] [input data] [output csv]\n"
+		"\t-p | --pattern  FILE    patterns for extracting features\n"
+		"\t-a | --algo     LIST    training algorithms to time\n"
+		"\t-t | --nthread  INT     number of worker threads\n"
+		"\t-j | --jobsize  INT     job size for worker threads\n"
+		"\t   | --scaley   LIST    label counts of synthetic data\n"
+		"\t   | --scalet   LIST    sequence lengths of synthetic data\n"
+		"\t   | --vbatch   INT     sequences per batched Viterbi\n"
 	;
 	fprintf(stderr, msg, pname);
 }
@@ -134,6 +198,21 @@ const opt_t opt_defaults = {
 	.label   = false,    .check   = false, .outsc = false,
 	.lblpost = false,    .nbest   = 1,     .force = false,
 	.prec    = 5,        .all     = false,
+	.binary  = false,    .packed  = false,
+	.reduce  = false,    .histfmt = "double",
+	.cache   = NULL,     .sgdbatch = 1,
+	.dist    = NULL,     .rank    = 0,
+	.ckptlen = 2048,
+	.wfmt    = "double",
+	.listen  = NULL,     .reload  = 1,     .stats  = 60,
+	.beam    = 0,        .margin  = 0.0,
+	.scaley  = NULL,     .scalet  = NULL,
+	.profile = false,    .profout = NULL,
+	.evthread = 0,       .evfrac  = 1.0,
+	.hash    = 0,        .hashbi  = 8,
+	.mincount = 0,       .vbatch  = 8,
+	.snapshot = NULL,    .snapint = 10,
+	.rpactive = 0,       .pin     = false,
 };
 
 /* opt_switch:
@@ -153,12 +232,20 @@ struct {
 	{0, "-p", "--pattern", 'S', offsetof(opt_t, pattern     )},
 	{0, "-m", "--model",   'S', offsetof(opt_t, model       )},
 	{0, "-d", "--devel",   'S', offsetof(opt_t, devel       )},
+	{0, "##", "--cache",   'S', offsetof(opt_t, cache       )},
 	{0, "##", "--rstate",  'S', offsetof(opt_t, rstate      )},
 	{0, "##", "--sstate",  'S', offsetof(opt_t, sstate      )},
 	{0, "-c", "--compact", 'B', offsetof(opt_t, compact     )},
+	{0, "-b", "--binary",  'B', offsetof(opt_t, binary      )},
+	{0, "##", "--packed",  'B', offsetof(opt_t, packed      )},
 	{0, "-s", "--sparse",  'B', offsetof(opt_t, sparse      )},
+	{0, "##", "--ckptlen", 'U', offsetof(opt_t, ckptlen     )},
 	{0, "-t", "--nthread", 'U', offsetof(opt_t, nthread     )},
 	{0, "-j", "--jobsize", 'U', offsetof(opt_t, jobsize     )},
+	{0, "##", "--pin",     'B', offsetof(opt_t, pin         )},
+	{0, "##", "--reduce",  'B', offsetof(opt_t, reduce      )},
+	{0, "##", "--dist",    'S', offsetof(opt_t, dist        )},
+	{0, "##", "--rank",    'U', offsetof(opt_t, rank        )},
 	{0, "-i", "--maxiter", 'U', offsetof(opt_t, maxiter     )},
 	{0, "-1", "--rho1",    'F', offsetof(opt_t, rho1        )},
 	{0, "-2", "--rho2",    'F', offsetof(opt_t, rho2        )},
@@ -168,14 +255,27 @@ struct {
 	{0, "##", "--clip",    'B', offsetof(opt_t, lbfgs.clip  )},
 	{0, "##", "--histsz",  'U', offsetof(opt_t, lbfgs.histsz)},
 	{0, "##", "--maxls",   'U', offsetof(opt_t, lbfgs.maxls )},
+	{0, "##", "--histfmt", 'S', offsetof(opt_t, histfmt     )},
 	{0, "##", "--eta0",    'F', offsetof(opt_t, sgdl1.eta0  )},
 	{0," ##", "--alpha",   'F', offsetof(opt_t, sgdl1.alpha )},
+	{0, "##", "--batch",   'U', offsetof(opt_t, sgdbatch    )},
 	{0, "##", "--kappa",   'F', offsetof(opt_t, bcd.kappa   )},
 	{0, "##", "--stpmin",  'F', offsetof(opt_t, rprop.stpmin)},
 	{0, "##", "--stpmax",  'F', offsetof(opt_t, rprop.stpmax)},
 	{0, "##", "--stpinc",  'F', offsetof(opt_t, rprop.stpinc)},
 	{0, "##", "--stpdec",  'F', offsetof(opt_t, rprop.stpdec)},
 	{0, "##", "--cutoff",  'B', offsetof(opt_t, rprop.cutoff)},
+	{0, "##", "--active",  'U', offsetof(opt_t, rpactive    )},
+	{0, "##", "--profile", 'B', offsetof(opt_t, profile     )},
+	{0, "##", "--profout", 'S', offsetof(opt_t, profout     )},
+	{0, "##", "--evthread",'U', offsetof(opt_t, evthread    )},
+	{0, "##", "--evfrac",  'F', offsetof(opt_t, evfrac      )},
+	{0, "##", "--hash",    'U', offsetof(opt_t, hash        )},
+	{0, "##", "--hashbi",  'U', offsetof(opt_t, hashbi      )},
+	{0, "##", "--mincount",'U', offsetof(opt_t, mincount    )},
+	{0, "##", "--vbatch",  'U', offsetof(opt_t, vbatch      )},
+	{0, "##", "--snapshot",'S', offsetof(opt_t, snapshot    )},
+	{0, "##", "--snapint", 'U', offsetof(opt_t, snapint     )},
 	{1, "##", "--me",      'B', offsetof(opt_t, maxent      )},
 	{1, "-m", "--model",   'S', offsetof(opt_t, model       )},
 	{1, "-l", "--label",   'B', offsetof(opt_t, label       )},
@@ -184,10 +284,42 @@ struct {
 	{1, "-p", "--post",    'B', offsetof(opt_t, lblpost     )},
 	{1, "-n", "--nbest",   'U', offsetof(opt_t, nbest       )},
 	{1, "##", "--force",   'B', offsetof(opt_t, force       )},
+	{1, "##", "--sparse",  'B', offsetof(opt_t, sparse      )},
+	{1, "##", "--beam",    'U', offsetof(opt_t, beam        )},
+	{1, "##", "--margin",  'F', offsetof(opt_t, margin      )},
+	{1, "##", "--vbatch",  'U', offsetof(opt_t, vbatch      )},
+	{1, "-t", "--nthread", 'U', offsetof(opt_t, nthread     )},
+	{1, "-j", "--jobsize", 'U', offsetof(opt_t, jobsize     )},
 	{2, "-p", "--prec",    'U', offsetof(opt_t, prec        )},
 	{2, "##", "--all",     'B', offsetof(opt_t, all         )},
 	{3, "-m", "--model",   'S', offsetof(opt_t, model       )},
 	{3, "-c", "--compact", 'B', offsetof(opt_t, compact     )},
+	{3, "-b", "--binary",  'B', offsetof(opt_t, binary      )},
+	{3, "##", "--packed",  'B', offsetof(opt_t, packed      )},
+	{4, "-b", "--binary",  'B', offsetof(opt_t, binary      )},
+	{4, "##", "--packed",  'B', offsetof(opt_t, packed      )},
+	{4, "##", "--wfmt",    'S', offsetof(opt_t, wfmt        )},
+	{4, "-d", "--devel",   'S', offsetof(opt_t, devel       )},
+	{5, "##", "--me",      'B', offsetof(opt_t, maxent      )},
+	{5, "-m", "--model",   'S', offsetof(opt_t, model       )},
+	{5, "-l", "--label",   'B', offsetof(opt_t, label       )},
+	{5, "-s", "--score",   'B', offsetof(opt_t, outsc       )},
+	{5, "-p", "--post",    'B', offsetof(opt_t, lblpost     )},
+	{5, "-n", "--nbest",   'U', offsetof(opt_t, nbest       )},
+	{5, "##", "--sparse",  'B', offsetof(opt_t, sparse      )},
+	{5, "##", "--beam",    'U', offsetof(opt_t, beam        )},
+	{5, "##", "--margin",  'F', offsetof(opt_t, margin      )},
+	{5, "-t", "--nthread", 'U', offsetof(opt_t, nthread     )},
+	{5, "##", "--listen",  'S', offsetof(opt_t, listen      )},
+	{5, "##", "--reload",  'U', offsetof(opt_t, reload      )},
+	{5, "##", "--stats",   'U', offsetof(opt_t, stats       )},
+	{6, "-p", "--pattern", 'S', offsetof(opt_t, pattern     )},
+	{6, "-a", "--algo",    'S', offsetof(opt_t, algo        )},
+	{6, "-t", "--nthread", 'U', offsetof(opt_t, nthread     )},
+	{6, "-j", "--jobsize", 'U', offsetof(opt_t, jobsize     )},
+	{6, "##", "--scaley",  'S', offsetof(opt_t, scaley      )},
+	{6, "##", "--scalet",  'S', offsetof(opt_t, scalet      )},
+	{6, "##", "--vbatch",  'U', offsetof(opt_t, vbatch      )},
 	{-1, NULL, NULL, '\0', 0}
 };
 
@@ -222,6 +354,12 @@ void opt_parse(int argc, char *argv[argc], opt_t *opt) {
 		opt->mode = 2;
 	} else if (!strcmp(argv[0], "u") || !strcmp(argv[0], "update")) {
 		opt->mode = 3;
+	} else if (!strcmp(argv[0], "c") || !strcmp(argv[0], "convert")) {
+		opt->mode = 4;
+	} else if (!strcmp(argv[0], "s") || !strcmp(argv[0], "serve")) {
+		opt->mode = 5;
+	} else if (!strcmp(argv[0], "b") || !strcmp(argv[0], "bench")) {
+		opt->mode = 6;
 	} else {
 		fatal("unknown mode <%s>", argv[0]);
 	}
@@ -283,6 +421,9 @@ void opt_parse(int argc, char *argv[argc], opt_t *opt) {
 				break;
 		}
 	}
+	// Dumping the profile implies to collect it
+	if (opt->profout != NULL)
+		opt->profile = true;
 	// Small trick for the maxiter switch
 	if (opt->maxiter == 0)
 		opt->maxiter = INT_MAX;
@@ -298,8 +439,27 @@ void opt_parse(int argc, char *argv[argc], opt_t *opt) {
 	argchecksub("--maxls",   opt->lbfgs.maxls  >  0  );
 	argchecksub("--eta0",    opt->sgdl1.eta0   >  0.0);
 	argchecksub("--alpha",   opt->sgdl1.alpha  >  0.0);
+	argchecksub("--batch",   opt->sgdbatch     >  0  );
 	argchecksub("--nbest",   opt->nbest        >  0  );
+	argchecksub("--margin",  opt->margin       >= 0.0);
+	argchecksub("--evfrac",  opt->evfrac > 0.0 && opt->evfrac <= 1.0);
+	argchecksub("--hash",    opt->hash         <= 32 );
+	argchecksub("--hashbi",  opt->hashbi       <= 32 );
+	argchecksub("--vbatch",  opt->vbatch       >  0  );
+	argchecksub("--snapint", opt->snapint      >  0  );
+	argchecksub("--active",  opt->rpactive     <= 255);
 	#undef argchecksub
+	// The buckets identifiers must fit in the observations lists of the
+	// sequences, the last value of obs_t being reserved.
+	if (opt->hash != 0) {
+		const uint64_t nbkt = ((uint64_t)1 << opt->hash)
+		                    + ((uint64_t)1 << opt->hashbi);
+		if (nbkt > (obs_t)none)
+			fatal("too many hashed buckets for <--hash> and <--hashbi>");
+	}
+	// The weights format is checked now so an unknown name doesn't leave
+	// an empty output file behind.
+	mdl_wfmt(opt->wfmt);
 	if ((opt->maxent || !strcmp(opt->type, "maxent")) && !strcmp(opt->algo, "bcd"))
 		fatal("BCD not supported for training maxent models");
 	if (!strcmp(opt->type, "memm") && !strcmp(opt->algo, "bcd"))
@@ -89,6 +89,52 @@ struct opt_s {
 	// Options for model dump
 	int       prec;
 	bool      all;
+	// Options for binary models
+	bool      binary;
+	bool      packed;
+	// Options for parallel gradient
+	bool      reduce;
+	// Storage format of the L-BFGS history
+	char     *histfmt;
+	// Featurized datasets cache
+	char     *cache;
+	// Mini-batches size of sgd-l1
+	uint32_t  sgdbatch;
+	// Distributed training
+	char     *dist;
+	uint32_t  rank;
+	// Length above which the forward-backward is checkpointed
+	uint32_t  ckptlen;
+	// Storage format of the weights of converted models
+	char     *wfmt;
+	// Label server
+	char     *listen;
+	uint32_t  reload;
+	uint32_t  stats;
+	// Beam-pruned decoding
+	uint32_t  beam;
+	double    margin;
+	// Synthetic benchmarks
+	char     *scaley, *scalet;
+	// Profiling of the training
+	bool      profile;
+	char     *profout;
+	// Devel evaluation
+	uint32_t  evthread;
+	double    evfrac;
+	// Hashed feature space
+	uint32_t  hash, hashbi;
+	// Pruning of rare observations
+	uint32_t  mincount;
+	// Batched Viterbi
+	uint32_t  vbatch;
+	// Periodic checkpoints of the training
+	char     *snapshot;
+	uint32_t  snapint;
+	// Active set of rprop
+	uint32_t  rpactive;
+	// Pinning of the worker threads
+	bool      pin;
 };
 
 extern const opt_t opt_defaults;
@@ -62,9 +62,12 @@
  *   This subset is implemented quite efficiently using recursion. All recursive
  *   calls are tail-call so they should be optimized by the compiler. As we do
  *   direct interpretation, we have to backtrack so performance can be very poor
- *   on specialy designed regexp. This is not a problem as the regexp as well as
- *   the string is expected to be very simple here. If this is not the case, you
- *   better have to prepare your data better.
+ *   on specialy designed regexp.
+ *
+ *   To avoid this, the regexps used in patterns are compiled once to a bit-
+ *   parallel automaton, see rex_comp below, which run in time linear in the
+ *   string length. The interpreter is only kept for very long regexps who don't
+ *   fit in the automaton.
  ******************************************************************************/
 
 /* rex_matchit:
@@ -171,6 +174,149 @@ static int32_t rex_match(const char *re, const char *str, uint32_t *len) {
 	return -1;
 }
 
+/* rex_t:
+ *   A regexp compiled to a bit-parallel automaton. The regexp is a sequence of
+ *   <nitems> items, each one matching a single character, optionally followed
+ *   by a '*' or '?'. Bit 'i' in the state vectors stand for "items i and next
+ *   ones can still be matched", so bit <nitems> is the end of the regexp.
+ *   For each character 'c', <cls>[c] have bit 'i' set if item 'i' match 'c',
+ *   <opt> have the bits of the optional items ('*' and '?') and <star> the bits
+ *   of the repeated ones. <bol> and <eol> are the anchors.
+ */
+#define REX_MAXITEMS 63
+struct rex_s {
+	uint64_t cls[256];
+	uint64_t opt, star;
+	uint32_t nitems;
+	bool     bol, eol;
+};
+
+/* rex_comp:
+ *   Compile a regexp following exactly the interpretation done by rex_matchme.
+ *   Return NULL if the regexp is too long to be compiled, in this case it must
+ *   be interpreted.
+ */
+static rex_t *rex_comp(const char *re) {
+	rex_t *rex = xmalloc(sizeof(rex_t));
+	memset(rex, 0, sizeof(rex_t));
+	if (*re == '^')
+		rex->bol = true, re++;
+	uint32_t n = 0;
+	while (re[0] != '\0') {
+		if (re[0] == '$' && re[1] == '\0') {
+			rex->eol = true;
+			break;
+		}
+		const char *ch  = re;
+		if (*ch == '*' || *ch == '?')
+			fatal("unescaped * or ? in regexp: %s", re);
+		if (n == REX_MAXITEMS) {
+			xfree(rex);
+			return NULL;
+		}
+		// A trailing backslash match nothing, as in the interpreter,
+		// and end the regexp.
+		const bool last = ch[0] == '\\' && ch[1] == '\0';
+		const char *nxt = re + 1 + (ch[0] == '\\' && !last);
+		const uint64_t bit = (uint64_t)1 << n;
+		for (int c = 1; c < 256; c++) {
+			const char str[2] = {(char)c, '\0'};
+			if (rex_matchit(ch, str))
+				rex->cls[c] |= bit;
+		}
+		if (nxt[0] == '*')
+			rex->opt |= bit, rex->star |= bit, nxt++;
+		else if (nxt[0] == '?')
+			rex->opt |= bit, nxt++;
+		n++;
+		re = nxt;
+	}
+	rex->nitems = n;
+	return rex;
+}
+
+/* rex_step:
+ *   Compute the state before the character <c> from the state <x> after it,
+ *   including the optional items which can be skipped.
+ */
+static inline uint64_t rex_step(const rex_t *rex, uint64_t x, uint8_t c) {
+	const uint64_t acc = (uint64_t)1 << rex->nitems;
+	const uint64_t cls = rex->cls[c];
+	uint64_t r = (cls & ~rex->star & (x >> 1)) | (cls & rex->star & x);
+	if (!rex->eol)
+		r |= acc;
+	for (uint64_t o = 0; o != r; ) {
+		o = r;
+		r |= (r >> 1) & rex->opt;
+	}
+	return r;
+}
+
+/* rex_exec:
+ *   Match a compiled regexp in the given string with the same semantic as the
+ *   rex_match interpreter: return the position of the leftmost match or -1 and
+ *   store its length in len. The string is scanned backward to get for each
+ *   position the set of items who can match from there, the leftmost match is
+ *   the first position where the full regexp can match. Its length is found
+ *   by walking forward and doing the same choices than the interpreter, which
+ *   is greedy for '?' and lazy for '*'.
+ *   If <test> is true, only the existence of a match is checked.
+ */
+static int32_t rex_exec(const rex_t *rex, const char *str, uint32_t *len,
+                        bool test) {
+	const uint8_t *raw = (const void *)str;
+	const uint32_t n = strlen(str);
+	uint64_t stk[128], *st = stk;
+	if (!test && n + 1 > 128)
+		st = xmalloc(sizeof(uint64_t) * (n + 1));
+	// Backward scan, if we only need to test, the states don't have to be
+	// stored so everything is done in the first one.
+	uint64_t x = (uint64_t)1 << rex->nitems;
+	for (uint64_t o = 0; o != x; ) {
+		o = x;
+		x |= (x >> 1) & rex->opt;
+	}
+	int32_t first = x & 1 ? (int32_t)n : -1;
+	if (!test)
+		st[n] = x;
+	for (uint32_t p = n; p-- > 0; ) {
+		x = rex_step(rex, x, raw[p]);
+		if (!test)
+			st[p] = x;
+		if (x & 1)
+			first = p;
+	}
+	if (rex->bol && first != 0)
+		first = -1;
+	if (first == -1 || test) {
+		if (st != stk)
+			xfree(st);
+		return first;
+	}
+	// Forward walk from the leftmost match position
+	uint32_t p = first;
+	for (uint32_t i = 0; i < rex->nitems; ) {
+		const uint64_t bit = (uint64_t)1 << i;
+		if (rex->star & bit) {
+			if (st[p] & (bit << 1))
+				i++;
+			else
+				p++;
+		} else if (rex->opt & bit) {
+			if (p < n && (rex->cls[raw[p]] & bit)
+			          && (st[p + 1] & (bit << 1)))
+				p++;
+			i++;
+		} else {
+			p++, i++;
+		}
+	}
+	*len = p - first;
+	if (st != stk)
+		xfree(st);
+	return first;
+}
+
 /*******************************************************************************
  * Pattern handling
  *
@@ -233,6 +379,7 @@ pat_t *pat_comp(char *p) {
 	while (p[pos] != '\0') {
 		pat_item_t *item = &(pat->items[nitems++]);
 		item->value = NULL;
+		item->rex   = NULL;
 		if (p[pos] == '%') {
 			// This is a command, so first parse its type and check
 			// its a valid one. Next prepare the item.
@@ -277,6 +424,7 @@ pat_t *pat_comp(char *p) {
 				item->value = xmalloc(sizeof(char) * (len + 1));
 				memcpy(item->value, p + start, len);
 				item->value[len] = '\0';
+				item->rex = rex_comp(item->value);
 				pos++;
 			}
 			// Just check the end of the arg list and loop.
@@ -303,20 +451,22 @@ pat_t *pat_comp(char *p) {
 	return pat;
 }
 
-/* pat_exec:
+/* pat_execbuf:
  *   Execute a compiled pattern at position 'at' in the given tokens sequences
- *   in order to produce an observation string. The string is returned as a
- *   newly allocated memory block and the caller is responsible to free it when
- *   not needed anymore.
+ *   in order to produce an observation string. The string is written in the
+ *   caller supplied buffer <buf> of <size> bytes starting at offset <off>, so
+ *   the caller can put a prefix in front of it. The buffer is grown if needed
+ *   and its new size stored back in <size>, so if the same buffer is used for
+ *   all observations, there is almost no memory allocation. The length of the
+ *   observation string, without the prefix, is returned.
  */
-char *pat_exec(const pat_t *pat, const tok_t *tok, uint32_t at) {
+uint32_t pat_execbuf(const pat_t *pat, const tok_t *tok, uint32_t at,
+                     char **buf, uint32_t *size, uint32_t off) {
 	static char *bval[] = {"_x-1", "_x-2", "_x-3", "_x-4", "_x-#"};
 	static char *eval[] = {"_x+1", "_x+2", "_x+3", "_x+4", "_x+#"};
 	const uint32_t T = tok->len;
-	// Prepare the buffer who will hold the result
-	uint32_t size = 16, pos = 0;
-	char *buffer = xmalloc(sizeof(char) * size);
-	// And loop over the compiled items
+	uint32_t pos = off;
+	// Loop over the compiled items
 	for (uint32_t it = 0; it < pat->nitems; it++) {
 		const pat_item_t *item = &(pat->items[it]);
 		char *value = NULL;
@@ -352,34 +502,61 @@ char *pat_exec(const pat_t *pat, const tok_t *tok, uint32_t at) {
 		} else if (item->type == 'x') {
 			len = strlen(value);
 		} else if (item->type == 't') {
-			if (rex_match(item->value, value, &len) == -1)
+			int32_t pos;
+			if (item->rex != NULL)
+				pos = rex_exec(item->rex, value, &len, true);
+			else
+				pos = rex_match(item->value, value, &len);
+			if (pos == -1)
 				value = "false";
 			else
 				value = "true";
 			len = strlen(value);
 		} else if (item->type == 'm') {
-			int32_t pos = rex_match(item->value, value, &len);
+			int32_t pos;
+			if (item->rex != NULL)
+				pos = rex_exec(item->rex, value, &len, false);
+			else
+				pos = rex_match(item->value, value, &len);
 			if (pos == -1)
 				len = 0;
 			value += pos;
 		}
 		// And we add it to the buffer, growing it if needed. If the
 		// user requested it, we also remove caps from the string.
-		if (pos + len >= size - 1) {
-			while (pos + len >= size - 1)
-				size = size * 1.4;
-			buffer = xrealloc(buffer, sizeof(char) * size);
+		if (pos + len + 1 > *size) {
+			uint32_t sz = max(*size, 16);
+			while (pos + len + 1 > sz)
+				sz = sz * 1.4;
+			*buf = xrealloc(*buf, sizeof(char) * sz);
+			*size = sz;
 		}
-		memcpy(buffer + pos, value, len);
+		char *dst = *buf;
+		memcpy(dst + pos, value, len);
 		if (item->caps)
 			for (uint32_t i = pos; i < pos + len; i++)
-				buffer[i] = tolower(buffer[i]);
+				dst[i] = tolower(dst[i]);
 		pos += len;
 	}
-	// Adjust the result and return it.
-	buffer[pos++] = '\0';
-	buffer = xrealloc(buffer, sizeof(char) * pos);
-	return buffer;
+	if (pos + 1 > *size) {
+		*buf = xrealloc(*buf, sizeof(char) * (pos + 1));
+		*size = pos + 1;
+	}
+	(*buf)[pos] = '\0';
+	return pos - off;
+}
+
+/* pat_exec:
+ *   Execute a compiled pattern at position 'at' in the given tokens sequences
+ *   in order to produce an observation string. The string is returned as a
+ *   newly allocated memory block and the caller is responsible to free it when
+ *   not needed anymore.
+ */
+char *pat_exec(const pat_t *pat, const tok_t *tok, uint32_t at) {
+	char *buf = NULL;
+	uint32_t size = 0;
+	const uint32_t len = pat_execbuf(pat, tok, at, &buf, &size, 0);
+	return xrealloc(buf, sizeof(char) * (len + 1));
 }
 
 /* pat_free:
@@ -388,8 +565,10 @@ char *pat_exec(const pat_t *pat, const tok_t *tok, uint32_t at) {
  *   not use this pointer again.
  */
 void pat_free(pat_t *pat) {
-	for (uint32_t it = 0; it < pat->nitems; it++)
+	for (uint32_t it = 0; it < pat->nitems; it++) {
 		xfree(pat->items[it].value);
+		xfree(pat->items[it].rex);
+	}
 	xfree(pat->src);
 	xfree(pat);
 }
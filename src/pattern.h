@@ -33,6 +33,7 @@
 
 #include "sequence.h"
 
+typedef struct rex_s rex_t;
 typedef struct pat_s pat_t;
 typedef struct pat_item_s pat_item_t;
 struct pat_s {
@@ -43,6 +44,7 @@ struct pat_s {
 		char      type;
 		bool      caps;
 		char     *value;
+		rex_t    *rex;
 		bool      absolute;
 		int32_t   offset;
 		uint32_t  column;
@@ -51,6 +53,8 @@ struct pat_s {
 
 pat_t *pat_comp(char *p);
 char *pat_exec(const pat_t *pat, const tok_t *tok, uint32_t at);
+uint32_t pat_execbuf(const pat_t *pat, const tok_t *tok, uint32_t at,
+                     char **buf, uint32_t *size, uint32_t off);
 void pat_free(pat_t *pat);
 
 #endif
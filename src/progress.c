@@ -24,6 +24,9 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+
+#define _POSIX_C_SOURCE 200112L
+
 #include <inttypes.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -31,6 +34,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #if defined(__llvm__) && defined(WIN32)
 #include "winsock.h"
@@ -39,11 +43,15 @@
 #include <sys/time.h>
 #endif
 #if !defined(WIN32) && !defined(_WIN32)
+#include <errno.h>
 #include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #endif
 
 #include "wapiti.h"
 #include "decoder.h"
+#include "dist.h"
 #include "model.h"
 #include "options.h"
 #include "progress.h"
@@ -59,6 +67,10 @@
  *   between to call to the progress function and evualtion on the devel data
  *   are included.
  *
+ *   If requested, trainers also save a checkpoint of the model and of their own
+ *   state every few iterations with uit_checkpoint. This is done in a forked
+ *   child so the training continue while it is written.
+ *
  *   This module setup a signal handler for SIGINT. If this signal is catched,
  *   the uit_stop global variable to inform the trainer that it have to stop as
  *   early as possible, discarding the recent computations if they cannot be
@@ -77,6 +89,48 @@
  */
 bool uit_stop = false;
 
+/* uit_intr:
+ *   This value is set to true when an interrupt signal is received. For
+ *   distributed training, the signal don't set directly <uit_stop> as all the
+ *   nodes must stop at the same point: it is only forwarded to all of them
+ *   with the next gradient and then set <uit_stop> everywhere.
+ */
+bool uit_intr = false;
+static bool uit_dist = false;
+
+/* uit_prf:
+ *   Profile counters of the current iteration summed over all the threads, and
+ *   the file where they are dumped in JSON if requested.
+ */
+static uit_prf_t uit_prf;
+static FILE *uit_prffile = NULL;
+
+/* uit_ev:
+ *   State of the devel set evaluation. <smp> is the sampled subset of the
+ *   devel set if only a fraction of it is evaluated. For background
+ *   evaluation, <mdl> is a shallow copy of the model whose weights point to
+ *   the <theta> snapshot, and <run> is the evaluation in progress started at
+ *   iteration <it>, or NULL if there is none.
+ */
+static struct {
+	dat_t        smp;
+	mdl_t        mdl;
+	double      *theta;
+	tag_evrun_t *run;
+	uint32_t     it;
+} uit_ev;
+
+/* uit_ck:
+ *   The child process writing the last checkpoint, started at iteration <it>,
+ *   or 0 if there is none.
+ */
+#if !defined(WIN32) && !defined(_WIN32)
+static struct {
+	pid_t    pid;
+	uint32_t it;
+} uit_ck;
+#endif
+
 /* uit_signal:
  *   Signal handler to catch interupt signal. When a signal is received, the
  *   trainer is aksed to stop as soon as possible leaving the model in a clean
@@ -86,7 +140,9 @@ bool uit_stop = false;
  */
 static void uit_signal(int sig) {
 	signal(sig, SIG_DFL);
-	uit_stop = true;
+	uit_intr = true;
+	if (!uit_dist)
+		uit_stop = true;
 }
 
 /* uit_setup:
@@ -94,13 +150,70 @@ static void uit_signal(int sig) {
  *   and start the timer.
  */
 void uit_setup(mdl_t *mdl) {
-	uit_stop = false;
+	uit_stop = uit_intr = false;
+	uit_dist = mdl->dist != NULL;
 	if (signal(SIGINT, uit_signal) == SIG_ERR)
 		warning("failed to set signal handler, no clean early stop");
 	gettimeofday(&mdl->timer, NULL);
 	if (mdl->opt->stopwin != 0)
 		mdl->werr = xmalloc(sizeof(double) * mdl->opt->stopwin);
 	mdl->wcnt = mdl->wpos = 0;
+	uit_prfclear(&uit_prf);
+	if (mdl->opt->profout != NULL) {
+		uit_prffile = fopen(mdl->opt->profout, "w");
+		if (uit_prffile == NULL)
+			pfatal("cannot open profile file");
+	}
+	// Select the sequences evaluated if only a fraction of the devel set
+	// is requested. They are taken at regular interval and kept for the
+	// whole training so error rates remain comparable between iterations.
+	uit_ev.smp.nseq = 0;
+	uit_ev.smp.seq  = NULL;
+	uit_ev.theta    = NULL;
+	uit_ev.run      = NULL;
+	if (mdl->opt->evfrac < 1.0) {
+		const dat_t *dat = mdl->devel == NULL ? mdl->train : mdl->devel;
+		const uint32_t S = dat->nseq;
+		uint32_t N = (uint32_t)(S * mdl->opt->evfrac);
+		N = max(N, min(S, 1u));
+		uit_ev.smp.lbl  = dat->lbl;
+		uit_ev.smp.mlen = dat->mlen;
+		uit_ev.smp.nseq = N;
+		uit_ev.smp.seq  = xmalloc(sizeof(seq_t *) * max(N, 1u));
+		uit_ev.smp.blk  = NULL;
+		for (uint32_t n = 0; n < N; n++)
+			uit_ev.smp.seq[n] = dat->seq[(uint64_t)n * S / N];
+	}
+	if (mdl->opt->evthread != 0)
+		uit_ev.theta = xmalloc(sizeof(double) * mdl->nftr);
+#if !defined(WIN32) && !defined(_WIN32)
+	uit_ck.pid = 0;
+#endif
+}
+
+/* uit_ckwait:
+ *   Wait for the child writing the last checkpoint, if there is one, and warn
+ *   the user if it failed. If <block> is false, return immediately with false
+ *   if it is still running.
+ */
+static bool uit_ckwait(bool block) {
+#if !defined(WIN32) && !defined(_WIN32)
+	if (uit_ck.pid == 0)
+		return true;
+	int st;
+	pid_t res;
+	do {
+		res = waitpid(uit_ck.pid, &st, block ? 0 : WNOHANG);
+	} while (res < 0 && errno == EINTR);
+	if (res == 0)
+		return false;
+	if (res < 0 || !WIFEXITED(st) || WEXITSTATUS(st) != EXIT_SUCCESS)
+		warning("checkpoint of iteration %"PRIu32" failed", uit_ck.it);
+	uit_ck.pid = 0;
+#else
+	(void)block;
+#endif
+	return true;
 }
 
 /* uit_cleanup:
@@ -108,14 +221,136 @@ void uit_setup(mdl_t *mdl) {
  *   interrupt.
  */
 void uit_cleanup(mdl_t *mdl) {
-	unused(mdl);
+	// Wait for the last background evaluation and report it as there will
+	// be no further iteration to do it.
+	if (uit_ev.run != NULL) {
+		double te, se;
+		tag_evalend(uit_ev.run, &te, &se);
+		uit_ev.run = NULL;
+		info("  [%4"PRIu32"] err=%5.2f%%/%5.2f%%\n", uit_ev.it, te, se);
+	}
+	// The last checkpoint must be complete before the program exit.
+	uit_ckwait(true);
+	if (uit_ev.theta != NULL) {
+		xfree(uit_ev.theta);
+		uit_ev.theta = NULL;
+	}
+	if (uit_ev.smp.seq != NULL) {
+		xfree(uit_ev.smp.seq);
+		uit_ev.smp.seq = NULL;
+	}
 	if (mdl->opt->stopwin != 0) {
 		xfree(mdl->werr);
 		mdl->werr = NULL;
 	}
+	if (uit_prffile != NULL) {
+		fclose(uit_prffile);
+		uit_prffile = NULL;
+	}
 	signal(SIGINT, SIG_DFL);
 }
 
+/* uit_clock:
+ *   Return the wall clock time in microseconds for the profile counters.
+ */
+uint64_t uit_clock(void) {
+	tms_t tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* uit_prfclear:
+ *   Reset all the given profile counters to zero.
+ */
+void uit_prfclear(uit_prf_t *prf) {
+	for (int p = 0; p < UIT_NPHASE; p++)
+		prf->tm[p] = 0;
+	prf->nseq = prf->ntok = prf->retry = 0;
+}
+
+/* uit_prfadd:
+ *   Add the given counters to the ones of the current iteration and clear
+ *   them. This can be called concurrently by the workers.
+ */
+void uit_prfadd(uit_prf_t *prf) {
+	for (int p = 0; p < UIT_NPHASE; p++)
+		__sync_fetch_and_add(&uit_prf.tm[p], prf->tm[p]);
+	__sync_fetch_and_add(&uit_prf.nseq,  prf->nseq);
+	__sync_fetch_and_add(&uit_prf.ntok,  prf->ntok);
+	__sync_fetch_and_add(&uit_prf.retry, prf->retry);
+	uit_prfclear(prf);
+}
+
+/* uit_prfreport:
+ *   Display the profile of the iteration who took <tm> seconds and dump it to
+ *   the JSON file if any, one object by line. The time of the optimizer is
+ *   what remain of the iteration outside of the gradient computations and the
+ *   evaluation. The counters are next cleared for the next iteration.
+ */
+static void uit_prfreport(mdl_t *mdl, uint32_t it, double obj, double tm) {
+	static const char *name[UIT_NPHASE] = {
+		"psi", "fwdbwd", "update", "gradient", "reduce", "eval"
+	};
+	const uit_prf_t *prf = &uit_prf;
+	double sec[UIT_NPHASE];
+	for (int p = 0; p < UIT_NPHASE; p++)
+		sec[p] = prf->tm[p] * 1.0e-6;
+	const double opt = max(0.0, tm - sec[UIT_GRADIENT] - sec[UIT_EVAL]);
+	info("         psi=%.2fs fwdbwd=%.2fs update=%.2fs",
+		sec[UIT_PSI], sec[UIT_FWDBWD], sec[UIT_UPDATE]);
+	info(" seq=%"PRIu64" tok=%"PRIu64" retry=%"PRIu64"\n",
+		prf->nseq, prf->ntok, prf->retry);
+	info("         gradient=%.2fs reduce=%.2fs optim=%.2fs eval=%.2fs\n",
+		sec[UIT_GRADIENT], sec[UIT_REDUCE], opt, sec[UIT_EVAL]);
+	FILE *file = uit_prffile;
+	if (file != NULL) {
+		fprintf(file, "{\"iter\":%"PRIu32",\"time\":%.6f", it, tm);
+		if (obj >= 0.0)
+			fprintf(file, ",\"obj\":%.6f", obj);
+		else
+			fprintf(file, ",\"obj\":null");
+		fprintf(file, ",\"threads\":%"PRIu32, mdl->opt->nthread);
+		fprintf(file, ",\"seqs\":%"PRIu64",\"tokens\":%"PRIu64
+			",\"retries\":%"PRIu64, prf->nseq, prf->ntok,
+			prf->retry);
+		for (int p = 0; p < UIT_NPHASE; p++)
+			fprintf(file, ",\"%s\":%.6f", name[p], sec[p]);
+		fprintf(file, ",\"optim\":%.6f}\n", opt);
+		fflush(file);
+	}
+	uit_prfclear(&uit_prf);
+}
+
+/* uit_eval:
+ *   Compute the error rates of the model on the devel set, or on the sampled
+ *   part of it. If background evaluation is enabled, this take a snapshot of
+ *   the weights and start their evaluation on the reserved threads while the
+ *   trainer go on, and return the result of the previous call instead. In
+ *   this case, false is returned if there is no such result yet.
+ */
+static bool uit_eval(mdl_t *mdl, uint32_t it, double *te, double *se) {
+	const opt_t *opt = mdl->opt;
+	dat_t *dat = mdl->devel == NULL ? mdl->train : mdl->devel;
+	if (uit_ev.smp.seq != NULL)
+		dat = &uit_ev.smp;
+	if (opt->evthread == 0) {
+		tag_evrun_t *run = tag_evalstart(mdl, dat, opt->nthread, false);
+		tag_evalend(run, te, se);
+		return true;
+	}
+	bool res = false;
+	if (uit_ev.run != NULL) {
+		tag_evalend(uit_ev.run, te, se);
+		res = true;
+	}
+	memcpy(uit_ev.theta, mdl->theta, sizeof(double) * mdl->nftr);
+	uit_ev.mdl = *mdl;
+	uit_ev.mdl.theta = uit_ev.theta;
+	uit_ev.run = tag_evalstart(&uit_ev.mdl, dat, opt->evthread, true);
+	uit_ev.it  = it;
+	return res;
+}
+
 /* uit_progress:
  *   Display a progress repport to the user consisting of some informations
  *   provided by the trainer: iteration count and objective function value, and
@@ -125,9 +360,22 @@ void uit_cleanup(mdl_t *mdl) {
  *   independant stoping criterion.
  */
 bool uit_progress(mdl_t *mdl, uint32_t it, double obj) {
-	// First we just compute the error rate on devel or train data
-	double te, se;
-	tag_eval(mdl, &te, &se);
+	// For distributed training, only the first node evaluate the model
+	// and display the report. Its decision to continue or not is next sent
+	// to the other nodes.
+	dst_t *dst = mdl->dist;
+	if (dst != NULL && dst->rank != 0) {
+		uit_prfclear(&uit_prf);
+		bool res;
+		dst_bcast(dst, &res, sizeof(res));
+		return res;
+	}
+	// First we just compute the error rate on devel or train data, with
+	// background evaluation these are the ones of the previous iteration.
+	double te = 0.0, se = 0.0;
+	const uint64_t tic = uit_clock();
+	const bool hasev = uit_eval(mdl, it, &te, &se);
+	uit_prf.tm[UIT_EVAL] += uit_clock() - tic;
 	// Next, we compute the number of active features
 	uint64_t act = 0;
 	for (uint64_t f = 0; f < mdl->nftr; f++)
@@ -145,13 +393,18 @@ bool uit_progress(mdl_t *mdl, uint32_t it, double obj) {
 	info("  [%4"PRIu32"]", it);
 	info(obj >= 0.0 ? " obj=%-10.2f" : " obj=NA", obj);
 	info(" act=%-8"PRIu64, act);
-	info(" err=%5.2f%%/%5.2f%%", te, se);
+	if (hasev)
+		info(" err=%5.2f%%/%5.2f%%", te, se);
+	else
+		info(" err=NA           ");
 	info(" time=%.2fs/%.2fs", tm, mdl->total);
 	info("\n");
+	if (mdl->opt->profile)
+		uit_prfreport(mdl, it, obj, tm);
 	// If requested, check the error rate stoping criterion. We check if the
 	// error rate is stable enought over a few iterations.
 	bool res = true;
-	if (mdl->opt->stopwin != 0) {
+	if (mdl->opt->stopwin != 0 && hasev) {
 		mdl->werr[mdl->wpos] = te;
 		mdl->wpos = (mdl->wpos + 1) % mdl->opt->stopwin;
 		mdl->wcnt++;
@@ -167,8 +420,122 @@ bool uit_progress(mdl_t *mdl, uint32_t it, double obj) {
 	}
 	// And return
 	if (uit_stop)
-		return false;
+		res = false;
+	if (dst != NULL)
+		dst_bcast(dst, &res, sizeof(res));
 	return res;
 }
 
+/* uit_ckput:
+ *   Write a checkpoint file with <fn>. It is written under a temporary name,
+ *   synced to disk and next renamed, so a crash at any time leave the previous
+ *   checkpoint intact. This may run in the forked child, so errors are only
+ *   reported and false is returned instead of exiting.
+ */
+static bool uit_ckput(const char *path, mdl_t *mdl, uit_state_t *fn,
+                      void *ud) {
+	const size_t len = strlen(path);
+	char *tmp = xmalloc(len + 5);
+	memcpy(tmp, path, len);
+	strcpy(tmp + len, ".tmp");
+	const char *err = NULL;
+	FILE *file = fopen(tmp, "wb");
+	if (file == NULL) {
+		warning("cannot open checkpoint file: %s", strerror(errno));
+		xfree(tmp);
+		return false;
+	}
+	fn(mdl, file, ud);
+	if (fflush(file) != 0 || ferror(file))
+		err = "write";
+#if !defined(WIN32) && !defined(_WIN32)
+	else if (fsync(fileno(file)) != 0)
+		err = "sync";
+#else
+	else
+		remove(path);
+#endif
+	if (fclose(file) != 0 && err == NULL)
+		err = "close";
+	if (err == NULL && rename(tmp, path) != 0)
+		err = "rename";
+	if (err != NULL) {
+		warning("cannot %s checkpoint file: %s", err, strerror(errno));
+		remove(tmp);
+	}
+	xfree(tmp);
+	return err == NULL;
+}
+
+/* uit_ckmodel:
+ *   Checkpoint writer for the model itself.
+ */
+static void uit_ckmodel(mdl_t *mdl, FILE *file, void *ud) {
+	(void)ud;
+	mdl_savebin(mdl, file);
+}
+
+/* uit_ckwrite:
+ *   Write a full checkpoint: the trainer state, if any, in the file given by
+ *   the user with ".state" appended, and the model in binary form in the file
+ *   itself. The state is written first so the model is never more recent than
+ *   it. Return false if any of them cannot be written.
+ */
+static bool uit_ckwrite(mdl_t *mdl, uit_state_t *state, void *ud) {
+	const char *path = mdl->opt->snapshot;
+	if (state != NULL) {
+		const size_t len = strlen(path);
+		char *spath = xmalloc(len + 7);
+		memcpy(spath, path, len);
+		strcpy(spath + len, ".state");
+		const bool ok = uit_ckput(spath, mdl, state, ud);
+		xfree(spath);
+		if (!ok)
+			return false;
+	}
+	return uit_ckput(path, mdl, uit_ckmodel, NULL);
+}
 
+/* uit_checkpoint:
+ *   Trainers call this at the end of each iteration, when the model and their
+ *   state <ud> are consistent, with the function writing this state in the
+ *   format read back with --rstate or NULL if they have none. Every <snapint>
+ *   iterations, a checkpoint is written from a forked child: the copy-on-write
+ *   pages give it a snapshot of the weights and the optimizer history for
+ *   free, the parent only paying for the pages it modifies while the child is
+ *   writing. If the previous checkpoint is still being written, this one is
+ *   skipped. Where fork is not available, the checkpoint is just written in
+ *   the foreground.
+ */
+void uit_checkpoint(mdl_t *mdl, uint32_t it, uit_state_t *state, void *ud) {
+	const opt_t *opt = mdl->opt;
+	if (opt->snapshot == NULL || it % opt->snapint != 0)
+		return;
+	if (mdl->dist != NULL && mdl->dist->rank != 0)
+		return;
+#if !defined(WIN32) && !defined(_WIN32)
+	if (!uit_ckwait(false)) {
+		warning("checkpoint of iteration %"PRIu32" still running, "
+			"skipping iteration %"PRIu32, uit_ck.it, it);
+		return;
+	}
+	// Pending output is flushed so it is not written again by the child
+	// if the model writer exit on error.
+	fflush(NULL);
+	const pid_t pid = fork();
+	if (pid == 0) {
+		signal(SIGINT, SIG_IGN);
+		if (!uit_ckwrite(mdl, state, ud))
+			_exit(EXIT_FAILURE);
+		_exit(EXIT_SUCCESS);
+	}
+	if (pid > 0) {
+		uit_ck.pid = pid;
+		uit_ck.it  = it;
+		return;
+	}
+	warning("cannot fork the checkpoint, writing it in the foreground");
+#endif
+	if (!uit_ckwrite(mdl, state, ud))
+		warning("checkpoint of iteration %"PRIu32" failed", it);
+}
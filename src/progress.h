@@ -30,15 +30,53 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include "wapiti.h"
 #include "model.h"
 
+/* uit_prf_t:
+ *   Profile counters of the training. The time, in microseconds, spent in each
+ *   phase is summed over all the threads doing it, with the count of sequences
+ *   and tokens processed and of the atomic updates of the gradient who had to
+ *   be retried.
+ *   Each worker accumulate in its own copy without any synchronization and
+ *   add it to the totals of the iteration with uit_prfadd.
+ */
+enum {
+	UIT_PSI,        // building of the Ψ matrices
+	UIT_FWDBWD,     // forward-backward recursions
+	UIT_UPDATE,     // updates of the gradient
+	UIT_GRADIENT,   // wall time of the full gradient computations
+	UIT_REDUCE,     //   including their reduction and penalty
+	UIT_EVAL,       // evaluation of the model at the end of iteration
+	UIT_NPHASE
+};
+
+typedef struct uit_prf_s uit_prf_t;
+struct uit_prf_s {
+	uint64_t  tm[UIT_NPHASE];  //  time spent in each phase
+	uint64_t  nseq;            //  sequences processed
+	uint64_t  ntok;            //  tokens processed
+	uint64_t  retry;           //  atomic updates retried
+};
+
+/* uit_state_t:
+ *   Function writing the state of a trainer in a checkpoint.
+ */
+typedef void (uit_state_t)(mdl_t *mdl, FILE *file, void *ud);
+
 extern bool uit_stop;
+extern bool uit_intr;
 
 void uit_setup(mdl_t *mdl);
 void uit_cleanup(mdl_t *mdl);
 bool uit_progress(mdl_t *mdl, uint32_t it, double obj);
+void uit_checkpoint(mdl_t *mdl, uint32_t it, uit_state_t *state, void *ud);
+
+uint64_t uit_clock(void);
+void uit_prfclear(uit_prf_t *prf);
+void uit_prfadd(uit_prf_t *prf);
 
 #endif
 
@@ -52,6 +52,14 @@
  *
  *   This code is copyright 2002-2013 Thomas Lavergne and licenced under the BSD
  *   Licence like the remaining of Wapiti.
+ *
+ *   Once the map will not change anymore, it can be frozen to a more compact
+ *   and cache friendly read-only form. All the keys are packed in a single
+ *   arena, each one preceded by its identifier, and an open-addressing hash
+ *   table store the hash and arena offset of each key. A successful lookup
+ *   generally touch only one slot of the table and one place in the arena, and
+ *   a failed one only the table as full hash values are compared first. This
+ *   form can be stored in binary files and used directly from a mapping.
  ******************************************************************************/
 
 typedef struct node_s node_t;
@@ -69,6 +77,14 @@ struct qrk_s {
 	bool     lock;
 	uint64_t count;
 	uint64_t size;
+	// Frozen form, see qrk_freeze
+	bool      frozen;
+	bool      owned;   //       frozen arrays allocated by us
+	char     *keys;    //       arena of identifiers and keys
+	uint64_t *offs;    // [N]   offset of each key in the arena
+	uint64_t *table;   // [2M]  hash table of (hash, offset) pairs
+	uint64_t  ksize;   //       size of the arena
+	uint64_t  mask;    //   M-1 size of the hash table minus one
 };
 
 #define qrk_lf2nd(lf)  ((node_t *)((intptr_t)(lf) |  1))
@@ -88,15 +104,17 @@ qrk_t *qrk_new(void) {
 	qrk->lock  = false;
 	qrk->size  = size;
 	qrk->leafs = xmalloc(sizeof(leaf_t *) * size);
+	qrk->frozen = qrk->owned = false;
+	qrk->keys  = NULL;
+	qrk->offs  = qrk->table = NULL;
+	qrk->ksize = qrk->mask = 0;
 	return qrk;
 }
 
-/* qrk_free:
- *   Release all the memory used by a qrk_t object allocated with qrk_new. This
- *   will release all key string stored internally so all key returned by
- *   qrk_unmap become invalid and must not be used anymore.
+/* qrk_freetrie:
+ *   Release all the nodes and leafs of the trie.
  */
-void qrk_free(qrk_t *qrk) {
+static void qrk_freetrie(qrk_t *qrk) {
 	const uint32_t stkmax = 1024;
 	if (qrk->count != 0) {
 		node_t *stk[stkmax];
@@ -113,17 +131,145 @@ void qrk_free(qrk_t *qrk) {
 			xfree(nd);
 		}
 	}
+	qrk->root = NULL;
+}
+
+/* qrk_free:
+ *   Release all the memory used by a qrk_t object allocated with qrk_new. This
+ *   will release all key string stored internally so all key returned by
+ *   qrk_unmap become invalid and must not be used anymore.
+ */
+void qrk_free(qrk_t *qrk) {
+	if (!qrk->frozen) {
+		qrk_freetrie(qrk);
+	} else if (qrk->owned) {
+		xfree(qrk->keys);
+		xfree(qrk->offs);
+		xfree(qrk->table);
+	}
 	xfree(qrk->leafs);
 	xfree(qrk);
 }
 
+/* qrk_hash:
+ *   Hash function used by the frozen form. This is the 64bit FNV-1a followed by
+ *   a final mix so the low bits used for indexing the table are good. The key
+ *   length is returned in <len>. It is also used by the reader to map hashed
+ *   observations to their buckets.
+ */
+uint64_t qrk_hash(const char *key, size_t *len) {
+	const uint8_t *raw = (void *)key;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t n;
+	for (n = 0; raw[n] != 0; n++)
+		h = (h ^ raw[n]) * 0x100000001b3ULL;
+	*len = n;
+	h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/* qrk_lookup:
+ *   Search a key in the frozen form of the map and return its identifier or
+ *   none if it is not present.
+ */
+static uint64_t qrk_lookup(const qrk_t *qrk, const char *key) {
+	size_t len;
+	const uint64_t h = qrk_hash(key, &len);
+	for (uint64_t i = h & qrk->mask; ; i = (i + 1) & qrk->mask) {
+		const uint64_t *slot = qrk->table + 2 * i;
+		if (slot[1] == none)
+			return none;
+		if (slot[0] != h)
+			continue;
+		const char *ent = qrk->keys + slot[1];
+		if (!strcmp(ent + sizeof(uint64_t), key))
+			return *(const uint64_t *)ent;
+	}
+}
+
+/* qrk_build:
+ *   Build the frozen arrays of the map from the keys currently stored in it.
+ *   This doesn't touch the trie and just fill the frozen fields, so the caller
+ *   have to decide what to do with them.
+ */
+static void qrk_build(qrk_t *qrk) {
+	const uint64_t N = qrk->count;
+	uint64_t M = 2;
+	while (M < N + N / 3 + 1)
+		M *= 2;
+	uint64_t *offs  = xmalloc(sizeof(uint64_t) * (N + 1));
+	uint64_t *table = xmalloc(sizeof(uint64_t) * 2 * M);
+	uint64_t  K = 0;
+	for (uint64_t n = 0; n < N; n++) {
+		const size_t len = strlen(qrk->leafs[n]->key) + 1;
+		offs[n] = K;
+		K += sizeof(uint64_t) + (len + 7) / 8 * 8;
+	}
+	char *keys = xmalloc(K + 1);
+	memset(keys, 0, K + 1);
+	for (uint64_t m = 0; m < M; m++)
+		table[2 * m] = 0, table[2 * m + 1] = none;
+	for (uint64_t n = 0; n < N; n++) {
+		const char *key = qrk->leafs[n]->key;
+		size_t len;
+		const uint64_t h = qrk_hash(key, &len);
+		memcpy(keys + offs[n], &n, sizeof(uint64_t));
+		memcpy(keys + offs[n] + sizeof(uint64_t), key, len + 1);
+		uint64_t i = h & (M - 1);
+		while (table[2 * i + 1] != none)
+			i = (i + 1) & (M - 1);
+		table[2 * i] = h, table[2 * i + 1] = offs[n];
+	}
+	qrk->keys  = keys;
+	qrk->offs  = offs;
+	qrk->table = table;
+	qrk->ksize = K;
+	qrk->mask  = M - 1;
+}
+
+/* qrk_thaw:
+ *   Rebuild the trie of a frozen map from its keys and release the frozen form.
+ *   As the keys are inserted in identifiers order, they get the same ids.
+ */
+static void qrk_thaw(qrk_t *qrk) {
+	const uint64_t N = qrk->count;
+	char     *keys  = qrk->keys;
+	uint64_t *offs  = qrk->offs;
+	uint64_t *table = qrk->table;
+	const bool owned = qrk->owned;
+	qrk->frozen = qrk->owned = false;
+	qrk->lock  = false;
+	qrk->count = 0;
+	qrk->root  = NULL;
+	if (qrk->size < N + 1) {
+		qrk->size  = N + 1;
+		qrk->leafs = xrealloc(qrk->leafs, sizeof(leaf_t *) * qrk->size);
+	}
+	for (uint64_t n = 0; n < N; n++)
+		qrk_str2id(qrk, keys + offs[n] + sizeof(uint64_t));
+	if (owned) {
+		xfree(keys);
+		xfree(offs);
+		xfree(table);
+	}
+	qrk->keys  = NULL;
+	qrk->offs  = qrk->table = NULL;
+	qrk->ksize = qrk->mask = 0;
+}
+
 /* qrk_insert:
  *   Map a key to a uniq identifier. If the key already exist in the map, return
  *   its identifier, else allocate a new identifier and insert the new (key,id)
  *   pair inside the quark. This function is not thread safe and should not be
- *   called on the same map from different thread without locking.
+ *   called on the same map from different thread without locking, unless the
+ *   map is frozen: the lookups are then done in the read-only frozen form and
+ *   can be done concurrently, see mdl_share.
  */
 uint64_t qrk_str2id(qrk_t *qrk, const char *key) {
+	if (qrk->frozen)
+		return qrk_lookup(qrk, key);
 	const uint8_t *raw = (void *)key;
 	const size_t   len = strlen(key);
 	// We first take care of the empty trie case so later we can safely
@@ -217,6 +363,8 @@ uint64_t qrk_str2id(qrk_t *qrk, const char *key) {
 const char *qrk_id2str(const qrk_t *qrk, uint64_t id) {
 	if (id >= qrk->count)
 		fatal("invalid identifier");
+	if (qrk->frozen)
+		return qrk->keys + qrk->offs[id] + sizeof(uint64_t);
 	return qrk->leafs[id]->key;
 }
 
@@ -231,7 +379,7 @@ void qrk_save(const qrk_t *qrk, iol_t *iol) {
 	if (qrk->count == 0)
 		return;
 	for (uint64_t n = 0; n < qrk->count; n++)
-		ns_writestr(iol, qrk->leafs[n]->key);
+		ns_writestr(iol, qrk_id2str(qrk, n));
 }
 
 /* qrk_load:
@@ -244,9 +392,11 @@ void qrk_load(qrk_t *qrk, iol_t *iol) {
 	uint64_t cnt = 0;
         char *line = iol->gets_cb(iol->in);
 
-	if (sscanf(line, "#qrk#%"SCNu64"\n", &cnt) != 1) {
+	if (line == NULL || sscanf(line, "#qrk#%"SCNu64"\n", &cnt) != 1) {
+		xfree(line);
 		pfatal("invalid format");
 	}
+	xfree(line);
 	for (uint64_t n = 0; n < cnt; ++n) {
                 char *str = ns_readstr(iol);
 		qrk_str2id(qrk, str);
@@ -254,6 +404,78 @@ void qrk_load(qrk_t *qrk, iol_t *iol) {
 	}
 }
 
+/* qrk_savebin:
+ *   Save the map in binary form to the given file. This is the frozen form of
+ *   the map, so it can be used directly from the mapped file: an header with
+ *   the number of keys, the arena size and the table mask followed by the keys
+ *   offsets, the arena and the hash table.
+ */
+void qrk_savebin(const qrk_t *qrk, FILE *file) {
+	qrk_t tmp = *qrk, *frz = &tmp;
+	if (!qrk->frozen)
+		qrk_build(frz);
+	const uint64_t hdr[4] = {frz->count, frz->ksize, frz->mask, 0};
+	bin_put(file, hdr, sizeof(hdr));
+	bin_put(file, frz->offs,  sizeof(uint64_t) * frz->count);
+	bin_put(file, frz->keys,  frz->ksize);
+	bin_put(file, frz->table, sizeof(uint64_t) * 2 * (frz->mask + 1));
+	if (!qrk->frozen) {
+		xfree(frz->keys);
+		xfree(frz->offs);
+		xfree(frz->table);
+	}
+}
+
+/* qrk_loadbin:
+ *   Load a map saved by qrk_savebin from the mapped file. The map is loaded in
+ *   its frozen form pointing directly inside the file, so this only cost a
+ *   check of the table, and the given map must be empty. The mapping must
+ *   remain valid as long as the map is used.
+ */
+void qrk_loadbin(qrk_t *qrk, bin_t *bin) {
+	const char *err = "invalid quark format";
+	if (qrk->count != 0)
+		fatal("cannot load binary quark in a non-empty one");
+	const uint64_t *hdr = bin_get(bin, sizeof(uint64_t) * 4);
+	const uint64_t N = hdr[0], K = hdr[1], M = hdr[2] + 1;
+	if (M & (M - 1) || M <= N || M > UINT64_MAX / sizeof(uint64_t) / 2)
+		fatal(err);
+	qrk->offs  = (uint64_t *)bin_get(bin, sizeof(uint64_t) * N);
+	qrk->keys  = (char     *)bin_get(bin, K);
+	qrk->table = (uint64_t *)bin_get(bin, sizeof(uint64_t) * 2 * M);
+	if (K != 0 && qrk->keys[K - 1] != '\0')
+		fatal(err);
+	// Each entry must hold its own identifier and each used slot of the
+	// table must point to an entry, so the lookups never go out of the
+	// keys block or return an invalid identifier.
+	for (uint64_t n = 0; n < N; n++) {
+		const uint64_t off = qrk->offs[n];
+		if (off >= K || K - off <= sizeof(uint64_t))
+			fatal(err);
+		if (off % sizeof(uint64_t) != 0)
+			fatal(err);
+		if (*(const uint64_t *)(qrk->keys + off) != n)
+			fatal(err);
+	}
+	for (uint64_t m = 0; m < M; m++) {
+		const uint64_t off = qrk->table[2 * m + 1];
+		if (off == none)
+			continue;
+		if (off >= K || K - off <= sizeof(uint64_t))
+			fatal(err);
+		if (off % sizeof(uint64_t) != 0)
+			fatal(err);
+		const uint64_t id = *(const uint64_t *)(qrk->keys + off);
+		if (id >= N || qrk->offs[id] != off)
+			fatal(err);
+	}
+	qrk->count  = N;
+	qrk->ksize  = K;
+	qrk->mask   = M - 1;
+	qrk->frozen = true;
+	qrk->owned  = false;
+	qrk->lock   = true;
+}
 
 /* qrk_count:
  *   Return the number of mappings stored in the quark.
@@ -267,7 +489,27 @@ uint64_t qrk_count(const qrk_t *qrk) {
  */
 bool qrk_lock(qrk_t *qrk, bool lock) {
 	bool old = qrk->lock;
+	if (!lock && qrk->frozen)
+		qrk_thaw(qrk);
 	qrk->lock = lock;
 	return old;
 }
 
+/* qrk_freeze:
+ *   Compile the map in its frozen form and release the trie. The map remain
+ *   usable through the same interface but is locked, unlocking it will rebuild
+ *   the trie so new keys can be added again.
+ */
+void qrk_freeze(qrk_t *qrk) {
+	if (qrk->frozen)
+		return;
+	qrk_build(qrk);
+	qrk_freetrie(qrk);
+	xfree(qrk->leafs);
+	qrk->size   = 1;
+	qrk->leafs  = xmalloc(sizeof(leaf_t *));
+	qrk->frozen = true;
+	qrk->owned  = true;
+	qrk->lock   = true;
+}
+
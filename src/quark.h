@@ -41,10 +41,14 @@ qrk_t *qrk_new(void);
 void qrk_free(qrk_t *qrk);
 uint64_t qrk_count(const qrk_t *qrk);
 bool qrk_lock(qrk_t *qrk, bool lock);
+void qrk_freeze(qrk_t *qrk);
 const char *qrk_id2str(const qrk_t *qrk, uint64_t id);
 uint64_t qrk_str2id(qrk_t *qrk, const char *key);
+uint64_t qrk_hash(const char *key, size_t *len);
 void qrk_load(qrk_t *qrk, iol_t *iol);
 void qrk_save(const qrk_t *qrk, iol_t *iol);
+void qrk_savebin(const qrk_t *qrk, FILE *file);
+void qrk_loadbin(qrk_t *qrk, bin_t *bin);
 
 #endif
 
@@ -37,6 +37,7 @@
 #include "quark.h"
 #include "reader.h"
 #include "sequence.h"
+#include "thread.h"
 #include "tools.h"
 #include "ioline.h"
 
@@ -61,6 +62,38 @@
  *   internal use in the reader as an intermediate step to apply patterns.
  ******************************************************************************/
 
+/* rdr_scrnew:
+ *   Create a new empty scratch memory object for converting sequences.
+ */
+rdr_scr_t *rdr_scrnew(void) {
+	rdr_scr_t *scr = xmalloc(sizeof(rdr_scr_t));
+	scr->obs  = NULL; scr->osize = 0;
+	scr->line = NULL; scr->lsize = 0;
+	scr->toks = NULL; scr->tsize = 0;
+	scr->tok  = NULL; scr->tlen  = 0;
+	scr->dobs = scr->dlbl = false;
+	scr->pnd  = NULL; scr->npnd  = 0; scr->spnd = 0;
+	scr->keys = NULL; scr->nkey  = 0; scr->skey = 0;
+	return scr;
+}
+
+/* rdr_scrfree:
+ *   Free all memory used by a scratch memory object.
+ */
+void rdr_scrfree(rdr_scr_t *scr) {
+	if (scr->tok != NULL) {
+		xfree(scr->tok->cnts);
+		xfree(scr->tok->lbl);
+		xfree(scr->tok);
+	}
+	xfree(scr->obs);
+	xfree(scr->line);
+	xfree(scr->toks);
+	xfree(scr->pnd);
+	xfree(scr->keys);
+	xfree(scr);
+}
+
 /* rdr_new:
  *   Create a new empty reader object. If no patterns are loaded before you
  *   start using the reader the input data are assumed to be already prepared
@@ -76,6 +109,10 @@ rdr_t *rdr_new(iol_t *iol, bool autouni) {
 	rdr->lbl = qrk_new();
 	rdr->obs = qrk_new();
         rdr->iol = iol;
+	rdr->scr = rdr_scrnew();
+	rdr->shard = 0;
+	rdr->nshard = 1;
+	rdr->hbits = rdr->hbbits = 0;
 	return rdr;
 }
 
@@ -89,7 +126,9 @@ void rdr_free(rdr_t *rdr) {
 	xfree(rdr->pats);
 	qrk_free(rdr->lbl);
 	qrk_free(rdr->obs);
-        iol_free(rdr->iol);
+	if (rdr->iol != NULL)
+		iol_free(rdr->iol);
+	rdr_scrfree(rdr->scr);
 	xfree(rdr);
 }
 
@@ -97,8 +136,9 @@ void rdr_free(rdr_t *rdr) {
  *   Free all memory used by a raw_t object.
  */
 void rdr_freeraw(raw_t *raw) {
-	for (uint32_t t = 0; t < raw->len; t++)
-		xfree(raw->lines[t]);
+	if (!raw->view)
+		for (uint32_t t = 0; t < raw->len; t++)
+			xfree(raw->lines[t]);
 	xfree(raw);
 }
 
@@ -114,12 +154,123 @@ void rdr_freeseq(seq_t *seq) {
  *   Free all memory used by a dat_t object.
  */
 void rdr_freedat(dat_t *dat) {
-	for (uint32_t i = 0; i < dat->nseq; i++)
-		rdr_freeseq(dat->seq[i]);
+	if (dat->blk != NULL)
+		xfree(dat->blk);
+	else
+		for (uint32_t i = 0; i < dat->nseq; i++)
+			rdr_freeseq(dat->seq[i]);
 	xfree(dat->seq);
 	xfree(dat);
 }
 
+/* rdr_sortdat:
+ *   Sort the sequences of a dataset by decreasing length, keeping the original
+ *   order between sequences of the same length. When the dataset is processed
+ *   in parallel, this ensure the longest sequences are scheduled first and the
+ *   last batches are short so threads finish at nearly the same time.
+ */
+typedef struct {
+	seq_t    *seq;
+	uint32_t  idx;
+} rdr_srt_t;
+
+static int rdr_sortcmp(const void *a, const void *b) {
+	const rdr_srt_t *x = a, *y = b;
+	if (x->seq->len != y->seq->len)
+		return x->seq->len > y->seq->len ? -1 : 1;
+	return x->idx < y->idx ? -1 : 1;
+}
+
+void rdr_sortdat(dat_t *dat) {
+	const uint32_t S = dat->nseq;
+	rdr_srt_t *srt = xmalloc(sizeof(rdr_srt_t) * S);
+	for (uint32_t s = 0; s < S; s++)
+		srt[s] = (rdr_srt_t){dat->seq[s], s};
+	qsort(srt, S, sizeof(rdr_srt_t), rdr_sortcmp);
+	for (uint32_t s = 0; s < S; s++)
+		dat->seq[s] = srt[s].seq;
+	xfree(srt);
+}
+
+/* rdr_prune:
+ *   Remove the observations seen at less than <min> positions of the dataset
+ *   from the quark and from the observations lists of its sequences, so they
+ *   will never get features. Observations with an identifier lower than
+ *   <keep>, the ones of a previous model, are always kept. The quark is
+ *   rebuilt with the remaining observations in the same order, so the kept
+ *   ones of the previous model retain their identifier, and is left locked.
+ *   Return the number of observations removed.
+ */
+uint64_t rdr_prune(rdr_t *rdr, dat_t *dat, uint32_t min, uint64_t keep) {
+	const uint64_t O = qrk_count(rdr->obs);
+	// First count the positions where each observation occur. An
+	// observation with the '*' prefix is in both lists of the position so
+	// the last position where each one was seen is tracked to count it only
+	// once.
+	uint32_t *cnt  = xmalloc(sizeof(uint32_t) * max(O, 1));
+	uint64_t *last = xmalloc(sizeof(uint64_t) * max(O, 1));
+	for (uint64_t o = 0; o < O; o++)
+		cnt[o] = 0, last[o] = none;
+	uint64_t P = 0;
+	for (uint32_t s = 0; s < dat->nseq; s++) {
+		const seq_t *seq = dat->seq[s];
+		for (uint32_t t = 0; t < seq->len; t++, P++) {
+			const pos_t *pos = &seq->pos[t];
+			const obs_t *raw = seq->raw + pos->off;
+			for (uint32_t n = 0; n < pos->ucnt + pos->bcnt; n++) {
+				const obs_t o = raw[n];
+				if (last[o] == P)
+					continue;
+				last[o] = P;
+				if (cnt[o] != UINT32_MAX)
+					cnt[o]++;
+			}
+		}
+	}
+	// Next, build the new quark with the observations to keep and the
+	// translation table from the old identifiers to the new ones.
+	qrk_t *old = rdr->obs, *new = qrk_new();
+	uint64_t *trans = last;
+	for (uint64_t o = 0; o < O; o++) {
+		trans[o] = none;
+		if (o < keep || cnt[o] >= min)
+			trans[o] = qrk_str2id(new, qrk_id2str(old, o));
+	}
+	xfree(cnt);
+	rdr->obs = new;
+	qrk_free(old);
+	qrk_lock(new, true);
+	// And finally remap the observations lists. They can only shrink so
+	// this is done in place, each list being moved down just after the
+	// previous one.
+	for (uint32_t s = 0; s < dat->nseq; s++) {
+		seq_t *seq = dat->seq[s];
+		uint32_t size = 0;
+		for (uint32_t t = 0; t < seq->len; t++) {
+			pos_t *pos = &seq->pos[t];
+			const obs_t *src = seq->raw + pos->off;
+			obs_t *dst = seq->raw + size;
+			uint32_t ucnt = 0, bcnt = 0;
+			for (uint32_t n = 0; n < pos->ucnt; n++)
+				if (trans[src[n]] != none)
+					dst[ucnt++] = trans[src[n]];
+			src += pos->ucnt;
+			for (uint32_t n = 0; n < pos->bcnt; n++)
+				if (trans[src[n]] != none)
+					dst[ucnt + bcnt++] = trans[src[n]];
+			pos->off  = size;
+			pos->ucnt = ucnt;
+			pos->bcnt = bcnt;
+			size += ucnt + bcnt;
+		}
+		if (dat->blk == NULL)
+			seq->raw = xrealloc(seq->raw,
+				sizeof(obs_t) * max(size, 1));
+	}
+	xfree(trans);
+	return O - qrk_count(new);
+}
+
 /* rdr_loadpat:
  *   Load and compile patterns from given file and store them in the reader. As
  *   we compile patterns, syntax errors in them will be raised at this time.
@@ -160,23 +311,29 @@ void rdr_loadpat(rdr_t *rdr, iol_t *iol) {
  *   Read a raw sequence from given file: a set of lines terminated by end of
  *   file or by an empty line. Return NULL if file end was reached before any
  *   sequence was read.
+ *
+ *   If the input can provide views of the lines, they are used directly so no
+ *   memory is allocated for them.
  */
 raw_t *rdr_readraw(iol_t *iol, bool autouni) {
 	// Prepare the raw sequence object
+	const bool view = iol->getv_cb != NULL;
 	uint32_t size = 32, cnt = 0;
 	raw_t *raw = xmalloc(sizeof(raw_t) + sizeof(char *) * size);
 	// And read the next sequence in the file, this will skip any blank line
 	// before reading the sequence stoping at end of file or on a new blank
 	// line.
 	while (true) {
-		char *line = iol->gets_cb(iol->in);
+		char *line = view ? (char *)iol->getv_cb(iol->in)
+		                  : iol->gets_cb(iol->in);
 		if (line == NULL)
 			break;
-		int len = strlen(line);
+		int len = strcspn(line, "\n");
 		while (len != 0 && isspace(line[len - 1] & 0xff))
 			len--;
 		if (len == 0) {
-			xfree(line);
+			if (!view)
+				xfree(line);
 			// Special case when no line was already read, we try
 			// again. This allow multiple blank lines between
 			// sequences.
@@ -204,29 +361,133 @@ raw_t *rdr_readraw(iol_t *iol, bool autouni) {
 		return NULL;
 	}
 	raw = xrealloc(raw, sizeof(raw_t) + sizeof(char *) * cnt);
-	raw->len = cnt;
+	raw->len  = cnt;
+	raw->view = view;
 	return raw;
 }
 
 
+/* rdr_nobs:
+ *   Return the number of observations known by the reader: the size of the
+ *   observations quark or, in hashed mode, the total number of buckets.
+ */
+uint64_t rdr_nobs(const rdr_t *rdr) {
+	if (rdr->hbits == 0)
+		return qrk_count(rdr->obs);
+	return ((uint64_t)1 << rdr->hbits) + ((uint64_t)1 << rdr->hbbits);
+}
+
+/* rdr_hashobs:
+ *   Map an observation string to its bucket in hashed mode, either a unigram
+ *   one or, if <bi> is true, a bigram one. Unigram and bigram buckets are
+ *   distinct so an observation with the '*' prefix get one of each, and the
+ *   identifier is always valid as nothing has to be interned.
+ */
+uint64_t rdr_hashobs(const rdr_t *rdr, const char *str, bool bi) {
+	size_t len;
+	const uint64_t h = qrk_hash(str, &len);
+	if (!bi)
+		return h & (((uint64_t)1 << rdr->hbits) - 1);
+	const uint64_t U = (uint64_t)1 << rdr->hbits;
+	return U + ((h >> 32) & (((uint64_t)1 << rdr->hbbits) - 1));
+}
+
+/* rdr_intern:
+ *   Map a key to its identifier in the given quark. If the key is unknown and
+ *   must be deferred, it is recorded in the scratch memory and a pending value
+ *   is returned in place of the identifier, see rdr_place.
+ */
+#define RDR_PND ((uint64_t)1 << 63)
+
+static uint64_t rdr_intern(rdr_scr_t *scr, qrk_t *qrk, const char *key,
+                           bool lbl) {
+	const uint64_t id = qrk_str2id(qrk, key);
+	if (id != none || !(lbl ? scr->dlbl : scr->dobs))
+		return id;
+	const uint64_t len = strlen(key) + 1;
+	if (scr->nkey + len > scr->skey) {
+		scr->skey = (scr->nkey + len) * 1.4 + 256;
+		scr->keys = xrealloc(scr->keys, sizeof(char) * scr->skey);
+	}
+	if (scr->npnd == scr->spnd) {
+		scr->spnd = scr->spnd * 1.4 + 16;
+		scr->pnd  = xrealloc(scr->pnd, sizeof(rdr_pnd_t) * scr->spnd);
+	}
+	memcpy(scr->keys + scr->nkey, key, len);
+	const uint32_t no = (uint32_t)-1;
+	scr->pnd[scr->npnd] = (rdr_pnd_t){scr->nkey, {no, no}, lbl};
+	scr->nkey += len;
+	return RDR_PND | scr->npnd++;
+}
+
 /* rdr_mapobs:
  *   Map an observation to its identifier, automatically adding a 'u' prefix in
- *   'autouni' mode.
+ *   'autouni' mode. The prefixed string is built in the scratch buffer. In
+ *   hashed mode, <bi> select the kind of bucket to use.
+ */
+static uint64_t rdr_mapobs(rdr_t *rdr, rdr_scr_t *scr, const char *str,
+                           bool bi) {
+	if (!rdr->autouni) {
+		if (rdr->hbits != 0)
+			return rdr_hashobs(rdr, str, bi);
+		return rdr_intern(scr, rdr->obs, str, false);
+	}
+	const uint32_t len = strlen(str);
+	if (len + 2 > scr->osize) {
+		scr->osize = len + 2;
+		scr->obs = xrealloc(scr->obs, sizeof(char) * scr->osize);
+	}
+	scr->obs[0] = 'u';
+	memcpy(scr->obs + 1, str, len + 1);
+	if (rdr->hbits != 0)
+		return rdr_hashobs(rdr, scr->obs, false);
+	return rdr_intern(scr, rdr->obs, scr->obs, false);
+}
+
+/* rdr_obsid:
+ *   Check that an observation identifier can be stored in a sequence and
+ *   return it as an obs_t.
+ */
+static inline obs_t rdr_obsid(uint64_t id) {
+	if ((obs_t)id != id || (obs_t)id == (obs_t)none)
+		fatal("too many observations, rebuild with SEQ_OBS64");
+	return (obs_t)id;
+}
+
+/* rdr_place:
+ *   Return the value to store in the observations list at offset <slot> for
+ *   an identifier returned by rdr_intern. For a pending one, the slot is kept
+ *   to be filled later and a placeholder is returned.
  */
-static uint64_t rdr_mapobs(rdr_t *rdr, const char *str) {
-	if (!rdr->autouni)
-		return qrk_str2id(rdr->obs, str);
-	char tmp[strlen(str) + 2];
-	tmp[0] = 'u';
-	strcpy(tmp + 1, str);
-	return qrk_str2id(rdr->obs, tmp);
+static inline obs_t rdr_place(rdr_scr_t *scr, uint64_t id, uint32_t slot) {
+	if (!(id & RDR_PND))
+		return rdr_obsid(id);
+	rdr_pnd_t *pnd = &scr->pnd[id & ~RDR_PND];
+	pnd->slot[pnd->slot[0] == (uint32_t)-1 ? 0 : 1] = slot;
+	return 0;
+}
+
+/* rdr_maplbl:
+ *   Map the labels of a tokenized sequence to their identifiers.
+ */
+static void rdr_maplbl(rdr_t *rdr, rdr_scr_t *scr, const tok_t *tok,
+                       seq_t *seq) {
+	for (uint32_t t = 0; t < tok->len; t++) {
+		const char *lbl = tok->lbl[t];
+		uint64_t id = rdr_intern(scr, rdr->lbl, lbl, true);
+		if (id != none && (id & RDR_PND)) {
+			scr->pnd[id & ~RDR_PND].slot[0] = t;
+			id = none;
+		}
+		seq->pos[t].lbl = id;
+	}
 }
 
 /* rdr_rawtok2seq:
  *   Convert a tok_t to a seq_t object taking each tokens as a feature without
  *   applying patterns.
  */
-static seq_t *rdr_rawtok2seq(rdr_t *rdr, const tok_t *tok) {
+static seq_t *rdr_rawtok2seq(rdr_t *rdr, rdr_scr_t *scr, const tok_t *tok) {
 	const uint32_t T = tok->len;
 	uint32_t size = 0;
 	if (rdr->autouni) {
@@ -246,130 +507,171 @@ static seq_t *rdr_rawtok2seq(rdr_t *rdr, const tok_t *tok) {
 		}
 	}
 	seq_t *seq = xmalloc(sizeof(seq_t) + sizeof(pos_t) * T);
-	seq->raw = xmalloc(sizeof(uint64_t) * size);
+	seq->raw = xmalloc(sizeof(obs_t) * max(size, 1));
 	seq->len = T;
-	uint64_t *raw = seq->raw;
+	obs_t *raw = seq->raw;
 	for (uint32_t t = 0; t < T; t++) {
 		seq->pos[t].lbl = (uint32_t)-1;
 		seq->pos[t].ucnt = 0;
-		seq->pos[t].uobs = raw;
+		seq->pos[t].off = raw - seq->raw;
 		for (uint32_t n = 0; n < tok->cnts[t]; n++) {
 			if (!rdr->autouni && tok->toks[t][n][0] == 'b')
 				continue;
-			uint64_t id = rdr_mapobs(rdr, tok->toks[t][n]);
+			const char *o = tok->toks[t][n];
+			uint64_t id = rdr_mapobs(rdr, scr, o, false);
 			if (id != none) {
-				(*raw++) = id;
-				seq->pos[t].ucnt++;
+				*raw = rdr_place(scr, id, raw - seq->raw);
+				raw++, seq->pos[t].ucnt++;
 			}
 		}
 		seq->pos[t].bcnt = 0;
 		if (rdr->autouni)
 			continue;
-		seq->pos[t].bobs = raw;
 		for (uint32_t n = 0; n < tok->cnts[t]; n++) {
 			if (tok->toks[t][n][0] == 'u')
 				continue;
-			uint64_t id = rdr_mapobs(rdr, tok->toks[t][n]);
+			const char *o = tok->toks[t][n];
+			uint64_t id = rdr_mapobs(rdr, scr, o, true);
 			if (id != none) {
-				(*raw++) = id;
-				seq->pos[t].bcnt++;
+				*raw = rdr_place(scr, id, raw - seq->raw);
+				raw++, seq->pos[t].bcnt++;
 			}
 		}
 	}
 	// And finally, if the user specified it, populate the labels
-	if (tok->lbl != NULL) {
-		for (uint32_t t = 0; t < T; t++) {
-			const char *lbl = tok->lbl[t];
-			uint64_t id = qrk_str2id(rdr->lbl, lbl);
-			seq->pos[t].lbl = id;
-		}
-	}
+	if (tok->lbl != NULL)
+		rdr_maplbl(rdr, scr, tok, seq);
 	return seq;
 }
 
 /* rdr_pattok2seq:
  *   Convert a tok_t to a seq_t object by applying the patterns of the reader.
  */
-static seq_t *rdr_pattok2seq(rdr_t *rdr, const tok_t *tok) {
+static seq_t *rdr_pattok2seq(rdr_t *rdr, rdr_scr_t *scr, const tok_t *tok) {
+	const uint32_t off = rdr->autouni ? 1 : 0;
 	const uint32_t T = tok->len;
 	// So now the tok object is ready, we can start building the seq_t
-	// object by appling patterns. First we allocate the seq_t object. The
-	// sequence itself as well as the sub array are allocated in one time.
+	// object by appling patterns. First we allocate the seq_t object and
+	// the block for the observations lists, big enough for the worst case.
 	seq_t *seq = xmalloc(sizeof(seq_t) + sizeof(pos_t) * T);
-	seq->raw = xmalloc(sizeof(uint64_t) * (rdr->nuni + rdr->nbi) * T);
+	seq->raw = xmalloc(sizeof(obs_t) * max((rdr->nuni + rdr->nbi) * T, 1));
 	seq->len = T;
-	uint64_t *tmp = seq->raw;
-	for (uint32_t t = 0; t < T; t++) {
-		seq->pos[t].lbl  = (uint32_t)-1;
-		seq->pos[t].uobs = tmp; tmp += rdr->nuni;
-		seq->pos[t].bobs = tmp; tmp += rdr->nbi;
-	}
 	// Next, we can build the observations list by applying the patterns on
-	// the tok_t sequence.
+	// the tok_t sequence. The bigrams are collected apart and moved after
+	// the unigrams once the position is done.
+	uint64_t bobs[rdr->nbi + 1];
+	uint32_t size = 0;
 	for (uint32_t t = 0; t < T; t++) {
 		pos_t *pos = &seq->pos[t];
+		obs_t *uobs = seq->raw + size;
+		pos->lbl  = (uint32_t)-1;
 		pos->ucnt = 0;
 		pos->bcnt = 0;
+		pos->off  = size;
 		for (uint32_t x = 0; x < rdr->npats; x++) {
-			// Get the observation and map it to an identifier
-			char *obs = pat_exec(rdr->pats[x], tok, t);
-			uint64_t id = rdr_mapobs(rdr, obs);
-			if (id == none) {
-				xfree(obs);
-				continue;
-			}
-			// If the observation is ok, add it to the lists
+			// Get the observation in the scratch buffer, after the
+			// room for the 'u' prefix in autouni mode, and map it
+			// to an identifier.
+			pat_execbuf(rdr->pats[x], tok, t,
+				&scr->obs, &scr->osize, off);
+			const char *obs = scr->obs + off;
+			if (off != 0)
+				scr->obs[0] = 'u';
 			char kind = 0;
 			switch (obs[0]) {
 				case 'u': kind = 1; break;
 				case 'b': kind = 2; break;
 				case '*': kind = 3; break;
 			}
-			if (kind & 1)
-				pos->uobs[pos->ucnt++] = id;
+			// In hashed mode, the unigram and bigram parts of the
+			// observation go to different buckets.
+			uint64_t uid, bid;
+			if (rdr->hbits != 0) {
+				uid = rdr_hashobs(rdr, scr->obs, false);
+				bid = rdr_hashobs(rdr, scr->obs, true);
+			} else {
+				uid = rdr_intern(scr, rdr->obs, scr->obs,
+					false);
+				bid = uid;
+			}
+			if (uid == none)
+				continue;
+			// If the observation is ok, add it to the lists
+			if (kind & 1) {
+				const uint32_t slot = size + pos->ucnt;
+				uobs[pos->ucnt++] = rdr_place(scr, uid, slot);
+			}
 			if (kind & 2)
-				pos->bobs[pos->bcnt++] = id;
-			xfree(obs);
+				bobs[pos->bcnt++] = bid;
 		}
-	}
-	// And finally, if the user specified it, populate the labels
-	if (tok->lbl != NULL) {
-		for (uint32_t t = 0; t < T; t++) {
-			const char *lbl = tok->lbl[t];
-			uint64_t id = qrk_str2id(rdr->lbl, lbl);
-			seq->pos[t].lbl = id;
+		for (uint32_t n = 0; n < pos->bcnt; n++) {
+			const uint32_t slot = size + pos->ucnt + n;
+			uobs[pos->ucnt + n] = rdr_place(scr, bobs[n], slot);
 		}
+		size += pos->ucnt + pos->bcnt;
 	}
+	// Observations lists are located by offsets, so the block can be
+	// shrinked to its real size.
+	seq->raw = xrealloc(seq->raw, sizeof(obs_t) * max(size, 1));
+	// And finally, if the user specified it, populate the labels
+	if (tok->lbl != NULL)
+		rdr_maplbl(rdr, scr, tok, seq);
 	return seq;
 }
 
-/* rdr_raw2seq:
+/* rdr_raw2seqscr:
  *   Convert a raw sequence to a seq_t object suitable for training or
  *   labelling. If lbl is true, the last column is assumed to be a label and
- *   interned also.
+ *   interned also. The conversion is done in the given scratch memory so, if
+ *   the reader quarks are locked, it is safe to call this from many threads
+ *   as long as each one use its own scratch.
  */
-seq_t *rdr_raw2seq(rdr_t *rdr, const raw_t *raw, bool lbl) {
+seq_t *rdr_raw2seqscr(rdr_t *rdr, rdr_scr_t *scr, const raw_t *raw, bool lbl) {
 	const uint32_t T = raw->len;
-	// Allocate the tok_t object, the label array is allocated only if they
-	// are requested by the user.
-	tok_t *tok = xmalloc(sizeof(tok_t) + T * sizeof(char **));
-	tok->cnts = xmalloc(sizeof(uint32_t) * T);
-	tok->lbl = NULL;
-	if (lbl == true)
-		tok->lbl = xmalloc(sizeof(char *) * T);
+	// Prepare the tok_t object in the scratch memory, growing it if the
+	// sequence is longer than all previous ones. We also compute the space
+	// needed to copy all the lines and the maximum number of tokens.
+	if (T > scr->tlen) {
+		if (scr->tok != NULL) {
+			xfree(scr->tok->cnts);
+			xfree(scr->tok->lbl);
+		}
+		scr->tlen = T;
+		scr->tok = xrealloc(scr->tok, sizeof(tok_t) + T * sizeof(char **));
+		scr->tok->cnts = xmalloc(sizeof(uint32_t) * T);
+		scr->tok->lbl  = xmalloc(sizeof(char *) * T);
+	}
+	tok_t *tok = scr->tok;
+	uint64_t lsize = 0, tsize = 0;
+	for (uint32_t t = 0; t < T; t++) {
+		const uint64_t len = strcspn(raw->lines[t], "\n");
+		lsize += len + 1;
+		tsize += len / 2 + 1;
+	}
+	if (lsize > scr->lsize) {
+		scr->lsize = lsize;
+		scr->line = xrealloc(scr->line, sizeof(char) * lsize);
+	}
+	if (tsize > scr->tsize) {
+		scr->tsize = tsize;
+		scr->toks = xrealloc(scr->toks, sizeof(char *) * tsize);
+	}
 	// We now take the raw sequence line by line and split them in list of
-	// tokens. To reduce memory fragmentation, the raw line is copied and
-	// his reference is kept by the first tokens, next tokens are pointer to
-	// this copy.
+	// tokens. The raw lines are copied one after the other in the scratch
+	// memory and the tokens are pointers into this copy.
+	char  *line = scr->line;
+	char **toks = scr->toks;
 	for (uint32_t t = 0; t < T; t++) {
 		// Get a copy of the raw line skiping leading space characters
 		const char *src = raw->lines[t];
 		while (isspace(*src & 0xff))
 			src++;
-		char *line = xstrdup(src);
+		const size_t len = strcspn(src, "\n");
+		memcpy(line, src, len);
+		line[len] = '\0';
 		// Split it in tokens
-		char *toks[strlen(line) / 2 + 1];
 		uint32_t cnt = 0;
+		tok->toks[t] = toks;
 		while (*line != '\0') {
 			toks[cnt++] = line;
 			while (*line != '\0' && !isspace(*line & 0xff))
@@ -380,6 +682,7 @@ seq_t *rdr_raw2seq(rdr_t *rdr, const raw_t *raw, bool lbl) {
 			while (*line != '\0' && isspace(*line & 0xff))
 				line++;
 		}
+		line++;
 		// If user specified that data are labelled, move the last token
 		// to the label array.
 		if (lbl == true) {
@@ -388,30 +691,30 @@ seq_t *rdr_raw2seq(rdr_t *rdr, const raw_t *raw, bool lbl) {
 		}
 		// And put the remaining tokens in the tok_t object
 		tok->cnts[t] = cnt;
-		tok->toks[t] = xmalloc(sizeof(char *) * cnt);
-		memcpy(tok->toks[t], toks, sizeof(char *) * cnt);
+		toks += cnt + (lbl == true);
 	}
 	tok->len = T;
 	// Convert the tok_t to a seq_t
+	char **lbls = tok->lbl;
+	if (lbl == false)
+		tok->lbl = NULL;
 	seq_t *seq = NULL;
 	if (rdr->npats == 0)
-		seq = rdr_rawtok2seq(rdr, tok);
+		seq = rdr_rawtok2seq(rdr, scr, tok);
 	else
-		seq = rdr_pattok2seq(rdr, tok);
-	// Before returning the sequence, we have to free the tok_t
-	for (uint32_t t = 0; t < T; t++) {
-		if (tok->cnts[t] == 0)
-			continue;
-		xfree(tok->toks[t][0]);
-		xfree(tok->toks[t]);
-	}
-	xfree(tok->cnts);
-	if (lbl == true)
-		xfree(tok->lbl);
-	xfree(tok);
+		seq = rdr_pattok2seq(rdr, scr, tok);
+	tok->lbl = lbls;
 	return seq;
 }
 
+/* rdr_raw2seq:
+ *   Same as rdr_raw2seqscr using the reader own scratch memory. This is not
+ *   thread safe, threads sharing a reader must have their own scratch.
+ */
+seq_t *rdr_raw2seq(rdr_t *rdr, const raw_t *raw, bool lbl) {
+	return rdr_raw2seqscr(rdr, rdr->scr, raw, lbl);
+}
+
 /* rdr_readseq:
  *   Simple wrapper around rdr_readraw and rdr_raw2seq to directly read a
  *   sequence as a seq_t object from file. This take care of all the process
@@ -428,12 +731,130 @@ seq_t *rdr_readseq(rdr_t *rdr, iol_t *iol, bool lbl) {
 	return seq;
 }
 
+/* rdr_itm_t, rdr_bat_t, rdr_wrk_t:
+ *   State of the parallel dataset reading: the current and next batches of
+ *   sequences with their deferred keys, and the per worker scratch memory.
+ */
+#define RDR_BATCH 1024
+
+typedef struct rdr_itm_s rdr_itm_t;
+struct rdr_itm_s {
+	raw_t     *raw;
+	seq_t     *seq;
+	rdr_pnd_t *pnd;
+	char      *keys;
+	uint32_t   npnd;
+};
+
+typedef struct rdr_bat_s rdr_bat_t;
+struct rdr_bat_s {
+	rdr_t     *rdr;
+	iol_t     *iol;
+	bool       lbl;
+	rdr_itm_t *cur, *nxt;
+	uint32_t   ncur, nnxt;
+};
+
+typedef struct rdr_wrk_s rdr_wrk_t;
+struct rdr_wrk_s {
+	rdr_bat_t *bat;
+	rdr_scr_t *scr;
+};
+
+/* rdr_readbat:
+ *   Read the next batch of raw sequences from the input.
+ */
+static void rdr_readbat(rdr_bat_t *bat) {
+	bat->nnxt = 0;
+	while (bat->nnxt < RDR_BATCH) {
+		raw_t *raw = rdr_readraw(bat->iol, bat->rdr->autouni);
+		if (raw == NULL)
+			break;
+		bat->nxt[bat->nnxt++].raw = raw;
+	}
+}
+
+/* rdr_readsub:
+ *   A reading round. The first worker read the next batch then all of them
+ *   convert the sequences of the current batch, moving their deferred keys
+ *   out of the scratch memory.
+ */
+static void rdr_readsub(job_t *job, uint32_t id, uint32_t cnt,
+                        rdr_wrk_t *wrk) {
+	unused(cnt);
+	rdr_bat_t *bat = wrk->bat;
+	rdr_scr_t *scr = wrk->scr;
+	if (id == 0)
+		rdr_readbat(bat);
+	uint32_t count, pos;
+	while (mth_getjob(job, &count, &pos)) {
+		for (uint32_t s = pos; s < pos + count; s++) {
+			rdr_itm_t *itm = &bat->cur[s];
+			itm->seq = rdr_raw2seqscr(bat->rdr, scr, itm->raw,
+				bat->lbl);
+			rdr_freeraw(itm->raw);
+			itm->npnd = scr->npnd;
+			itm->pnd  = NULL;
+			itm->keys = NULL;
+			if (scr->npnd == 0)
+				continue;
+			const size_t psz = sizeof(rdr_pnd_t) * scr->npnd;
+			const size_t ksz = sizeof(char) * scr->nkey;
+			itm->pnd  = xmalloc(psz);
+			itm->keys = xmalloc(ksz);
+			memcpy(itm->pnd,  scr->pnd,  psz);
+			memcpy(itm->keys, scr->keys, ksz);
+			scr->npnd = 0;
+			scr->nkey = 0;
+		}
+	}
+}
+
+/* rdr_intbat:
+ *   Intern the deferred keys of the current batch in input order and store
+ *   their identifiers in the sequences.
+ */
+static void rdr_intbat(rdr_bat_t *bat) {
+	rdr_t *rdr = bat->rdr;
+	for (uint32_t s = 0; s < bat->ncur; s++) {
+		rdr_itm_t *itm = &bat->cur[s];
+		seq_t *seq = itm->seq;
+		for (uint32_t n = 0; n < itm->npnd; n++) {
+			const rdr_pnd_t *pnd = &itm->pnd[n];
+			const char *key = itm->keys + pnd->key;
+			if (pnd->lbl) {
+				const uint64_t id = qrk_str2id(rdr->lbl, key);
+				seq->pos[pnd->slot[0]].lbl = id;
+				continue;
+			}
+			const obs_t id = rdr_obsid(qrk_str2id(rdr->obs, key));
+			for (uint32_t i = 0; i < 2; i++)
+				if (pnd->slot[i] != (uint32_t)-1)
+					seq->raw[pnd->slot[i]] = id;
+		}
+		xfree(itm->pnd);
+		xfree(itm->keys);
+	}
+}
+
 /* rdr_readdat:
  *   Read a full dataset at once and return it as a dat_t object. This function
  *   take and interpret his parameters like the single sequence reading
  *   function.
+ *
+ *   The input is processed by batches of raw sequences split at blank lines.
+ *   Each round, the first worker read the next batch while the <W> workers
+ *   convert the current one. During the conversion the quarks are locked so
+ *   they can be searched from all threads at once, and the keys who should
+ *   have been inserted are deferred. They are interned after the round one by
+ *   one in input order so the identifiers are exactly the same than when the
+ *   sequences are converted in a single thread.
+ *
+ *   For distributed training, only the sequences whose index modulo <nshard>
+ *   is <shard> are kept. All sequences are still interned so all nodes share
+ *   the same identifiers.
  */
-dat_t *rdr_readdat(rdr_t *rdr, iol_t *iol, bool lbl) {
+dat_t *rdr_readdat(rdr_t *rdr, iol_t *iol, bool lbl, uint32_t W) {
 	// Prepare dataset
 	uint32_t size = 1000;
 	dat_t *dat = xmalloc(sizeof(dat_t));
@@ -441,23 +862,63 @@ dat_t *rdr_readdat(rdr_t *rdr, iol_t *iol, bool lbl) {
 	dat->mlen = 0;
 	dat->lbl = lbl;
 	dat->seq = xmalloc(sizeof(seq_t *) * size);
-	// Load sequences
-	while (true) {
-		// Read the next sequence
-        seq_t *seq = rdr_readseq(rdr, iol, lbl);
-		if (seq == NULL)
-			break;
-		// Grow the buffer if needed
-		if (dat->nseq == size) {
-			size *= 1.4;
-			dat->seq = xrealloc(dat->seq, sizeof(seq_t *) * size);
+	dat->blk = NULL;
+	// Prepare the batches and the workers. With a single thread, nothing
+	// need to be deferred as the sequences are converted in order.
+	rdr_itm_t *itms = xmalloc(sizeof(rdr_itm_t) * RDR_BATCH * 2);
+	rdr_bat_t bat = {
+		.rdr = rdr, .iol = iol, .lbl = lbl,
+		.cur = itms, .nxt = itms + RDR_BATCH,
+	};
+	rdr_wrk_t *wrk[W];
+	for (uint32_t w = 0; w < W; w++) {
+		wrk[w] = xmalloc(sizeof(rdr_wrk_t));
+		wrk[w]->bat = &bat;
+		wrk[w]->scr = rdr_scrnew();
+	}
+	// Load sequences batch by batch
+	uint64_t cnt = 0;
+	rdr_readbat(&bat);
+	while (bat.nnxt != 0) {
+		rdr_itm_t *tmp = bat.cur;
+		bat.cur = bat.nxt, bat.ncur = bat.nnxt;
+		bat.nxt = tmp;
+		const bool dobs = W > 1 && !qrk_lock(rdr->obs, true);
+		const bool dlbl = W > 1 && !qrk_lock(rdr->lbl, true);
+		for (uint32_t w = 0; w < W; w++) {
+			wrk[w]->scr->dobs = dobs;
+			wrk[w]->scr->dlbl = dlbl;
+		}
+		mth_spawn((func_t *)rdr_readsub, W, (void *)wrk, bat.ncur, 16);
+		if (W > 1) {
+			qrk_lock(rdr->obs, !dobs);
+			qrk_lock(rdr->lbl, !dlbl);
+		}
+		rdr_intbat(&bat);
+		// Grow the buffer if needed and store the sequences
+		for (uint32_t s = 0; s < bat.ncur; s++) {
+			seq_t *seq = bat.cur[s].seq;
+			if (cnt++ % rdr->nshard != rdr->shard) {
+				rdr_freeseq(seq);
+				continue;
+			}
+			if (dat->nseq == size) {
+				size *= 1.4;
+				dat->seq = xrealloc(dat->seq,
+					sizeof(seq_t *) * size);
+			}
+			dat->seq[dat->nseq++] = seq;
+			dat->mlen = max(dat->mlen, seq->len);
+			if (dat->nseq % 1000 == 0)
+				info("%7"PRIu32" sequences loaded\n",
+					dat->nseq);
 		}
-		// And store the sequence
-		dat->seq[dat->nseq++] = seq;
-		dat->mlen = max(dat->mlen, seq->len);
-		if (dat->nseq % 1000 == 0)
-			info("%7"PRIu32" sequences loaded\n", dat->nseq);
 	}
+	for (uint32_t w = 0; w < W; w++) {
+		rdr_scrfree(wrk[w]->scr);
+		xfree(wrk[w]);
+	}
+	xfree(itms);
 	// If no sequence readed, cleanup and repport
 	if (dat->nseq == 0) {
 		xfree(dat->seq);
@@ -470,7 +931,6 @@ dat_t *rdr_readdat(rdr_t *rdr, iol_t *iol, bool lbl) {
 	return dat;
 }
 
-
 /* rdr_load:
  *   Read from the given file a reader saved previously with rdr_save. The given
  *   reader must be empty, comming fresh from rdr_new. Be carefull that this
@@ -481,20 +941,41 @@ void rdr_load(rdr_t *rdr) {
 	const char *err = "broken file, invalid reader format";
 	int autouni = rdr->autouni;
 	char *line = rdr->iol->gets_cb(rdr->iol->in);
-	if (sscanf(line, "#rdr#%"PRIu32"/%"PRIu32"/%d\n",
-			&rdr->npats, &rdr->ntoks, &autouni) != 3) {
+	if (line == NULL)
+		fatal(err);
+	// The bits of hashed observations are only present for such readers
+	// and oldest files don't have the autouni flag.
+	uint32_t hbits = 0, hbbits = 0, npats = 0;
+	const int n = sscanf(line,
+		"#rdr#%"PRIu32"/%"PRIu32"/%d/%"PRIu32"/%"PRIu32"\n",
+		&npats, &rdr->ntoks, &autouni, &hbits, &hbbits);
+	if (n == 5) {
+		if (hbits == 0 || hbits > 32 || hbbits > 32) {
+			xfree(line);
+			fatal(err);
+		}
+		rdr->hbits  = hbits;
+		rdr->hbbits = hbbits;
+	} else if (n != 3) {
 		// This for compatibility with previous file format
 		if (sscanf(line, "#rdr#%"PRIu32"/%"PRIu32"\n",
-				&rdr->npats, &rdr->ntoks) != 2)
+				&npats, &rdr->ntoks) != 2) {
+			xfree(line);
 			fatal(err);
+		}
 	}
+	xfree(line);
 	rdr->autouni = autouni;
 	rdr->nuni = rdr->nbi = 0;
-	if (rdr->npats != 0) {
-		rdr->pats = xmalloc(sizeof(pat_t *) * rdr->npats);
-		for (uint32_t p = 0; p < rdr->npats; p++) {
+	// The patterns are counted as they are compiled so, if one of them is
+	// invalid, the reader can still be freed.
+	rdr->npats = 0;
+	if (npats != 0) {
+		rdr->pats = xmalloc(sizeof(pat_t *) * npats);
+		for (uint32_t p = 0; p < npats; p++) {
                         char *pat = ns_readstr(rdr->iol);
 			rdr->pats[p] = pat_comp(pat);
+			rdr->npats = p + 1;
 			switch (tolower(pat[0])) {
 				case 'u': rdr->nuni++; break;
 				case 'b': rdr->nbi++;  break;
@@ -513,12 +994,171 @@ void rdr_load(rdr_t *rdr) {
  *   is plain text and portable accros computers.
  */
 void rdr_save(const rdr_t *rdr, iol_t *iol) {
-        if (iol->print_cb(iol->out, "#rdr#%"PRIu32"/%"PRIu32"/%d\n",
+        if (iol->print_cb(iol->out, "#rdr#%"PRIu32"/%"PRIu32"/%d",
                      rdr->npats, rdr->ntoks, rdr->autouni) < 0)
 		pfatal("cannot write to file");
+	if (rdr->hbits != 0)
+		if (iol->print_cb(iol->out, "/%"PRIu32"/%"PRIu32,
+		                  rdr->hbits, rdr->hbbits) < 0)
+			pfatal("cannot write to file");
+	if (iol->print_cb(iol->out, "\n") < 0)
+		pfatal("cannot write to file");
 	for (uint32_t p = 0; p < rdr->npats; p++)
 		ns_writestr(iol, rdr->pats[p]->src);
 	qrk_save(rdr->lbl, iol);
 	qrk_save(rdr->obs, iol);
 }
 
+
+/* rdr_savebin:
+ *   Save the reader in binary form to the given file. This store the same
+ *   informations as rdr_save: a small header, the patterns as a table of
+ *   strings, and the labels and observations quarks.
+ */
+void rdr_savebin(const rdr_t *rdr, FILE *file) {
+	const uint32_t hash = rdr->hbits | rdr->hbbits << 16;
+	const uint32_t hdr[4] = {rdr->npats, rdr->ntoks, rdr->autouni, hash};
+	bin_put(file, hdr, sizeof(hdr));
+	const char **src = xmalloc(sizeof(char *) * (rdr->npats + 1));
+	for (uint32_t p = 0; p < rdr->npats; p++)
+		src[p] = rdr->pats[p]->src;
+	bin_putstrs(file, src, rdr->npats);
+	xfree(src);
+	qrk_savebin(rdr->lbl, file);
+	qrk_savebin(rdr->obs, file);
+}
+
+/* rdr_loadbin:
+ *   Read from the mapped file a reader saved previously with rdr_savebin. Like
+ *   for rdr_load, the given reader must be empty.
+ */
+void rdr_loadbin(rdr_t *rdr, bin_t *bin) {
+	const uint32_t *hdr = bin_get(bin, sizeof(uint32_t) * 4);
+	rdr->ntoks   = hdr[1];
+	rdr->autouni = hdr[2];
+	rdr->hbits   = hdr[3] & 0xFFFF;
+	rdr->hbbits  = hdr[3] >> 16;
+	if (rdr->hbits > 32 || rdr->hbbits > 32)
+		fatal("broken file, invalid reader format");
+	rdr->nuni = rdr->nbi = 0;
+	const uint64_t *off;
+	uint64_t cnt;
+	const char *blk = bin_getstrs(bin, &cnt, &off);
+	if (cnt != hdr[0])
+		fatal("broken file, invalid reader format");
+	rdr->npats = 0;
+	if (cnt != 0) {
+		rdr->pats = xmalloc(sizeof(pat_t *) * cnt);
+		for (uint32_t p = 0; p < cnt; p++) {
+			char *pat = xstrdup(blk + off[p]);
+			rdr->pats[p] = pat_comp(pat);
+			rdr->npats = p + 1;
+			switch (tolower(pat[0])) {
+				case 'u': rdr->nuni++; break;
+				case 'b': rdr->nbi++;  break;
+				case '*': rdr->nuni++;
+				          rdr->nbi++;  break;
+			}
+		}
+	}
+	qrk_loadbin(rdr->lbl, bin);
+	qrk_loadbin(rdr->obs, bin);
+}
+
+/* rdr_savedat:
+ *   Save a featurized dataset in binary format. After a small header, the file
+ *   hold the length of each sequence, the positions of all the sequences and
+ *   all their observations lists, each in a single block.
+ */
+void rdr_savedat(const dat_t *dat, FILE *file) {
+	const uint32_t S = dat->nseq;
+	uint64_t P = 0, N = 0;
+	uint32_t *len = xmalloc(sizeof(uint32_t) * (S + 1));
+	for (uint32_t s = 0; s < S; s++) {
+		const seq_t *seq = dat->seq[s];
+		const pos_t *lst = &seq->pos[seq->len - 1];
+		len[s] = seq->len;
+		P += seq->len;
+		N += lst->off + lst->ucnt + lst->bcnt;
+	}
+	const uint64_t hdr[4] = {S, dat->mlen, dat->lbl, sizeof(obs_t)};
+	bin_put(file, hdr, sizeof(hdr));
+	bin_put(file, len, sizeof(uint32_t) * S);
+	xfree(len);
+	for (uint32_t s = 0; s < S; s++) {
+		const seq_t *seq = dat->seq[s];
+		if (fwrite(seq->pos, sizeof(pos_t), seq->len, file) != seq->len)
+			pfatal("cannot write to file");
+	}
+	bin_put(file, NULL, sizeof(pos_t) * P);
+	for (uint32_t s = 0; s < S; s++) {
+		const seq_t *seq = dat->seq[s];
+		const pos_t *lst = &seq->pos[seq->len - 1];
+		const uint64_t n = lst->off + lst->ucnt + lst->bcnt;
+		if (n != 0 && fwrite(seq->raw, sizeof(obs_t), n, file) != n)
+			pfatal("cannot write to file");
+	}
+	bin_put(file, NULL, sizeof(obs_t) * N);
+}
+
+/* rdr_loaddat:
+ *   Load a featurized dataset from a mapped binary file. The sequences are
+ *   allocated in a single block but their observations lists are used in place
+ *   so the file must stay mapped as long as the dataset is used. Identifiers
+ *   are checked against the reader and labels so a broken file fail here and
+ *   not during training.
+ */
+dat_t *rdr_loaddat(rdr_t *rdr, bin_t *bin) {
+	const char *err = "broken file, invalid dataset format";
+	const uint64_t *hdr = bin_get(bin, sizeof(uint64_t) * 4);
+	if (hdr[3] != sizeof(obs_t))
+		fatal("dataset saved with a different observation size");
+	const uint32_t S = hdr[0];
+	const uint32_t Y = qrk_count(rdr->lbl);
+	const uint64_t O = rdr_nobs(rdr);
+	const uint32_t *len = bin_get(bin, sizeof(uint32_t) * S);
+	uint64_t P = 0;
+	for (uint32_t s = 0; s < S; s++) {
+		if (len[s] == 0 || len[s] > hdr[1])
+			fatal(err);
+		P += len[s];
+	}
+	const pos_t *pos = bin_get(bin, sizeof(pos_t) * P);
+	uint64_t N = 0;
+	for (uint64_t p = 0, s = 0; s < S; s++) {
+		p += len[s];
+		N += pos[p - 1].off + pos[p - 1].ucnt + pos[p - 1].bcnt;
+	}
+	obs_t *obs = (obs_t *)bin_get(bin, sizeof(obs_t) * N);
+	dat_t *dat = xmalloc(sizeof(dat_t));
+	dat->nseq = S;
+	dat->mlen = hdr[1];
+	dat->lbl  = hdr[2];
+	dat->seq  = xmalloc(sizeof(seq_t *) * S);
+	dat->blk  = xmalloc(sizeof(seq_t) * S + sizeof(pos_t) * P);
+	char *blk = dat->blk;
+	for (uint32_t s = 0; s < S; s++) {
+		const uint32_t T = len[s];
+		const uint64_t n = pos[T - 1].off + pos[T - 1].ucnt
+		                 + pos[T - 1].bcnt;
+		seq_t *seq = (seq_t *)blk;
+		seq->len = T;
+		seq->raw = obs;
+		memcpy(seq->pos, pos, sizeof(pos_t) * T);
+		for (uint32_t t = 0; t < T; t++) {
+			const pos_t *ps = &seq->pos[t];
+			if ((uint64_t)ps->off + ps->ucnt + ps->bcnt > n)
+				fatal(err);
+			if (dat->lbl && ps->lbl >= Y)
+				fatal(err);
+		}
+		for (uint64_t i = 0; i < n; i++)
+			if (obs[i] >= O)
+				fatal(err);
+		dat->seq[s] = seq;
+		blk += sizeof(seq_t) + sizeof(pos_t) * T;
+		pos += T;
+		obs += n;
+	}
+	return dat;
+}
@@ -38,12 +38,54 @@
 #include "tools.h"
 #include "ioline.h"
 
+/* rdr_pnd_t:
+ *   An observation or label unknown to a locked quark when it was searched
+ *   during a parallel conversion: the offset of its key in the keys buffer and
+ *   the slots where its identifier must be stored once interned. For labels
+ *   the slot is the position in the sequence.
+ */
+typedef struct rdr_pnd_s rdr_pnd_t;
+struct rdr_pnd_s {
+	uint64_t   key;        //      Offset of the key
+	uint32_t   slot[2];    //      Slots to fill or -1
+	bool       lbl;        //      Is this a label
+};
+
+/* rdr_scr_t:
+ *   Scratch memory used to convert raw sequences without allocating memory for
+ *   each line or observation: a buffer where the observations strings are
+ *   built, and the tokenized form of the sequence with its copy of the lines.
+ *   The memory is grown as needed and kept for the next sequences.
+ *
+ *   If <dobs> or <dlbl> are set, the corresponding quark is locked only for the
+ *   conversion and its unknown keys are deferred in <pnd> instead of dropped.
+ */
+typedef struct rdr_scr_s rdr_scr_t;
+struct rdr_scr_s {
+	char      *obs;        //      Observation string buffer
+	uint32_t   osize;      //      Size of <obs>
+	char      *line;       //      Copy of the lines of the sequence
+	uint64_t   lsize;      //      Size of <line>
+	char     **toks;       //      Tokens of all the lines
+	uint64_t   tsize;      //      Size of <toks>
+	tok_t     *tok;        //      Tokenized sequence
+	uint32_t   tlen;       //      Max length of <tok>
+	bool       dobs, dlbl; //      Defer unknown observations and labels
+	rdr_pnd_t *pnd;        //      Deferred observations and labels
+	uint32_t   npnd, spnd; //      Count and size of <pnd>
+	char      *keys;       //      Keys of the deferred entries
+	uint64_t   nkey, skey; //      Used size and size of <keys>
+};
+
 /* rdr_t:
  *   The reader object who hold all informations needed to parse the input file:
  *   the patterns and quark for labels and observations. We keep separate count
  *   for unigrams and bigrams pattern for simpler allocation of sequences. We
  *   also store the expected number of column in the input data to check that
  *   pattern are appliables.
+ *   If <hbits> is not 0, observations are not interned in <obs> but hashed to
+ *   one of 2^hbits unigram buckets, and to one of 2^hbbits bigram buckets who
+ *   follow them, see rdr_hashobs.
  */
 typedef struct rdr_s rdr_t;
 struct rdr_s {
@@ -55,24 +97,42 @@ struct rdr_s {
 	qrk_t     *lbl;        //      Labels database
 	qrk_t     *obs;        //      Observation database
     iol_t     *iol;        //      Class to handle line based IO.
+	rdr_scr_t *scr;        //      Scratch memory for rdr_raw2seq
+	uint32_t   shard;      //      Keep only sequences <shard> modulo
+	uint32_t   nshard;     //      <nshard> in rdr_readdat
+	uint32_t   hbits;      //      Bits of unigram buckets or 0
+	uint32_t   hbbits;     //      Bits of bigram buckets
 };
 
+rdr_scr_t *rdr_scrnew(void);
+void rdr_scrfree(rdr_scr_t *scr);
+
 rdr_t *rdr_new(iol_t *iol, bool autouni);
 void rdr_free(rdr_t *rdr);
 void rdr_freeraw(raw_t *raw_t);
 void rdr_freeseq(seq_t *seq);
 void rdr_freedat(dat_t *dat);
+void rdr_sortdat(dat_t *dat);
+uint64_t rdr_prune(rdr_t *rdr, dat_t *dat, uint32_t min, uint64_t keep);
+
+uint64_t rdr_nobs(const rdr_t *rdr);
+uint64_t rdr_hashobs(const rdr_t *rdr, const char *str, bool bi);
 
 
 void rdr_loadpat(rdr_t *rdr, iol_t *iol);
 raw_t *rdr_readraw(iol_t *iol, bool autouni);
+seq_t *rdr_raw2seqscr(rdr_t *rdr, rdr_scr_t *scr, const raw_t *raw, bool lbl);
 seq_t *rdr_raw2seq(rdr_t *rdr, const raw_t *raw, bool lbl);
 seq_t *rdr_readseq(rdr_t *rdr, iol_t *iol, bool lbl);
-dat_t *rdr_readdat(rdr_t *rdr, iol_t *iol, bool lbl);
+dat_t *rdr_readdat(rdr_t *rdr, iol_t *iol, bool lbl, uint32_t W);
 
 
 void rdr_load(rdr_t *rdr);
 void rdr_save(const rdr_t *rdr, iol_t *iol);
+void rdr_savebin(const rdr_t *rdr, FILE *file);
+void rdr_loadbin(rdr_t *rdr, bin_t *bin);
+void rdr_savedat(const dat_t *dat, FILE *file);
+dat_t *rdr_loaddat(rdr_t *rdr, bin_t *bin);
 
 char *rdr_readline(void *rl_data);
 
@@ -64,18 +64,49 @@
  ******************************************************************************/
 typedef struct rprop_s rprop_t;
 struct rprop_s {
-	mdl_t  *mdl;
-	double *xp;
-	double *stp;
-	double *g;
-	double *gp;
+	mdl_t   *mdl;
+	double  *x;
+	double  *xp;
+	double  *stp;
+	double  *g;
+	double  *gp;
+	uint8_t *act;
 };
 
+/* trn_rpropinit:
+ *   Initialize the part of the optimizer vectors updated by the thread <id> in
+ *   trn_rpropsub and copy there the same part of the weights. Memory pages are
+ *   placed by the system on the NUMA node of the thread who first touch them,
+ *   so, if threads stay on their node, each of them will next update memory
+ *   local to it.
+ */
+static void trn_rpropinit(job_t *job, uint32_t id, uint32_t cnt, rprop_t *st) {
+	unused(job);
+	const mdl_t   *mdl  = st->mdl;
+	const uint64_t F    = mdl->nftr;
+	const uint64_t from = F * id / cnt;
+	const uint64_t to   = F * (id + 1) / cnt;
+	for (uint64_t f = from; f < to; f++) {
+		st->x  [f] = mdl->theta[f];
+		st->stp[f] = 0.1;
+		st->g  [f] = 0.0;
+		st->gp [f] = 0.0;
+		if (st->xp != NULL)
+			st->xp[f] = 0.0;
+		if (st->act != NULL)
+			st->act[f] = 0;
+	}
+}
+
 /* trn_rpropsub:
  *   Partial update of the weight vector including partial gradient in case of
  *   l1 regularisation. The sub vector updated depend on the id and cnt
  *   parameter given, the job scheduling system is not used here as we can
  *   easily split processing in equals parts.
+ *   With an active set, a coordinate whose weight and previous weight stayed
+ *   null over the last iterations is skipped while its gradient is too small
+ *   to move it: in this case the full update would only copy the gradient, so
+ *   the result is the same but most of the vectors are not read.
  */
 static void trn_rpropsub(job_t *job, uint32_t id, uint32_t cnt, rprop_t *st) {
 	unused(job);
@@ -91,9 +122,22 @@ static void trn_rpropsub(job_t *job, uint32_t id, uint32_t cnt, rprop_t *st) {
 	double *x = mdl->theta;
 	double *xp  = st->xp,   *stp = st->stp;
 	double *g   = st->g,    *gp  = st->gp;
+	uint8_t *act = st->act;
+	const uint8_t  A    = mdl->opt->rpactive;
 	const uint64_t from = F * id / cnt;
 	const uint64_t to   = F * (id + 1) / cnt;
 	for (uint64_t f = from; f < to; f++) {
+		// Coordinates out of the active set are kept at zero unless
+		// the gradient is high enough to move them out of the cutoff,
+		// or, without l1 penalty, if it is no more null.
+		if (act != NULL && act[f] == A) {
+			const double ag = fabs(g[f]);
+			if (l1 == 0 ? ag <= EPSILON : ag < rho1) {
+				gp[f] = g[f];
+				continue;
+			}
+			act[f] = 0;
+		}
 		double pg = g[f];
 		// If there is a l1 component in the regularization component,
 		// we either project the gradient in the current orthant or
@@ -111,6 +155,8 @@ static void trn_rpropsub(job_t *job, uint32_t id, uint32_t cnt, rprop_t *st) {
 					xp[f] = x[f];
 				x[f]  = 0.0;
 				gp[f] = g[f];
+				if (act != NULL && (!wbt || xp[f] == 0.0))
+					act[f] = min(act[f] + 1, A);
 				continue;
 			}
 		}
@@ -141,6 +187,28 @@ static void trn_rpropsub(job_t *job, uint32_t id, uint32_t cnt, rprop_t *st) {
 				x[f] += stp[f] * -spg;
 		}
 		gp[f] = g[f];
+		if (act == NULL)
+			continue;
+		if (x[f] == 0.0 && (!wbt || xp[f] == 0.0))
+			act[f] = min(act[f] + 1, A);
+		else
+			act[f] = 0;
+	}
+}
+
+/* trn_rpropsave:
+ *   Write the optimizer state in the format read back with --rstate. This is
+ *   used both for --sstate and for the checkpoints.
+ */
+static void trn_rpropsave(mdl_t *mdl, FILE *file, void *ud) {
+	const rprop_t *st = ud;
+	const uint64_t F  = mdl->nftr;
+	fprintf(file, "#state#3#%"PRIu64"\n", F);
+	for (uint64_t f = 0; f < F; f++) {
+		double vxp = st->xp != NULL ? st->xp[f] : 0.0;
+		double vstp = st->stp[f], vgp = st->gp[f];
+		fprintf(file, "%"PRIu64" ", f);
+		fprintf(file, "%la %la %la\n", vxp, vstp, vgp);
 	}
 }
 
@@ -149,18 +217,30 @@ void trn_rprop(mdl_t *mdl) {
 	const uint32_t K   = mdl->opt->maxiter;
 	const uint32_t W   = mdl->opt->nthread;
 	const bool     wbt = strcmp(mdl->opt->algo, "rprop-");
-	const int      cut = mdl->opt->rprop.cutoff;
-	// Allocate state memory and initialize it
+	// Allocate state memory and initialize it. This is done by the threads
+	// which will update each part of the vectors so they are allocated on
+	// their NUMA node, the weights being moved there too. The previous
+	// weights are needed for backtracking, including with the cutoff.
 	double *xp  = NULL,       *stp = xvm_new(F);
 	double *g   = xvm_new(F), *gp  = xvm_new(F);
-	if (wbt && !cut)
+	if (wbt)
 		xp = xvm_new(F);
-	for (uint64_t f = 0; f < F; f++) {
-		if (wbt && !cut)
-			xp[f]  = 0.0;
-		gp[f]  = 0.0;
-		stp[f] = 0.1;
-	}
+	uint8_t *act = NULL;
+	if (mdl->opt->rpactive != 0)
+		act = xmalloc(sizeof(uint8_t) * F);
+	rprop_t *st = xmalloc(sizeof(rprop_t));
+	st->mdl = mdl;
+	st->x   = xvm_new(F);
+	st->xp  = xp;  st->stp = stp;
+	st->g   = g;   st->gp  = gp;
+	st->act = act;
+	rprop_t *rprop[W];
+	for (uint32_t w = 0; w < W; w++)
+		rprop[w] = st;
+	mth_spawn((func_t *)trn_rpropinit, W, (void **)rprop, 0, 0);
+	if (!bin_has(mdl->map, mdl->theta))
+		xvm_free(mdl->theta);
+	mdl->theta = st->x;
 	// Restore a saved state if given by the user
 	if (mdl->opt->rstate != NULL) {
 		const char *err = "invalid state file";
@@ -179,21 +259,12 @@ void trn_rprop(mdl_t *mdl) {
 			if (fscanf(file, "%"PRIu64" %la %la %la\n", &f, &vxp,
 					&vstp, &vgp) != 4)
 				fatal(err);
-			if (wbt && !cut) xp[f] = vxp;
+			if (wbt) xp[f] = vxp;
 			gp[f] = vgp;
 			stp[f] = vstp;
 		}
 		fclose(file);
 	}
-	// Prepare the rprop state used to send information to the rprop worker
-	// about updating weight using the gradient.
-	rprop_t *st = xmalloc(sizeof(rprop_t));
-	st->mdl = mdl;
-	st->xp  = xp;  st->stp = stp;
-	st->g   = g;   st->gp  = gp;
-	rprop_t *rprop[W];
-	for (uint32_t w = 0; w < W; w++)
-		rprop[w] = st;
 	// Prepare the gradient state for the distributed gradient computation.
 	grd_t *grd = grd_new(mdl, g);
 	// And iterate the gradient computation / weight update process until
@@ -205,24 +276,20 @@ void trn_rprop(mdl_t *mdl) {
 		mth_spawn((func_t *)trn_rpropsub, W, (void **)rprop, 0, 0);
 		if (uit_progress(mdl, k + 1, fx) == false)
 			break;
+		uit_checkpoint(mdl, k + 1, trn_rpropsave, st);
 	}
 	// Save state if user requested it
 	if (mdl->opt->sstate != NULL) {
 		FILE *file = fopen(mdl->opt->sstate, "w");
 		if (file == NULL)
 			fatal("failed to open output state file");
-		fprintf(file, "#state#3#%"PRIu64"\n", F);
-		for (uint64_t f = 0; f < F; f++) {
-			double vxp = xp != NULL ? xp[f] : 0.0;
-			double vstp = stp[f], vgp = gp[f];
-			fprintf(file, "%"PRIu64" ", f);
-			fprintf(file, "%la %la %la\n", vxp, vstp, vgp);
-		}
+		trn_rpropsave(mdl, file, st);
 		fclose(file);
 	}
 	// Free all allocated memory
-	if (wbt && !cut)
+	if (wbt)
 		xvm_free(xp);
+	xfree(act);
 	xvm_free(g);
 	xvm_free(gp);
 	xvm_free(stp);
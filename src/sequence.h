@@ -28,6 +28,7 @@
 #ifndef sequence_h
 #define sequence_h
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -69,11 +70,15 @@
  *   find the corresponding line at <lines>[t].
  *
  *   The <lines> array is allocated with data structure, and the different lines
- *   are allocated separatly.
+ *   are allocated separatly. If <view> is set, the lines are instead views in
+ *   the input buffer terminated by a '\n' and are not owned by the object, so
+ *   their length must be taken with strcspn(line, "\n") who also work for the
+ *   owned ones.
  */
 typedef struct raw_s raw_t;
 struct raw_s {
 	uint32_t  len;      //   T     Sequence length
+	bool      view;     //         Lines are views in the input buffer
 	char     *lines[];  //  [T]    Raw lines directly from file
 };
 
@@ -115,28 +120,54 @@ struct tok_s {
  *   labelling mode, the <lbl> field will be NULL and so, the sequence cannot be
  *   used for training.
  *
- *   The raw field is private and used internaly for efficient memory
- *   allocation. This allow to allocate <lbl>, <*cnt>, and all the list in
- *   <*obs> with the datastructure itself.
+ *   All the observations lists of a sequence are stored contiguously in <raw>,
+ *   the unigrams observations of a position immediately followed by its bigram
+ *   ones, and each position only keep the offset <off> of its lists in this
+ *   block. Observation identifiers are stored as obs_t values. The lists must
+ *   be accessed through seq_uobs and seq_bobs.
  */
+#ifdef SEQ_OBS64
+typedef uint64_t obs_t;
+#else
+typedef uint32_t obs_t;
+#endif
+
 typedef struct pos_s pos_t;
 typedef struct seq_s seq_t;
+struct pos_s {
+	uint32_t  lbl;
+	uint32_t  ucnt,  bcnt;
+	uint32_t  off;
+};
 struct seq_s {
 	uint32_t  len;
-	uint64_t *raw;
-	struct pos_s {
-		uint32_t  lbl;
-		uint32_t  ucnt,  bcnt;
-		uint64_t *uobs, *bobs;
-	} pos[];
+	obs_t    *raw;
+	pos_t     pos[];
 };
 
+/* seq_uobs:
+ *   Return the list of unigram observations at the given position.
+ */
+static inline const obs_t *seq_uobs(const seq_t *seq, const pos_t *pos) {
+	return seq->raw + pos->off;
+}
+
+/* seq_bobs:
+ *   Return the list of bigram observations at the given position.
+ */
+static inline const obs_t *seq_bobs(const seq_t *seq, const pos_t *pos) {
+	return seq->raw + pos->off + pos->ucnt;
+}
+
 /* dat_t:
  *   Data-structure representing a full dataset: a collection of sequences ready
  *   to be used for training or to be labelled. It keep tracks of the maximum
  *   sequence length as the trainer need this for memory allocation. The dataset
  *   contains <nseq> sequence stored in <seq>. These sequences are labeled only
  *   if <lbl> is true.
+ *   When the dataset is loaded from a binary cache, all the sequences are
+ *   allocated in the single block <blk> and their observations lists point
+ *   inside the mapped file, else <blk> is NULL.
  */
 typedef struct dat_s dat_t;
 struct dat_s {
@@ -144,6 +175,7 @@ struct dat_s {
 	uint32_t   mlen;  //         Length of the longest sequence in the set
 	uint32_t   nseq;  //   S     Number of sequences in the set
 	seq_t    **seq;   //  [S]    List of sequences
+	void      *blk;   //         Sequences block or NULL
 };
 
 #endif
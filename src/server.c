@@ -0,0 +1,968 @@
+/*
+ *      Wapiti - A linear-chain CRF tool
+ *
+ * Copyright (c) 2009-2013  CNRS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <errno.h>
+#include <inttypes.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "wapiti.h"
+
+#if !defined(WIN32) && !defined(_WIN32) && !defined(MTH_ANSI)
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#endif
+
+#include "decoder.h"
+#include "model.h"
+#include "options.h"
+#include "quark.h"
+#include "reader.h"
+#include "sequence.h"
+#include "server.h"
+#include "thread.h"
+#include "tools.h"
+
+/******************************************************************************
+ * Label server
+ *
+ *   This module keep a model loaded and label the sequences sent by clients
+ *   over a Unix or TCP socket, so the loading cost is paid only once. A client
+ *   can send, on the same connection, any number of requests of two kinds:
+ *     - a sequence in the usual column format terminated by a blank line, the
+ *       reply is the same as the output of the label mode for it ;
+ *     - a binary frame made of a null byte and the size of the payload as a 32
+ *       bits integer in network order followed by the payload, a sequence in
+ *       column format. The reply is a frame of the same form whose payload is
+ *       the output of the label mode restricted to the labels.
+ *   The null byte cannot appear in text data so the two kinds can be mixed.
+ *
+ *   A poller thread watch the listening socket and the idle connections and
+ *   hand the ones with incoming data to a pool of workers. A worker process
+ *   all the complete requests received on the connection and give it back to
+ *   the poller. So idle clients cost nothing and requests from different
+ *   clients are decoded concurrently.
+ *
+ *   A reloader thread check the model file at regular interval and, when it
+ *   has changed and stayed the same for a full interval, load the new model
+ *   and make it replace the current one. The errors of the loaders are caught
+ *   in this thread so, if the new file cannot be loaded, the current model is
+ *   kept. As binary models are mapped, a new model file must be written aside
+ *   and renamed over the old one. Models are reference counted: each
+ *   request use the model current when it started and the old one is
+ *   released only when the last request using it is done, so no request is
+ *   dropped or see a mix of the two models. The latencies of the requests
+ *   are collected and their percentiles are reported at regular interval.
+ ******************************************************************************/
+#if !defined(WIN32) && !defined(_WIN32) && !defined(MTH_ANSI)
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define SRV_MAXREQ  (64 << 20)  // Maximum size of a request in bytes
+#define SRV_TICK    200         // Poller timeout in milliseconds
+#define SRV_SNDTMO  30          // Send timeout in seconds
+
+/* srv_mdl_t:
+ *   A loaded model with its decoding cache. The current model hold one
+ *   reference and each worker using it hold another one.
+ */
+typedef struct srv_mdl_s srv_mdl_t;
+struct srv_mdl_s {
+	mdl_t       *mdl;
+	tag_cache_t *cache;
+	uint32_t     refs;
+};
+
+/* srv_con_t:
+ *   A client connection with the data received but not yet processed in
+ *   <buf> from <pos> to <len>, and the reply being built in <out>.
+ */
+typedef struct srv_con_s srv_con_t;
+struct srv_con_s {
+	int        sck;
+	bool       eof;     //  True if the client closed its side
+	char      *buf;     //  Received data
+	size_t     pos, len, size;
+	char      *out;     //  Reply to send
+	size_t     olen, osize;
+	double     tdsp;    //  Time of the last dispatch to a worker
+	srv_con_t *next;
+};
+
+/* srv_t:
+ *   The state shared by the poller and the workers, all protected by <lock>
+ *   except the options and the wake-up pipe.
+ */
+typedef struct srv_s srv_t;
+struct srv_s {
+	const opt_t     *opt;
+	pthread_mutex_t  lock;
+	pthread_cond_t   wake;     //  Signaled when connections are queued
+	pthread_cond_t   rwake;    //  Signaled to stop the reloader
+	bool             stop;
+	srv_mdl_t       *cur;      //  Current model
+	srv_con_t       *qhead;    //  Connections waiting for a worker
+	srv_con_t       *qtail;
+	srv_con_t       *back;     //  Connections given back by the workers
+	int              pipe[2];  //  Wake up the poller when <back> is filled
+	double          *lat;      //  Latencies since the last report
+	size_t           nlat, slat;
+	uint64_t         nreq;     //  Total number of requests
+};
+
+/* srv_wrk_t:
+ *   The per-thread state. Each worker keep a decoding state for the model it
+ *   used last, and a reference on it, until the model is replaced.
+ */
+typedef struct srv_wrk_s srv_wrk_t;
+struct srv_wrk_s {
+	srv_t     *srv;
+	int        lsck;    //  Listening socket, for the poller
+	srv_mdl_t *mdl;
+	tag_st_t  *st;
+	rdr_scr_t *scr;
+	char      *req;     //  Copy of the current request
+	size_t     rsize;
+	uint32_t  *out;     //  [T][N] decoded labels
+	double    *psc;     //  [T][N] and their scores
+	double    *scs;     //  [N]    sequences scores
+	uint32_t   osize;
+};
+
+static volatile sig_atomic_t srv_sig = 0;
+
+static void srv_signal(int sig) {
+	unused(sig);
+	srv_sig = 1;
+}
+
+/* srv_now:
+ *   Return the value of a monotonic clock in seconds.
+ */
+static double srv_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1.0e-9;
+}
+
+/******************************************************************************
+ * Models
+ ******************************************************************************/
+
+/* srv_load:
+ *   Load the model file given in the options and prepare it for decoding. If
+ *   <keep> is true, errors are not fatal: they are reported as a warning, the
+ *   partially loaded model is released, and NULL is returned.
+ */
+static srv_mdl_t *srv_load(const opt_t *opt, bool keep) {
+	FILE  *volatile file = NULL;
+	mdl_t *volatile mdl  = NULL;
+	err_t err;
+	if (keep) {
+		if (setjmp(err.env) != 0) {
+			warning("cannot load model file, keep the current one"
+				"\n\t<%s>", err.msg);
+			if (file != NULL)
+				fclose(file);
+			if (mdl != NULL)
+				mdl_free(mdl);
+			return NULL;
+		}
+		err_push(&err);
+	}
+	file = fopen(opt->model, "r");
+	if (file == NULL)
+		pfatal("cannot open model file %s", opt->model);
+	mdl = mdl_new(rdr_new(iol_new(file, NULL), opt->maxent));
+	mdl->opt = opt;
+	if (mdl_isbin(opt->model))
+		mdl_loadbin(mdl, opt->model);
+	else
+		mdl_load(mdl);
+	fclose(file);
+	file = NULL;
+	if (opt->lblpost)
+		mdl_expand(mdl);
+	mdl_share(mdl);
+	srv_mdl_t *sm = xmalloc(sizeof(srv_mdl_t));
+	sm->mdl   = mdl;
+	sm->cache = tag_cachenew(mdl);
+	sm->refs  = 1;
+	if (keep)
+		err_pop(&err);
+	return sm;
+}
+
+/* srv_release:
+ *   Drop a reference on a model and free it if this was the last one.
+ */
+static void srv_release(srv_t *srv, srv_mdl_t *sm) {
+	pthread_mutex_lock(&srv->lock);
+	const bool last = --sm->refs == 0;
+	pthread_mutex_unlock(&srv->lock);
+	if (!last)
+		return;
+	tag_cachefree(sm->cache);
+	mdl_free(sm->mdl);
+	xfree(sm);
+}
+
+/* srv_drop:
+ *   Release the decoding state of a worker and its model.
+ */
+static void srv_drop(srv_wrk_t *wrk) {
+	if (wrk->mdl == NULL)
+		return;
+	tag_stfree(wrk->st);
+	srv_release(wrk->srv, wrk->mdl);
+	wrk->st  = NULL;
+	wrk->mdl = NULL;
+}
+
+/* srv_use:
+ *   Make sure the worker decoding state is for the current model. The model
+ *   is then kept for the whole request even if it is replaced meanwhile.
+ */
+static void srv_use(srv_wrk_t *wrk) {
+	srv_t *srv = wrk->srv;
+	pthread_mutex_lock(&srv->lock);
+	srv_mdl_t *cur = srv->cur;
+	const bool same = wrk->mdl == cur;
+	if (!same)
+		cur->refs++;
+	pthread_mutex_unlock(&srv->lock);
+	if (same)
+		return;
+	srv_drop(wrk);
+	wrk->mdl = cur;
+	wrk->st  = tag_stnew(cur->mdl, srv->opt->nbest);
+	wrk->st->cache = cur->cache;
+}
+
+/* srv_same:
+ *   Check if two stats of the model file are for the same content.
+ */
+static bool srv_same(const struct stat *a, const struct stat *b) {
+	return a->st_dev   == b->st_dev  && a->st_ino  == b->st_ino
+	    && a->st_size  == b->st_size && a->st_mtime == b->st_mtime;
+}
+
+/* srv_reload:
+ *   Check if the model file has changed since it was loaded and is stable,
+ *   that is it had the same stat at the previous check. In this case, load
+ *   it and make it the current model. If the new file cannot be loaded, the
+ *   current model is kept and the file is ignored until it changes again.
+ *   This is called only from the reloader thread so the workers and the
+ *   poller are never blocked by the loading.
+ */
+static void srv_reload(srv_t *srv, struct stat *seen, struct stat *pend) {
+	struct stat now;
+	if (stat(srv->opt->model, &now) != 0 || srv_same(&now, seen))
+		return;
+	if (!srv_same(&now, pend)) {
+		*pend = now;
+		return;
+	}
+	info("* Reload model\n");
+	// If the file is replaced again during the loading, the new one will
+	// be seen as a change at the next check.
+	*seen = now;
+	srv_mdl_t *sm = srv_load(srv->opt, true);
+	if (sm == NULL)
+		return;
+	pthread_mutex_lock(&srv->lock);
+	srv_mdl_t *old = srv->cur;
+	srv->cur = sm;
+	pthread_cond_broadcast(&srv->wake);
+	pthread_mutex_unlock(&srv->lock);
+	srv_release(srv, old);
+}
+
+/* srv_reloader:
+ *   Main loop of the reloader: check the model file every <reload> seconds
+ *   until the server is stopped.
+ */
+static void srv_reloader(srv_t *srv) {
+	const opt_t *opt = srv->opt;
+	if (opt->reload == 0)
+		return;
+	struct stat seen, pend;
+	if (stat(opt->model, &seen) != 0)
+		pfatal("cannot stat model file");
+	pend = seen;
+	pthread_mutex_lock(&srv->lock);
+	while (!srv->stop) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += opt->reload;
+		int res = 0;
+		while (!srv->stop && res != ETIMEDOUT)
+			res = pthread_cond_timedwait(&srv->rwake, &srv->lock,
+			                             &ts);
+		if (srv->stop)
+			break;
+		pthread_mutex_unlock(&srv->lock);
+		srv_reload(srv, &seen, &pend);
+		pthread_mutex_lock(&srv->lock);
+	}
+	pthread_mutex_unlock(&srv->lock);
+}
+
+/******************************************************************************
+ * Latencies
+ ******************************************************************************/
+
+/* srv_done:
+ *   Record the latency of a request started at <t0>.
+ */
+static void srv_done(srv_t *srv, double t0) {
+	const double lat = srv_now() - t0;
+	pthread_mutex_lock(&srv->lock);
+	if (srv->nlat == srv->slat) {
+		srv->slat = max(srv->slat * 2, (size_t)1024);
+		srv->lat  = xrealloc(srv->lat, sizeof(double) * srv->slat);
+	}
+	srv->lat[srv->nlat++] = lat;
+	srv->nreq++;
+	pthread_mutex_unlock(&srv->lock);
+}
+
+static int srv_cmp(const void *a, const void *b) {
+	const double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* srv_report:
+ *   Report the percentiles of the latencies of the requests done since the
+ *   previous report and start a new window.
+ */
+static void srv_report(srv_t *srv) {
+	pthread_mutex_lock(&srv->lock);
+	double *lat = srv->lat;
+	const size_t   n    = srv->nlat;
+	const uint64_t nreq = srv->nreq;
+	srv->lat  = NULL;
+	srv->nlat = srv->slat = 0;
+	pthread_mutex_unlock(&srv->lock);
+	if (n == 0) {
+		xfree(lat);
+		return;
+	}
+	qsort(lat, n, sizeof(double), srv_cmp);
+	const double p[3] = {0.50, 0.90, 0.99};
+	double v[3];
+	for (int i = 0; i < 3; i++) {
+		const size_t k = (size_t)(p[i] * n + 0.999999);
+		v[i] = lat[min(max(k, (size_t)1), n) - 1] * 1000.0;
+	}
+	info("    [%"PRIu64"] %zu requests  p50=%.3fms  p90=%.3fms"
+	     "  p99=%.3fms  max=%.3fms\n", nreq, n, v[0], v[1], v[2],
+	     lat[n - 1] * 1000.0);
+	xfree(lat);
+}
+
+/******************************************************************************
+ * Requests
+ ******************************************************************************/
+
+/* srv_blank:
+ *   Return true if the line from <beg> to <end> contains only spaces.
+ */
+static bool srv_blank(const char *beg, const char *end) {
+	for ( ; beg < end; beg++)
+		if (*beg != ' ' && *beg != '\t' && *beg != '\r')
+			return false;
+	return true;
+}
+
+/* srv_next:
+ *   Search for the next complete request in the data received on <con>. If
+ *   one is found, it is returned in <req> and <len>, its kind in <bin>, and it
+ *   is consumed. Return 1 if a request was found, 0 if more data are needed,
+ *   and -1 if the data are invalid.
+ */
+static int srv_next(srv_con_t *con, const char **req, size_t *len, bool *bin) {
+	const char *end = con->buf + con->len;
+	// First skip the blank lines between two text requests
+	while (con->pos < con->len && con->buf[con->pos] != '\0') {
+		const char *beg = con->buf + con->pos;
+		const char *eol = memchr(beg, '\n', end - beg);
+		if (eol == NULL && !con->eof)
+			return 0;
+		if (eol == NULL)
+			eol = end;
+		if (!srv_blank(beg, eol))
+			break;
+		con->pos = min((size_t)(eol + 1 - con->buf), con->len);
+	}
+	if (con->pos == con->len)
+		return 0;
+	const char   *beg   = con->buf + con->pos;
+	const size_t  avail = con->len - con->pos;
+	if (beg[0] == '\0') {
+		uint32_t size;
+		if (avail < 5)
+			return con->eof ? -1 : 0;
+		memcpy(&size, beg + 1, sizeof(size));
+		size = ntohl(size);
+		if (size > SRV_MAXREQ)
+			return -1;
+		if (avail < 5 + (size_t)size)
+			return con->eof ? -1 : 0;
+		*req = beg + 5, *len = size, *bin = true;
+		con->pos += 5 + (size_t)size;
+		return 1;
+	}
+	for (const char *lin = beg; lin < end; ) {
+		const char *eol = memchr(lin, '\n', end - lin);
+		if (eol == NULL)
+			break;
+		if (srv_blank(lin, eol)) {
+			*req = beg, *len = lin - beg, *bin = false;
+			con->pos = eol + 1 - con->buf;
+			return 1;
+		}
+		lin = eol + 1;
+	}
+	if (!con->eof)
+		return avail > SRV_MAXREQ ? -1 : 0;
+	*req = beg, *len = avail, *bin = false;
+	con->pos = con->len;
+	return 1;
+}
+
+/* srv_print:
+ *   Append formatted text to the reply of the connection.
+ */
+static void srv_print(srv_con_t *con, const char *fmt, ...) {
+	while (true) {
+		va_list args;
+		va_start(args, fmt);
+		const size_t room = con->osize - con->olen;
+		const int n = vsnprintf(con->out + con->olen, room, fmt, args);
+		va_end(args);
+		if (n < 0)
+			fatal("cannot format reply");
+		if ((size_t)n < room) {
+			con->olen += n;
+			return;
+		}
+		con->osize = max(con->osize * 2, con->olen + n + 1);
+		con->out   = xrealloc(con->out, con->osize);
+	}
+}
+
+/* srv_decode:
+ *   Label a raw sequence and append the result to the reply, in the same
+ *   format as the label mode, without the input columns for binary frames.
+ */
+static void srv_decode(srv_wrk_t *wrk, srv_con_t *con, const raw_t *raw,
+                       bool bin) {
+	const opt_t *opt = wrk->srv->opt;
+	mdl_t *mdl = wrk->mdl->mdl;
+	const uint32_t N = opt->nbest;
+	seq_t *seq = rdr_raw2seqscr(mdl->reader, wrk->scr, raw, false);
+	const uint32_t T = seq->len;
+	if (T * N > wrk->osize) {
+		wrk->osize = T * N;
+		wrk->out = xrealloc(wrk->out, sizeof(uint32_t) * T * N);
+		wrk->psc = xrealloc(wrk->psc, sizeof(double  ) * T * N);
+	}
+	if (N == 1)
+		tag_viterbi(wrk->st, seq, wrk->out, wrk->scs, wrk->psc);
+	else
+		tag_nbviterbi(wrk->st, seq, N, wrk->out, wrk->scs, wrk->psc);
+	const qrk_t *lbls = mdl->reader->lbl;
+	for (uint32_t n = 0; n < N; n++) {
+		if (opt->outsc)
+			srv_print(con, "# %d %f\n", (int)n, wrk->scs[n]);
+		for (uint32_t t = 0; t < T; t++) {
+			if (!opt->label && !bin) {
+				const char *ln = raw->lines[t];
+				const int len = strcspn(ln, "\n");
+				srv_print(con, "%.*s\t", len, ln);
+			}
+			const uint32_t lb = wrk->out[t * N + n];
+			const char *lblstr = qrk_id2str(lbls, lb);
+			srv_print(con, "%s", lblstr);
+			if (opt->outsc)
+				srv_print(con, "\t%s/%f", lblstr,
+					wrk->psc[t * N + n]);
+			srv_print(con, "\n");
+		}
+		srv_print(con, "\n");
+	}
+	rdr_freeseq(seq);
+}
+
+/* srv_label:
+ *   Label a request and build its reply. The request is copied so each line
+ *   is terminated by a '\n' and can be used as a view by the reader. Blank
+ *   lines in binary frames are ignored and, in maxent mode, each line is a
+ *   sequence by itself like in the label mode.
+ */
+static void srv_label(srv_wrk_t *wrk, srv_con_t *con, const char *req,
+                      size_t len, bool bin) {
+	srv_use(wrk);
+	const bool autouni = wrk->mdl->mdl->reader->autouni;
+	if (len + 2 > wrk->rsize) {
+		wrk->rsize = len + 2;
+		wrk->req = xrealloc(wrk->req, wrk->rsize);
+	}
+	char *end = wrk->req + len + 1;
+	memcpy(wrk->req, req, len);
+	wrk->req[len] = '\n';
+	wrk->req[len + 1] = '\0';
+	uint32_t cnt = 0;
+	for (size_t i = 0; i <= len; i++)
+		cnt += wrk->req[i] == '\n';
+	raw_t *raw = xmalloc(sizeof(raw_t) + sizeof(char *) * cnt);
+	raw->view = true;
+	raw->len  = 0;
+	for (char *lin = wrk->req; lin < end; ) {
+		char *eol = memchr(lin, '\n', end - lin);
+		if (!srv_blank(lin, eol))
+			raw->lines[raw->len++] = lin;
+		lin = eol + 1;
+	}
+	const size_t hdr = con->olen;
+	if (bin)
+		srv_print(con, "%c%c%c%c%c", 0, 0, 0, 0, 0);
+	if (autouni) {
+		raw_t *one = xmalloc(sizeof(raw_t) + sizeof(char *));
+		one->view = true;
+		one->len  = 1;
+		for (uint32_t t = 0; t < raw->len; t++) {
+			one->lines[0] = raw->lines[t];
+			srv_decode(wrk, con, one, bin);
+		}
+		xfree(one);
+	} else if (raw->len != 0) {
+		srv_decode(wrk, con, raw, bin);
+	}
+	if (bin) {
+		uint32_t size = htonl(con->olen - hdr - 5);
+		memcpy(con->out + hdr + 1, &size, sizeof(size));
+	}
+	xfree(raw);
+}
+
+/* srv_send:
+ *   Send the reply built for the connection.
+ */
+static bool srv_send(srv_con_t *con) {
+	size_t pos = 0;
+	while (pos < con->olen) {
+		const ssize_t n = send(con->sck, con->out + pos,
+			con->olen - pos, MSG_NOSIGNAL);
+		if (n > 0)
+			pos += n;
+		else if (n == -1 && errno != EINTR)
+			return false;
+	}
+	con->olen = 0;
+	return true;
+}
+
+/* srv_serve:
+ *   Process all the complete requests received on the connection, reading
+ *   what is available on the socket without blocking. Return false if the
+ *   connection must be closed.
+ */
+static bool srv_serve(srv_wrk_t *wrk, srv_con_t *con) {
+	double t0 = con->tdsp;
+	while (true) {
+		const char *req;
+		size_t len;
+		bool bin;
+		int res;
+		while ((res = srv_next(con, &req, &len, &bin)) == 1) {
+			srv_label(wrk, con, req, len, bin);
+			if (!srv_send(con))
+				return false;
+			srv_done(wrk->srv, t0);
+			t0 = srv_now();
+		}
+		if (res < 0 || con->eof)
+			return false;
+		if (con->pos != 0) {
+			memmove(con->buf, con->buf + con->pos,
+				con->len - con->pos);
+			con->len -= con->pos;
+			con->pos  = 0;
+		}
+		if (con->len == con->size) {
+			con->size = max(con->size * 2, (size_t)65536);
+			con->buf  = xrealloc(con->buf, con->size);
+		}
+		const ssize_t n = recv(con->sck, con->buf + con->len,
+			con->size - con->len, MSG_DONTWAIT);
+		if (n > 0)
+			con->len += n;
+		else if (n == 0)
+			con->eof = true;
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return true;
+		else if (errno != EINTR)
+			return false;
+	}
+}
+
+/******************************************************************************
+ * Connections
+ ******************************************************************************/
+
+/* srv_listen:
+ *   Open the listening socket at the given address, either "unix:PATH" for a
+ *   Unix socket or "HOST:PORT" for a TCP one where the host can be empty to
+ *   listen on all interfaces.
+ */
+static int srv_listen(const char *addr) {
+	int sck;
+	if (!strncmp(addr, "unix:", 5)) {
+		struct sockaddr_un sun;
+		memset(&sun, 0, sizeof(sun));
+		if (strlen(addr + 5) >= sizeof(sun.sun_path))
+			fatal("socket path too long '%s'", addr + 5);
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, addr + 5);
+		sck = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (sck == -1)
+			pfatal("cannot create socket");
+		unlink(sun.sun_path);
+		if (bind(sck, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+			pfatal("cannot bind listening socket");
+	} else {
+		char *host = xstrdup(addr);
+		char *sep = strrchr(host, ':');
+		if (sep == NULL)
+			fatal("invalid listen address '%s'", addr);
+		*sep = '\0';
+		struct addrinfo hint, *res;
+		memset(&hint, 0, sizeof(hint));
+		hint.ai_family   = AF_UNSPEC;
+		hint.ai_socktype = SOCK_STREAM;
+		hint.ai_flags    = AI_PASSIVE;
+		const int err = getaddrinfo(host[0] ? host : NULL, sep + 1,
+			&hint, &res);
+		if (err != 0)
+			fatal("cannot resolve '%s': %s", addr,
+				gai_strerror(err));
+		sck = socket(res->ai_family, res->ai_socktype,
+			res->ai_protocol);
+		if (sck == -1)
+			pfatal("cannot create socket");
+		const int one = 1;
+		setsockopt(sck, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(sck, res->ai_addr, res->ai_addrlen) == -1)
+			pfatal("cannot bind listening socket");
+		freeaddrinfo(res);
+		xfree(host);
+	}
+	if (listen(sck, SOMAXCONN) == -1)
+		pfatal("cannot listen on socket");
+	if (fcntl(sck, F_SETFL, fcntl(sck, F_GETFL) | O_NONBLOCK) == -1)
+		pfatal("cannot setup socket");
+	return sck;
+}
+
+/* srv_connew:
+ *   Setup a new client connection. Replies are sent in blocking mode with a
+ *   timeout so a client which doesn't read them cannot hold a worker forever.
+ */
+static srv_con_t *srv_connew(int sck) {
+	const int one = 1;
+	const struct timeval tmo = {SRV_SNDTMO, 0};
+	setsockopt(sck, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(sck, SOL_SOCKET, SO_SNDTIMEO, &tmo, sizeof(tmo));
+	fcntl(sck, F_SETFL, fcntl(sck, F_GETFL) & ~O_NONBLOCK);
+	srv_con_t *con = xmalloc(sizeof(srv_con_t));
+	memset(con, 0, sizeof(srv_con_t));
+	con->sck   = sck;
+	con->osize = 4096;
+	con->out   = xmalloc(con->osize);
+	return con;
+}
+
+/* srv_confree:
+ *   Close a connection and free it.
+ */
+static void srv_confree(srv_con_t *con) {
+	close(con->sck);
+	xfree(con->buf);
+	xfree(con->out);
+	xfree(con);
+}
+
+/******************************************************************************
+ * Threads
+ ******************************************************************************/
+
+/* srv_worker:
+ *   Main loop of the workers: take the connections queued by the poller, serve
+ *   them, and give them back. When the model is replaced, idle workers are
+ *   woken up to release their reference on the old one.
+ */
+static void srv_worker(srv_wrk_t *wrk) {
+	srv_t *srv = wrk->srv;
+	while (true) {
+		pthread_mutex_lock(&srv->lock);
+		while (srv->qhead == NULL && !srv->stop) {
+			if (wrk->mdl != NULL && wrk->mdl != srv->cur) {
+				pthread_mutex_unlock(&srv->lock);
+				srv_drop(wrk);
+				pthread_mutex_lock(&srv->lock);
+				continue;
+			}
+			pthread_cond_wait(&srv->wake, &srv->lock);
+		}
+		srv_con_t *con = srv->qhead;
+		if (con != NULL) {
+			srv->qhead = con->next;
+			if (srv->qhead == NULL)
+				srv->qtail = NULL;
+		}
+		pthread_mutex_unlock(&srv->lock);
+		if (con == NULL)
+			return;
+		if (!srv_serve(wrk, con)) {
+			srv_confree(con);
+			continue;
+		}
+		pthread_mutex_lock(&srv->lock);
+		con->next = srv->back;
+		srv->back = con;
+		pthread_mutex_unlock(&srv->lock);
+		if (write(srv->pipe[1], "", 1) == -1 && errno != EAGAIN)
+			pfatal("cannot wake up poller");
+	}
+}
+
+/* srv_poller:
+ *   Main loop of the poller: accept new connections, dispatch the ones with
+ *   incoming data to the workers, and at regular interval report the
+ *   latencies. Run until interrupted by a signal.
+ */
+static void srv_poller(srv_wrk_t *wrk) {
+	srv_t *srv = wrk->srv;
+	const opt_t *opt = srv->opt;
+	uint32_t nidle = 0, sidle = 16;
+	srv_con_t    **idle = xmalloc(sizeof(srv_con_t *) * sidle);
+	struct pollfd *fds  = xmalloc(sizeof(struct pollfd) * (sidle + 2));
+	double trep = srv_now();
+	while (!srv_sig) {
+		fds[0] = (struct pollfd){.fd = wrk->lsck,    .events = POLLIN};
+		fds[1] = (struct pollfd){.fd = srv->pipe[0], .events = POLLIN};
+		for (uint32_t i = 0; i < nidle; i++)
+			fds[i + 2] = (struct pollfd){idle[i]->sck, POLLIN, 0};
+		if (poll(fds, nidle + 2, SRV_TICK) == -1 && errno != EINTR)
+			pfatal("cannot poll sockets");
+		// Queue the connections with incoming data for the workers
+		const double now = srv_now();
+		uint32_t cnt = 0;
+		pthread_mutex_lock(&srv->lock);
+		for (uint32_t i = 0; i < nidle; i++) {
+			srv_con_t *con = idle[i];
+			if (fds[i + 2].revents == 0) {
+				idle[cnt++] = con;
+				continue;
+			}
+			con->tdsp = now;
+			con->next = NULL;
+			if (srv->qtail != NULL)
+				srv->qtail->next = con;
+			else
+				srv->qhead = con;
+			srv->qtail = con;
+		}
+		if (cnt != nidle)
+			pthread_cond_broadcast(&srv->wake);
+		nidle = cnt;
+		// Get back the connections served by the workers
+		srv_con_t *back = NULL;
+		if (fds[1].revents != 0) {
+			char tmp[64];
+			while (read(srv->pipe[0], tmp, sizeof(tmp)) > 0)
+				;
+			back = srv->back;
+			srv->back = NULL;
+		}
+		pthread_mutex_unlock(&srv->lock);
+		// Add them and the new ones to the idle list
+		while (true) {
+			int sck = -1;
+			srv_con_t *con = back;
+			if (con != NULL) {
+				back = con->next;
+			} else if (fds[0].revents != 0) {
+				sck = accept(wrk->lsck, NULL, NULL);
+				if (sck == -1)
+					break;
+				con = srv_connew(sck);
+			} else {
+				break;
+			}
+			if (nidle == sidle) {
+				sidle *= 2;
+				idle = xrealloc(idle,
+					sizeof(srv_con_t *) * sidle);
+				fds  = xrealloc(fds,
+					sizeof(struct pollfd) * (sidle + 2));
+			}
+			idle[nidle++] = con;
+		}
+		if (opt->stats != 0 && now - trep >= opt->stats) {
+			srv_report(srv);
+			trep = now;
+		}
+	}
+	// Stop the workers, they first finish the connections already queued,
+	// and the reloader, and close the idle connections.
+	pthread_mutex_lock(&srv->lock);
+	srv->stop = true;
+	pthread_cond_broadcast(&srv->wake);
+	pthread_cond_signal(&srv->rwake);
+	pthread_mutex_unlock(&srv->lock);
+	for (uint32_t i = 0; i < nidle; i++)
+		srv_confree(idle[i]);
+	xfree(idle);
+	xfree(fds);
+}
+
+/* srv_thread:
+ *   Entry point of the server threads, the first one is the poller, the
+ *   second the reloader, and the others are the workers.
+ */
+static void srv_thread(job_t *job, uint32_t id, uint32_t cnt, srv_wrk_t *wrk) {
+	unused(job); unused(cnt);
+	if (id == 0)
+		srv_poller(wrk);
+	else if (id == 1)
+		srv_reloader(wrk->srv);
+	else
+		srv_worker(wrk);
+	srv_drop(wrk);
+}
+
+/* srv_run:
+ *   Run the label server with the given options until it is interrupted by
+ *   SIGINT or SIGTERM.
+ */
+void srv_run(const opt_t *opt) {
+	if (opt->model == NULL)
+		fatal("you must specify a model");
+	if (opt->listen == NULL)
+		fatal("you must specify an address to listen on");
+	info("* Load model\n");
+	srv_t srv = {.opt = opt};
+	pthread_mutex_init(&srv.lock, NULL);
+	pthread_cond_init(&srv.wake, NULL);
+	pthread_cond_init(&srv.rwake, NULL);
+	srv.cur = srv_load(opt, false);
+	if (pipe(srv.pipe) == -1)
+		pfatal("cannot create pipe");
+	for (int i = 0; i < 2; i++)
+		fcntl(srv.pipe[i], F_SETFL, fcntl(srv.pipe[i], F_GETFL)
+			| O_NONBLOCK);
+	info("* Listen on %s\n", opt->listen);
+	const int lsck = srv_listen(opt->listen);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT,  srv_signal);
+	signal(SIGTERM, srv_signal);
+	// Start the poller, the reloader, and the workers threads
+	const uint32_t P = opt->nthread + 2;
+	srv_wrk_t *wrk[P];
+	for (uint32_t w = 0; w < P; w++) {
+		wrk[w] = xmalloc(sizeof(srv_wrk_t));
+		memset(wrk[w], 0, sizeof(srv_wrk_t));
+		wrk[w]->srv  = &srv;
+		wrk[w]->lsck = lsck;
+		wrk[w]->scr  = rdr_scrnew();
+		wrk[w]->scs  = xmalloc(sizeof(double) * opt->nbest);
+	}
+	mth_spawn((func_t *)srv_thread, P, (void *)wrk, 0, 0);
+	// Cleanup everything
+	info("* Stop server\n");
+	srv_report(&srv);
+	info("    %"PRIu64" requests served\n", srv.nreq);
+	for (uint32_t w = 0; w < P; w++) {
+		rdr_scrfree(wrk[w]->scr);
+		xfree(wrk[w]->req);
+		xfree(wrk[w]->out);
+		xfree(wrk[w]->psc);
+		xfree(wrk[w]->scs);
+		xfree(wrk[w]);
+	}
+	while (srv.back != NULL) {
+		srv_con_t *con = srv.back;
+		srv.back = con->next;
+		srv_confree(con);
+	}
+	close(lsck);
+	if (!strncmp(opt->listen, "unix:", 5))
+		unlink(opt->listen + 5);
+	close(srv.pipe[0]);
+	close(srv.pipe[1]);
+	srv_release(&srv, srv.cur);
+	pthread_cond_destroy(&srv.wake);
+	pthread_cond_destroy(&srv.rwake);
+	pthread_mutex_destroy(&srv.lock);
+	info("* Done\n");
+}
+
+#else
+
+void srv_run(const opt_t *opt) {
+	unused(opt);
+	fatal("server mode is not supported on this platform");
+}
+
+#endif
+
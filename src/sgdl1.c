@@ -37,7 +37,9 @@
 #include "options.h"
 #include "progress.h"
 #include "sequence.h"
+#include "thread.h"
 #include "tools.h"
+#include "vmath.h"
 
 /******************************************************************************
  * The SGD-L1 trainer
@@ -56,6 +58,87 @@ typedef struct sgd_idx_s {
 	uint64_t *bobs;
 } sgd_idx_t;
 
+/* sgd_t:
+ *   State of the trainer shared by all the workers. Each worker compute the
+ *   gradient of its sequences in private blocks, allocated for the features
+ *   of its current batch only and released after it, and apply the updates
+ *   directly to the weights, while the others continue to use them, in the
+ *   way of the Hogwild! algorithm [2]. To keep the weights and the penalties
+ *   of a feature consistent, the updates of an observation are done under a
+ *   lock choosen from a small set of stripes by its identifier, locks are not
+ *   used with a single worker.
+ *
+ *   [2] Hogwild!: A lock-free approach to parallelizing stochastic gradient
+ *       descent, Feng Niu, Benjamin Recht, Christopher Ré and Stephen J.
+ *       Wright, in Advances in Neural Information Processing Systems 24, pages
+ *       693-701, 2011
+ */
+#define SGD_STRIPES 4096
+
+typedef struct sgd_s sgd_t;
+struct sgd_s {
+	mdl_t        *mdl;
+	sgd_idx_t    *idx;   // [S]  active observations of each sequences
+	uint32_t     *perm;  // [S]  current permutation of the sequences
+	double       *q;     // [F]  penalty already applied to each features
+	double        u;     //      total penalty that should have been applied
+	uint32_t      k;     //      current iteration
+	volatile int *lck;   //      stripes of locks or NULL
+};
+
+typedef struct sgd_wrk_s sgd_wrk_t;
+struct sgd_wrk_s {
+	sgd_t    *sgd;
+	grd_st_t *grd_st;
+	double   *g;     // [F]  gradient vector or NULL if blocks are used
+};
+
+/* sgd_lock, sgd_unlock:
+ *   Take and release the lock of the stripe of observation <o>.
+ */
+static inline void sgd_lock(sgd_t *sgd, uint64_t o) {
+#ifndef ATM_ANSI
+	if (sgd->lck == NULL)
+		return;
+	volatile int *lck = &sgd->lck[o % SGD_STRIPES];
+	while (__sync_lock_test_and_set(lck, 1))
+		while (*lck != 0)
+			;
+#else
+	unused(sgd); unused(o);
+#endif
+}
+
+static inline void sgd_unlock(sgd_t *sgd, uint64_t o) {
+#ifndef ATM_ANSI
+	if (sgd->lck != NULL)
+		__sync_lock_release(&sgd->lck[o % SGD_STRIPES]);
+#else
+	unused(sgd); unused(o);
+#endif
+}
+
+/* sgd_addu:
+ *   Atomically add <inc> to the total penalty and return the new value.
+ */
+static inline double sgd_addu(sgd_t *sgd, double inc) {
+#ifdef ATM_ANSI
+	return sgd->u += inc;
+#else
+	while (1) {
+		volatile union {
+			double   d;
+			uint64_t u;
+		} old, new;
+		old.d = sgd->u;
+		new.d = old.d + inc;
+		uint64_t *ptr = (uint64_t *)&sgd->u;
+		if (__sync_bool_compare_and_swap(ptr, old.u, new.u))
+			return new.d;
+	}
+#endif
+}
+
 /* applypenalty:
  *   This macro is quite ugly as it make a lot of things and use local variables
  *   of the function below. I'm sorry for this but this is allow to not
@@ -88,17 +171,136 @@ static void sgd_add(uint64_t *obs, uint32_t *cnt, uint64_t new) {
 	*cnt = *cnt + 1;
 }
 
+/* sgd_take:
+ *   Return the gradient of feature <f> accumulated by the worker and clear it,
+ *   either in its gradient vector or in its private blocks.
+ */
+static inline double sgd_take(sgd_wrk_t *wrk, uint64_t f) {
+	double *g = wrk->g;
+	if (g == NULL) {
+		g = wrk->grd_st->blk[f >> GRD_BLKBITS];
+		if (g == NULL)
+			return 0.0;
+		f &= GRD_BLKSZ - 1;
+	}
+	const double v = g[f];
+	g[f] = 0.0;
+	return v;
+}
+
+/* sgd_release:
+ *   Free the private gradient blocks of the worker covering the features of
+ *   the sequence <s>, so a worker only keep the blocks of its current batch.
+ */
+static void sgd_release(sgd_wrk_t *wrk, uint32_t s) {
+	const mdl_t     *mdl = wrk->sgd->mdl;
+	const sgd_idx_t *idx = &wrk->sgd->idx[s];
+	const uint64_t   Y   = mdl->nlbl;
+	double **blk = wrk->grd_st->blk;
+	for (int bi = 0; bi < 2; bi++) {
+		const uint64_t *lst = bi ? idx->bobs : idx->uobs;
+		const uint64_t  len = bi ? Y * Y : Y;
+		for (uint32_t n = 0; lst[n] != none; n++) {
+			const uint64_t o = lst[n];
+			const uint64_t f = bi ? mdl->boff[o] : mdl->uoff[o];
+			const uint64_t b0 = f >> GRD_BLKBITS;
+			const uint64_t b1 = (f + len - 1) >> GRD_BLKBITS;
+			for (uint64_t b = b0; b <= b1; b++) {
+				if (blk[b] != NULL)
+					xvm_free(blk[b]);
+				blk[b] = NULL;
+			}
+		}
+	}
+}
+
+/* sgd_update:
+ *   Apply the gradient of the sequence <s> accumulated by the worker to the
+ *   weights with the learning rate <nk> and apply the pending penalties. The
+ *   gradient is cleared for the next sequences.
+ */
+static void sgd_update(sgd_wrk_t *wrk, uint32_t s, double nk, double u) {
+	sgd_t          *sgd = wrk->sgd;
+	const mdl_t    *mdl = sgd->mdl;
+	const uint64_t  Y   = mdl->nlbl;
+	const sgd_idx_t *idx = &sgd->idx[s];
+	double *w = mdl->theta;
+	double *q = sgd->q;
+	for (uint32_t n = 0; idx->uobs[n] != none; n++) {
+		const uint64_t o = idx->uobs[n];
+		uint64_t f = mdl->uoff[o];
+		sgd_lock(sgd, o);
+		for (uint32_t y = 0; y < Y; y++, f++) {
+			w[f] -= nk * sgd_take(wrk, f);
+			applypenalty(f);
+		}
+		sgd_unlock(sgd, o);
+	}
+	for (uint32_t n = 0; idx->bobs[n] != none; n++) {
+		const uint64_t o = idx->bobs[n];
+		uint64_t f = mdl->boff[o];
+		sgd_lock(sgd, o);
+		for (uint32_t d = 0; d < Y * Y; d++, f++) {
+			w[f] -= nk * sgd_take(wrk, f);
+			applypenalty(f);
+		}
+		sgd_unlock(sgd, o);
+	}
+}
+
+/* sgd_worker:
+ *   Process mini-batches of sequences taken in the current permutation. The
+ *   gradient of the batch is accumulated and its mean is applied at once, with
+ *   the learning rate of its first sequence.
+ */
+static void sgd_worker(job_t *job, uint32_t id, uint32_t cnt, sgd_wrk_t *wrk) {
+	unused(id); unused(cnt);
+	sgd_t *sgd = wrk->sgd;
+	const mdl_t *mdl = sgd->mdl;
+	const uint32_t S     = mdl->train->nseq;
+	const double   n0    = mdl->opt->sgdl1.eta0;
+	const double   alpha = mdl->opt->sgdl1.alpha;
+	uint32_t count, pos;
+	while (!uit_stop && mth_getjob(job, &count, &pos)) {
+		for (uint32_t sp = pos; sp < pos + count; sp++)
+			grd_dospl(wrk->grd_st, mdl->train->seq[sgd->perm[sp]]);
+		// Before applying the gradient, we have to compute the
+		// learning rate to apply to this batch. For this we use an
+		// exponential decay [1, pp 481(5)]
+		//   η_i = η_0 * α^{i/S}
+		// where <i> is the number of already processed sequences. And
+		// at the same time, we update the total penalty that must have
+		// been applied to each features.
+		//   u <- u + η * rho1 / S
+		const uint64_t i  = (uint64_t)sgd->k * S + pos;
+		const double   nk = n0 * pow(alpha, (double)i / S);
+		const double   u  = sgd_addu(sgd, nk * mdl->opt->rho1 / S);
+		// Now we apply the update to all unigrams and bigrams
+		// observations actives in the batch sequences.
+		for (uint32_t sp = pos; sp < pos + count; sp++)
+			sgd_update(wrk, sgd->perm[sp], nk / count, u);
+		if (wrk->g == NULL)
+			for (uint32_t sp = pos; sp < pos + count; sp++)
+				sgd_release(wrk, sgd->perm[sp]);
+	}
+}
+
 /* trn_sgdl1:
  *   Train the model with the SGD-l1 algorithm described by tsurukoa et al.
+ *   The sequences are processed by mini-batches, of a single sequence by
+ *   default, spread over the worker threads.
  */
 void trn_sgdl1(mdl_t *mdl) {
-	const uint64_t  Y = mdl->nlbl;
 	const uint64_t  F = mdl->nftr;
-	const uint32_t  U = mdl->reader->nuni;
-	const uint32_t  B = mdl->reader->nbi;
 	const uint32_t  S = mdl->train->nseq;
 	const uint32_t  K = mdl->opt->maxiter;
-	      double   *w = mdl->theta;
+	const uint32_t  M = mdl->opt->sgdbatch;
+#ifndef ATM_ANSI
+	const uint32_t  W = mdl->opt->nthread;
+#else
+	const uint32_t  W = 1;
+#endif
+	const uint64_t  B = (F + GRD_BLKSZ - 1) >> GRD_BLKBITS;
 	// First we have to build and index who hold, for each sequences, the
 	// list of actives observations.
 	// The index is a simple table indexed by sequences number. Each entry
@@ -108,16 +310,22 @@ void trn_sgdl1(mdl_t *mdl) {
 	sgd_idx_t *idx  = xmalloc(sizeof(sgd_idx_t) * S);
 	for (uint32_t s = 0; s < S; s++) {
 		const seq_t *seq = mdl->train->seq[s];
-		const uint32_t T = seq->len;
-		uint64_t uobs[U * T + 1];
-		uint64_t bobs[B * T + 1];
+		uint32_t usize = 0, bsize = 0;
+		for (uint32_t t = 0; t < seq->len; t++) {
+			usize += seq->pos[t].ucnt;
+			bsize += seq->pos[t].bcnt;
+		}
+		uint64_t uobs[usize + 1];
+		uint64_t bobs[bsize + 1];
 		uint32_t ucnt = 0, bcnt = 0;
 		for (uint32_t t = 0; t < seq->len; t++) {
 			const pos_t *pos = &seq->pos[t];
+			const obs_t *pu = seq_uobs(seq, pos);
+			const obs_t *pb = seq_bobs(seq, pos);
 			for (uint32_t p = 0; p < pos->ucnt; p++)
-				sgd_add(uobs, &ucnt, pos->uobs[p]);
+				sgd_add(uobs, &ucnt, pu[p]);
 			for (uint32_t p = 0; p < pos->bcnt; p++)
-				sgd_add(bobs, &bcnt, pos->bobs[p]);
+				sgd_add(bobs, &bcnt, pb[p]);
 		}
 		uobs[ucnt++] = none;
 		bobs[bcnt++] = none;
@@ -131,30 +339,52 @@ void trn_sgdl1(mdl_t *mdl) {
 	// will have to permute them. The current permutation is stored in a
 	// vector called <perm> shuffled at the start of each iteration. We
 	// just initialize it with the identity permutation.
-	// As we use the same gradient function than the other trainers, we need
-	// an array to store it. These functions accumulate the gradient so we
-	// need to clear it at start and before each new computation. As we now
-	// which features are active and so which gradient cell are updated, we
-	// can clear them selectively instead of fully clear the gradient each
-	// time.
+	// As we use the same gradient function than the other trainers, each
+	// worker need an array to store it. These functions accumulate the
+	// gradient so we need to clear it at start and before each new
+	// computation. As we now which features are active and so which
+	// gradient cell are updated, we can clear them selectively instead of
+	// fully clear the gradient each time. With several workers, they use
+	// private blocks instead so they don't each need a full vector.
 	// We also need an aditional vector named <q> who hold the penalty
 	// already applied to each features.
-	uint32_t *perm = xmalloc(sizeof(uint32_t) * S);
+	sgd_t sgd = {.mdl = mdl, .idx = idx, .u = 0.0, .lck = NULL};
+	sgd.perm = xmalloc(sizeof(uint32_t) * S);
 	for (uint32_t s = 0; s < S; s++)
-		perm[s] = s;
-	double *g = xmalloc(sizeof(double) * F);
-	double *q = xmalloc(sizeof(double) * F);
+		sgd.perm[s] = s;
+	sgd.q = xmalloc(sizeof(double) * F);
 	for (uint64_t f = 0; f < F; f++)
-		g[f] = q[f] = 0.0;
+		sgd.q[f] = 0.0;
+	if (W > 1) {
+		sgd.lck = xmalloc(sizeof(int) * SGD_STRIPES);
+		for (uint32_t i = 0; i < SGD_STRIPES; i++)
+			sgd.lck[i] = 0;
+	}
+	sgd_wrk_t *wrk[W];
+	for (uint32_t w = 0; w < W; w++) {
+		wrk[w] = xmalloc(sizeof(sgd_wrk_t));
+		wrk[w]->sgd = &sgd;
+		wrk[w]->g   = NULL;
+		if (W == 1) {
+			wrk[w]->g = xmalloc(sizeof(double) * F);
+			for (uint64_t f = 0; f < F; f++)
+				wrk[w]->g[f] = 0.0;
+		}
+		wrk[w]->grd_st = grd_stnew(mdl, wrk[w]->g);
+		if (W > 1) {
+			wrk[w]->grd_st->blk = xmalloc(sizeof(double *) * B);
+			for (uint64_t b = 0; b < B; b++)
+				wrk[w]->grd_st->blk[b] = NULL;
+		}
+	}
 	// We can now start training the model, we perform the requested number
-	// of iteration, each of these going through all the sequences. For
-	// computing the decay, we will need to keep track of the number of
-	// already processed sequences, this is tracked by the <i> variable.
-	double u = 0.0;
-	grd_st_t *grd_st = grd_stnew(mdl, g);
-	for (uint32_t k = 0, i = 0; k < K && !uit_stop; k++) {
+	// of iteration, each of these going through all the sequences. The
+	// losses of the sequences are collected during the iteration to give
+	// an estimate of the objective function.
+	for (sgd.k = 0; sgd.k < K && !uit_stop; sgd.k++) {
 		// First we shuffle the sequence by making a lot of random swap
 		// of entry in the permutation index.
+		uint32_t *perm = sgd.perm;
 		for (uint32_t s = 0; s < S; s++) {
 			const uint32_t a = rand() % S;
 			const uint32_t b = rand() % S;
@@ -163,58 +393,44 @@ void trn_sgdl1(mdl_t *mdl) {
 			perm[b] = t;
 		}
 		// And so, we can process sequence in a random order
-		for (uint32_t sp = 0; sp < S && !uit_stop; sp++, i++) {
-			const uint32_t s = perm[sp];
-			const seq_t *seq = mdl->train->seq[s];
-			grd_dospl(grd_st, seq);
-			// Before applying the gradient, we have to compute the
-			// learning rate to apply to this sequence. For this we
-			// use an exponential decay [1, pp 481(5)]
-			//   η_i = η_0 * α^{i/S}
-			// And at the same time, we update the total penalty
-			// that must have been applied to each features.
-			//   u <- u + η * rho1 / S
-			const double n0    = mdl->opt->sgdl1.eta0;
-			const double alpha = mdl->opt->sgdl1.alpha;
-			const double nk = n0 * pow(alpha, (double)i / S);
-			u = u + nk * mdl->opt->rho1 / S;
-			// Now we apply the update to all unigrams and bigrams
-			// observations actives in the current sequence. We must
-			// not forget to clear the gradient for the next
-			// sequence.
-			for (uint32_t n = 0; idx[s].uobs[n] != none; n++) {
-				uint64_t f = mdl->uoff[idx[s].uobs[n]];
-				for (uint32_t y = 0; y < Y; y++, f++) {
-					w[f] -= nk * g[f];
-					applypenalty(f);
-					g[f] = 0.0;
-				}
-			}
-			for (uint32_t n = 0; idx[s].bobs[n] != none; n++) {
-				uint64_t f = mdl->boff[idx[s].bobs[n]];
-				for (uint32_t d = 0; d < Y * Y; d++, f++) {
-					w[f] -= nk * g[f];
-					applypenalty(f);
-					g[f] = 0.0;
-				}
-			}
-		}
+		for (uint32_t w = 0; w < W; w++)
+			wrk[w]->grd_st->lloss = 0.0;
+		mth_spawn((func_t *)sgd_worker, W, (void **)wrk, S, M);
 		if (uit_stop)
 			break;
 		// Repport progress back to the user
-		if (!uit_progress(mdl, k + 1, -1.0))
+		double fx = 0.0;
+		for (uint32_t w = 0; w < W; w++)
+			fx += wrk[w]->grd_st->lloss;
+		for (uint32_t w = 0; w < W && mdl->opt->profile; w++)
+			uit_prfadd(&wrk[w]->grd_st->prf);
+		for (uint64_t f = 0; f < F; f++)
+			fx += fabs(mdl->theta[f]) * mdl->opt->rho1;
+		if (!uit_progress(mdl, sgd.k + 1, fx))
 			break;
+		uit_checkpoint(mdl, sgd.k + 1, NULL, NULL);
 	}
-	grd_stfree(grd_st);
 	// Cleanup allocated memory before returning
+	for (uint32_t w = 0; w < W; w++) {
+		if (W > 1) {
+			for (uint64_t b = 0; b < B; b++)
+				if (wrk[w]->grd_st->blk[b] != NULL)
+					xvm_free(wrk[w]->grd_st->blk[b]);
+			xfree(wrk[w]->grd_st->blk);
+		}
+		grd_stfree(wrk[w]->grd_st);
+		xfree(wrk[w]->g);
+		xfree(wrk[w]);
+	}
 	for (uint32_t s = 0; s < S; s++) {
 		xfree(idx[s].uobs);
 		xfree(idx[s].bobs);
 	}
 	xfree(idx);
-	xfree(perm);
-	xfree(g);
-	xfree(q);
+	xfree(sgd.perm);
+	xfree(sgd.q);
+	if (sgd.lck != NULL)
+		xfree((void *)sgd.lck);
 }
 #undef applypenalty
 
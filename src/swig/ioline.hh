@@ -1,3 +1,7 @@
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <string>
 
@@ -13,6 +17,7 @@ extern "C" {
     #include "../ioline.h"
     #include "../model.h"
     #include "../options.h"
+    #include "../quark.h"
     #include "../reader.h"
 }
 
@@ -33,49 +38,63 @@ char *wapiti_gets_cb(void *x) {
 int wapiti_print_cb(void *x, char *format, ...) {
     WapitiIO *io = static_cast<WapitiIO*>(x);
     
-    va_list args;
+    // The arguments are consumed by the first pass so a copy is needed to
+    // format them again in the buffer.
+    va_list args, copy;
     va_start(args, format);
-    size_t len = vsnprintf(NULL, 0, format, args);
+    va_copy(copy, args);
+    int len = vsnprintf(NULL, 0, format, copy);
+    va_end(copy);
     char *buf = (char*)xmalloc(len + 1);
-    len = vsnprintf(buf, len, format, args);
+    vsnprintf(buf, len + 1, format, args);
     va_end(args);
 
-    if (len > 0)
-        buf[len] = '\0';
-
     io->append(buf);
     free(buf);
 
     return len;
 }
 
+// A model loaded once and shared by all the threads that use it. Once built,
+// nothing in it is modified so any number of WapitiContext, or of calls to
+// label, can use it concurrently.
 class WapitiModel {
+    friend class WapitiContext;
+
 private:
-    WapitiIO *_io;
-    iol_t *_iol;
-    rdr_t *_rdr;
     mdl_t *_mdl;
+    tag_cache_t *_cache;
+    char **_lbls;
 
 public:
     WapitiModel(WapitiIO *io) {
-        _io = io;
-
-        _iol = iol_new2(
+        // The reader own the input and free it with the model, the WapitiIO
+        // is only used while loading.
+        iol_t *iol = iol_new2(
             wapiti_gets_cb, 
             static_cast<void*>(io), 
             wapiti_print_cb, 
             static_cast<void*>(io));
 
-        _rdr = rdr_new(_iol, opt_defaults.maxent);
-        _mdl = mdl_new(_rdr);
+        _mdl = mdl_new(rdr_new(iol, opt_defaults.maxent));
         _mdl->opt = &opt_defaults;
         
         mdl_load(_mdl);
+        mdl_share(_mdl);
+
+        // The decoding cache and the label table are built once here and
+        // only read after.
+        _cache = tag_cachenew(_mdl);
+        const uint32_t Y = _mdl->nlbl;
+        _lbls = new char*[Y + 1];
+        for (uint32_t y = 0; y < Y; y++)
+            _lbls[y] = const_cast<char*>(qrk_id2str(_mdl->reader->lbl, y));
+        _lbls[Y] = NULL;
     }
 
     ~WapitiModel() {
-        iol_free(_iol);
-        rdr_free(_rdr);
+        delete[] _lbls;
+        tag_cachefree(_cache);
         mdl_free(_mdl);
     }
 
@@ -89,4 +108,58 @@ public:
         tag_label(_mdl, iol);
         iol_free(iol);
     }
+
+    // Return the label table, the name of label id 'y' is at index 'y'.
+    char **labels() {
+        return _lbls;
+    }
+
+    // Same as WapitiContext::labelBatch with a context private to the call,
+    // better use one context per thread when doing many calls.
+    int labelBatch(const char *buf, int len, int *out, int size);
+    int labelBatch(const std::string &data, int *out, int size);
 };
+
+// The per-thread part of the decoding: all the memory needed to label with a
+// shared model. A context is cheap but must not be used by two threads at the
+// same time, and the model must outlive it.
+class WapitiContext {
+private:
+    tag_ctx_t *_ctx;
+
+public:
+    WapitiContext(WapitiModel *model) {
+        _ctx = tag_ctxnew(model->_mdl, model->_cache, 1);
+    }
+
+    ~WapitiContext() {
+        tag_ctxfree(_ctx);
+    }
+
+    // Label all the sequences in the <len> first bytes of <buf>, given in
+    // the data file format with blank lines between sequences, and store
+    // the label id of each token in <out> in input order. Return the number
+    // of tokens, if it is bigger than <size> only the first <size> labels
+    // are stored and the call can be done again with a larger array. The
+    // lines are not copied and no callback is made.
+    int labelBatch(const char *buf, int len, int *out, int size) {
+        return tag_labelbuf(_ctx, buf, len,
+            reinterpret_cast<uint32_t*>(out), size);
+    }
+
+    int labelBatch(const std::string &data, int *out, int size) {
+        return labelBatch(data.data(), data.size(), out, size);
+    }
+};
+
+inline int WapitiModel::labelBatch(const char *buf, int len, int *out,
+        int size) {
+    WapitiContext ctx(this);
+    return ctx.labelBatch(buf, len, out, size);
+}
+
+inline int WapitiModel::labelBatch(const std::string &data, int *out,
+        int size) {
+    WapitiContext ctx(this);
+    return ctx.labelBatch(data, out, size);
+}
@@ -5,9 +5,47 @@
 %}
 
 %include "std_string.i"
+%include "various.i"
+
+// The label table is returned as a String[] in a single call.
+%apply char **STRING_ARRAY { char **labels };
+
+// Batch labelling takes its input from a direct ByteBuffer which is read in
+// place, without any copy, and the label ids are stored in an int[] whose
+// length give the number of ids that can be stored.
+%typemap(jni)    const char *buf "jobject"
+%typemap(jtype)  const char *buf "java.nio.ByteBuffer"
+%typemap(jstype) const char *buf "java.nio.ByteBuffer"
+%typemap(javain) const char *buf "$javainput"
+%typemap(in) const char *buf {
+    $1 = (const char *)jenv->GetDirectBufferAddress($input);
+    if ($1 == NULL) {
+        SWIG_JavaThrowException(jenv, SWIG_JavaIllegalArgumentException,
+            "direct buffer expected");
+        return $null;
+    }
+}
+
+%typemap(jni)    (int *out, int size) "jintArray"
+%typemap(jtype)  (int *out, int size) "int[]"
+%typemap(jstype) (int *out, int size) "int[]"
+%typemap(javain) (int *out, int size) "$javainput"
+%typemap(in) (int *out, int size) {
+    $1 = NULL;
+    $2 = 0;
+    if ($input != NULL) {
+        $1 = (int *)jenv->GetIntArrayElements($input, NULL);
+        if ($1 == NULL)
+            return $null;
+        $2 = (int)jenv->GetArrayLength($input);
+    }
+}
+%typemap(argout) (int *out, int size) {
+    if ($1 != NULL)
+        jenv->ReleaseIntArrayElements($input, (jint *)$1, 0);
+}
 
 %feature("director") WapitiIO;
 %feature("director") WapitiModel;
 
 %include "ioline.hh"
-
@@ -25,6 +25,13 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+// Needed for the CPU affinity functions on Linux
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <inttypes.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "model.h"
@@ -42,6 +49,10 @@
  *   If you don't want to use multithreading on non-POSIX system, just enable
  *   the definition of MTH_ANSI in wapiti.h. This will disable multithreading.
  *
+ *   Worker threads are kept in a pool created the first time they are needed
+ *   so the cost of thread creation is paid only once per process. On Linux,
+ *   they can also be pinned to CPUs with mth_setpin.
+ *
  *   The jobs system is a simple scheduling system, you have to provide the
  *   number of jobs to be done and the size of each batch, a call to getjob will
  *   return the index of the first available and the size of the batch, and mark
@@ -75,15 +86,38 @@ void mth_spawn(func_t *f, uint32_t W, void *ud[W], uint32_t size, uint32_t batch
 	}
 }
 
+struct mth_task_s {
+	int dummy;
+};
+
+mth_task_t *mth_async(func_t *f, uint32_t W, void *ud[W], uint32_t size,
+                      uint32_t batch) {
+	mth_spawn(f, W, ud, size, batch);
+	return xmalloc(sizeof(mth_task_t));
+}
+
+void mth_wait(mth_task_t *task) {
+	xfree(task);
+}
+
+void mth_setpin(void) {
+	warning("thread pinning not supported without threads");
+}
+
 #else
 
 #include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 struct job_s {
 	uint32_t size;
 	uint32_t send;
 	uint32_t batch;
+#ifdef ATM_ANSI
 	pthread_mutex_t lock;
+#endif
 };
 
 typedef struct mth_s mth_t;
@@ -95,36 +129,212 @@ struct mth_s {
 	void     *ud;
 };
 
+/* mth_pool_t:
+ *   The pool of persistent worker threads. Creating and joining threads for
+ *   each parallel section is costly when these are short like a gradient
+ *   computation on a small dataset, so threads are created the first time
+ *   they are needed and then sleep on the <wake> condition between calls.
+ *   Each call to mth_spawn increment the generation counter <gen> and wake
+ *   all the threads, thread <i> of the pool run the job with identifier i if
+ *   i < <cnt> and signal its end by decrementing <run>. The calling thread
+ *   itself run the job with identifier 0.
+ */
+typedef struct mth_pool_s mth_pool_t;
+struct mth_pool_s {
+	pthread_mutex_t  lock;
+	pthread_cond_t   wake;
+	pthread_cond_t   done;
+	bool             busy;  //       True if a call is in progress
+	uint32_t         nth;   //       Number of threads in the pool
+	uint64_t         gen;   //       Current generation
+	uint32_t         run;   //       Number of threads still running
+	func_t          *f;
+	job_t           *job;
+	void           **ud;
+	uint32_t         cnt;
+};
+
+static mth_pool_t mth_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+/* mth_pinned:
+ *   When pinning is requested with mth_setpin, the thread of the pool with
+ *   identifier <i> always run on the i-th CPU, modulo their count, of the
+ *   affinity mask <mth_cpus> of the process at this time. As each thread of
+ *   the pool always run the part of the job with its own identifier, a static
+ *   split of the work, like the rprop update, stay on the same CPU and so on
+ *   the same NUMA node from one call to the next. The fresh and background
+ *   threads are not pinned and run on the full mask.
+ */
+#ifdef __linux__
+static bool      mth_pinned = false;
+static cpu_set_t mth_cpus;
+
+/* mth_pinself:
+ *   Pin the calling thread to the CPU of identifier <id>.
+ */
+static void mth_pinself(uint32_t id) {
+	const uint32_t n = CPU_COUNT(&mth_cpus);
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (uint32_t c = 0, i = 0; c < CPU_SETSIZE; c++) {
+		if (!CPU_ISSET(c, &mth_cpus))
+			continue;
+		if (i++ == id % n) {
+			CPU_SET(c, &set);
+			break;
+		}
+	}
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		warning("failed to pin thread %"PRIu32, id);
+}
+#endif
+
+/* mth_setpin:
+ *   Pin the calling thread, which run the part 0 of the jobs, and the threads
+ *   of the pool to their CPU. The pool threads already created pin themselves
+ *   the next time they are woken up.
+ */
+void mth_setpin(void) {
+#ifdef __linux__
+	if (sched_getaffinity(0, sizeof(mth_cpus), &mth_cpus) != 0) {
+		warning("cannot get CPU affinity, threads not pinned");
+		return;
+	}
+	mth_pinned = true;
+	mth_pinself(0);
+#else
+	warning("thread pinning not supported on this platform");
+#endif
+}
+
+/* mth_attr:
+ *   Setup the attributes of the fresh and background threads so they are not
+ *   restricted to the CPU of their creator if it is pinned.
+ */
+static void mth_attr(pthread_attr_t *attr) {
+	pthread_attr_init(attr);
+	pthread_attr_setscope(attr, PTHREAD_SCOPE_SYSTEM);
+	pthread_attr_setdetachstate(attr, PTHREAD_CREATE_JOINABLE);
+#ifdef __linux__
+	if (mth_pinned)
+		pthread_attr_setaffinity_np(attr, sizeof(mth_cpus), &mth_cpus);
+#endif
+}
+
 /* mth_getjob:
  *   Get a new bunch of sequence to process. This function will return a new
  *   batch of sequence to process starting at position <pos> and with size
  *   <cnt> and return true. If no more batch are available, return false.
- *   This function use a lock to ensure thread safety as it will be called by
- *   the multiple workers threads.
+ *   This function is called concurrently by the workers threads and so use an
+ *   atomic fetch-and-add to reserve the batch, or a lock if ATM_ANSI is
+ *   defined.
  */
 bool mth_getjob(job_t *job, uint32_t *cnt, uint32_t *pos) {
 	if (job == NULL)
 		return false;
-	if (job->send == job->size)
+	if (job->send >= job->size)
 		return false;
+#ifdef ATM_ANSI
 	pthread_mutex_lock(&job->lock);
-	*cnt = min(job->batch, job->size - job->send);
-	*pos = job->send;
-	job->send += *cnt;
+	uint32_t first = job->send;
+	if (first < job->size)
+		job->send += min(job->batch, job->size - first);
 	pthread_mutex_unlock(&job->lock);
+#else
+	uint32_t first = __sync_fetch_and_add(&job->send, job->batch);
+#endif
+	if (first >= job->size)
+		return false;
+	*cnt = min(job->batch, job->size - first);
+	*pos = first;
 	return true;
 }
 
+/* mth_worker:
+ *   Main loop of the pool threads. Each of them wait for a new generation to
+ *   be published by mth_spawn and, if its identifier is in the requested
+ *   range, run the user function before going back to sleep.
+ */
+static void *mth_worker(void *ud) {
+	mth_pool_t *pool = &mth_pool;
+	const uint32_t id = (uintptr_t)ud;
+	// Threads are created by mth_spawn just before it publish a generation
+	// and this one cannot complete without us, so the first generation to
+	// run is the current one.
+	pthread_mutex_lock(&pool->lock);
+	uint64_t gen = pool->gen - 1;
+	bool pinned = false;
+	while (true) {
+		while (pool->gen == gen)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		gen = pool->gen;
+#ifdef __linux__
+		if (mth_pinned && !pinned) {
+			mth_pinself(id);
+			pinned = true;
+		}
+#endif
+		if (id >= pool->cnt)
+			continue;
+		func_t  *f   = pool->f;
+		job_t   *job = pool->job;
+		void    *arg = pool->ud[id];
+		uint32_t cnt = pool->cnt;
+		pthread_mutex_unlock(&pool->lock);
+		f(job, id, cnt, arg);
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->run == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	return NULL;
+}
+
 static void *mth_stub(void *ud) {
 	mth_t *mth = (mth_t *)ud;
 	mth->f(mth->job, mth->id, mth->cnt, mth->ud);
 	return NULL;
 }
 
+/* mth_fresh:
+ *   Run the user function in W newly created threads and wait for all of them
+ *   to finish. This is used when the pool is already in use by another call,
+ *   for example when a parallel section is started from inside an other one.
+ */
+static void mth_fresh(func_t *f, uint32_t W, void *ud[W], job_t *job) {
+	// We prepare the parameters structures that will be send to the threads
+	// with informations for calling the user function.
+	mth_t p[W];
+	for (uint32_t w = 0; w < W; w++) {
+		p[w].job = job;
+		p[w].id  = w;
+		p[w].cnt = W;
+		p[w].f   = f;
+		p[w].ud  = ud[w];
+	}
+	// We are now ready to spawn the threads and wait for them to finish
+	// their jobs. So we just create all the thread and try to join them
+	// waiting for there return.
+	pthread_attr_t attr;
+	mth_attr(&attr);
+	pthread_t th[W];
+	for (uint32_t w = 0; w < W; w++)
+		if (pthread_create(&th[w], &attr, &mth_stub, &p[w]) != 0)
+			fatal("failed to create thread");
+	for (uint32_t w = 0; w < W; w++)
+		if (pthread_join(th[w], NULL) != 0)
+			fatal("failed to join thread");
+	pthread_attr_destroy(&attr);
+}
+
 /* mth_spawn:
- *   This function spawn W threads for calling the 'f' function. The function
- *   will get a unique identifier between 0 and W-1 and a user data from the
- *   'ud' array.
+ *   This function run W instances of the 'f' function in parallel. Each of
+ *   them will get a unique identifier between 0 and W-1 and a user data from
+ *   the 'ud' array. Instance 0 is run by the calling thread and the others by
+ *   the threads of the pool which is grown as needed.
  */
 void mth_spawn(func_t *f, uint32_t W, void *ud[W], uint32_t size, uint32_t batch) {
 	// First prepare the jobs scheduler
@@ -134,40 +344,128 @@ void mth_spawn(func_t *f, uint32_t W, void *ud[W], uint32_t size, uint32_t batch
 		job.size = size;
 		job.send = 0;
 		job.batch = batch;
+#ifdef ATM_ANSI
 		if (pthread_mutex_init(&job.lock, NULL) != 0)
 			fatal("failed to create mutex");
+#endif
 	}
 	// We handle differently the case where user requested a single thread
 	// for efficiency.
 	if (W == 1) {
-		f(&job, 0, 1, ud[0]);
+		f(pjob, 0, 1, ud[0]);
 		return;
 	}
-	// We prepare the parameters structures that will be send to the threads
-	// with informations for calling the user function.
-	mth_t p[W];
+	// If the pool is already running an other call, fallback to fresh
+	// threads, else grow it if needed and publish the new generation.
+	mth_pool_t *pool = &mth_pool;
+	pthread_mutex_lock(&pool->lock);
+	if (pool->busy) {
+		pthread_mutex_unlock(&pool->lock);
+		mth_fresh(f, W, ud, pjob);
+		return;
+	}
+	pool->busy = true;
+	if (pool->nth < W - 1) {
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		for (uint32_t w = pool->nth + 1; w < W; w++) {
+			pthread_t th;
+			void *id = (void *)(uintptr_t)w;
+			if (pthread_create(&th, &attr, &mth_worker, id) != 0)
+				fatal("failed to create thread");
+		}
+		pthread_attr_destroy(&attr);
+		pool->nth = W - 1;
+	}
+	pool->f   = f;
+	pool->job = pjob;
+	pool->ud  = ud;
+	pool->cnt = W;
+	pool->run = W - 1;
+	pool->gen++;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+	// Run our own part of the job and wait for the others to complete
+	// before releasing the pool.
+	f(pjob, 0, W, ud[0]);
+	pthread_mutex_lock(&pool->lock);
+	while (pool->run != 0)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pool->busy = false;
+	pthread_mutex_unlock(&pool->lock);
+#ifdef ATM_ANSI
+	if (pjob != NULL)
+		pthread_mutex_destroy(&job.lock);
+#endif
+}
+/* mth_task_t:
+ *   A parallel section running in the background. Contrary to mth_spawn, the
+ *   W instances are all run by newly created threads so the caller and the
+ *   pool stay available for other works until mth_wait is called.
+ */
+struct mth_task_s {
+	job_t      job;
+	uint32_t   W;
+	mth_t     *p;
+	pthread_t *th;
+};
+
+/* mth_async:
+ *   Start W instances of the 'f' function in background threads and return
+ *   immediately. The returned task must be given to mth_wait to wait for their
+ *   completion and release it, the user data cannot be used before this.
+ */
+mth_task_t *mth_async(func_t *f, uint32_t W, void *ud[W], uint32_t size,
+                      uint32_t batch) {
+	mth_task_t *task = xmalloc(sizeof(mth_task_t));
+	job_t *pjob = NULL;
+	task->job.size = size;
+	if (size != 0) {
+		pjob = &task->job;
+		pjob->send  = 0;
+		pjob->batch = batch;
+#ifdef ATM_ANSI
+		if (pthread_mutex_init(&pjob->lock, NULL) != 0)
+			fatal("failed to create mutex");
+#endif
+	}
+	task->W  = W;
+	task->p  = xmalloc(sizeof(mth_t) * W);
+	task->th = xmalloc(sizeof(pthread_t) * W);
 	for (uint32_t w = 0; w < W; w++) {
-		p[w].job = pjob;
-		p[w].id  = w;
-		p[w].cnt = W;
-		p[w].f   = f;
-		p[w].ud  = ud[w];
+		task->p[w].job = pjob;
+		task->p[w].id  = w;
+		task->p[w].cnt = W;
+		task->p[w].f   = f;
+		task->p[w].ud  = ud[w];
 	}
-	// We are now ready to spawn the threads and wait for them to finish
-	// their jobs. So we just create all the thread and try to join them
-	// waiting for there return.
 	pthread_attr_t attr;
-	pthread_attr_init(&attr);
-	pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-	pthread_t th[W];
+	mth_attr(&attr);
 	for (uint32_t w = 0; w < W; w++)
-		if (pthread_create(&th[w], &attr, &mth_stub, &p[w]) != 0)
+		if (pthread_create(&task->th[w], &attr, &mth_stub,
+		                   &task->p[w]) != 0)
 			fatal("failed to create thread");
-	for (uint32_t w = 0; w < W; w++)
-		if (pthread_join(th[w], NULL) != 0)
-			fatal("failed to join thread");
 	pthread_attr_destroy(&attr);
+	return task;
 }
+
+/* mth_wait:
+ *   Wait for all the threads of a task started by mth_async to finish and
+ *   release it.
+ */
+void mth_wait(mth_task_t *task) {
+	for (uint32_t w = 0; w < task->W; w++)
+		if (pthread_join(task->th[w], NULL) != 0)
+			fatal("failed to join thread");
+#ifdef ATM_ANSI
+	if (task->job.size != 0)
+		pthread_mutex_destroy(&task->job.lock);
 #endif
+	xfree(task->th);
+	xfree(task->p);
+	xfree(task);
+}
 
+#endif
@@ -36,10 +36,15 @@
 #include "model.h"
 
 typedef struct job_s job_t;
+typedef struct mth_task_s mth_task_t;
 
 typedef void (func_t)(job_t *job, uint32_t id, uint32_t cnt, void *ud);
 
 bool mth_getjob(job_t *job, uint32_t *cnt, uint32_t *pos);
 void mth_spawn(func_t *f, uint32_t W, void *ud[W], uint32_t size, uint32_t batch);
+mth_task_t *mth_async(func_t *f, uint32_t W, void *ud[W], uint32_t size,
+                      uint32_t batch);
+void mth_wait(mth_task_t *task);
+void mth_setpin(void);
 
 #endif
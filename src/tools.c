@@ -28,12 +28,24 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+#if !defined(WIN32) && !defined(_WIN32) && !defined(MTH_ANSI)
+#include <pthread.h>
+#endif
+
+#if !defined(WIN32) && !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 #include "tools.h"
 #include "ioline.h"
 
@@ -48,8 +60,88 @@
  *   Memory allocation is one of the possible point of failure and its painfull
  *   to always remeber to check return value of malloc so we provide wrapper
  *   around it and realloc who check and fail in case of error.
+ *
+ *   For benchmarking, the allocations can also be counted. This is off by
+ *   default so the normal paths only pay for a test of <xmem_track>.
+ *
+ *   A long running process, like the label server, can still survive some of
+ *   these errors by catching them in a thread with err_push. The fatal errors
+ *   of this thread then jump back to the catcher instead of exiting.
  ******************************************************************************/
 
+bool xmem_track = false;
+static uint64_t xmem_cnt  = 0;
+static uint64_t xmem_size = 0;
+
+/* err_get, err_set:
+ *   Return or set the innermost error catcher of the calling thread. Where the
+ *   threads are not available, there is a single catcher for the process.
+ */
+#if !defined(WIN32) && !defined(_WIN32) && !defined(MTH_ANSI)
+static pthread_key_t  err_key;
+static pthread_once_t err_once = PTHREAD_ONCE_INIT;
+
+static void err_init(void) {
+	if (pthread_key_create(&err_key, NULL) != 0)
+		abort();
+}
+
+static err_t *err_get(void) {
+	pthread_once(&err_once, err_init);
+	return pthread_getspecific(err_key);
+}
+
+static void err_set(err_t *err) {
+	pthread_once(&err_once, err_init);
+	pthread_setspecific(err_key, err);
+}
+#else
+static err_t *err_cur = NULL;
+
+static err_t *err_get(void) {
+	return err_cur;
+}
+
+static void err_set(err_t *err) {
+	err_cur = err;
+}
+#endif
+
+/* err_push:
+ *   Install a catcher for the fatal errors of the calling thread. The caller
+ *   must have initialized <env> with setjmp, which will return a non-zero
+ *   value when an error is caught. At this point, the catcher is already
+ *   removed and <msg> hold the error message. Else, the catcher must be
+ *   removed with err_pop before the function calling setjmp return. Nothing
+ *   is released when an error is caught, so the caller is responsible for
+ *   the resources it can reach.
+ */
+void err_push(err_t *err) {
+	err->up = err_get();
+	err->msg[0] = '\0';
+	err_set(err);
+}
+
+/* err_pop:
+ *   Remove the given catcher, which must be the innermost one of the calling
+ *   thread.
+ */
+void err_pop(err_t *err) {
+	err_set(err->up);
+}
+
+/* err_throw:
+ *   Jump back to the given catcher, with the error message already stored in
+ *   it, after appending the system error message <sys> if not NULL.
+ */
+static void err_throw(err_t *err, const char *sys) {
+	err_set(err->up);
+	const size_t len = strlen(err->msg);
+	if (sys != NULL)
+		snprintf(err->msg + len, sizeof(err->msg) - len, " <%s>", sys);
+	longjmp(err->env, 1);
+}
+
 /* fatal:
  *   This is the main error function, it will print the given message with same
  *   formating than the printf family and exit program with an error. We let the
@@ -57,6 +149,13 @@
  */
 void fatal(const char *msg, ...) {
 	va_list args;
+	err_t *cth = err_get();
+	if (cth != NULL) {
+		va_start(args, msg);
+		vsnprintf(cth->msg, sizeof(cth->msg), msg, args);
+		va_end(args);
+		err_throw(cth, NULL);
+	}
 	fprintf(stderr, "error: ");
 	va_start(args, msg);
 	vfprintf(stderr, msg, args);
@@ -75,6 +174,13 @@ void fatal(const char *msg, ...) {
 void pfatal(const char *msg, ...) {
 	const char *err = strerror(errno);
 	va_list args;
+	err_t *cth = err_get();
+	if (cth != NULL) {
+		va_start(args, msg);
+		vsnprintf(cth->msg, sizeof(cth->msg), msg, args);
+		va_end(args);
+		err_throw(cth, err);
+	}
 	fprintf(stderr, "error: ");
 	va_start(args, msg);
 	vfprintf(stderr, msg, args);
@@ -122,17 +228,40 @@ void xfree(void *p) {
  *   allocated, so it will never return NULL.
  */
 void *xmalloc(size_t size) {
+	xmem_note(size);
 	void *ptr = malloc(size);
 	if (ptr == NULL)
 		fatal("out of memory");
 	return ptr;
 }
 
+/* xmem_note:
+ *   Account for an allocation of <size> bytes if tracking is enabled. This
+ *   can be called from any thread.
+ */
+void xmem_note(size_t size) {
+	if (!xmem_track)
+		return;
+	__sync_fetch_and_add(&xmem_cnt, 1);
+	__sync_fetch_and_add(&xmem_size, (uint64_t)size);
+}
+
+/* xmem_stats:
+ *   Return the number of allocations and their total size in bytes since the
+ *   start of the program. Only the allocations done while tracking was enabled
+ *   are counted, and the memory released is not subtracted.
+ */
+void xmem_stats(uint64_t *cnt, uint64_t *size) {
+	*cnt  = __sync_fetch_and_add(&xmem_cnt,  0);
+	*size = __sync_fetch_and_add(&xmem_size, 0);
+}
+
 /* xrealloc:
  *   As xmalloc, this is a simple wrapper around realloc who fail on memory
  *   error and so never return NULL.
  */
 void *xrealloc(void *ptr, size_t size) {
+	xmem_note(size);
 	void *new = realloc(ptr, size);
 	if (new == NULL)
 		fatal("out of memory");
@@ -181,12 +310,14 @@ char *ns_readstr(iol_t *iol) {
         int i = 0;
         char *line = iol->gets_cb(iol->in);
         
-        if (sscanf(line, "%d:", &len) != 1)
+        if (line == NULL)
             pfatal("invalid format");
-
         char *colon = strchr(line, ':');
-        if (colon == NULL)
+        if (sscanf(line, "%d:", &len) != 1 || len < 0 || colon == NULL
+                || strlen(colon + 1) <= (size_t)len) {
+            xfree(line);
             pfatal("invalid format");
+        }
 
         char *comma = colon + len + 1;
         if (comma[0] != ',') {
@@ -198,14 +329,13 @@ char *ns_readstr(iol_t *iol) {
                 printf("%2x-", (int)line[i]);
             printf("\n====================================\n");
 
+            xfree(line);
             pfatal("invalid format");
         }
 
         char *buf = xstrndup(colon + 1, len);
         buf[len] = '\0';
-
-
-
+	xfree(line);
 	return buf;
 }
 
@@ -218,3 +348,156 @@ void ns_writestr(iol_t *iol, const char *str) {
 		pfatal("cannot write to file");
 }
 
+
+/******************************************************************************
+ * Binary storage
+ *
+ *   Binary files are made of blocks written one after the other, each padded
+ *   with zeros up to a multiple of <bin_align> bytes. They are loaded back by
+ *   mapping the full file in memory so the blocks can be used in place without
+ *   any parsing or copy and the pages can be shared between several processes
+ *   using the same file.
+ *   The file is mapped privately with write access, so any modification to the
+ *   data is kept local to the process. On systems without mmap, the file is
+ *   simply read in a properly aligned block of memory.
+ *
+ *   These files are not portable across platforms with different endianness or
+ *   types sizes, they are intended as a fast loading cache of the text formats.
+ ******************************************************************************/
+
+/* bin_open:
+ *   Map the given file in memory and return a new bin_t object to read from it,
+ *   this will fail violently if the file cannot be mapped.
+ */
+bin_t *bin_open(const char *path) {
+	bin_t *bin = xmalloc(sizeof(bin_t));
+	bin->pos = 0;
+	bin->mem = NULL;
+#if !defined(WIN32) && !defined(_WIN32)
+	const int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		pfatal("cannot open file %s", path);
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		pfatal("cannot stat file %s", path);
+	bin->size = st.st_size;
+	if (bin->size == 0)
+		fatal("empty binary file %s", path);
+	void *base = mmap(NULL, bin->size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED)
+		pfatal("cannot map file %s", path);
+	close(fd);
+	bin->base = base;
+#else
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		pfatal("cannot open file %s", path);
+	if (fseek(file, 0, SEEK_END) != 0)
+		pfatal("cannot read file %s", path);
+	bin->size = ftell(file);
+	rewind(file);
+	bin->mem  = xmalloc(bin->size + bin_align);
+	bin->base = (char *)bin->mem + bin_align
+	          - ((uintptr_t)bin->mem % bin_align);
+	if (fread(bin->base, 1, bin->size, file) != bin->size)
+		pfatal("cannot read file %s", path);
+	fclose(file);
+#endif
+	return bin;
+}
+
+/* bin_close:
+ *   Unmap the file and release the bin_t object. All pointers returned by
+ *   bin_get become invalid.
+ */
+void bin_close(bin_t *bin) {
+	if (bin->mem != NULL)
+		xfree(bin->mem);
+#if !defined(WIN32) && !defined(_WIN32)
+	else
+		munmap(bin->base, bin->size);
+#endif
+	xfree(bin);
+}
+
+/* bin_has:
+ *   Return true if the given pointer point inside the mapped file. This is used
+ *   to know if a block of memory have to be released.
+ */
+bool bin_has(const bin_t *bin, const void *ptr) {
+	if (bin == NULL || ptr == NULL)
+		return false;
+	const char *p = ptr;
+	return p >= bin->base && p < bin->base + bin->size;
+}
+
+/* bin_get:
+ *   Return a pointer to the next block of <size> bytes in the mapped file and
+ *   move past it. If the file is too short, this fail violently.
+ */
+const void *bin_get(bin_t *bin, uint64_t size) {
+	if (size > bin->size - bin->pos)
+		fatal("truncated binary file");
+	const uint64_t len = (size + bin_align - 1) / bin_align * bin_align;
+	if (len > bin->size - bin->pos)
+		fatal("truncated binary file");
+	const void *ptr = bin->base + bin->pos;
+	bin->pos += len;
+	return ptr;
+}
+
+/* bin_put:
+ *   Write a block of <size> bytes to the given file, padded with zeros so the
+ *   next block will be properly aligned. If <ptr> is NULL, the data are assumed
+ *   to be already written and only the padding is output.
+ */
+void bin_put(FILE *file, const void *ptr, uint64_t size) {
+	static const char pad[bin_align] = {0};
+	const uint64_t rem = (bin_align - size % bin_align) % bin_align;
+	if (ptr != NULL && size != 0 && fwrite(ptr, size, 1, file) != 1)
+		pfatal("cannot write to file");
+	if (rem != 0 && fwrite(pad, rem, 1, file) != 1)
+		pfatal("cannot write to file");
+}
+
+/* bin_putstrs:
+ *   Write a table of <cnt> strings to the given file. The table is stored as
+ *   the number of strings and the total size of the strings block, an array of
+ *   strings offsets in the block, and the block of 0-terminated strings.
+ */
+void bin_putstrs(FILE *file, const char *strs[], uint64_t cnt) {
+	uint64_t hdr[2] = {cnt, 0};
+	uint64_t *off = xmalloc(sizeof(uint64_t) * (cnt + 1));
+	for (uint64_t n = 0; n < cnt; n++) {
+		off[n] = hdr[1];
+		hdr[1] += strlen(strs[n]) + 1;
+	}
+	bin_put(file, hdr, sizeof(hdr));
+	bin_put(file, off, sizeof(uint64_t) * cnt);
+	for (uint64_t n = 0; n < cnt; n++)
+		if (fwrite(strs[n], strlen(strs[n]) + 1, 1, file) != 1)
+			pfatal("cannot write to file");
+	bin_put(file, NULL, hdr[1]);
+	xfree(off);
+}
+
+/* bin_getstrs:
+ *   Read back a table of strings written by bin_putstrs. The number of strings
+ *   is stored in <cnt> and the offsets of each of them in the returned block
+ *   are stored in <off>. Everything point directly inside the mapped file.
+ */
+const char *bin_getstrs(bin_t *bin, uint64_t *cnt, const uint64_t **off) {
+	const uint64_t *hdr = bin_get(bin, sizeof(uint64_t) * 2);
+	if (hdr[0] > UINT64_MAX / sizeof(uint64_t))
+		fatal("invalid strings table");
+	*off = bin_get(bin, sizeof(uint64_t) * hdr[0]);
+	const char *blk = bin_get(bin, hdr[1]);
+	if (hdr[1] != 0 && blk[hdr[1] - 1] != '\0')
+		fatal("invalid strings table");
+	for (uint64_t n = 0; n < hdr[0]; n++)
+		if ((*off)[n] >= hdr[1])
+			fatal("invalid strings table");
+	*cnt = hdr[0];
+	return blk;
+}
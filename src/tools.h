@@ -27,7 +27,9 @@
 #ifndef tools_h
 #define tools_h
 
+#include <setjmp.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -45,6 +47,20 @@
 #define max(a, b) ((a) < (b) ? (b) : (a))
 #endif
 
+/* err_t:
+ *   An error catcher, see err_push. The message of the caught error is stored
+ *   in <msg> before jumping back to <env>.
+ */
+typedef struct err_s err_t;
+struct err_s {
+	jmp_buf  env;
+	err_t   *up;
+	char     msg[256];
+};
+
+void err_push(err_t *err);
+void err_pop(err_t *err);
+
 void fatal(const char *msg, ...);
 void pfatal(const char *msg, ...);
 void warning(const char *msg, ...);
@@ -57,7 +73,32 @@ char *xstrndup(const char *str, size_t size);
 
 void xfree(void *);
 
+extern bool xmem_track;
+void xmem_note(size_t size);
+void xmem_stats(uint64_t *cnt, uint64_t *size);
+
 char *ns_readstr(iol_t *iol);
 void ns_writestr(iol_t *iol, const char *str);
 
+/* bin_t:
+ *   A binary file mapped in memory. All blocks stored in such files are aligned
+ *   on <bin_align> bytes so they can be used in place, even by the SSE code.
+ */
+#define bin_align 16
+typedef struct bin_s bin_t;
+struct bin_s {
+	char     *base;  // Start of the mapped file
+	uint64_t  size;  // Size of the mapping in bytes
+	uint64_t  pos;   // Read position for bin_get
+	void     *mem;   // Memory to release if not truly mapped
+};
+
+bin_t *bin_open(const char *path);
+void bin_close(bin_t *bin);
+bool bin_has(const bin_t *bin, const void *ptr);
+const void *bin_get(bin_t *bin, uint64_t size);
+void bin_put(FILE *file, const void *ptr, uint64_t size);
+void bin_putstrs(FILE *file, const char *strs[], uint64_t cnt);
+const char *bin_getstrs(bin_t *bin, uint64_t *cnt, const uint64_t **off);
+
 #endif
@@ -27,22 +27,56 @@
 
 #include <assert.h>
 #include <math.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "wapiti.h"
 #include "tools.h"
+#include "thread.h"
 #include "vmath.h"
 
 #if defined(__SSE2__) && !defined(XVM_ANSI)
 #include <emmintrin.h>
 #endif
 
+/* XVM_DISPATCH:
+ *   The lattice kernels have AVX2 and AVX-512 versions compiled in whatever
+ *   the target of the build and selected at runtime depending on what the CPU
+ *   support. This need the GCC function target attributes and builtins, also
+ *   available with CLang.
+ */
+#if !defined(XVM_ANSI) && defined(__GNUC__)                   \
+ && (defined(__x86_64__) || defined(__i386__))                \
+ && !(defined(__llvm__) && defined(WIN32))
+#define XVM_DISPATCH
+#include <immintrin.h>
+#endif
+
+/* xvm_level:
+ *   Return the level of SIMD instructions usable by the lattice kernels: 2 for
+ *   AVX-512, 1 for AVX2 and 0 if none of them is available.
+ */
+static inline int xvm_level(void) {
+#ifdef XVM_DISPATCH
+	if (__builtin_cpu_supports("avx512f"))
+		return 2;
+	if (__builtin_cpu_supports("avx2"))
+		return 1;
+#endif
+	return 0;
+}
+
 /* xvm_mode:
  *   Return a string describing the SSE level used in the optimized code paths.
  */
 const char *xvm_mode(void) {
+	switch (xvm_level()) {
+		case 2: return "avx512f";
+		case 1: return "avx2";
+	}
 #if defined(__SSE2__) && !defined(XVM_ANSI)
 	return "sse2";
 #else
@@ -59,6 +93,7 @@ double *xvm_new(uint64_t N) {
 #if defined(__SSE2__) && !defined(XVM_ANSI)
 	if (N % 4 != 0)
 		N += 4 - N % 4;
+	xmem_note(sizeof(double) * N);
 	void *ptr = _mm_malloc(sizeof(double) * N, 16);
 	if (ptr == NULL)
 		fatal("out of memory");
@@ -79,11 +114,162 @@ void xvm_free(double x[]) {
 #endif
 }
 
+/******************************************************************************
+ * Parallel vector operations
+ *
+ *   Optimizers do a lot of passes over vectors of size F who can be very large
+ *   so, when parallel mode is enabled with xvm_parallel, these are split in
+ *   chunks of XVM_CHUNK values processed by the worker threads. Chunks are
+ *   statically assigned to workers, each one getting a contiguous range, so a
+ *   given part of a vector is always processed by the same thread and stay in
+ *   its local memory on NUMA systems once first touched.
+ *   Reductions over long vectors are always computed per chunk and summed in
+ *   chunk order, even with a single thread, so results are exactly the same
+ *   whatever the number of threads. Short vectors, and the other operations
+ *   with a single thread, use the direct sequential code.
+ ******************************************************************************/
+#define XVM_CHUNK ((uint64_t)1 << 14)
+
+static uint32_t xvm_nth = 1;
+
+/* xvm_parallel:
+ *   Set the number of threads used for large vector operations, 1 disable the
+ *   parallel mode.
+ */
+void xvm_parallel(uint32_t W) {
+	xvm_nth = max(W, 1);
+}
+
+typedef struct xvm_par_s xvm_par_t;
+struct xvm_par_s {
+	xvm_fn_t *fn;
+	void     *ud;
+	uint64_t  N;
+	uint32_t  K;
+	double   *part;
+};
+
+static void xvm_parsub(job_t *job, uint32_t id, uint32_t cnt, xvm_par_t *par) {
+	unused(job);
+	const uint64_t C  = (par->N + XVM_CHUNK - 1) / XVM_CHUNK;
+	const uint64_t lo = C * id / cnt, hi = C * (id + 1) / cnt;
+	for (uint64_t c = lo; c < hi; c++) {
+		const uint64_t off = c * XVM_CHUNK;
+		const uint64_t n   = min(XVM_CHUNK, par->N - off);
+		par->fn(par->ud, off, n, par->part + c * par->K);
+	}
+}
+
+/* xvm_parfor:
+ *   Apply <fn> on the range [0, N[ split in chunks. The function get the first
+ *   index and the size of its chunk and must store in <res> the <K> partial
+ *   sums it computes over it, if any. Partial sums are added in chunk order
+ *   and stored in <res>. With a short range, or a single thread and nothing
+ *   to sum, <fn> is called once on the full range.
+ */
+void xvm_parfor(xvm_fn_t *fn, void *ud, uint64_t N, double res[], uint32_t K) {
+	for (uint32_t k = 0; k < K; k++)
+		res[k] = 0.0;
+	if (N < 2 * XVM_CHUNK || (xvm_nth == 1 && K == 0)) {
+		fn(ud, 0, N, res);
+		return;
+	}
+	const uint64_t C = (N + XVM_CHUNK - 1) / XVM_CHUNK;
+	if (xvm_nth == 1) {
+		double part[K];
+		for (uint64_t c = 0; c < C; c++) {
+			const uint64_t off = c * XVM_CHUNK;
+			for (uint32_t k = 0; k < K; k++)
+				part[k] = 0.0;
+			fn(ud, off, min(XVM_CHUNK, N - off), part);
+			for (uint32_t k = 0; k < K; k++)
+				res[k] += part[k];
+		}
+		return;
+	}
+	const uint32_t W = min(xvm_nth, C);
+	xvm_par_t par = {fn, ud, N, K, NULL};
+	if (K != 0) {
+		par.part = xmalloc(sizeof(double) * C * K);
+		for (uint64_t i = 0; i < C * K; i++)
+			par.part[i] = 0.0;
+	}
+	void *arg[W];
+	for (uint32_t w = 0; w < W; w++)
+		arg[w] = &par;
+	mth_spawn((func_t *)xvm_parsub, W, arg, 0, 0);
+	for (uint64_t c = 0; c < C; c++)
+		for (uint32_t k = 0; k < K; k++)
+			res[k] += par.part[c * K + k];
+	if (K != 0)
+		xfree(par.part);
+}
+
+/* xvm_op_t:
+ *   Arguments of a basic vector operation run in parallel mode, each chunk is
+ *   processed by calling back the sequential version of the operation on it.
+ */
+typedef struct xvm_op_s xvm_op_t;
+struct xvm_op_s {
+	int           op;
+	double       *r;
+	const double *x, *y;
+	double        a;
+};
+
+enum {XVM_NEG, XVM_SUB, XVM_SCALE, XVM_COPY, XVM_AXPY, XVM_DOT};
+
+static void xvm_opfn(xvm_op_t *op, uint64_t off, uint64_t n, double res[]) {
+	double       *r = op->r + off;
+	const double *x = op->x + off;
+	const double *y = op->y == NULL ? NULL : op->y + off;
+	switch (op->op) {
+		case XVM_NEG:   xvm_neg(r, x, n);            break;
+		case XVM_SUB:   xvm_sub(r, x, y, n);         break;
+		case XVM_SCALE: xvm_scale(r, x, op->a, n);   break;
+		case XVM_COPY:  xvm_copy(r, x, n);           break;
+		case XVM_AXPY:  xvm_axpy(r, op->a, x, y, n); break;
+		case XVM_DOT:   res[0] = xvm_dot(x, y, n);   break;
+	}
+}
+
+/* xvm_split:
+ *   Return true if an operation over <N> values must be split and run in
+ *   parallel, or, for a reduction, summed by chunks.
+ */
+static inline bool xvm_split(uint64_t N, bool red) {
+	return (red || xvm_nth != 1) && N >= 2 * XVM_CHUNK;
+}
+
+static double xvm_runop(int op, double r[], const double x[],
+		const double y[], double a, uint64_t N) {
+	xvm_op_t arg = {op, r == NULL ? (double *)x : r, x, y, a};
+	double res = 0.0;
+	xvm_parfor((xvm_fn_t *)xvm_opfn, &arg, N, &res, op == XVM_DOT);
+	return res;
+}
+
+/* xvm_copy:
+ *   Copy the given vector:
+ *       r = x
+ */
+void xvm_copy(double r[], const double x[], uint64_t N) {
+	if (xvm_split(N, false)) {
+		xvm_runop(XVM_COPY, r, x, NULL, 0.0, N);
+		return;
+	}
+	memcpy(r, x, sizeof(double) * N);
+}
+
 /* xvm_neg:
  *   Return the component-wise negation of the given vector:
  *       r = -x
  */
 void xvm_neg(double r[], const double x[], uint64_t N) {
+	if (xvm_split(N, false)) {
+		xvm_runop(XVM_NEG, r, x, NULL, 0.0, N);
+		return;
+	}
 #if defined(__SSE2__) && !defined(XVM_ANSI)
 	assert(r != NULL && ((uintptr_t)r % 16) == 0);
 	assert(x != NULL && ((uintptr_t)x % 16) == 0);
@@ -107,6 +293,10 @@ void xvm_neg(double r[], const double x[], uint64_t N) {
  *       r = x .- y
  */
 void xvm_sub(double r[], const double x[], const double y[], uint64_t N) {
+	if (xvm_split(N, false)) {
+		xvm_runop(XVM_SUB, r, x, y, 0.0, N);
+		return;
+	}
 #if defined(__SSE2__) && !defined(XVM_ANSI)
 	assert(r != NULL && ((uintptr_t)r % 16) == 0);
 	assert(x != NULL && ((uintptr_t)x % 16) == 0);
@@ -132,6 +322,10 @@ void xvm_sub(double r[], const double x[], const double y[], uint64_t N) {
  *     r = a * x
  */
 void xvm_scale(double r[], const double x[], double a, uint64_t N) {
+	if (xvm_split(N, false)) {
+		xvm_runop(XVM_SCALE, r, x, NULL, a, N);
+		return;
+	}
 	for (uint64_t n = 0; n < N; n++)
 		r[n] = x[n] * a;
 }
@@ -153,6 +347,8 @@ double xvm_unit(double r[], const double x[], uint64_t N) {
  *   Return the euclidian norm of the given vector.
  */
 double xvm_norm(const double x[], uint64_t N) {
+	if (xvm_split(N, true))
+		return sqrt(xvm_runop(XVM_DOT, NULL, x, x, 0.0, N));
 	double r = 0.0;
 #if defined(__SSE2__) && !defined(XVM_ANSI)
 	assert(x != NULL && ((uintptr_t)x % 16) == 0);
@@ -184,6 +380,8 @@ double xvm_norm(const double x[], uint64_t N) {
  *   Return the dot product of the two given vectors.
  */
 double xvm_dot(const double x[], const double y[], uint64_t N) {
+	if (xvm_split(N, true))
+		return xvm_runop(XVM_DOT, NULL, x, y, 0.0, N);
 	double r = 0.0;
 #if defined(__SSE2__) && !defined(XVM_ANSI)
 	assert(x != NULL && ((uintptr_t)x % 16) == 0);
@@ -220,6 +418,10 @@ double xvm_dot(const double x[], const double y[], uint64_t N) {
  */
 void xvm_axpy(double r[], double a, const double x[], const double y[],
 		uint64_t N) {
+	if (xvm_split(N, false)) {
+		xvm_runop(XVM_AXPY, r, x, y, a, N);
+		return;
+	}
 #if defined(__SSE2__) && !defined(XVM_ANSI)
 	assert(r != NULL && ((uintptr_t)r % 16) == 0);
 	assert(x != NULL && ((uintptr_t)x % 16) == 0);
@@ -372,3 +574,346 @@ void xvm_expma(double r[], const double x[], double a, uint64_t N) {
 #endif
 }
 
+
+/******************************************************************************
+ * Lattice kernels
+ *
+ *   These are the products of a vector with the square NxN matrix of scores of
+ *   a position in the label lattice, as needed by the Viterbi and by the
+ *   forward-backward. The matrix is stored by rows, M[y'][y], so the products
+ *   with the vector on the left are computed on blocks of consecutive columns
+ *   kept in registers while walking down the rows.
+ *
+ *   For each output value the operations are done in the same order than in
+ *   the plain loops so all versions give exactly the same results. This is why
+ *   no fused multiply-add is used.
+ ******************************************************************************/
+
+/* xvm_maxadd / xvm_maxmul:
+ *   Compute the max-plus (or max-product) vector matrix product and keep the
+ *   index of the row giving each maximum, the first one in case of tie:
+ *       r[y] = max_{y'} x[y'] + M[y'][y]      idx[y] = argmax_{y'} ...
+ */
+#ifdef XVM_DISPATCH
+__attribute__((target("avx512f")))
+static uint64_t xvm_vmax512(double r[], uint32_t idx[], const double x[],
+                            const double M[], uint64_t N, bool mul,
+                            uint64_t y) {
+	for ( ; y + 8 <= N; y += 8) {
+		__m512d bst = _mm512_set1_pd(-HUGE_VAL);
+		__m512d arg = _mm512_setzero_pd();
+		for (uint64_t yp = 0; yp < N; yp++) {
+			const __m512d m = _mm512_loadu_pd(M + yp * N + y);
+			const __m512d v = _mm512_set1_pd(x[yp]);
+			const __m512d c = mul ? _mm512_mul_pd(v, m)
+			                      : _mm512_add_pd(v, m);
+			const __mmask8 k = _mm512_cmp_pd_mask(c, bst, _CMP_GT_OQ);
+			bst = _mm512_mask_blend_pd(k, bst, c);
+			arg = _mm512_mask_blend_pd(k, arg, _mm512_set1_pd(yp));
+		}
+		_mm512_storeu_pd(r + y, bst);
+		_mm256_storeu_si256((__m256i *)(idx + y), _mm512_cvtpd_epi32(arg));
+	}
+	return y;
+}
+
+__attribute__((target("avx2")))
+static uint64_t xvm_vmax256(double r[], uint32_t idx[], const double x[],
+                            const double M[], uint64_t N, bool mul,
+                            uint64_t y) {
+	for ( ; y + 4 <= N; y += 4) {
+		__m256d bst = _mm256_set1_pd(-HUGE_VAL);
+		__m256d arg = _mm256_setzero_pd();
+		for (uint64_t yp = 0; yp < N; yp++) {
+			const __m256d m = _mm256_loadu_pd(M + yp * N + y);
+			const __m256d v = _mm256_set1_pd(x[yp]);
+			const __m256d c = mul ? _mm256_mul_pd(v, m)
+			                      : _mm256_add_pd(v, m);
+			const __m256d k = _mm256_cmp_pd(c, bst, _CMP_GT_OQ);
+			bst = _mm256_blendv_pd(bst, c, k);
+			arg = _mm256_blendv_pd(arg, _mm256_set1_pd(yp), k);
+		}
+		_mm256_storeu_pd(r + y, bst);
+		_mm_storeu_si128((__m128i *)(idx + y), _mm256_cvtpd_epi32(arg));
+	}
+	return y;
+}
+#endif
+
+static void xvm_vmax(double r[], uint32_t idx[], const double x[],
+                     const double M[], uint64_t N, bool mul) {
+	uint64_t y = 0;
+#ifdef XVM_DISPATCH
+	const int lvl = xvm_level();
+	if (lvl >= 2)
+		y = xvm_vmax512(r, idx, x, M, N, mul, y);
+	if (lvl >= 1)
+		y = xvm_vmax256(r, idx, x, M, N, mul, y);
+#endif
+	for ( ; y < N; y++) {
+		double   bst = -HUGE_VAL;
+		uint32_t arg = 0;
+		for (uint64_t yp = 0; yp < N; yp++) {
+			double val = x[yp];
+			if (mul)
+				val *= M[yp * N + y];
+			else
+				val += M[yp * N + y];
+			if (val > bst) {
+				bst = val;
+				arg = yp;
+			}
+		}
+		r[y]   = bst;
+		idx[y] = arg;
+	}
+}
+
+void xvm_maxadd(double r[], uint32_t idx[], const double x[],
+                const double M[], uint64_t N) {
+	xvm_vmax(r, idx, x, M, N, false);
+}
+
+void xvm_maxmul(double r[], uint32_t idx[], const double x[],
+                const double M[], uint64_t N) {
+	xvm_vmax(r, idx, x, M, N, true);
+}
+
+/* xvm_maxaddb:
+ *   Batched version of xvm_maxadd for B independent lattices whose values are
+ *   interleaved, the B lanes of each value being consecutive. So each lane of
+ *   the vectors of packed registers decode a different sequence. The scores
+ *   are given as a unigram part <u> and a bigram one <M> summed on the fly:
+ *       p[y][b] = u[y][b] + M[y'][y][b]
+ *       r[y][b] = max_{y'} x[y'][b] + p[y][b]      idx[y][b] = argmax ...
+ *   and the best score p[y][b] is also returned. If <sh> is true, the same
+ *   N×N matrix M[y'][y] is used for all the lanes.
+ */
+#ifdef XVM_DISPATCH
+__attribute__((target("avx512f")))
+static uint64_t xvm_vmaxb512(double r[], uint32_t idx[], double p[],
+                             const double x[], const double u[],
+                             const double M[], uint64_t N, uint64_t B,
+                             bool sh, uint64_t b) {
+	for ( ; b + 8 <= B; b += 8) {
+		for (uint64_t y = 0; y < N; y++) {
+			const __m512d uni = _mm512_loadu_pd(u + y * B + b);
+			__m512d bst = _mm512_set1_pd(-HUGE_VAL);
+			__m512d arg = _mm512_setzero_pd();
+			__m512d psc = _mm512_setzero_pd();
+			for (uint64_t yp = 0; yp < N; yp++) {
+				const uint64_t d = yp * N + y;
+				const __m512d m = sh ? _mm512_set1_pd(M[d])
+					: _mm512_loadu_pd(M + d * B + b);
+				const double *px = x + yp * B + b;
+				const __m512d v = _mm512_loadu_pd(px);
+				const __m512d s = _mm512_add_pd(uni, m);
+				const __m512d c = _mm512_add_pd(v, s);
+				const __mmask8 k =
+					_mm512_cmp_pd_mask(c, bst, _CMP_GT_OQ);
+				bst = _mm512_mask_blend_pd(k, bst, c);
+				psc = _mm512_mask_blend_pd(k, psc, s);
+				arg = _mm512_mask_blend_pd(k, arg,
+					_mm512_set1_pd(yp));
+			}
+			_mm512_storeu_pd(r + y * B + b, bst);
+			_mm512_storeu_pd(p + y * B + b, psc);
+			_mm256_storeu_si256((__m256i *)(idx + y * B + b),
+				_mm512_cvtpd_epi32(arg));
+		}
+	}
+	return b;
+}
+
+__attribute__((target("avx2")))
+static uint64_t xvm_vmaxb256(double r[], uint32_t idx[], double p[],
+                             const double x[], const double u[],
+                             const double M[], uint64_t N, uint64_t B,
+                             bool sh, uint64_t b) {
+	for ( ; b + 4 <= B; b += 4) {
+		for (uint64_t y = 0; y < N; y++) {
+			const __m256d uni = _mm256_loadu_pd(u + y * B + b);
+			__m256d bst = _mm256_set1_pd(-HUGE_VAL);
+			__m256d arg = _mm256_setzero_pd();
+			__m256d psc = _mm256_setzero_pd();
+			for (uint64_t yp = 0; yp < N; yp++) {
+				const uint64_t d = yp * N + y;
+				const __m256d m = sh ? _mm256_set1_pd(M[d])
+					: _mm256_loadu_pd(M + d * B + b);
+				const double *px = x + yp * B + b;
+				const __m256d v = _mm256_loadu_pd(px);
+				const __m256d s = _mm256_add_pd(uni, m);
+				const __m256d c = _mm256_add_pd(v, s);
+				const __m256d k =
+					_mm256_cmp_pd(c, bst, _CMP_GT_OQ);
+				bst = _mm256_blendv_pd(bst, c, k);
+				psc = _mm256_blendv_pd(psc, s, k);
+				arg = _mm256_blendv_pd(arg,
+					_mm256_set1_pd(yp), k);
+			}
+			_mm256_storeu_pd(r + y * B + b, bst);
+			_mm256_storeu_pd(p + y * B + b, psc);
+			_mm_storeu_si128((__m128i *)(idx + y * B + b),
+				_mm256_cvtpd_epi32(arg));
+		}
+	}
+	return b;
+}
+#endif
+
+void xvm_maxaddb(double r[], uint32_t idx[], double p[], const double x[],
+                 const double u[], const double M[], uint64_t N, uint64_t B,
+                 bool sh) {
+	uint64_t b = 0;
+#ifdef XVM_DISPATCH
+	const int lvl = xvm_level();
+	if (lvl >= 2)
+		b = xvm_vmaxb512(r, idx, p, x, u, M, N, B, sh, b);
+	if (lvl >= 1)
+		b = xvm_vmaxb256(r, idx, p, x, u, M, N, B, sh, b);
+#endif
+	if (b == B)
+		return;
+	for (uint64_t y = 0; y < N; y++) {
+		for (uint64_t l = b; l < B; l++) {
+			r[y * B + l]   = -HUGE_VAL;
+			idx[y * B + l] = 0;
+			p[y * B + l]   = 0.0;
+		}
+		for (uint64_t yp = 0; yp < N; yp++) {
+			const uint64_t d = yp * N + y;
+			const double *v = x + yp * B;
+			for (uint64_t l = b; l < B; l++) {
+				const double m = sh ? M[d] : M[d * B + l];
+				const double s = u[y * B + l] + m;
+				const double val = v[l] + s;
+				if (val > r[y * B + l]) {
+					r[y * B + l]   = val;
+					idx[y * B + l] = yp;
+					p[y * B + l]   = s;
+				}
+			}
+		}
+	}
+}
+
+/* xvm_vecmat:
+ *   Compute the product of the vector and matrix:
+ *       r[y] = \sum_{y'} x[y'] * M[y'][y]
+ */
+#ifdef XVM_DISPATCH
+__attribute__((target("avx512f")))
+static uint64_t xvm_vecmat512(double r[], const double x[], const double M[],
+                              uint64_t N, uint64_t y) {
+	for ( ; y + 8 <= N; y += 8) {
+		__m512d sum = _mm512_setzero_pd();
+		for (uint64_t yp = 0; yp < N; yp++) {
+			const __m512d m = _mm512_loadu_pd(M + yp * N + y);
+			const __m512d v = _mm512_set1_pd(x[yp]);
+			sum = _mm512_add_pd(sum, _mm512_mul_pd(v, m));
+		}
+		_mm512_storeu_pd(r + y, sum);
+	}
+	return y;
+}
+
+__attribute__((target("avx2")))
+static uint64_t xvm_vecmat256(double r[], const double x[], const double M[],
+                              uint64_t N, uint64_t y) {
+	for ( ; y + 4 <= N; y += 4) {
+		__m256d sum = _mm256_setzero_pd();
+		for (uint64_t yp = 0; yp < N; yp++) {
+			const __m256d m = _mm256_loadu_pd(M + yp * N + y);
+			const __m256d v = _mm256_set1_pd(x[yp]);
+			sum = _mm256_add_pd(sum, _mm256_mul_pd(v, m));
+		}
+		_mm256_storeu_pd(r + y, sum);
+	}
+	return y;
+}
+#endif
+
+void xvm_vecmat(double r[], const double x[], const double M[], uint64_t N) {
+	uint64_t y = 0;
+#ifdef XVM_DISPATCH
+	const int lvl = xvm_level();
+	if (lvl >= 2)
+		y = xvm_vecmat512(r, x, M, N, y);
+	if (lvl >= 1)
+		y = xvm_vecmat256(r, x, M, N, y);
+#endif
+	for ( ; y < N; y++) {
+		double sum = 0.0;
+		for (uint64_t yp = 0; yp < N; yp++)
+			sum += x[yp] * M[yp * N + y];
+		r[y] = sum;
+	}
+}
+
+/* xvm_matvec:
+ *   Compute the product of the matrix and vector:
+ *       r[y'] = \sum_{y} M[y'][y] * x[y]
+ *   Here the sums run along the rows so, to keep the order of operations, four
+ *   rows are processed together by transposing 4x4 blocks in registers. The
+ *   AVX-512 level use this same code.
+ */
+#ifdef XVM_DISPATCH
+__attribute__((target("avx2")))
+static uint64_t xvm_matvec256(double r[], const double M[], const double x[],
+                              uint64_t N) {
+	uint64_t yp = 0;
+	for ( ; yp + 4 <= N; yp += 4) {
+		const double *m0 = M + (yp    ) * N, *m1 = M + (yp + 1) * N;
+		const double *m2 = M + (yp + 2) * N, *m3 = M + (yp + 3) * N;
+		__m256d sum = _mm256_setzero_pd();
+		uint64_t y = 0;
+		for ( ; y + 4 <= N; y += 4) {
+			const __m256d r0 = _mm256_loadu_pd(m0 + y);
+			const __m256d r1 = _mm256_loadu_pd(m1 + y);
+			const __m256d r2 = _mm256_loadu_pd(m2 + y);
+			const __m256d r3 = _mm256_loadu_pd(m3 + y);
+			const __m256d t0 = _mm256_unpacklo_pd(r0, r1);
+			const __m256d t1 = _mm256_unpackhi_pd(r0, r1);
+			const __m256d t2 = _mm256_unpacklo_pd(r2, r3);
+			const __m256d t3 = _mm256_unpackhi_pd(r2, r3);
+			const __m256d c0 = _mm256_permute2f128_pd(t0, t2, 0x20);
+			const __m256d c1 = _mm256_permute2f128_pd(t1, t3, 0x20);
+			const __m256d c2 = _mm256_permute2f128_pd(t0, t2, 0x31);
+			const __m256d c3 = _mm256_permute2f128_pd(t1, t3, 0x31);
+			sum = _mm256_add_pd(sum, _mm256_mul_pd(c0,
+				_mm256_set1_pd(x[y    ])));
+			sum = _mm256_add_pd(sum, _mm256_mul_pd(c1,
+				_mm256_set1_pd(x[y + 1])));
+			sum = _mm256_add_pd(sum, _mm256_mul_pd(c2,
+				_mm256_set1_pd(x[y + 2])));
+			sum = _mm256_add_pd(sum, _mm256_mul_pd(c3,
+				_mm256_set1_pd(x[y + 3])));
+		}
+		double tmp[4];
+		_mm256_storeu_pd(tmp, sum);
+		for ( ; y < N; y++) {
+			tmp[0] += m0[y] * x[y];
+			tmp[1] += m1[y] * x[y];
+			tmp[2] += m2[y] * x[y];
+			tmp[3] += m3[y] * x[y];
+		}
+		for (uint64_t i = 0; i < 4; i++)
+			r[yp + i] = tmp[i];
+	}
+	return yp;
+}
+#endif
+
+void xvm_matvec(double r[], const double M[], const double x[], uint64_t N) {
+	uint64_t yp = 0;
+#ifdef XVM_DISPATCH
+	if (xvm_level() != 0)
+		yp = xvm_matvec256(r, M, x, N);
+#endif
+	for ( ; yp < N; yp++) {
+		double sum = 0.0;
+		for (uint64_t y = 0; y < N; y++)
+			sum += M[yp * N + y] * x[y];
+		r[yp] = sum;
+	}
+}
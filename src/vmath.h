@@ -28,6 +28,7 @@
 #ifndef vmath_h
 #define vmath_h
 
+#include <stdbool.h>
 #include <stdint.h>
 
 const char *xvm_mode(void);
@@ -35,6 +36,12 @@ const char *xvm_mode(void);
 double *xvm_new(uint64_t N);
 void    xvm_free(double x[]);
 
+typedef void (xvm_fn_t)(void *ud, uint64_t off, uint64_t n, double res[]);
+
+void xvm_parallel(uint32_t W);
+void xvm_parfor(xvm_fn_t *fn, void *ud, uint64_t N, double res[], uint32_t K);
+
+void xvm_copy(double r[], const double x[], uint64_t N);
 void xvm_neg(double r[], const double x[], uint64_t N);
 void xvm_sub(double r[], const double x[], const double y[], uint64_t N);
 void xvm_scale(double r[], const double x[], double a, uint64_t N);
@@ -48,5 +55,15 @@ void xvm_axpy(double r[], double a, const double x[], const double y[],
 
 void xvm_expma(double r[], const double x[], double a, uint64_t N);
 
+void xvm_maxadd(double r[], uint32_t idx[], const double x[],
+                const double M[], uint64_t N);
+void xvm_maxmul(double r[], uint32_t idx[], const double x[],
+                const double M[], uint64_t N);
+void xvm_maxaddb(double r[], uint32_t idx[], double p[], const double x[],
+                 const double u[], const double M[], uint64_t N, uint64_t B,
+                 bool sh);
+void xvm_vecmat(double r[], const double x[], const double M[], uint64_t N);
+void xvm_matvec(double r[], const double M[], const double x[], uint64_t N);
+
 #endif
 
@@ -33,15 +33,20 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "bench.h"
 #include "decoder.h"
+#include "dist.h"
 #include "model.h"
 #include "options.h"
 #include "progress.h"
 #include "quark.h"
 #include "reader.h"
 #include "sequence.h"
+#include "server.h"
+#include "thread.h"
 #include "tools.h"
 #include "trainers.h"
+#include "vmath.h"
 #include "wapiti.h"
 
 /*******************************************************************************
@@ -67,6 +72,31 @@ static const struct {
 };
 static const uint32_t trn_cnt = sizeof(trn_lst) / sizeof(trn_lst[0]);
 
+/* load_model:
+ *   Load the model either from a binary file if <path> is given and point to
+ *   one, or from the text model iol of the reader.
+ */
+static void load_model(mdl_t *mdl, const char *path) {
+	if (path != NULL && mdl_isbin(path))
+		mdl_loadbin(mdl, path);
+	else
+		mdl_load(mdl);
+	// Reduced precision weights can only be used for Viterbi decoding,
+	// everything else needs them back in double precision.
+	if (mdl->opt->mode != 1 || mdl->opt->lblpost)
+		mdl_expand(mdl);
+}
+
+/* save_model:
+ *   Save the model in the format requested by the user.
+ */
+static void save_model(mdl_t *mdl, iol_t *iol) {
+	if (mdl->opt->binary)
+		mdl_savebin(mdl, (FILE *)iol->out);
+	else
+		mdl_save(mdl, iol);
+}
+
 /* train:
  * Interop method to support model training.  This method is based on
  * dotrain.  There is no native caller of this method.
@@ -98,7 +128,7 @@ int train(opt_t *opt, iol_t *model_iol, iol_t *pattern_iol) {
 	qrk_lock(mdl->reader->obs, false);
 
 	// 4. load the training data
-	mdl->train = rdr_readdat(mdl->reader, model_iol, true);
+	mdl->train = rdr_readdat(mdl->reader, model_iol, true, opt->nthread);
 
 	// 5. lock the quarks
 	qrk_lock(mdl->reader->lbl, true);
@@ -124,37 +154,55 @@ int train(opt_t *opt, iol_t *model_iol, iol_t *pattern_iol) {
 /*******************************************************************************
 * Training
 ******************************************************************************/
-static void dotrain(mdl_t *mdl, iol_t *iol) {
-	// Check if the user requested the type or trainer list. If this is not
-	// the case, search them in the lists.
-	if (!strcmp(mdl->opt->type, "list")) {
-		info("Available types of models:\n");
-		for (uint32_t i = 0; i < typ_cnt; i++)
-			info("\t%s\n", typ_lst[i]);
-		exit(EXIT_SUCCESS);
-	}
-	if (!strcmp(mdl->opt->algo, "list")) {
-		info("Available training algorithms:\n");
-		for (uint32_t i = 0; i < trn_cnt; i++)
-			info("\t%s\n", trn_lst[i].name);
-		exit(EXIT_SUCCESS);
-	}
-	uint32_t typ, trn;
-	for (typ = 0; typ < typ_cnt; typ++)
-		if (!strcmp(mdl->opt->type, typ_lst[typ]))
-			break;
-	if (typ == typ_cnt)
-		fatal("unknown model type '%s'", mdl->opt->type);
-	mdl->type = typ;
-	for (trn = 0; trn < trn_cnt; trn++)
-		if (!strcmp(mdl->opt->algo, trn_lst[trn].name))
-			break;
-	if (trn == trn_cnt)
-		fatal("unknown algorithm '%s'", mdl->opt->algo);
+/* chkpattern:
+ *   Check that the patterns given by the user are the ones stored in the
+ *   dataset cache as features would else silently not match them.
+ */
+static void chkpattern(mdl_t *mdl) {
+	FILE *file = fopen(mdl->opt->pattern, "r");
+	if (file == NULL)
+		pfatal("cannot open pattern file");
+	iol_t *iol = iol_new(file, NULL);
+	rdr_t *pat = rdr_new(NULL, mdl->reader->autouni);
+	rdr_loadpat(pat, iol);
+	iol_free(iol);
+	fclose(file);
+	const rdr_t *rdr = mdl->reader;
+	bool same = pat->npats == rdr->npats;
+	for (uint32_t p = 0; same && p < rdr->npats; p++)
+		same = !strcmp(pat->pats[p]->src, rdr->pats[p]->src);
+	if (!same)
+		fatal("cache was built with different patterns");
+	rdr_free(pat);
+}
+
+/* chkhash:
+ *   Check that the feature hashing requested by the user, if any, is the one
+ *   of the reader loaded from a previous model or a dataset cache, as it
+ *   cannot be changed once the observations are mapped.
+ */
+static void chkhash(mdl_t *mdl, const char *what) {
+	const opt_t *opt = mdl->opt;
+	const rdr_t *rdr = mdl->reader;
+	if (opt->hash == 0)
+		return;
+	if (rdr->hbits != opt->hash || rdr->hbbits != opt->hashbi)
+		fatal("%s was built with a different feature hashing", what);
+}
+
+/* loaddata:
+ *   Load the patterns, the training and the development data from the files
+ *   given by the user, on top of a previous model if one is specified.
+ */
+static void loaddata(mdl_t *mdl, iol_t *iol) {
 	// Load a previous model to train again if specified by the user.
 	if (mdl->opt->model != NULL) {
 		info("* Load previous model\n");
-		mdl_load(mdl);
+		load_model(mdl, mdl->opt->model);
+		chkhash(mdl, "previous model");
+	} else {
+		mdl->reader->hbits  = mdl->opt->hash;
+		mdl->reader->hbbits = mdl->opt->hashbi;
 	}
 	// Load the pattern file. This will unlock the database if previously
 	// locked by loading a model.
@@ -172,24 +220,121 @@ static void dotrain(mdl_t *mdl, iol_t *iol) {
 	// Load the training data. When this is done we lock the quarks as we
 	// don't want to put in the model, informations present only in the
 	// devlopment set.
+	// For distributed training, each node keep only its own part of the
+	// training data.
 	info("* Load training data\n");
-	mdl->train = rdr_readdat(mdl->reader, iol, true);
+	if (mdl->dist != NULL) {
+		mdl->reader->shard  = mdl->dist->rank;
+		mdl->reader->nshard = mdl->dist->size;
+	}
+	mdl->train = rdr_readdat(mdl->reader, iol, true, mdl->opt->nthread);
+	mdl->reader->shard  = 0;
+	mdl->reader->nshard = 1;
 	qrk_lock(mdl->reader->lbl, true);
 	qrk_lock(mdl->reader->obs, true);
 	if (mdl->train == NULL || mdl->train->nseq == 0)
 		fatal("no train data loaded");
+	// If requested, remove the rare observations before they get features
+	// and before the development set is loaded so they are unknown there
+	// too. The observations of a previous model are kept.
+	if (mdl->opt->mincount > 1) {
+		if (mdl->reader->hbits != 0)
+			fatal("cannot prune hashed observations");
+		info("* Prune rare observations\n");
+		const uint64_t n = rdr_prune(mdl->reader, mdl->train,
+			mdl->opt->mincount, mdl->nobs);
+		info("    %8"PRIu64" observations removed\n", n);
+	}
 	// If present, load the development set in the model. If not specified,
-	// the training dataset will be used instead.
-	if (mdl->opt->devel != NULL) {
+	// the training dataset will be used instead. Only the first node of a
+	// distributed training evaluate the model so the others don't need it.
+	const bool eval = mdl->dist == NULL || mdl->dist->rank == 0;
+	if (mdl->opt->devel != NULL && eval) {
 		info("* Load development data\n");
 		FILE *file = fopen(mdl->opt->devel, "r");
 		iol_t *iol = iol_new(file, NULL);
 		if (file == NULL)
 			pfatal("cannot open development file");
-		mdl->devel = rdr_readdat(mdl->reader, iol, true);
+		mdl->devel = rdr_readdat(mdl->reader, iol, true,
+			mdl->opt->nthread);
 		iol_free(iol);
 		fclose(file);
 	}
+}
+
+static void dotrain(mdl_t *mdl, iol_t *iol) {
+	// Check if the user requested the type or trainer list. If this is not
+	// the case, search them in the lists.
+	if (!strcmp(mdl->opt->type, "list")) {
+		info("Available types of models:\n");
+		for (uint32_t i = 0; i < typ_cnt; i++)
+			info("\t%s\n", typ_lst[i]);
+		exit(EXIT_SUCCESS);
+	}
+	if (!strcmp(mdl->opt->algo, "list")) {
+		info("Available training algorithms:\n");
+		for (uint32_t i = 0; i < trn_cnt; i++)
+			info("\t%s\n", trn_lst[i].name);
+		exit(EXIT_SUCCESS);
+	}
+	uint32_t typ, trn;
+	for (typ = 0; typ < typ_cnt; typ++)
+		if (!strcmp(mdl->opt->type, typ_lst[typ]))
+			break;
+	if (typ == typ_cnt)
+		fatal("unknown model type '%s'", mdl->opt->type);
+	mdl->type = typ;
+	for (trn = 0; trn < trn_cnt; trn++)
+		if (!strcmp(mdl->opt->algo, trn_lst[trn].name))
+			break;
+	if (trn == trn_cnt)
+		fatal("unknown algorithm '%s'", mdl->opt->algo);
+	// Connect to the other nodes for distributed training. Only the
+	// trainers using the full gradient can be distributed.
+	if (mdl->opt->dist != NULL) {
+		void (* fn)(mdl_t *mdl) = trn_lst[trn].train;
+		if (fn != trn_lbfgs && fn != trn_rprop)
+			fatal("distributed training need l-bfgs or rprop");
+		if (mdl->opt->cache != NULL)
+			fatal("cannot use a dataset cache with several nodes");
+		if (mdl->opt->mincount > 1)
+			fatal("cannot prune observations with several nodes");
+		info("* Connect nodes\n");
+		mdl->dist = dst_new(mdl->opt->dist, mdl->opt->rank);
+	}
+	// If a featurized cache of the datasets exist, load everything from it
+	// and skip the patterns and data files. Else, load them normally and
+	// save the featurized datasets before anything reorder them so the
+	// cache give the same training than the data files.
+	const char *cache = mdl->opt->cache;
+	if (cache != NULL && mdl->opt->model != NULL)
+		fatal("cannot use a dataset cache with a previous model");
+	bool exist = false;
+	if (cache != NULL) {
+		FILE *file = fopen(cache, "rb");
+		exist = file != NULL;
+		if (exist)
+			fclose(file);
+		if (exist && !mdl_iscache(cache))
+			fatal("%s exists and is not a dataset cache", cache);
+	}
+	if (exist) {
+		info("* Load featurized data from cache\n");
+		mdl_loadcache(mdl, cache);
+		if (mdl->opt->pattern != NULL)
+			chkpattern(mdl);
+		chkhash(mdl, "cache");
+	} else {
+		loaddata(mdl, iol);
+		if (cache != NULL) {
+			info("* Save featurized data cache\n");
+			FILE *file = fopen(cache, "wb");
+			if (file == NULL)
+				pfatal("cannot open cache file");
+			mdl_savecache(mdl, file);
+			fclose(file);
+		}
+	}
 	// Initialize the model. If a previous model was loaded, this will be
 	// just a resync, else the model structure will be created.
 	if (mdl->theta == NULL)
@@ -197,6 +342,20 @@ static void dotrain(mdl_t *mdl, iol_t *iol) {
 	else
 		info("* Resync the model\n");
 	mdl_sync(mdl);
+	// When the gradient is computed in parallel, schedule the longest
+	// sequences first so the threads finish at nearly the same time.
+	if (mdl->opt->nthread > 1) {
+		rdr_sortdat(mdl->train);
+		if (mdl->devel != NULL)
+			rdr_sortdat(mdl->devel);
+	}
+	// Large vector operations of the optimizers use the same number of
+	// threads than the gradient computation.
+	xvm_parallel(mdl->opt->nthread);
+	// If requested, pin the worker threads to their CPU so the memory
+	// they touch first remains local to them.
+	if (mdl->opt->pin)
+		mth_setpin();
 	// Display some statistics as we all love this.
 	info("* Summary\n");
 	info("    nb train:    %"PRIu32"\n", mdl->train->nseq);
@@ -219,9 +378,19 @@ static void dotrain(mdl_t *mdl, iol_t *iol) {
 		info("    %8"PRIu64" observations removed\n", O - mdl->nobs);
 		info("    %8"PRIu64" features removed\n", F - mdl->nftr);
 	}
-	// And save the trained model
+	// And save the trained model, only the first node of a distributed
+	// training has to do it as all have the same one.
+	if (mdl->dist != NULL) {
+		const bool save = mdl->dist->rank == 0;
+		dst_free(mdl->dist);
+		mdl->dist = NULL;
+		if (!save) {
+			info("* Done\n");
+			return;
+		}
+	}
 	info("* Save the model\n");
-	mdl_save(mdl, iol);
+	save_model(mdl, iol);
 	info("* Done\n");
 }
 
@@ -232,7 +401,10 @@ static void dolabel(mdl_t *mdl, iol_t *iol) {
 	// First, load the model provided by the user. This is mandatory to
 	// label new datas ;-)
 	info("* Load model\n");
-	mdl_load(mdl);
+	load_model(mdl, mdl->opt->model);
+	// The model will not change anymore so we can switch the quarks to the
+	// faster read-only form.
+	mdl_share(mdl);
 
 	// Do the labelling
 	info("* Label sequences\n");
@@ -246,7 +418,7 @@ static void dolabel(mdl_t *mdl, iol_t *iol) {
 static void dodump(mdl_t *mdl, iol_t *iol) {
 	// Load input model file
 	info("* Load model\n");
-	mdl_load(mdl);
+	load_model(mdl, mdl->opt->input);
 	// Dump model
 	info("* Dump model\n");
 	const uint32_t Y = mdl->nlbl;
@@ -255,8 +427,15 @@ static void dodump(mdl_t *mdl, iol_t *iol) {
 	const qrk_t *Qobs = mdl->reader->obs;
 	char fmt[16];
 	sprintf(fmt, "%%.%df\n", mdl->opt->prec);
+	char bkt[32];
 	for (uint64_t o = 0; o < O; o++) {
-		const char *obs = qrk_id2str(Qobs, o);
+		// Hashed observations have no string so their buckets are
+		// dumped by index.
+		const char *obs = bkt;
+		if (mdl->reader->hbits != 0)
+			sprintf(bkt, "@%"PRIu64, o);
+		else
+			obs = qrk_id2str(Qobs, o);
 		bool empty = true;
 		if (mdl->kind[o] & 1) {
 			const double *w = mdl->theta + mdl->uoff[o];
@@ -293,14 +472,14 @@ static void dodump(mdl_t *mdl, iol_t *iol) {
 static void doupdt(mdl_t *mdl, iol_t *iol) {
 	// Load input model file
 	info("* Load model\n");
-	mdl_load(mdl);
+	load_model(mdl, mdl->opt->model);
 
 	// Open patch file
 	info("* Update model\n");
 	int nline = 0;
 	while (true) {
-		char *line = iol->gets_cb(iol->in);
-		if (line == NULL)
+		char *buf = iol->gets_cb(iol->in), *line = buf;
+		if (buf == NULL)
 			break;
 		nline++;
 		// First we split the line in space separated tokens. We expect
@@ -320,18 +499,29 @@ static void doupdt(mdl_t *mdl, iol_t *iol) {
 			*line++ = '\0';
 		}
 		if (ntoks == 0) {
-			xfree(line);
+			xfree(buf);
 			continue;
 		} else if (ntoks != 4) {
 			fatal("invalid line at %d", nline);
 		}
 		// Parse the tokens, the first three should be string maping to
 		// observations and labels and the last should be the weight.
+		// With hashed observations, they are given either as a string
+		// to hash or as a bucket index like in the dump.
 		uint64_t obs = none, yp = none, y = none;
-		obs = qrk_str2id(mdl->reader->obs, toks[0]);
+		const rdr_t *rdr = mdl->reader;
+		const bool bi = strcmp(toks[1], "#") != 0;
+		if (rdr->hbits == 0)
+			obs = qrk_str2id(mdl->reader->obs, toks[0]);
+		else if (toks[0][0] != '@')
+			obs = rdr_hashobs(rdr, toks[0], bi);
+		else if (sscanf(toks[0] + 1, "%"SCNu64, &obs) != 1)
+			obs = none;
+		if (obs >= mdl->nobs || !(mdl->kind[obs] & (bi ? 2 : 1)))
+			obs = none;
 		if (obs == none)
 			fatal("bad on observation on line %d", nline);
-		if (strcmp(toks[1], "#")) {
+		if (bi) {
 			yp = qrk_str2id(mdl->reader->lbl, toks[1]);
 			if (yp == none)
 				fatal("bad label <%s> line %d", toks[1], nline);
@@ -351,7 +541,7 @@ static void doupdt(mdl_t *mdl, iol_t *iol) {
 			double *w = mdl->theta + mdl->boff[obs];
 			w[yp * Y + y] = wgh;
 		}
-		xfree(line);
+		xfree(buf);
 	}
 	// If requested compact the model.
 	if (mdl->opt->compact) {
@@ -364,7 +554,53 @@ static void doupdt(mdl_t *mdl, iol_t *iol) {
 	}
 	// And save the updated model
 	info("* Save the model\n");
-	mdl_save(mdl, iol);
+	save_model(mdl, iol);
+	info("* Done\n");
+}
+
+/*******************************************************************************
+ * Converting
+ ******************************************************************************/
+static void doconv(mdl_t *mdl, iol_t *iol) {
+	// Load input model file, either text or binary
+	info("* Load model\n");
+	load_model(mdl, mdl->opt->input);
+	// If requested, reduce the precision of the weights. As the result can
+	// only be stored in a binary model, this is checked first. With a
+	// development set, the error rates of both models are reported so the
+	// loss of accuracy can be checked.
+	const uint32_t fmt = mdl_wfmt(mdl->opt->wfmt);
+	if (fmt != MDL_WDBL) {
+		if (!mdl->opt->binary || mdl->opt->packed)
+			fatal("reduced weights need a non packed binary model");
+		double te[2], se[2];
+		if (mdl->opt->devel != NULL) {
+			info("* Load development data\n");
+			FILE *file = fopen(mdl->opt->devel, "r");
+			if (file == NULL)
+				pfatal("cannot open development file");
+			iol_t *iol = iol_new(file, NULL);
+			mdl->devel = rdr_readdat(mdl->reader, iol, true, 1);
+			iol_free(iol);
+			fclose(file);
+			if (mdl->devel == NULL || mdl->devel->nseq == 0)
+				fatal("no development data loaded");
+			tag_eval(mdl, &te[0], &se[0]);
+		}
+		info("* Reduce weights to %s\n", mdl->opt->wfmt);
+		const double err = mdl_reduce(mdl, fmt);
+		info("    max error:   %g\n", err);
+		if (mdl->opt->devel != NULL) {
+			tag_eval(mdl, &te[1], &se[1]);
+			info("    token error: %5.2f%% -> %5.2f%%\n",
+				te[0], te[1]);
+			info("    seq error:   %5.2f%% -> %5.2f%%\n",
+				se[0], se[1]);
+		}
+	}
+	// And save it back in the requested format
+	info("* Save the model\n");
+	save_model(mdl, iol);
 	info("* Done\n");
 }
 
@@ -376,7 +612,7 @@ static iol_t *create_iol(opt_t *opt) {
 			pfatal("cannot open input data file");
 	}
 	if (opt->output != NULL) {
-		fout = fopen(opt->output, "w");
+		fout = fopen(opt->output, opt->binary ? "wb" : "w");
 		if (fout == NULL)
 			pfatal("cannot open output data file");
 	}
@@ -384,13 +620,6 @@ static iol_t *create_iol(opt_t *opt) {
     return iol_new(fin, fout);
 }
 
-static void close_iol(iol_t *iol) {
-	if (iol->in != NULL)
-		fclose(iol->in);
-	if (iol->out != NULL)
-		fclose(iol->out);
-}
-
 static iol_t *create_model_iol(opt_t *opt) {
     if (opt->model == NULL)
         fatal("you must specify a model");
@@ -416,8 +645,13 @@ int main(int argc, char *argv[argc]) {
     iol_t *io_iol = create_iol(&opt);
     iol_t *model_iol;
 	switch (opt.mode) {
-			case 0:  model_iol = io_iol; break;
+			case 0:  model_iol = opt.model != NULL
+			                   ? create_model_iol(&opt) : io_iol;
+			         break;
 	        case 2:  model_iol = io_iol; break;
+	        case 4:  model_iol = io_iol; break;
+	        case 5:  model_iol = io_iol; break;
+	        case 6:  model_iol = io_iol; break;
             default: model_iol = create_model_iol(&opt); break;
 	}
 	mdl_t *mdl = mdl_new(rdr_new(model_iol, opt.maxent));
@@ -428,9 +662,12 @@ int main(int argc, char *argv[argc]) {
             case 1: dolabel(mdl, io_iol); break;
 	        case 2: dodump(mdl, io_iol);  break;
 	        case 3: doupdt(mdl, io_iol);  break;
+	        case 4: doconv(mdl, io_iol);  break;
+	        case 5: srv_run(mdl->opt);    break;
+	        case 6: bch_run(mdl, io_iol); break;
 	}
 	// And cleanup
-	close_iol(io_iol);
+	iol_close(io_iol);
 	mdl_free(mdl);
 	return EXIT_SUCCESS;
 }
@@ -48,6 +48,14 @@
  */
 //#define ATM_ANSI
 
+/* SEQ_OBS64:
+ *   By uncomenting the following define, observations identifiers in the
+ *   sequences are stored on 64 bits instead of 32. This is only needed for
+ *   models with more than 2^32 observations and double the memory used by
+ *   the datasets.
+ */
+//#define SEQ_OBS64
+
 /* Without multi-threading we disable atomic updates as they are not needed and
  * can only decrease performances in this case.
  */